@@ -29,6 +29,30 @@ feed_watchdog(void) {
 		dp(1, "watchdog failed to write to %s\n", tty_pathname);
 }
 
+/* parse pathname:metric:seconds,... */
+static int
+parse_metric_watches(char *s, metric_watch_t **watches) {
+	int n = 0;
+	*watches = NULL;
+	for (char *p = strtok(s, ","); p; p = strtok(NULL, ",")) {
+		char *seconds = strrchr(p, ':');
+		if (!seconds)
+			die("Bad watchdog metric specification: '%s'", p);
+		*seconds++ = '\0';
+		char *name = strrchr(p, ':');
+		char *invalid = NULL;
+		long n_seconds = strtol(seconds, &invalid, 10);
+		if (!name || !*seconds || *invalid)
+			die("Bad watchdog metric specification: '%s'", p);
+		*name++ = '\0';
+		*watches = srealloc(*watches, (n+1)*sizeof **watches);
+		(*watches)[n] = (metric_watch_t){sstrdup(p), sstrdup(name), n_seconds, 0, time(NULL)};
+		dp(1, "metric %s in '%s' must change at least every %ld seconds\n", name, p, n_seconds);
+		n++;
+	}
+	return n;
+}
+
 static void
 watchdog(void) {
 	avr_prefix = param_get_string_with_default("beagle_watchdog", "prefix", "avr://");
@@ -64,6 +88,8 @@ watchdog(void) {
 		if (p)
 			p++;
     }
+	metric_watch_t *metric_watches;
+	int n_metric_watches = parse_metric_watches(sstrdup(param_get_string_with_default("beagle_watchdog", "metrics", "")), &metric_watches);
 	uint32_t feed_seconds = param_get_integer_with_default("beagle_watchdog", "feed_seconds", 300);
 	uint32_t granularity_seconds = param_get_integer_with_default("beagle_watchdog", "granularity_seconds", 60);
 	uint32_t startup_seconds = param_get_integer_with_default("beagle_watchdog", "startup_seconds", 7200);
@@ -78,6 +104,8 @@ watchdog(void) {
 	time_t now = time(NULL) ;
 	for (int f = 0; f < n_files; f++)
 		file_last_modified[f] = now;
+	for (int w = 0; w < n_metric_watches; w++)
+		metric_watches[w].last_changed = now;
 	while (1) {
  	    for (int i = granularity_seconds/feed_seconds; i >= 0; i--) {
      		dp(33, "i=%d\n", i);
@@ -97,6 +125,13 @@ watchdog(void) {
 				do_reboot();
 			}
 		}
+		for (int w = 0; w < n_metric_watches; w++) {
+			uint32_t age = metrics_watch_age(&metric_watches[w], time(NULL));
+			if (age > metric_watches[w].seconds) {
+				dp(1, "Rebooting because metric %s in '%s' has not changed for %d seconds\n", metric_watches[w].name, metric_watches[w].pathname, age);
+				do_reboot();
+			}
+		}
     }
 }
 
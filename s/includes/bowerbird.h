@@ -9,7 +9,9 @@
 #include <math.h>
 #include <sndfile.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <time.h>
+#include <pthread.h>
 #include <ctype.h>
 #include <stdarg.h>
 #include <glib.h>
@@ -87,6 +89,67 @@ typedef uint64_t power_t;    // for signal power
 #define dp(level, ...) (level <= verbosity ? debug_printf(level, "%s:%d: %s ", __FILE__ , __LINE__, __func__),debug_printf(level,  __VA_ARGS__) : 0)
 #define approximately_zero(x) (ABS(x) < sqrt(DBL_EPSILON))
 
+typedef enum {pt_boolean, pt_integer, pt_double, pt_string} param_type_t;
+
+// declaration of one parameter resolved into a field of a module's snapshot struct
+typedef struct param_spec_t {
+	const char *group;
+	const char *key;
+	param_type_t type;
+	size_t offset;              // offsetof field in snapshot struct (int, int, double or char *)
+	const char *default_value;  // used if parameter absent from all config files
+	double min, max;            // valid range for pt_integer & pt_double, unchecked if min > max
+	const char *description;
+} param_spec_t;
+
+// a module's parameters - see param_snapshot
+typedef struct param_table_t {
+	const param_spec_t *specs;
+	int n_specs;
+	size_t snapshot_size;
+	void *volatile snapshot;
+	volatile int generation;    // param_generation() when snapshot was resolved
+	void *retired;              // previous snapshot, freed when the next is published
+} param_table_t;
+
+// metrics - see util/metrics.c
+#define METRICS_MAGIC "bbmetr1"
+#define METRICS_MAX 64
+#define METRICS_NAME_LENGTH 48
+#define METRICS_HISTOGRAM_BUCKETS 24     // bucket i counts values below 2^i, the last also those above
+
+typedef enum {mt_counter, mt_gauge, mt_histogram} metric_type_t;
+
+// one metric, only changed with __atomic builtins so it can be read from another process at any time
+typedef struct metric_t {
+	char name[METRICS_NAME_LENGTH];
+	uint32_t type;                      // metric_type_t
+	uint32_t unused;
+	uint64_t value;                     // counter total, gauge value or number of histogram observations
+	uint64_t max;                       // largest gauge value or histogram observation
+	uint64_t sum;                       // sum of histogram observations
+	uint64_t buckets[METRICS_HISTOGRAM_BUCKETS];
+} metric_t;
+
+// layout of a metrics file, which is the metrics themselves mapped into memory
+typedef struct metrics_file_t {
+	char magic[8];
+	uint32_t n_metrics;                 // slots in use, names are set before this is advanced
+	uint32_t max_metrics;
+	int64_t pid;
+	int64_t start_time;
+	metric_t metrics[METRICS_MAX];
+} metrics_file_t;
+
+// a counter in another process's metrics file which must keep changing - see metrics_watch_age
+typedef struct metric_watch_t {
+	char *pathname;
+	char *name;
+	uint32_t seconds;                   // longest the counter may go unchanged
+	uint64_t value;
+	time_t last_changed;
+} metric_watch_t;
+
 typedef struct sinusoid_t {
 	double amplitude;
 	double phase;
@@ -94,7 +157,7 @@ typedef struct sinusoid_t {
 } sinusoid_t;
 
 typedef struct {
-	enum {sft_libsndfile, sft_wavpack} t;
+	enum {sft_libsndfile, sft_wavpack, sft_mmap} t;
 	enum {sft_read, sft_write} m;
 	uint32_t channels;
 	uint32_t samplerate;
@@ -105,10 +168,42 @@ typedef struct {
     uint32_t bytes_written, first_block_size;
     FILE *file;
     int error;
+	// next 4 fields for reading memory-mapped 16-bit PCM wav (sft_mmap)
+	void *map;
+	size_t map_length;
+	const sample_t *samples;
+	index_t position;
+	// conversion buffer for sft_wavpack, grown as needed
+	int32_t *scratch;
+	index_t scratch_frames;
+	// decoder thread state if soundfile_read_ahead has been called
+	struct soundfile_read_ahead *read_ahead;
+	// worker pool state if writing wavpack with sound_io:wavpack_threads > 1
+	struct soundfile_encoder *encoder;
+	// set for handles from soundfile_cache_open
+	pthread_mutex_t *cache_lock;
 } soundfile_t;
 
 // definitions from spectral analysis
 
+// parameters read on per-frame paths, see spectral_analysis_parameters()
+typedef struct spectral_analysis_parameters_t {
+	int use_fftw;
+	double sampling_rate;
+	double fft_points;
+	int fft_window;
+	double fft_overlap;
+	double peak_min_height;
+	double peak_radius;
+	double relative_relief_inside_radius;
+	double relative_relief_outside_radius;
+	double min_relative_relief;
+	double max_frequency_delta;
+	double min_power_between_track_bins;
+	double min_track_length;
+	double max_gap_size;
+} spectral_analysis_parameters_t;
+
 typedef enum fft_window_t {
 	fw_hann,
 	fw_none,
@@ -0,0 +1,349 @@
+/* a catalogue of the recordings under a data root, so they needn't all be
+ * found again on every run.
+ *   o catalogue_open() reads the catalogue left by the last run
+ *   o catalogue_update() brings the days wanted up to date
+ *   o catalogue_station() lists a station's recordings
+ *   o catalogue_save() writes it back if anything has changed
+ *
+ * recordings are <root>/<station dir>/<date dir>/<time at eof>@<suffix>.wav
+ * or .wv, maybe with a .details file beside them giving their priority.
+ * the catalogue remembers when each date directory was last changed and only
+ * reads the directories which have changed since, so a run over a day
+ * already seen costs a stat of its directory rather than a readdir. */
+
+#include "i.h"
+
+#define CATALOGUE_FILENAME	".catalogue"
+#define CATALOGUE_MAGIC		"bbcat1"
+
+static char *entry_key(const char *station_dir, const char *date_dir, const char *base_filename)
+{
+	return g_strdup_printf("%s/%s/%s",station_dir,date_dir,base_filename);
+}
+
+static catalogue_dir_t *find_dir(catalogue_t *cat, const char *station_dir, const char *date_dir, int create)
+{
+	char *key = g_strdup_printf("%s/%s",station_dir,date_dir);
+	catalogue_dir_t *dir = g_hash_table_lookup(cat->dirs,key);
+	if (!dir && create)
+	{
+		dir = salloc(sizeof(catalogue_dir_t));
+		dir->station_dir = g_intern_string(station_dir);
+		dir->date_dir = g_intern_string(date_dir);
+		dir->mtime = -1;
+		dir->entries = g_ptr_array_new();
+		g_hash_table_insert(cat->dirs,key,dir);
+		key = NULL;
+	}
+	g_free(key);
+	return dir;
+}
+
+static catalogue_entry_t *add_entry(catalogue_t *cat, catalogue_dir_t *dir, const char *base_filename)
+{
+	catalogue_entry_t *entry = salloc(sizeof(catalogue_entry_t));
+	entry->station_dir = dir->station_dir;
+	entry->date_dir = dir->date_dir;
+	g_strlcpy(entry->base_filename,base_filename,MAX_FILENAME_LEN);
+	entry->priority = -1;
+	g_hash_table_insert(cat->entries,entry_key(dir->station_dir,dir->date_dir,base_filename),entry);
+	g_ptr_array_add(dir->entries,entry);
+	return entry;
+}
+
+static void free_dir(catalogue_dir_t *dir)
+{
+	g_ptr_array_free(dir->entries,TRUE);
+	free(dir);
+}
+
+static void free_station(GPtrArray *entries)
+{
+	g_ptr_array_free(entries,TRUE);
+}
+
+/* read the catalogue left in root by an earlier run, or start an empty one */
+catalogue_t *catalogue_open(const char *root)
+{
+	catalogue_t *cat = salloc(sizeof(catalogue_t));
+	cat->root = g_strdup(root);
+	cat->entries = g_hash_table_new_full(g_str_hash,g_str_equal,g_free,free);
+	cat->dirs = g_hash_table_new_full(g_str_hash,g_str_equal,g_free,(GDestroyNotify)free_dir);
+	cat->stations = g_hash_table_new_full(g_str_hash,g_str_equal,NULL,(GDestroyNotify)free_station);
+
+	char path[MAX_PATH_LEN];
+	sprintf(path,"%s/%s",root,CATALOGUE_FILENAME);
+	FILE *fp = fopen(path,"r");
+	if (!fp)
+		return cat;
+	char line[MAX_PATH_LEN];
+	if (!fgets(line,sizeof(line),fp) || strncmp(line,CATALOGUE_MAGIC,strlen(CATALOGUE_MAGIC)))
+	{
+		dp(1,"Ignoring '%s', it isn't a catalogue\n",path);
+		fclose(fp);
+		return cat;
+	}
+	/* d <station dir> <date dir> <mtime>
+	 * f <station dir> <date dir> <base filename> <formats> <time at eof> <suffix> <nsamples> <priority> */
+	char station_dir[MAX_PATH_LEN], date_dir[MAX_PATH_LEN], base_filename[MAX_PATH_LEN];
+	catalogue_dir_t *dir = NULL;
+	int nentries = 0;
+	while (fgets(line,sizeof(line),fp))
+	{
+		long long mtime;
+		catalogue_entry_t e;
+		if (sscanf(line,"d\t%[^\t]\t%[^\t]\t%lld",station_dir,date_dir,&mtime) == 3)
+		{
+			dir = find_dir(cat,station_dir,date_dir,1);
+			dir->mtime = mtime;
+		}
+		else if (dir && sscanf(line,"f\t%[^\t]\t%[^\t]\t%[^\t]\t%d\t%lf\t%d\t%u\t%d",station_dir,date_dir,base_filename,
+				&e.formats,&e.time_at_eof,&e.suffix,&e.nsamples,&e.priority) == 8 &&
+				!strcmp(station_dir,dir->station_dir) && !strcmp(date_dir,dir->date_dir) && strlen(base_filename) < MAX_FILENAME_LEN)
+		{
+			catalogue_entry_t *entry = add_entry(cat,dir,base_filename);
+			entry->formats = e.formats;
+			entry->time_at_eof = e.time_at_eof;
+			entry->suffix = e.suffix;
+			entry->nsamples = e.nsamples;
+			entry->priority = e.priority;
+			nentries++;
+		}
+		else
+		{
+			/* the directory will be read again */
+			dp(1,"Bad line in '%s': %s",path,line);
+			if (dir)
+				dir->mtime = -1;
+		}
+	}
+	fclose(fp);
+	dp(5,"Catalogue '%s' has %d recordings in %d directories\n",path,nentries,g_hash_table_size(cat->dirs));
+	return cat;
+}
+
+/* the priority of a recording from the first line of its details file, <time>@<level> */
+static int read_priority(const char *path)
+{
+	FILE *fp = fopen(path,"r");
+	if (!fp)
+		return -1;
+	int priority;
+	if (fscanf(fp,"%*f@%d",&priority) != 1)
+		priority = -1;
+	fclose(fp);
+	return priority;
+}
+
+/* read a date directory again, keeping what is known of recordings still there.
+ * returns 0 if it can't be read. */
+static int scan_dir(catalogue_t *cat, catalogue_dir_t *dir, const char *path)
+{
+	DIR *dp = opendir(path);
+	if (!dp)
+	{
+		dp(1,"Failed to open the directory '%s'\n",path);
+		return 0;
+	}
+	for (int i=0; i<dir->entries->len; i++)
+		((catalogue_entry_t *)g_ptr_array_index(dir->entries,i))->formats = 0;
+
+	struct dirent *ep;
+	while ((ep = readdir(dp)))
+	{
+		double time_at_eof;
+		int suffix;
+		char extension[16];
+		if (sscanf(ep->d_name,"%lf@%d.%15s",&time_at_eof,&suffix,extension) != 3)
+			continue;
+		int format;
+		if (strcmp(extension,"wav") == 0)
+			format = CATALOGUE_WAV;
+		else if (strcmp(extension,"wv") == 0)
+			format = CATALOGUE_WV;
+		else if (strcmp(extension,"details") == 0)
+			format = 0;
+		else
+			continue;
+
+		char base_filename[MAX_FILENAME_LEN];
+		if (strlen(ep->d_name) >= MAX_FILENAME_LEN)
+			continue;
+		strcpy(base_filename,ep->d_name);
+		*strrchr(base_filename,'.') = '\0';
+
+		char *key = entry_key(dir->station_dir,dir->date_dir,base_filename);
+		catalogue_entry_t *entry = g_hash_table_lookup(cat->entries,key);
+		g_free(key);
+		if (!entry)
+		{
+			entry = add_entry(cat,dir,base_filename);
+			entry->time_at_eof = time_at_eof;
+			entry->suffix = suffix;
+		}
+		entry->formats |= format;
+		if (format == 0 && entry->priority < 0)
+		{
+			char details[MAX_PATH_LEN];
+			snprintf(details,sizeof(details),"%s/%s",path,ep->d_name);
+			entry->priority = read_priority(details);
+		}
+	}
+	closedir(dp);
+
+	/* drop recordings which have gone, and any details left without their sound */
+	int nremoved = 0;
+	for (int i=0; i<dir->entries->len; )
+	{
+		catalogue_entry_t *entry = g_ptr_array_index(dir->entries,i);
+		if (entry->formats)
+		{
+			i++;
+			continue;
+		}
+		g_ptr_array_remove_index_fast(dir->entries,i);
+		char *key = entry_key(dir->station_dir,dir->date_dir,entry->base_filename);
+		g_hash_table_remove(cat->entries,key);
+		g_free(key);
+		nremoved++;
+	}
+	dp(5,"Read '%s': %d recordings, %d gone\n",path,dir->entries->len,nremoved);
+	return 1;
+}
+
+/* bring the date directories from first_day to last_day (inclusive, compared as
+ * strings, so they should be named like 2008_03_19) of a station up to date,
+ * forgetting any of them which have been removed */
+void catalogue_update(catalogue_t *cat, const char *station_dir, const char *first_day, const char *last_day)
+{
+	char path[MAX_PATH_LEN];
+	snprintf(path,sizeof(path),"%s/%s",cat->root,station_dir);
+	DIR *dp = opendir(path);
+	if (!dp)
+		die("Failed to open the directory '%s'",path);
+	GHashTable *found = g_hash_table_new(NULL,NULL);
+	struct dirent *ep;
+	while ((ep = readdir(dp)))
+	{
+		if (ep->d_name[0] == '.' || strcmp(ep->d_name,first_day) < 0 || strcmp(ep->d_name,last_day) > 0)
+			continue;
+		char dir_path[MAX_PATH_LEN];
+		snprintf(dir_path,sizeof(dir_path),"%s/%s",path,ep->d_name);
+		struct stat st;
+		if (stat(dir_path,&st) || !S_ISDIR(st.st_mode))
+			continue;
+		int64_t mtime = st.st_mtim.tv_sec*(int64_t)1000000000 + st.st_mtim.tv_nsec;
+		catalogue_dir_t *dir = find_dir(cat,station_dir,ep->d_name,1);
+		g_hash_table_insert(found,dir,dir);
+		if (dir->mtime == mtime)
+			continue;
+		if (!scan_dir(cat,dir,dir_path))
+			continue;
+		dir->mtime = mtime;
+		g_hash_table_remove(cat->stations,dir->station_dir);
+		cat->changed = 1;
+	}
+	closedir(dp);
+
+	station_dir = g_intern_string(station_dir);
+	GHashTableIter iter;
+	catalogue_dir_t *dir;
+	g_hash_table_iter_init(&iter,cat->dirs);
+	while (g_hash_table_iter_next(&iter,NULL,(gpointer *)&dir))
+	{
+		if (dir->station_dir != station_dir || strcmp(dir->date_dir,first_day) < 0 || strcmp(dir->date_dir,last_day) > 0 ||
+				g_hash_table_lookup(found,dir))
+			continue;
+		dp(5,"'%s/%s' has gone, forgetting its %d recordings\n",station_dir,dir->date_dir,dir->entries->len);
+		for (int i=0; i<dir->entries->len; i++)
+		{
+			catalogue_entry_t *entry = g_ptr_array_index(dir->entries,i);
+			char *key = entry_key(dir->station_dir,dir->date_dir,entry->base_filename);
+			g_hash_table_remove(cat->entries,key);
+			g_free(key);
+		}
+		g_hash_table_iter_remove(&iter);
+		g_hash_table_remove(cat->stations,station_dir);
+		cat->changed = 1;
+	}
+	g_hash_table_destroy(found);
+}
+
+static int entry_compare(const void *p1, const void *p2)
+{
+	const catalogue_entry_t *entry1 = *(catalogue_entry_t **)p1;
+	const catalogue_entry_t *entry2 = *(catalogue_entry_t **)p2;
+	if (entry1->time_at_eof == entry2->time_at_eof)
+		return 0;
+	return (entry1->time_at_eof > entry2->time_at_eof)?1:-1;
+}
+
+/* all the recordings of a station known to the catalogue, in time order.
+ * the array belongs to the catalogue and lasts until it is next updated. */
+GPtrArray *catalogue_station(catalogue_t *cat, const char *station_dir)
+{
+	station_dir = g_intern_string(station_dir);
+	GPtrArray *entries = g_hash_table_lookup(cat->stations,station_dir);
+	if (entries)
+		return entries;
+	entries = g_ptr_array_new();
+	GHashTableIter iter;
+	catalogue_dir_t *dir;
+	g_hash_table_iter_init(&iter,cat->dirs);
+	while (g_hash_table_iter_next(&iter,NULL,(gpointer *)&dir))
+	{
+		if (dir->station_dir != station_dir)
+			continue;
+		for (int i=0; i<dir->entries->len; i++)
+			g_ptr_array_add(entries,g_ptr_array_index(dir->entries,i));
+	}
+	qsort(entries->pdata,entries->len,sizeof(gpointer),entry_compare);
+	g_hash_table_insert(cat->stations,(gpointer)station_dir,entries);
+	return entries;
+}
+
+/* write the catalogue out, if it has changed, so the next run needn't read the same directories */
+void catalogue_save(catalogue_t *cat)
+{
+	if (!cat->changed)
+		return;
+	char path[MAX_PATH_LEN], tmp_path[MAX_PATH_LEN+16];
+	sprintf(path,"%s/%s",cat->root,CATALOGUE_FILENAME);
+	sprintf(tmp_path,"%s.%d",path,(int)getpid());
+	FILE *fp = fopen(tmp_path,"w");
+	if (!fp)
+	{
+		dp(1,"Can not write catalogue '%s', the directories will be read again next run\n",tmp_path);
+		return;
+	}
+	fprintf(fp,"%s\n",CATALOGUE_MAGIC);
+	GHashTableIter iter;
+	catalogue_dir_t *dir;
+	g_hash_table_iter_init(&iter,cat->dirs);
+	while (g_hash_table_iter_next(&iter,NULL,(gpointer *)&dir))
+	{
+		fprintf(fp,"d\t%s\t%s\t%lld\n",dir->station_dir,dir->date_dir,(long long)dir->mtime);
+		for (int i=0; i<dir->entries->len; i++)
+		{
+			catalogue_entry_t *entry = g_ptr_array_index(dir->entries,i);
+			fprintf(fp,"f\t%s\t%s\t%s\t%d\t%.6f\t%d\t%u\t%d\n",entry->station_dir,entry->date_dir,entry->base_filename,
+				entry->formats,entry->time_at_eof,entry->suffix,entry->nsamples,entry->priority);
+		}
+	}
+	if (fclose(fp) || rename(tmp_path,path))
+	{
+		dp(1,"Failed to write catalogue '%s'\n",path);
+		unlink(tmp_path);
+		return;
+	}
+	cat->changed = 0;
+}
+
+void catalogue_free(catalogue_t *cat)
+{
+	g_hash_table_destroy(cat->stations);
+	g_hash_table_destroy(cat->dirs);
+	g_hash_table_destroy(cat->entries);
+	g_free(cat->root);
+	free(cat);
+}
@@ -0,0 +1,127 @@
+#include "i.h"
+
+/* globals of localize.c, which is not in the library */
+int NUM_STATIONS;
+int graphing;
+
+static char root[] = "/tmp/catalogue_testXXXXXX";
+
+static void make_file(const char *date_dir, const char *name, const char *contents)
+{
+	char path[MAX_PATH_LEN];
+	snprintf(path,sizeof(path),"%s/station0/%s",root,date_dir);
+	g_mkdir_with_parents(path,0755);
+	snprintf(path,sizeof(path),"%s/station0/%s/%s",root,date_dir,name);
+	if (!g_file_set_contents(path,contents,-1,NULL))
+		die("Can't write '%s'",path);
+}
+
+static void remove_file(const char *date_dir, const char *name)
+{
+	char path[MAX_PATH_LEN];
+	snprintf(path,sizeof(path),"%s/station0/%s/%s",root,date_dir,name);
+	if (unlink(path))
+		die("Can't remove '%s'",path);
+}
+
+static void remove_dir(const char *date_dir)
+{
+	char path[MAX_PATH_LEN];
+	snprintf(path,sizeof(path),"%s/station0/%s",root,date_dir);
+	if (rmdir(path))
+		die("Can't remove '%s'",path);
+}
+
+/* the station's recordings must be exactly these, in time order */
+static void check_station(catalogue_t *cat, const char *expected[], int nexpected)
+{
+	GPtrArray *entries = catalogue_station(cat,"station0");
+	for (int i=0; i<entries->len; i++)
+		dp(5,"%s/%s\n",((catalogue_entry_t *)g_ptr_array_index(entries,i))->date_dir,((catalogue_entry_t *)g_ptr_array_index(entries,i))->base_filename);
+	assert(entries->len == nexpected);
+	for (int i=0; i<nexpected; i++)
+		assert(!strcmp(((catalogue_entry_t *)g_ptr_array_index(entries,i))->base_filename,expected[i]));
+}
+
+static catalogue_entry_t *find_entry(catalogue_t *cat, const char *base_filename)
+{
+	GPtrArray *entries = catalogue_station(cat,"station0");
+	for (int i=0; i<entries->len; i++)
+		if (!strcmp(((catalogue_entry_t *)g_ptr_array_index(entries,i))->base_filename,base_filename))
+			return g_ptr_array_index(entries,i);
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	testing_initialize(&argc,&argv,"");
+	if (!mkdtemp(root))
+		die("Can't make a directory for the test");
+	make_file("2008_03_19","1205911300.000000@90.wav","");
+	make_file("2008_03_19","1205911300.000000@90.details","1205911300.0@7\n");
+	make_file("2008_03_19","1205911200.000000@90.wv","");
+	make_file("2008_03_19","1205911100.000000@90.details","1205911100.0@3\n");
+	make_file("2008_03_19","notes.txt","");
+	make_file("2008_03_20","1205997600.000000@90.wav","");
+	make_file("2008_03_20","1205997600.000000@90.wv","");
+	make_file("2008_03_21","1206084000.000000@90.wav","");
+
+	/* a new catalogue reads the days asked for, and only those.
+	 * details without their sound aren't recordings */
+	catalogue_t *cat = catalogue_open(root);
+	catalogue_update(cat,"station0","2008_03_19","2008_03_20");
+	const char *first[] = {"1205911200.000000@90","1205911300.000000@90","1205997600.000000@90"};
+	check_station(cat,first,3);
+	catalogue_entry_t *entry = find_entry(cat,"1205911300.000000@90");
+	assert(entry->formats == CATALOGUE_WAV && entry->priority == 7 && entry->suffix == 90 && entry->time_at_eof == 1205911300);
+	assert(find_entry(cat,"1205997600.000000@90")->formats == (CATALOGUE_WAV|CATALOGUE_WV));
+	assert(find_entry(cat,"1205911200.000000@90")->priority == -1);
+	find_entry(cat,"1205997600.000000@90")->nsamples = 960000;
+	cat->changed = 1;
+	catalogue_save(cat);
+	catalogue_free(cat);
+	dp(0,"new catalogue OK\n");
+
+	/* what is saved is read back without reading the directories again */
+	cat = catalogue_open(root);
+	check_station(cat,first,3);
+	catalogue_update(cat,"station0","2008_03_19","2008_03_20");
+	assert(!cat->changed);
+	check_station(cat,first,3);
+	assert(find_entry(cat,"1205997600.000000@90")->nsamples == 960000);
+	assert(find_entry(cat,"1205911300.000000@90")->priority == 7);
+	dp(0,"saved catalogue OK\n");
+
+	/* added and removed recordings are noticed, and what is known of the rest kept */
+	make_file("2008_03_19","1205911400.000000@90.wv","");
+	remove_file("2008_03_19","1205911200.000000@90.wv");
+	remove_file("2008_03_20","1205997600.000000@90.wav");
+	catalogue_update(cat,"station0","2008_03_19","2008_03_21");
+	assert(cat->changed);
+	const char *rescanned[] = {"1205911300.000000@90","1205911400.000000@90","1205997600.000000@90","1206084000.000000@90"};
+	check_station(cat,rescanned,4);
+	assert(find_entry(cat,"1205997600.000000@90")->formats == CATALOGUE_WV);
+	assert(find_entry(cat,"1205997600.000000@90")->nsamples == 960000);
+	dp(0,"rescan OK\n");
+
+	/* a day removed is forgotten, though only when it is asked for */
+	remove_file("2008_03_20","1205997600.000000@90.wv");
+	remove_dir("2008_03_20");
+	catalogue_update(cat,"station0","2008_03_21","2008_03_21");
+	check_station(cat,rescanned,4);
+	catalogue_update(cat,"station0","2008_03_19","2008_03_21");
+	const char *removed[] = {"1205911300.000000@90","1205911400.000000@90","1206084000.000000@90"};
+	check_station(cat,removed,3);
+	catalogue_save(cat);
+	catalogue_free(cat);
+	cat = catalogue_open(root);
+	check_station(cat,removed,3);
+	catalogue_free(cat);
+	dp(0,"removed day OK\n");
+
+	char *command = g_strdup_printf("rm -rf '%s'",root);
+	if (system(command))
+		die("Can't remove '%s'",root);
+	g_free(command);
+	return 0;
+}
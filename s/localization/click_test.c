@@ -0,0 +1,109 @@
+#include "i.h"
+
+/* globals of localize.c, which is not in the library */
+int NUM_STATIONS;
+int graphing;
+
+#define TEST_SAMPLING_RATE	16000
+#define TEST_SECONDS		8
+#define TEST_THRESHOLD		0.2
+#define TEST_OFFSET		3000.5	/* of the clicks after each second, half way between samples */
+#define TEST_FAINT		5	/* the second whose click is too faint to find */
+
+/* a pps click, a dip then a rise, added at centre.  whatever the zero phase
+ * filter, the filtered click goes above zero exactly at centre */
+static void add_click(double *x, index_t n, double centre, double depth)
+{
+	for (index_t i=0; i<n; i++)
+	{
+		double t = (i - centre)/SAMPLING_RATE;
+		x[i] += depth*(exp(-square_d((t-0.002)/0.001)) - exp(-square_d((t+0.002)/0.001)));
+	}
+}
+
+/* how far a click of depth 1 dips once filtered as the detector does */
+static double filtered_depth(void)
+{
+	index_t n = SAMPLING_RATE/4;
+	double *x = (double *)salloc(sizeof(double)*n);
+	add_click(x,n,n/2,1);
+	filter_in_place(x,n,0,CLICK_LOWPASS_FREQ);
+	double depth = 0;
+	for (index_t i=0; i<n; i++)
+		depth = MAX(depth,-x[i]);
+	free(x);
+	return depth;
+}
+
+/* one click a second, some of them just either side of the threshold, with a little noise */
+static double *clicks_waveform(index_t n)
+{
+	double *x = (double *)salloc(sizeof(double)*n);
+	srand(1);
+	for (index_t i=0; i<n; i++)
+		x[i] = 0.01*(rand()/(double)RAND_MAX - 0.5);
+	double unit = TEST_THRESHOLD/filtered_depth();
+	for (int s=0; s<TEST_SECONDS; s++)
+	{
+		double depth = 3*unit;
+		if (s == 2)
+			depth = 1.2*unit;
+		else if (s == TEST_FAINT)
+			depth = 0.8*unit;
+		add_click(x,n,s*SAMPLING_RATE + TEST_OFFSET,depth);
+	}
+	return x;
+}
+
+/* the clicks found when the waveform is given to the detector block samples at a time */
+static index_t *detect(const double *x, index_t n, index_t block, int *nclicks)
+{
+	click_detector_t *detector = (click_detector_t *)salloc(sizeof(click_detector_t));
+	click_detector_init(detector,TEST_THRESHOLD);
+	for (index_t i=0; i<n; i+=block)
+		click_detector_add(detector,x+i,MIN(block,n-i));
+	index_t *clicks = click_detector_finish(detector,nclicks);
+	free(detector);
+	return clicks;
+}
+
+static void test_click_detector(void)
+{
+	index_t n = TEST_SECONDS*SAMPLING_RATE;
+	double *x = clicks_waveform(n);
+
+	int nclicks;
+	index_t *clicks = detect(x,n,n,&nclicks);
+	for (int k=0; k<nclicks; k++)
+		dp(5,"click %d at %u\n",k,clicks[k]);
+	assert(nclicks == TEST_SECONDS-1);
+	for (int k=0, s=0; s<TEST_SECONDS; s++)
+	{
+		if (s == TEST_FAINT)
+			continue;
+		assert(clicks[k++] == (index_t)ceil(s*SAMPLING_RATE + TEST_OFFSET));
+	}
+	dp(0,"click detector OK\n");
+
+	/* blocks ending in the middle of a click, or after every sample, change nothing */
+	index_t blocks[] = {(index_t)TEST_OFFSET + 1, 4099, 1};
+	for (int b=0; b<sizeof(blocks)/sizeof(blocks[0]); b++)
+	{
+		int nblock_clicks;
+		index_t *block_clicks = detect(x,n,blocks[b],&nblock_clicks);
+		assert(nblock_clicks == nclicks);
+		assert(!memcmp(block_clicks,clicks,nclicks*sizeof(index_t)));
+		free(block_clicks);
+	}
+	dp(0,"click detector blocks OK\n");
+	free(clicks);
+	free(x);
+}
+
+int main(int argc, char **argv)
+{
+	testing_initialize(&argc,&argv,"");
+	SAMPLING_RATE = TEST_SAMPLING_RATE;
+	test_click_detector();
+	return 0;
+}
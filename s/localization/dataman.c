@@ -8,148 +8,121 @@
 /* config data */
 char *base_dir;
 char *date_dir;
-char *station_dir[NUM_STATIONS];
+char *last_date_dir;
+char **station_dir;
 double click_threshold;
-int compress_clicktracks; 
+double waveform_cache_mb;
+
+/* from the headers of the recordings, which must all agree */
+int NUM_CHANNELS;
+int SAMPLING_RATE;
 
 /* they specify the same time, just in different formats */
 struct tm *base_date; 
 time_t     base_epoch;
 
-/* internal data */
-datafile_t files[NUM_STATIONS][MAX_FILES];
-int num_files[NUM_STATIONS];
+/* internal data, files and num_files are for each station */
+catalogue_t *catalogue;
+datafile_t **files;
+int *num_files;
+
+/* the soundfile cache isn't thread-safe, and a handle may be closed by the next open
+ * unless it is locked with soundfile_cache_lock */
+static pthread_mutex_t soundfile_lock = PTHREAD_MUTEX_INITIALIZER;
 
 void dataman_cleanup(void)
 {
-	for (int i = 0; i<NUM_STATIONS; i++)
-	for (int j = 0; j<num_files[i]; j++)
+	for (int i = 0; files && i<NUM_STATIONS; i++)
 	{
-		if (files[i][j].clicktrack != NULL)
-			free(files[i][j].clicktrack);
+		for (int j = 0; j<num_files[i]; j++)
+		{
+			datafile_t *file = &files[i][j];
+			if (file->clicks != NULL)
+				free(file->clicks);
+			pthread_mutex_destroy(&file->clicks_lock);
+			/* remember the lengths of recordings read, so they needn't be guessed next time */
+			if (file->nsamples && file->entry->nsamples != file->nsamples)
+			{
+				file->entry->nsamples = file->nsamples;
+				catalogue->changed = 1;
+			}
+		}
+		free(files[i]);
 	}
+	free(files);
+	free(num_files);
+	files = NULL;
+	num_files = NULL;
+	if (catalogue)
+	{
+		catalogue_save(catalogue);
+		catalogue_free(catalogue);
+		catalogue = NULL;
+	}
+	waveform_cache_flush();
+	soundfile_cache_flush();
 }
 
-/* for qsort */
-int file_compare(const void *p1, const void *p2)
-{
-	datafile_t *file1 = (datafile_t *)p1;
-	datafile_t *file2 = (datafile_t *)p2;
-
-	if (file1->time_at_eof == file2->time_at_eof)
-		return 0;
-	return (file1->time_at_eof > file2->time_at_eof)?1:-1;
-}
-
-/* for my binary search */
-int file_consider(const void *p1, const void *p2)
-{
-	datafile_t *file = (datafile_t *)p1;
-	double      time = *((double *)p2);
-
-	if (time > file->time_at_eof)
-		return 1;
-	else if (time <= file->time_at_eof - 60)
-		return -1;
-	else
-		return 0;
-}
-
-/* returns the index to an elem p in the array such that consider(p,key)==0 or else returns -1 */
-int binary_search(void *array, size_t nmemb, size_t size, void *key, int(*consider)(const void*, const void *))
+/* the number of channels and sampling rate of a station are taken from its first recording */
+static void read_station_format(int station)
 {
-	if (nmemb == 0)
-		return -1;
+	char path[MAX_PATH_LEN];
+	sprint_filepath(path,&files[station][0]);
+	pthread_mutex_lock(&soundfile_lock);
+	soundfile_t *sf = soundfile_cache_open(path);
+	int nchannels = sf->channels;
+	int sampling_rate = sf->samplerate;
+	pthread_mutex_unlock(&soundfile_lock);
 
-	int mididx = nmemb/2;
-	void *mid = array + size*mididx;
-	int result = consider(mid,key);
-	if (result < 0)
+	dp(5,"Station %d has %d channels at %d Hz\n",station,nchannels,sampling_rate);
+	if (station == 0)
 	{
-		return binary_search(array,mididx,size,key,consider);
-	}
-	else if (result > 0)
-	{
-		int recidx = binary_search(mid + size,nmemb-mididx-1,size,key,consider);
-		if (recidx < 0)
-			return -1;
-		else
-			return mididx+1+recidx;
-	}
-	else // result == 0
-	{
-		return mididx;
+		NUM_CHANNELS = nchannels;
+		SAMPLING_RATE = sampling_rate;
 	}
+	else if (nchannels != NUM_CHANNELS || sampling_rate != SAMPLING_RATE)
+		die("Station %d has %d channels at %d Hz but station 0 has %d channels at %d Hz",station,nchannels,sampling_rate,NUM_CHANNELS,SAMPLING_RATE);
 }
 
-
-/* scan the appropriate directories and populate the `files' arrays with datafile_t info */
+/* bring the catalogue of the data directories up to date and populate the `files'
+ * arrays with datafile_t info for the days from date_dir to last_date_dir */
 void dataman_scan(void)
 {
+	char *last_day = (last_date_dir && *last_date_dir) ? last_date_dir : date_dir;
+	catalogue = catalogue_open(base_dir);
+	files = salloc(sizeof(datafile_t *)*NUM_STATIONS);
+	num_files = salloc(sizeof(int)*NUM_STATIONS);
 	for (int station = 0; station<NUM_STATIONS; station++)
 	{
-		num_files[station] = 0;	
+		catalogue_update(catalogue,station_dir[station],date_dir,last_day);
+		GPtrArray *entries = catalogue_station(catalogue,station_dir[station]);
 
-		char dir[MAX_PATH_LEN];
-		sprintf(dir,"%s/%s/%s",base_dir,station_dir[station],date_dir);
-
-		DIR *dp;
-		dp = opendir(dir);
-		if (!dp) die("Failed to open the directory '%s'",dir);
-		struct dirent *ep;
-		while ((ep = readdir(dp)))
+		files[station] = salloc(sizeof(datafile_t)*MAX(1,entries->len));
+		num_files[station] = 0;
+		for (int i=0; i<entries->len; i++)
 		{
-			datafile_t *file = &files[station][num_files[station]];
-			file->have_uncompressed = 0;
-			file->have_compressed   = 0;
-
-			char extension[16];
-			if (sscanf(ep->d_name,"%lf@%d.%s",&file->time_at_eof,&file->suffix,(char *)&extension)==3)
-			{
-				// see if we have this file already
-				int exists=0;
-				for (int i=0; i<num_files[station]; i++)
-				{
-					if (approximately_zero(files[station][i].time_at_eof - file->time_at_eof))
-					//if (files[station][i].time_at_eof == file->time_at_eof)
-					{
-						exists=1;
-						file = &files[station][i];
-						break;
-					}
-				}
-
-				if (strcmp(extension,"wav")==0)
-				{
-					file->have_uncompressed = 1;
-				}
-				else if (strcmp(extension,"wv")==0)
-				{
-					file->have_compressed   = 1;
-				}
-				else continue;
-		
-				if (!exists)
-				{
-					// this is the first time we've found this file so set it up
-					strncpy(file->base_filename,ep->d_name,MAX_FILENAME_LEN);
-					// strip the extension
-					char *pext = strrchr(ep->d_name,'.');
-					file->base_filename[strlen(file->base_filename)-strlen(pext)]='\0';
-
-					file->clicktrack = NULL;
-					file->station = station;
-					num_files[station]++;
-				}
-			}
+			catalogue_entry_t *entry = g_ptr_array_index(entries,i);
+			if (strcmp(entry->date_dir,date_dir) < 0 || strcmp(entry->date_dir,last_day) > 0)
+				continue;
+			datafile_t *file = &files[station][num_files[station]++];
+			file->have_uncompressed = (entry->formats & CATALOGUE_WAV) != 0;
+			file->have_compressed   = (entry->formats & CATALOGUE_WV) != 0;
+			strcpy(file->base_filename,entry->base_filename);
+			file->time_at_eof = entry->time_at_eof;
+			file->suffix = entry->suffix;
+			file->station = station;
+			file->date_dir = entry->date_dir;
+			file->entry = entry;
+			file->clicks = NULL;
+			pthread_mutex_init(&file->clicks_lock,NULL);
 		}
-		closedir(dp);
 
-		dp(5,"Found %d files for station %d on day %s\n",num_files[station],station,date_dir);
-
-		// now we sort them (by their timestamps)
-		qsort(&files[station],num_files[station],sizeof(datafile_t),file_compare);
+		dp(5,"Found %d files for station %d on days %s to %s\n",num_files[station],station,date_dir,last_day);
+		if (num_files[station] == 0)
+			die("No recordings found for station %d in '%s/%s' from %s to %s",station,base_dir,station_dir[station],date_dir,last_day);
+		read_station_format(station);
 	}
+	catalogue_save(catalogue);
 
 	// now we can set the base time
 	base_epoch = floor(files[0][0].time_at_eof);
@@ -164,7 +137,7 @@ int sprint_filepath(char *output,datafile_t *file)
 {
 	char* extension = file->have_uncompressed ? ".wav" : ".wv";
 	int compression = file->have_uncompressed ? UNCOMPRESSED : WAVPACK;
-	sprintf(output,"%s/%s/%s/%s%s",base_dir,station_dir[file->station],date_dir,file->base_filename,extension);
+	sprintf(output,"%s/%s/%s/%s%s",base_dir,station_dir[file->station],file->date_dir,file->base_filename,extension);
 	return compression;
 }
 
@@ -223,60 +196,62 @@ double *read_raw(char *filename,index_t *nsamples,int *nchannels,double *samplin
 }
 
 
-/* write one channel of data to a file, compressing if desired.
- * note that this differs from read_raw in that the result of read_raw has
- * the data for all channels interleaved, whereas write_raw only deals with
- * a single channel */
- 
-void write_waveform(char *file, double *waveform, index_t nsamples, int compression)
+/* read a region of a file without decoding anything outside it.  uncompressed files
+ * are read straight out of the page cache, wavpack files are seeked to the region.
+ * handles come from the soundfile cache so neighbouring regions of the same file
+ * don't reopen it.  channel -1 means all channels, otherwise only output[0] is set.
+ * returns 0 (and reads nothing) for files soundfile can't read, in which case the
+ * caller should fall back to read_raw. */
+static int read_region(double *output[], int channel, char *filename, index_t start, index_t *len)
 {
-	if (compression == UNCOMPRESSED)
+	/* only the open is serialised, the handle's own lock keeps it open while it is read */
+	pthread_mutex_lock(&soundfile_lock);
+	soundfile_t *sf = soundfile_cache_open(filename);
+	soundfile_cache_lock(sf);
+	pthread_mutex_unlock(&soundfile_lock);
+	if (sf->t == sft_wavpack && (WavpackGetMode(sf->p) & MODE_FLOAT))
+	{
+		soundfile_cache_unlock(sf);
+		return 0;
+	}
+	assert(sf->samplerate == SAMPLING_RATE);
+	assert(channel < 0 ? sf->channels <= NUM_CHANNELS : sf->channels > channel);
+	if (start+*len >= sf->frames)
 	{
-		soundfile_write_entire_double(file,nsamples,1,SAMPLING_RATE,waveform);
+		dp(15,"read_region: wanting to read past end of file\n");
+		*len = start < sf->frames ? sf->frames - start : 0;
 	}
-	else
+	int nchannels = sf->channels;
+	double *data = NULL;
+	const sample_t *frames = soundfile_view(sf, start, len);
+	if (!frames)
 	{
-		soundfile_write_entire_double("/tmp/clicktocompress.wav",nsamples,1,SAMPLING_RATE,waveform);
-		char line[MAX_PATH_LEN];
-		if (system("wavpack -y /tmp/clicktocompress.wav 2>/dev/null"))
-		{
-			printf("wavpack command failed for file '%s'\n", file);
-			exit (1);
-		}
-		sprintf(line,"mv /tmp/clicktocompress.wv %s",file);
-		if (system(line)) 
+		data = salloc((size_t)*len*nchannels*sizeof(double));
+		*len = soundfile_read_range_double(sf, start, data, *len);
+	}
+	for (int chan = 0; chan<nchannels; chan++)
+	{
+		if (channel >= 0 && chan != channel)
+			continue;
+		double *waveform = salloc(*len*sizeof(double));
+		for (index_t i=0; i<*len; i++)
 		{
-			printf("failed to move compressed file to '%s'\n", file);
-			exit(1);
+			waveform[i] = frames ? sample_t_to_double(frames[i*nchannels+chan]) : data[i*nchannels+chan];
 		}
-		/*
-		printf("Writing compressed files isn't implemented yet!\n");
-		exit(1);
-		*/
-/*		
-  1. get a context and set block output function with WavpackOpenFileOutput()
-  2. set the data format and specify modes with WavpackSetConfiguration()
-  3. optionally write a RIFF header with WavpackAddWrapper()
-  4. allocate buffers and prepare for packing with WavpackPackInit()
-  5. actually compress audio and write blocks with WavpackPackSamples()
-  6. flush final samples into blocks with WavpackFlushSamples()
-  7. optionally write MD5 sum with WavpackStoreMD5Sum()
-  8. optionally write RIFF trailer with WavpackAddWrapper()
-  9. if MD5 sum or RIFF trailer written, call WavpackFlushSamples() again
-  10. optionally append metadata tag with functions in next section
-  11. optionally update number of samples with WavpackUpdateNumSamples()
-  12. close the context with WavpackCloseFile()
-*/
+		output[channel < 0 ? chan : 0] = waveform;
 	}
+	soundfile_cache_unlock(sf);
+	free(data);
+	return 1;
 }
 
-/* read the specified region for all channels of the file.
- * if the region spans past the end of file, don't fail, just read to end of file.
- * returns the number of samples read.
- * output should be an array with one (double *) for each channel in the file, through
- * which the read waveforms will be returned (as newly allocated double*'s) */
-index_t read_all_channels(double *output[], char *filename, index_t start, index_t len, int compressed)
+/* decodes a region of all channels, see read_all_channels */
+static index_t decode_all_channels(double *output[], char *filename, index_t start, index_t len, int compressed)
 {
+	if (read_region(output, -1, filename, start, &len))
+	{
+		return len;
+	}
 	index_t nsamples;
 	int nchannels;
 	double sampling_rate;
@@ -301,15 +276,14 @@ index_t read_all_channels(double *output[], char *filename, index_t start, index
 }	
 
 
-/* reads a region (of `len' samples starting at sample `start') of channel `channel' 
- * of the wavfile `filename'.
- * 
- * (*output) points to a newly allocated waveform
- * returns the number of samples read
- */
-
-index_t read_waveform(double **output, char *filename, int channel, index_t start, index_t len, int compressed)
+/* decodes a region of one channel, see read_waveform */
+static index_t decode_waveform(double **output, char *filename, int channel, index_t start, index_t len, int compressed)
 {
+	if (read_region(output, channel, filename, start, &len))
+	{
+		dp(10,"Successfully read channel %d of waveform %s from %d to %d\n",channel,filename,start,start+len-1);
+		return len;
+	}
 	index_t nsamples;
 	int nchannels;
 	double sampling_rate;
@@ -337,119 +311,425 @@ index_t read_waveform(double **output, char *filename, int channel, index_t star
 	return len;
 }
 
-/* reads a whole channel */
+/*============================================================================================*/
+
+/* batches of regions mostly fall within a few files, so whole files are kept
+ * decoded, one float array per channel, in a cache of waveform_cache_mb
+ * which discards the least recently used file first.  a file is decoded
+ * whole once it has been read from twice, or when a read covers a large part
+ * of it; until then reads only decode the region asked for. */
 
-index_t read_whole_waveform(double **output, char *filename, int channel, int compression)
+typedef struct
 {
-	int nchannels;
+	char *filename;
+	int accesses;
+	unsigned long last_used;
 	index_t nsamples;
-	double sampling_rate;
-//	double *data = soundfile_read_entire_double(filename,&nsamples,&nchannels,&sampling_rate);
-	double *data = read_raw(filename,&nsamples,&nchannels,&sampling_rate,compression);	
-	assert(sampling_rate == SAMPLING_RATE);
-	assert(nchannels > channel);
+	int nchannels;
+	float **channel;	/* [nchannels][nsamples], NULL if not decoded */
+} cached_waveform_t;
 
-	double *waveform = salloc(nsamples*sizeof(double));
-	double (*channels)[nchannels] = (void *)data;
-	for (index_t i=0; i<nsamples; i++)
+static struct
+{
+	pthread_mutex_t lock;
+	GHashTable *files;	/* filename -> cached_waveform_t */
+	size_t bytes;
+	unsigned long uses;
+} waveform_cache = {PTHREAD_MUTEX_INITIALIZER};
+
+static void waveform_cache_discard(cached_waveform_t *c)
+{
+	for (int chan=0; chan<c->nchannels; chan++)
+		free(c->channel[chan]);
+	free(c->channel);
+	c->channel = NULL;
+	waveform_cache.bytes -= (size_t)c->nsamples*c->nchannels*sizeof(float);
+}
+
+/* discards least recently used files until the cache is within its budget, keeping keep */
+static void waveform_cache_trim(cached_waveform_t *keep)
+{
+	size_t budget = waveform_cache_mb*1024*1024;
+	while (waveform_cache.bytes > budget)
+	{
+		cached_waveform_t *oldest = NULL;
+		GHashTableIter iter;
+		gpointer key, value;
+		g_hash_table_iter_init(&iter,waveform_cache.files);
+		while (g_hash_table_iter_next(&iter,&key,&value))
+		{
+			cached_waveform_t *c = value;
+			if (c->channel && c != keep && (!oldest || c->last_used < oldest->last_used))
+				oldest = c;
+		}
+		if (!oldest)
+			break;
+		dp(15,"waveform cache: discarding %s\n",oldest->filename);
+		waveform_cache_discard(oldest);
+	}
+}
+
+/* copies a region of a cached file out as newly allocated doubles, as read_region does */
+static index_t waveform_cache_copy(double *output[], int channel, cached_waveform_t *c, index_t start, index_t len)
+{
+	assert(channel < 0 ? c->nchannels <= NUM_CHANNELS : c->nchannels > channel);
+	if (start+len >= c->nsamples)
 	{
-		waveform[i] = channels[i][channel];
+		dp(15,"waveform cache: wanting to read past end of file\n");
+		len = start < c->nsamples ? c->nsamples - start : 0;
 	}
-	free(data);
+	for (int chan=0; chan<c->nchannels; chan++)
+	{
+		if (channel >= 0 && chan != channel)
+			continue;
+		double *waveform = salloc(len*sizeof(double));
+		const float *from = c->channel[chan] + start;
+		for (index_t i=0; i<len; i++)
+			waveform[i] = from[i];
+		output[channel < 0 ? chan : 0] = waveform;
+	}
+	return len;
+}
 
-	*output = waveform;
-	return nsamples;
+/* reads a region of channel, or of all channels if channel is -1, through the cache */
+static index_t read_cached(double *output[], int channel, char *filename, index_t start, index_t len, int compressed)
+{
+	pthread_mutex_lock(&waveform_cache.lock);
+	if (!waveform_cache.files)
+		waveform_cache.files = g_hash_table_new(g_str_hash,g_str_equal);
+	cached_waveform_t *c = g_hash_table_lookup(waveform_cache.files,filename);
+	if (!c)
+	{
+		c = salloc(sizeof(cached_waveform_t));
+		memset(c,0,sizeof(cached_waveform_t));
+		c->filename = sstrdup(filename);
+		g_hash_table_insert(waveform_cache.files,c->filename,c);
+	}
+	c->accesses++;
+	c->last_used = ++waveform_cache.uses;
+	if (c->channel)
+	{
+		len = waveform_cache_copy(output,channel,c,start,len);
+		pthread_mutex_unlock(&waveform_cache.lock);
+		return len;
+	}
+	int accesses = c->accesses;
+	pthread_mutex_unlock(&waveform_cache.lock);
+
+	index_t nsamples = determine_nsamples(filename,compressed);
+	int whole = waveform_cache_mb > 0 && (accesses > 1 || len >= nsamples*WAVEFORM_CACHE_WHOLE_FRACTION);
+	if (!whole)
+	{
+		if (channel < 0)
+			return decode_all_channels(output,filename,start,len,compressed);
+		return decode_waveform(output,filename,channel,start,len,compressed);
+	}
+
+	/* decoding isn't done under the lock, if another thread gets in first its copy is kept */
+	double *decoded[NUM_CHANNELS];
+	memset(decoded,0,sizeof(decoded));
+	nsamples = decode_all_channels(decoded,filename,0,nsamples,compressed);
+	int nchannels = 0;
+	while (nchannels < NUM_CHANNELS && decoded[nchannels])
+		nchannels++;
+	float **channels = salloc(sizeof(float *)*nchannels);
+	for (int chan=0; chan<nchannels; chan++)
+	{
+		channels[chan] = salloc(sizeof(float)*nsamples);
+		for (index_t i=0; i<nsamples; i++)
+			channels[chan][i] = decoded[chan][i];
+		free(decoded[chan]);
+	}
+	dp(15,"waveform cache: decoded %d channels of %s\n",nchannels,filename);
+
+	pthread_mutex_lock(&waveform_cache.lock);
+	if (c->channel)
+	{
+		for (int chan=0; chan<nchannels; chan++)
+			free(channels[chan]);
+		free(channels);
+	}
+	else
+	{
+		c->channel = channels;
+		c->nchannels = nchannels;
+		c->nsamples = nsamples;
+		waveform_cache.bytes += (size_t)nsamples*nchannels*sizeof(float);
+		waveform_cache_trim(c);
+	}
+	len = waveform_cache_copy(output,channel,c,start,len);
+	pthread_mutex_unlock(&waveform_cache.lock);
+	return len;
+}
+
+/* frees everything in the waveform cache */
+void waveform_cache_flush(void)
+{
+	pthread_mutex_lock(&waveform_cache.lock);
+	if (waveform_cache.files)
+	{
+		GHashTableIter iter;
+		gpointer key, value;
+		g_hash_table_iter_init(&iter,waveform_cache.files);
+		while (g_hash_table_iter_next(&iter,&key,&value))
+		{
+			cached_waveform_t *c = value;
+			if (c->channel)
+				waveform_cache_discard(c);
+			free(c->filename);
+			free(c);
+		}
+		g_hash_table_destroy(waveform_cache.files);
+		waveform_cache.files = NULL;
+	}
+	pthread_mutex_unlock(&waveform_cache.lock);
+}
+
+/* read the specified region for all channels of the file.
+ * if the region spans past the end of file, don't fail, just read to end of file.
+ * returns the number of samples read.
+ * output should be an array with one (double *) for each channel in the file, through
+ * which the read waveforms will be returned (as newly allocated double*'s) */
+index_t read_all_channels(double *output[], char *filename, index_t start, index_t len, int compressed)
+{
+	return read_cached(output,-1,filename,start,len,compressed);
+}
+
+/* reads a region (of `len' samples starting at sample `start') of channel `channel' 
+ * of the wavfile `filename'.
+ * 
+ * (*output) points to a newly allocated waveform
+ * returns the number of samples read
+ */
+
+index_t read_waveform(double **output, char *filename, int channel, index_t start, index_t len, int compressed)
+{
+	return read_cached(output,channel,filename,start,len,compressed);
 }
 
 /*======================================================================================*/
 
-/* search the clicktrack for a click.  we search either left or right depending
- * on the relation of end to position */
+/* the pps signal on channel 0 gives a click on every second, which is the
+ * sample where the low-passed signal next goes above zero after falling below
+ * -click_threshold.  they are found in one pass: the sound is averaged over
+ * blocks of CLICK_DECIMATION samples and low-pass filtered at the reduced
+ * rate to spot each click roughly.  as the delay of that filter depends on
+ * the shape of the click, the last few thousand samples are kept, and the
+ * click is then placed exactly by filtering just the samples around it. */
 
-index_t find_click(double *waveform, index_t position, index_t end, double threshold)
+void click_detector_init(click_detector_t *d, double threshold)
 {
-	/* we want the sample which crosses zero after we have found a peak */
+	memset(d,0,sizeof(click_detector_t));
+	/* a filter designed at the full rate has the same response at the reduced rate scaled down */
+	butterworth_lowpass(&d->lowpass,CLICK_LOWPASS_FREQ*CLICK_DECIMATION,CLICK_LOWPASS_ORDER);
+	d->delay = biquad_cascade_delay(&d->lowpass)*CLICK_DECIMATION - (CLICK_DECIMATION-1)/2.0;
+	d->threshold = threshold;
+	d->clicks = g_array_new(FALSE,FALSE,sizeof(index_t));
+}
+
+/* place the pending click using the samples kept around it */
+static void click_detector_refine(click_detector_t *d)
+{
+	index_t guess = d->pending;
+	index_t start = guess > CLICK_REFINE_SAMPLES ? guess - CLICK_REFINE_SAMPLES : 0;
+	if (d->nsamples > CLICK_HISTORY && start < d->nsamples - CLICK_HISTORY)
+		start = d->nsamples - CLICK_HISTORY;
+	index_t end = MIN(d->nsamples,guess+CLICK_REFINE_SAMPLES);
+	index_t n = end - start;
+	double window[2*CLICK_REFINE_SAMPLES];
+	for (index_t i=0; i<n; i++)
+		window[i] = d->history[(start+i)%CLICK_HISTORY];
+	filter_in_place(window,n,0,CLICK_LOWPASS_FREQ);
+
+	/* search from a little before the rough position, which is never far out */
+	index_t click = guess;
 	int found_peak = 0;
-	index_t i = position;
-	int step = end > position ? 1 : -1;
-	dp(15,"find_click: from %u to %u step=%d\n",position,end,step);
-
-	while (i != end)
-	{
-		double val = waveform[i];
-//		dp(1, "i=%d\n", (int)i);
-		if (((-step)*val < 0) && (found_peak)) 
-			return i;
-		if ((-step)*val > threshold)
-			found_peak=1;
-		i += step;
-	}
-	dp(10,"warning: Didn't find the click for position %u!\n",position);
-	if ((end > position) && (end - position < 1.5*SAMPLING_RATE))
-		dp(10,"warning: But it's okay because we were near the end of the file\n");
-	if ((end < position) && (position - end < 1.5*SAMPLING_RATE))
-		dp(10,"warning: But it's okay because we were near the start of the file\n");
-	return end;
+	for (index_t i=(guess-start)/2; i<n; i++)
+	{
+		if (window[i] > 0 && found_peak)
+		{
+			click = start + i;
+			break;
+		}
+		if (-window[i] > d->threshold)
+			found_peak = 1;
+	}
+	/* the same click may be spotted twice if the filtered sound wobbles about zero */
+	if (d->clicks->len == 0 || click > g_array_index(d->clicks,index_t,d->clicks->len-1))
+		g_array_append_val(d->clicks,click);
+	d->has_pending = 0;
 }
 
-/* generate the clicktrack for the file and write it to disk */
+void click_detector_add(click_detector_t *d, const double *samples, index_t nsamples)
+{
+	for (index_t i=0; i<nsamples; i++)
+	{
+		d->history[d->nsamples%CLICK_HISTORY] = samples[i];
+		d->nsamples++;
+		if (d->has_pending && d->nsamples >= d->pending + CLICK_REFINE_SAMPLES)
+			click_detector_refine(d);
+
+		d->sum += samples[i];
+		if (++d->nsummed < CLICK_DECIMATION)
+			continue;
+		double y = biquad_cascade_step(&d->lowpass,d->state,d->sum/CLICK_DECIMATION);
+		d->sum = 0;
+		d->nsummed = 0;
+		if (y < -d->threshold)
+			d->found_peak = 1;
+		else if (d->found_peak && y > 0)
+		{
+			/* the crossing is between decimated samples ndecimated-1 and ndecimated */
+			double crossing = d->ndecimated - 1 + d->previous/(d->previous - y);
+			double position = ceil(crossing*CLICK_DECIMATION - d->delay);
+			if (d->has_pending)
+				click_detector_refine(d);
+			d->pending = MAX(0,position);
+			d->has_pending = 1;
+			d->found_peak = 0;
+		}
+		d->previous = y;
+		d->ndecimated++;
+	}
+}
 
-void generate_clicktrack(datafile_t *file)
+/* returns the clicks found, in order, and frees the detector */
+index_t *click_detector_finish(click_detector_t *d, int *nclicks)
 {
-	dp(1,"Clicktrack file wasn't found so generating a new one...");
+	if (d->has_pending)
+		click_detector_refine(d);
+	*nclicks = d->clicks->len;
+	index_t *clicks = (index_t *)g_array_free(d->clicks,FALSE);
+	d->clicks = NULL;
+	return clicks;
+}
 
-	int oldverbosity=verbosity; verbosity = 0;
+/* the clicks of each file are kept in an index beside it, so they are found only once */
+static void click_index_path(char *path, datafile_t *file)
+{
+	sprintf(path,"%s/%s/%s/clicktracks/%s.clicks",base_dir,station_dir[file->station],file->date_dir,file->base_filename);
+}
 
-	/* we read in the zero'th channel of the file and filter it to get the clicktrack */
+static int read_click_index(datafile_t *file)
+{
 	char path[MAX_PATH_LEN];
-	int compression = sprint_filepath(path,file);
-	double *waveform;
-	file->nsamples = read_waveform(&waveform,path,0,0,2*60*SAMPLING_RATE,compression);
-	file->clicktrack = filter(waveform,file->nsamples,0,125);
-	free(waveform);
-
-	/* now write the clicktrack to file */
-	char *ext   = compress_clicktracks ?   ".wv" : ".wav";
-	compression = compress_clicktracks ? WAVPACK : UNCOMPRESSED;
-	sprintf(path,"%s/%s/%s/clicktracks/clicktrack__%s%s",base_dir,station_dir[file->station],date_dir,file->base_filename,ext);
-	sprintf(path,"/tmp/clicktracks/clicktrack__%s%s",file->base_filename,ext);
-	write_waveform(path,file->clicktrack,file->nsamples,compression);
-
-	verbosity = oldverbosity;
-	dp(1,"done\n");
+	click_index_path(path,file);
+	FILE *fp = fopen(path,"r");
+	if (!fp)
+		return 0;
+	click_index_header_t header;
+	int ok = fread(&header,sizeof(header),1,fp) == 1 &&
+		!memcmp(header.magic,CLICK_INDEX_MAGIC,sizeof(header.magic)) &&
+		header.threshold == click_threshold;
+	if (ok)
+	{
+		file->clicks = salloc(sizeof(index_t)*MAX(1,header.nclicks));
+		ok = fread(file->clicks,sizeof(index_t),header.nclicks,fp) == header.nclicks;
+		if (ok)
+		{
+			file->nclicks = header.nclicks;
+			file->nsamples = header.nsamples;
+		}
+		else
+		{
+			free(file->clicks);
+			file->clicks = NULL;
+			pthread_mutex_init(&file->clicks_lock,NULL);
+		}
+	}
+	fclose(fp);
+	if (!ok)
+		dp(1,"Ignoring out of date or damaged click index '%s'\n",path);
+	return ok;
 }
 
-/* read in the click track for the file, if it hasn't already been read in.
- * moreover, we may need to generate it, if it doesn't exist. */
-void read_clicktrack(datafile_t *file)
+static void write_click_index(datafile_t *file)
 {
-	if (file->clicktrack != NULL)
-		return;
-
 	char path[MAX_PATH_LEN];
-	sprintf(path,"%s/%s/%s/clicktracks/clicktrack__%s.wav",base_dir,station_dir[file->station],date_dir,file->base_filename);
-	sprintf(path,"/tmp/clicktracks/clicktrack__%s.wav",file->base_filename);
-	int compression = UNCOMPRESSED;
-	FILE *fp = fopen(path,"r");
+	sprintf(path,"%s/%s/%s/clicktracks",base_dir,station_dir[file->station],file->date_dir);
+	if (mkdir(path,0777) && errno != EEXIST)
+		dp(1,"Can not create '%s': %s\n",path,strerror(errno));
+	click_index_path(path,file);
+	/* written under another name and renamed, so a reader never sees half an index */
+	char tmp_path[MAX_PATH_LEN+8];
+	sprintf(tmp_path,"%s.%d",path,(int)getpid());
+	FILE *fp = fopen(tmp_path,"w");
 	if (!fp)
 	{
-		// see if a compressed file exists instead
-		sprintf(path,"%s/%s/%s/clicktracks/clicktrack__%s.wv",base_dir,station_dir[file->station],date_dir,file->base_filename);
-		sprintf(path,"/tmp/clicktracks/clicktrack__%s.wv",file->base_filename);
-		fp = fopen(path,"r");
-		compression = WAVPACK;
+		dp(1,"Can not write click index '%s', clicks will be found again next run\n",tmp_path);
+		return;
 	}
-	if (!fp)
+	click_index_header_t header;
+	memset(&header,0,sizeof(header));
+	memcpy(header.magic,CLICK_INDEX_MAGIC,sizeof(header.magic));
+	header.nsamples = file->nsamples;
+	header.nclicks = file->nclicks;
+	header.threshold = click_threshold;
+	int ok = fwrite(&header,sizeof(header),1,fp) == 1 &&
+		fwrite(file->clicks,sizeof(index_t),file->nclicks,fp) == file->nclicks;
+	if (fclose(fp) || !ok || rename(tmp_path,path))
 	{
-		// neither file exists, so generate it
-		generate_clicktrack(file);
+		dp(1,"Failed to write click index '%s'\n",path);
+		unlink(tmp_path);
 	}
-	else
+}
+
+/* find the clicks in the file and index them */
+void generate_clicks(datafile_t *file)
+{
+	dp(1,"Click index wasn't found so generating a new one...");
+
+	char path[MAX_PATH_LEN];
+	int compression = sprint_filepath(path,file);
+	click_detector_t *detector = salloc(sizeof(click_detector_t));
+	click_detector_init(detector,click_threshold);
+	/* a block at a time, so the whole sound is never held at once */
+	file->nsamples = 0;
+	index_t len;
+	do
+	{
+		double *block;
+		len = CLICK_BLOCK_SAMPLES;
+		/* float wavpack, which read_region can't read, goes through the cache */
+		if (!read_region(&block,0,path,file->nsamples,&len))
+			len = read_waveform(&block,path,0,file->nsamples,CLICK_BLOCK_SAMPLES,compression);
+		click_detector_add(detector,block,len);
+		free(block);
+		file->nsamples += len;
+	} while (len == CLICK_BLOCK_SAMPLES);
+	file->clicks = click_detector_finish(detector,&file->nclicks);
+	free(detector);
+	write_click_index(file);
+
+	dp(1,"done, %d clicks\n",file->nclicks);
+}
+
+/* read in the clicks for the file, if they haven't already been read in.
+ * moreover, we may need to find them, if there is no index yet.
+ * regions are analyzed in parallel, so one thread does this for each file
+ * and the others wanting that file wait for it, while threads wanting
+ * other files carry on. */
+void read_clicks(datafile_t *file)
+{
+	pthread_mutex_lock(&file->clicks_lock);
+	if (file->clicks == NULL && !read_click_index(file))
+		generate_clicks(file);
+	pthread_mutex_unlock(&file->clicks_lock);
+}
+
+/* index of the first click at or after position, file->nclicks if there isn't one */
+static int first_click_from(datafile_t *file, index_t position)
+{
+	int lo = 0, hi = file->nclicks;
+	while (lo < hi)
 	{
-		// one of the files exists.
-		fclose(fp);
-		file->nsamples = read_whole_waveform(&file->clicktrack,path,0,compression);
+		int mid = (lo+hi)/2;
+		if (file->clicks[mid] < position)
+			lo = mid+1;
+		else
+			hi = mid;
 	}
+	return lo;
 }
 
 /* side specifies in which direction the click is, and sgn specifies the sign of the
@@ -459,12 +739,15 @@ index_t find_nearest_second(int station, int fileidx, index_t position, int *sgn
 {
 	datafile_t *file = &files[station][fileidx];
 
-	double threshold = click_threshold;	
-
-	read_clicktrack(file);
+	read_clicks(file);
 	/* search to the right for a click */
-	index_t clickpos = find_click(file->clicktrack, position, file->nsamples, threshold);
-	if (clickpos == file->nsamples)
+	int right = first_click_from(file,position);
+	index_t clickpos;
+	if (right < file->nclicks)
+	{
+		clickpos = file->clicks[right];
+	}
+	else
 	{
 		// didn't find a click in this direction
 		// need to look at the next file
@@ -479,18 +762,24 @@ index_t find_nearest_second(int station, int fileidx, index_t position, int *sgn
 		else
 		{
 			datafile_t *nextfile = &files[station][fileidx+1];
-			read_clicktrack(nextfile);
-			clickpos = find_click(nextfile->clicktrack, 0, nextfile->nsamples,threshold);
+			read_clicks(nextfile);
+			clickpos = nextfile->nclicks ? nextfile->clicks[0] : nextfile->nsamples;
 			clickpos += file->nsamples;			
 		}
 	}
 	index_t clickpos_distance = clickpos - position;
 
 	/* search to the left for a click */
-	index_t clickneg = find_click(file->clicktrack, position, 0, threshold);
+	int left = first_click_from(file,position+1) - 1;
+	index_t clickneg;
 	int clickneg_inprevious = 0;
-	index_t clickneg_distance = position - clickneg;
-	if (clickneg == 0)
+	index_t clickneg_distance;
+	if (left >= 0)
+	{
+		clickneg = file->clicks[left];
+		clickneg_distance = position - clickneg;
+	}
+	else
 	{
 		// didn't find click
 		if (fileidx == 0)
@@ -504,8 +793,8 @@ index_t find_nearest_second(int station, int fileidx, index_t position, int *sgn
 		else
 		{
 			datafile_t *prevfile = &files[station][fileidx-1];
-			read_clicktrack(prevfile);
-			clickneg = find_click(prevfile->clicktrack, prevfile->nsamples-1,0,threshold);
+			read_clicks(prevfile);
+			clickneg = prevfile->nclicks ? prevfile->clicks[prevfile->nclicks-1] : 0;
 			clickneg_inprevious = 1;
 			clickneg_distance = position + prevfile->nsamples - clickneg;
 		}
@@ -529,11 +818,15 @@ index_t find_nearest_second(int station, int fileidx, index_t position, int *sgn
 /* returns the file and the sample position in that file for a specified time */
 index_t find_position(int station, double time_in_seconds, int *fileidx_)
 {
-//	int fileidx = binary_search(files[station],num_files[station],sizeof(datafile_t),&time_in_seconds,file_consider);
-	int fileidx;
-	for (fileidx = 0; fileidx < num_files[station];fileidx++) {
-		if (files[station][fileidx].time_at_eof > time_in_seconds)
-			break;
+	/* the first file ending after the time */
+	int fileidx = 0, hi = num_files[station];
+	while (fileidx < hi)
+	{
+		int mid = (fileidx+hi)/2;
+		if (files[station][mid].time_at_eof > time_in_seconds)
+			hi = mid;
+		else
+			fileidx = mid+1;
 	}
 	
 	if (fileidx == num_files[station] )
@@ -543,7 +836,7 @@ index_t find_position(int station, double time_in_seconds, int *fileidx_)
 	*fileidx_ = fileidx;
 	datafile_t *file = &files[station][fileidx];
 	dp(6,"Time of %.3lf (for station %d) should be in %s\n",time_in_seconds,station,file->base_filename);
-	read_clicktrack(file);
+	read_clicks(file);
 
 	// TODO: fileidx == 0
 	//double time_at_sof = files[station][fileidx-1].time_at_eof;
@@ -601,9 +894,16 @@ index_t find_position(int station, double time_in_seconds, int *fileidx_)
 	if (side > 0)
 	{
 		dp(23, "RHS = %lf\n", SAMPLING_RATE * ( ceil(time_in_seconds) - time_in_seconds ));
-		if (SAMPLING_RATE * ( ceil(time_in_seconds) - time_in_seconds) > click)
+		if (SAMPLING_RATE * ( ceil(time_in_seconds) - time_in_seconds) > click && *fileidx_ == 0)
+		{
+			dp(1,"warning: time %.3lf is before the first recording for station %d, starting at its beginning\n",time_in_seconds,station);
+			position = 0;
+		}
+		else if (SAMPLING_RATE * ( ceil(time_in_seconds) - time_in_seconds) > click)
 		{
+			/* the time is in the previous file, whose length is only known once its clicks are */
 			*fileidx_ = *fileidx_ - 1;
+			read_clicks(&files[station][*fileidx_]);
 			position = files[station][*fileidx_].nsamples + click - SAMPLING_RATE * ( ceil(time_in_seconds) - time_in_seconds);
 		}
 		else
@@ -625,23 +925,12 @@ index_t find_position(int station, double time_in_seconds, int *fileidx_)
 
 index_t determine_nsamples(char *filename, int compression)
 {
-	index_t nsamples;
-	if (compression == UNCOMPRESSED)
-	{
-		SF_INFO		infile_info = {0};
-		SNDFILE		*infile = sf_open(filename, SFM_READ, &infile_info);
-		if (!infile) sdie(NULL, "can not open input file %s: ", filename) ;
-		nsamples = infile_info.frames;
-		sf_close(infile);
-	}
-	else if (compression == WAVPACK)
-	{
-		char error[128]; // must be at least 80 chars
-		WavpackContext *wavpack = WavpackOpenFileInput(filename,error,OPEN_NORMALIZE,0);
-		nsamples                = WavpackGetNumSamples(wavpack);
-		WavpackCloseFile(wavpack);
-	} else 
+	if (compression != UNCOMPRESSED && compression != WAVPACK)
 		die("determine_nsamples unknown compression type");
+	/* the handle stays cached for the read which usually follows */
+	pthread_mutex_lock(&soundfile_lock);
+	index_t nsamples = soundfile_cache_open(filename)->frames;
+	pthread_mutex_unlock(&soundfile_lock);
 	return nsamples;
 }
 
@@ -245,966 +245,69 @@ void relative_2d_to_earth_position(earthpos_t *result, point2d_t *relative, eart
  * is really a question of analytic geometry. Note however, that since the TDOAs will not be
  * correct (they are just estimates) they may describe a physically impossible situation.
  * That is, it is likely that there is _no_ point on earth which would produce the given TDOAs.
- * We are after an estimate.  We can measure how good a point is simply by computing the 
- * distance from it to each of the stations which gives the TDOAs that would be produced from
- * that point.  We can then compare these TDOAs with the given TDOAs.
- *
- * If we cannot find a point whose TDOAs are close to the ones given, then it is good evidence
- * that the given TDOAs are inconsistent, which indicates that they have been estimated 
- * incorrectly.
- *
- * There are several ways that the geometric problem can be solved.  Note that it is really
- * the question of finding a point in the plane such that the differences of its distances
- * from three given points are prescribed values.
+ * We are after an estimate.
  *
  * Recall that given two points p1 and p2 the locus of points such that
  *               | x - p1 | - | x - p2 | = c
- * forms a hyperbola.  (The hyperbola has two sheets, depending on the order of p1 and p2
- * in the above equation, or equivalently, depending on the sign taken for c).   
- * Thus the (signed) TDOA between stations p1 and p2 specifies that the point we are after
- * lies on a specific sheet of the hyperbola
+ * forms a hyperbola.  Thus the (signed) TDOA between stations p1 and p2 specifies that the
+ * point we are after lies on a specific sheet of the hyperbola
  *               | x - p1 | - | x - p2 | = TDOA*speedofsound
+ * and with a TDOA for each of a number of pairs we are after the point closest, in a
+ * least squares sense, to the intersection of their hyperbolas.  multilaterate() in
+ * multilateration.c finds it.
  *
- * Thus, since we have three TDOAs, we are looking for a point in the intersection of three
- * hyperbolas.  From this view, our discussion about the inconsistency of the TDOAs means
- * that this intersection could be empty or even contain multiple points. Most likely, it
- * will be empty.  So one approach to the solution is to search for the point that is 
- * closest to the three hyperbolas, say in a least squares sense.
- *
- * An easier approach is just to search along the hyperbolas looking for the point that
- * gives the nearest TDOAs.
- *
- *
- * There is also a completely different (in some sense dual) approach to the geometry.
- * Recall that a conic section is uniquely determined by its major axis, and three points
- * that it intersects.  That is, given three points, and a line, there is a unique conic
- * section (ellipse or hyperbola) which intersects the points and has the line as its
- * major axis.
- *
- * It turns out that we can define a certain line (in terms of given TDOAs) such that
- * the point which produces those TDOAs lies on this line.  Moreoever if we construct
- * the conic section with this line as major axis, which intersects the three stations,
- * we can prove using some analytic geometry that the point which produces those TDOAs
- * is one of the two focii of the conic section.
- *
- * Thus we can derive a close-form solution.  Unfortunately, it only works when the 
- * TDOAs are consistent.  That is, _given_ that the TDOAs all come from some point, 
- * we can prove that that point is one of the focii of the aforementioned conic
- * section.  However, if the TDOAs are inconsistent, then these focii need not
- * produce the TDOAs.
- *
- * Our approach will actually be to search both along the hyperbolas and along the
- * major axis of this conic section, optimizing the obvious fitness function.
+ * The stations are close enough together that we can work in a plane tangent to the
+ * earth at station 0, as described above.  The rms of the residuals, which is large when
+ * the TDOAs are inconsistent (a good sign they have been estimated incorrectly) becomes
+ * the consistency heuristic, and the uncertainty of the fix a heuristic of its own.
  */
 
-void locate_point(double TDOA_01_in_seconds,double TDOA_12_in_seconds,double TDOA_20_in_seconds,earthpos_t station_earthpos[],earthpos_t *location,double heuristics[])
-{
-	/* first we need to convert the station positions from points on earth to
-	 * points on a 2D grid, as described above.*/
-	point2d_t station_planepos[NUM_STATIONS];
-	station_planepos[0].x = 0;  /* we will take station 0 to be the origin of the plane, */
-	station_planepos[0].y = 0;
-	/* and convert the other two stations to points relative to station 0 */
-	earth_to_relative_2d_position(&station_planepos[1],&station_earthpos[1],&station_earthpos[0]);
-	earth_to_relative_2d_position(&station_planepos[2],&station_earthpos[2],&station_earthpos[0]);
-	dp(6,"Station 1 is at (%lf,%lf) relative to station 0\n",station_planepos[1].x,station_planepos[1].y);
-	dp(6,"Station 2 is at (%lf,%lf) relative to station 0\n",station_planepos[2].x,station_planepos[2].y);
-	dp(6,"Centre is at (%lf,%lf) relative to station 0\n",(station_planepos[1].x+station_planepos[2].x)/3.0,(station_planepos[1].y+station_planepos[2].y)/3.0);
-
-
-	point2d_t location_in_plane;
-	locate_point_in_plane(TDOA_01_in_seconds,TDOA_12_in_seconds,TDOA_20_in_seconds,station_planepos,&location_in_plane,heuristics);
-
-
-	relative_2d_to_earth_position(location,&location_in_plane,&station_earthpos[0]);
-	dp(5,"Best point in plane at (%lf,%lf) coordinates (%.10lf, %.10lf)\n",location_in_plane.x,location_in_plane.y,deg2full(location->lng_deg,location->lng_min),deg2full(location->lat_deg,location->lat_min));
-
-//	earthpos_t current3d;
-//	relative_2d_to_earth_position(&current3d,&current2d,&station_earthpos[0]);
-	//printf("Error in space = %lf\n",earth_distance(&current3d,location));
-	//printf("Dist between current3d and current = %lf\n",earth_distance(&current3d,current));
-
-//heuristics[LOCATION_CONSISTENCY_HEUR] = badness;
-	heuristics[LOCATION_LATDEG_HEUR] = location->lat_deg;
-	heuristics[LOCATION_LATMIN_HEUR] = location->lat_min;
-	heuristics[LOCATION_LNGDEG_HEUR] = location->lng_deg;
-	heuristics[LOCATION_LNGMIN_HEUR] = location->lng_min;
-}
-void rotate2(point2d_t *p,double slope,point2d_t *origin)
+void locate_point(station_pair_t pairs[], double tdoas_in_seconds[], int npairs, earthpos_t station_earthpos[], earthpos_t *location, double heuristics[])
 {
-	double d = sqrt(1+slope*slope);
-	double newx = origin->x + (p->x - origin->x - slope*(p->y-origin->y))/d;
-	double newy = origin->y + (slope*(p->x - origin->x) + p->y - origin->y)/d;
-	p->x = newx;
-	p->y = newy;
-}
-void flip(point2d_t *p)
-{
-	double temp = p->x;
-	p->x = p->y;
-	p->y = temp;
-}
-double fitnessfunc(point2d_t *p,double del01,double del12,double del20,point2d_t *stations)
-{
-	return fabs(del01 - dist2(p,&stations[0]) + dist2(p,&stations[1])) + fabs(del12 - dist2(p,&stations[1]) + dist2(p,&stations[2]))  + abs(del20 - dist2(p,&stations[2]) + dist2(p,&stations[0]));
-}
-
-void locate_point_in_plane(double TDOA_01,double TDOA_12,double TDOA_20,point2d_t stations[],point2d_t *location,double *heuristics)
-{
-	/* these are the (signed) differences in distance between the point we're after and the pairs of
-	 * stations. */
-	double del01, del12, del20;
-	del01 = TDOA_01 * SPEED_OF_SOUND;
-	del12 = TDOA_12 * SPEED_OF_SOUND;
-	del20 = TDOA_20 * SPEED_OF_SOUND;
-
-	double origdel01 = del01;
-	double origdel12 = del12;
-	double origdel20 = del20;
-	double average = (del01+del12+del20)/3.0;
-	del01 -= average;
-	del12 -= average;
-	del20 -= average;
-
-	dp(5,"TDOA sum = %g\n",3*average);
-
-
-	/*=====================================================
-	 * first we compute the major axis of the conic section
-	 *=====================================================*/
-	double station0_nsqr, station1_nsqr, station2_nsqr;
-	double A,B,C;
-
-	station0_nsqr = normsquared2(stations[0]);
-	station1_nsqr = normsquared2(stations[1]);
-	station2_nsqr = normsquared2(stations[2]);
-
-	A     = stations[0].x * del12 +
-		stations[1].x * del20 +
-		stations[2].x * del01;
-
-	B     = stations[0].y * del12 +
-		stations[1].y * del20 +
-		stations[2].y * del01;
-
-	C     = (del01*del12*del20   +
-		 station0_nsqr*del12 +
-		 station1_nsqr*del20 +
-		 station2_nsqr*del01  )/2.0;
-
-	/* The line is Ax + By = C */
-	dp(10,"The line is %lf x + %lf y = %lf\n",A,B,C);
-
-	/*======================================================================
-	 * the equations are easier to deal with if the line of major axis
-	 * is just one of the coordinate axes.  thus what we do is we
-	 * work as if we have rotated everything to one of the coordinate axes
-	 * and work there and then we will rotate back
-	 *=====================================================================*/
-
-	int flipped=0;
-	/* if the slope M of the line is between [-1,1] then we rotate to the
-	 * horizontal axis, otherwise we rotate to the vertical axis. Since
-	 *    M=-A/B this is as follows */
-	if ((-fabs(B) > -A) || (-A > fabs(B)))
-	{
-		// we should really just do a reflection and at the end reflect back
-		//printf("We should rotate to vert. exiting...\n");	
-		//exit(1);
-		//
-		flipped=1;
-		double temp = A;
-		A=B;
-		B=temp;
-		dp(10,"flipped\n");
-	}
-	else
-	{
-		dp(10,"not flipped\n");
-	}
-
-	/* now. the slpoe should be in [-1,1] and i believe this will force that
-	 * the y-intercept can't be too high, because one of the stations has to lie above it*/
-	assert( C < 1000000*fabs(B));
-
-	double yintercept = C/B;
-
-	/* now we translate the line downwards so that it intersects the origin */
-	/* so we consider it to be Ax + By = 0 */
-	/* we also need to move down the stations and then rotate them */
-
-	// now we rotate to x-axis
-
-	double M;
-	M = -A/B;
-	
-	point2d_t p0 = stations[0];
-	point2d_t p1 = stations[1];
-	point2d_t p2 = stations[2];
-	if (flipped)
-	{
-		flip(&p0);
-		flip(&p1);
-		flip(&p2);
-	}
-	p0.y -= yintercept;
-	p1.y -= yintercept;
-	p2.y -= yintercept;
-	point2d_t origin;
-	origin.x = 0;
-	origin.y = 0;
-	rotate2(&p0,-M,&origin);
-	rotate2(&p1,-M,&origin);
-	rotate2(&p2,-M,&origin);
-
-	/* now we compute the the conic section from the rotated points */
-
-	double U, V, W;
-
-	U = ((p2.x - p1.x)*square_d(p0.y) +
-             (p0.x - p2.x)*square_d(p1.y) +
-	     (p1.x - p0.x)*square_d(p2.y))   /
-		     (  p2.x*square_d(p1.x)
-		      - p1.x*square_d(p2.x)
-		      + p1.x*square_d(p0.x)
-		      - p0.x*square_d(p1.x)
-		      + p0.x*square_d(p2.x)
-		      - p2.x*square_d(p0.x)
-		     );
-
-	V = (square_d(p2.y) - square_d(p1.y) + U*(square_d(p2.x) - square_d(p1.x))) / (p1.x - p2.x);
-
-	W = -square_d(p0.y) - V*p0.x - U*square_d(p0.x);
-
-	dp(10,"U=%lf, V=%lf, W=%lf\n",U,V,W);
-
-	double asqr, bsqr;
-
-	point2d_t rotated_centre;
-	rotated_centre.x = -V/(2*U);
-	rotated_centre.y = 0;
-
-	asqr = square_d(rotated_centre.x) - W/U;
-	bsqr = U*asqr;
-
-	dp(10,"asqr = %lf, bsqr = %lf\n",asqr,bsqr);
-
-	double dist_to_focus;
-	if (bsqr < 0)
-	{
-		// we have a hyperbola
-		dist_to_focus = sqrt(asqr-bsqr);
-		dp(10,"Equation of hyperbola is (x- %.2f)^2/%.2f - y^2/%.2f = 1\n",rotated_centre.x,asqr,bsqr);
-	}
-	else
-	{
-		// we have an ellipse
-		dp(10,"Equation of ellipse is (x- %.2f)^2/%.2f + y^2/%.2f = 1\n", rotated_centre.x,asqr,bsqr);
-		if (asqr >= bsqr)
-		{
-			dp(10,"Major x is true");
-			dist_to_focus = sqrt(asqr-bsqr);
-		}
-		else
-		{
-			dp(10,"Major x is false");
-			dist_to_focus = sqrt(bsqr-asqr);
-		}
-	}
-	dp(10,"Dist to focus = %.10lf\n",dist_to_focus);
-
-
-	point2d_t focus1;
-	point2d_t focus2;
-
-/*	if (!majorx)
-	{
-		focus1.x = rotated_centre.x;
-		focus1.y = dist_to_focus;
-		rotate2(&focus1,M,&xintercept);
-
-		focus2.x = rotated_centre.x;
-		focus2.y = -dist_to_focus;
-		rotate2(&focus2,M,&xintercept);	
-	}
-	else*/
-	{
-		focus1.x = rotated_centre.x+dist_to_focus;
-		focus1.y = 0;
-		rotate2(&focus1,M,&origin);
-
-		focus2.x = rotated_centre.x-dist_to_focus;
-		focus2.y = 0;
-		rotate2(&focus2,M,&origin);
-	}
-
-	//now translate back up
-	focus1.y += yintercept;
-	focus2.y += yintercept;
-
-	if (flipped)
+	point2d_t planepos[NUM_STATIONS];
+	planepos[0].x = 0;  /* we will take station 0 to be the origin of the plane, */
+	planepos[0].y = 0;
+	for (int i=1; i<NUM_STATIONS; i++)
 	{
-		flip(&focus1);
-		flip(&focus2);
+		/* and the others relative to it */
+		earth_to_relative_2d_position(&planepos[i],&station_earthpos[i],&station_earthpos[0]);
+		dp(6,"Station %d is at (%lf,%lf) relative to station 0\n",i,planepos[i].x,planepos[i].y);
 	}
 
-	dp(10,"Focus 1 at (%.10lf,%.10lf)\n",focus1.x,focus1.y);
-	dp(10,"Focus 2 at (%.10lf,%.10lf)\n",focus2.x,focus2.y);
-
-	
-	if (graphing >= 15)
-	{
-		char line[1024];
-		sprintf(line,"python pyplotgeometry.py %lf %lf %lf %lf %lf %lf %lf %lf %lf > /dev/null\n",stations[0].x,stations[0].y,stations[1].x,stations[1].y,stations[2].x,stations[2].y,TDOA_01,TDOA_12,TDOA_20);
-		printf("line = '%s'\n",line);
-		if (system(line))
-		{
-			printf("failed\n");
-			exit(1);
-		}
-		printf("done\n");
-	}
-
-
-//	double fitness1 = fitnessfunc(&focus1,del01,del12,del20,stations);
-//	double fitness2 = fitnessfunc(&focus2,del01,del12,del20,stations);
-	dp(10,"Focus 1 has fitness %lf\n",fitnessfunc(&focus1,del01,del12,del20,stations));
-	dp(10,"Focus 2 has fitness %lf\n",fitnessfunc(&focus2,del01,del12,del20,stations));
-	double origfitness1 = fitnessfunc(&focus1,origdel01,origdel12,origdel20,stations);
-	double origfitness2 = fitnessfunc(&focus2,origdel01,origdel12,origdel20,stations);
-	dp(10,"Focus 1 has orig fitness %lf\n",origfitness1);
-	dp(10,"Focus 2 has orig fitness %lf\n",origfitness2);
-
-	if (origfitness1 < origfitness2)
-	{
-		memcpy(location,&focus1,sizeof *location);
-	}	
-	else
-	{
-		memcpy(location,&focus2,sizeof *location);
-	}
-}
-
-#if 0
-
-	if (A == 0 || B==0)
-	{
-		printf("geometry.c: The line of goodness is horizontal or vertical, not sure what to do, bailing.\n");
-		exit(1);
-	}
-
-	// M is the slope
-	M = -A/B;
-	point2d_t xintercept;
-	xintercept.x = C/A;
-	xintercept.y = 0;
-
-	point2d_t p0 = stations[0];
-	point2d_t p1 = stations[1];
-	point2d_t p2 = stations[2];
-
-	rotate2(&p0,-M,&xintercept);
-	rotate2(&p1,-M,&xintercept);
-	rotate2(&p2,-M,&xintercept);
-
-	double U, V, W;
-
-	U = ((p2.x - p1.x)*square_d(p0.y) +
-             (p0.x - p2.x)*square_d(p1.y) +
-	     (p1.x - p0.x)*square_d(p2.y))   /
-		     (  p2.x*square_d(p1.x)
-		      - p1.x*square_d(p2.x)
-		      + p1.x*square_d(p0.x)
-		      - p0.x*square_d(p1.x)
-		      + p0.x*square_d(p2.x)
-		      - p2.x*square_d(p0.x)
-		     );
-
-	V = (square_d(p2.y) - square_d(p1.y) + U*(square_d(p2.x) - square_d(p1.x))) / (p1.x - p2.x);
-
-	W = -square_d(p0.y) - V*p0.x - U*square_d(p0.x);
-
-	dp(10,"U=%lf, V=%lf, W=%lf\n",U,V,W);
-
-
-	double asqr, bsqr;
-
-	point2d_t rotated_centre;
-	rotated_centre.x = -V/(2*U);
-	rotated_centre.y = 0;
-
-	asqr = square_d(rotated_centre.x) - W/U;
-	bsqr = U*asqr;
-
-	dp(10,"asqr = %lf, bsqr = %lf\n",asqr,bsqr);
-
-	double dist_to_focus;
-	int majorx = 1;
-	int hyper = 1;
-	if (bsqr < 0)
-	{
-		// we have a hyperbola
-		dist_to_focus = sqrt(asqr-bsqr);
-		dp(10,"Equation of hyperbola is (x- %.2f)^2/%.2f - y^2/%.2f = 1\n",rotated_centre.x,asqr,bsqr);
-
-	}
-	else
-	{
-		hyper = 0;
-		// we have an ellipse
-		dp(10,"Equation of ellipse is (x- %.2f)^2/%.2f + y^2/%.2f = 1\n", rotated_centre.x,asqr,bsqr);
-		if (asqr >= bsqr)
-		{
-			dp(10,"Major x is true");
-			dist_to_focus = sqrt(asqr-bsqr);
-		}
-		else
-		{
-			dp(10,"Major x is false");
-			dist_to_focus = sqrt(bsqr-asqr);
-			majorx=0;
-		}
-		
-
-	}
-	dp(10,"Dist to focus = %.10lf\n",dist_to_focus);
-
-
-	point2d_t focus1;
-	point2d_t focus2;
-
-
-/*	if (!majorx)
-	{
-		focus1.x = rotated_centre.x;
-		focus1.y = dist_to_focus;
-		rotate2(&focus1,M,&xintercept);
-
-		focus2.x = rotated_centre.x;
-		focus2.y = -dist_to_focus;
-		rotate2(&focus2,M,&xintercept);	
-	}
-	else*/
-	{
-		focus1.x = rotated_centre.x+dist_to_focus;
-		focus1.y = 0;
-		rotate2(&focus1,M,&xintercept);
-
-		focus2.x = rotated_centre.x-dist_to_focus;
-		focus2.y = 0;
-		rotate2(&focus2,M,&xintercept);
-	}
-
-	dp(10,"Focus 1 at (%.10lf,%.10lf)\n",focus1.x,focus1.y);
-	dp(10,"Focus 2 at (%.10lf,%.10lf)\n",focus2.x,focus2.y);
-
-	dp(10,"Focus 1 has fitness %lf\n",fitnessfunc(&focus1,del01,del12,del20,stations));
-	dp(10,"Focus 2 has fitness %lf\n",fitnessfunc(&focus2,del01,del12,del20,stations));
-
-	if (hyper)
-	{
-	dp(10,"Hyper\n");
-	}
-	else if (majorx)
-	{
-		dp(10,"Ellip, Major\n");
-	}
-	else
-	{
-		dp(10,"Ellip, Minor\n");
-	}
-	dp(10,"A/C=%lf, B/C=%lf, U=%lf, V=%lf, W=%lf\n",A/C,B/C,U,V,W);
-
-	searchforit(&focus1,&focus2,500,location,del01,del12,del20,stations);
-	double bestval = fitnessfunc(bestpoint,del01,del12,del20,stations);
-
-	/* now let's search the hyperbolas */
-	point2d_t *hyperpoints; int num;
-	hyperpoints = construct_hyperbola(&stations[1],&stations[2],del12, &num);
-	for (int i=0; i<num; i++)
-	{
-		double val = fitnessfunc(&hyperpoints[i],del01,del12,del20,stations);
-		//	printf(" %lf (%lf,%lf)\n",val,hyperpoints[i].x,hyperpoints[i].y);
-		if (val < bestval)
-		{
-			dp(10,"Got a better one on hyperbola: %lf -> %lf\n",bestval,val);
-			bestval = val;
-			bestpoint->x = hyperpoints[i].x;
-			bestpoint->y = hyperpoints[i].y;
-		}
-	}
-
-	free(hyperpoints);
-	hyperpoints = construct_hyperbola(&stations[2],&stations[0],del20, &num);
-	for (int i=0; i<num; i++)
-	{
-		double val = fitnessfunc(&hyperpoints[i],del01,del12,del20,stations);
-		if (val < bestval)
-		{
-			dp(10,"Got a better one on hyperbola: %lf -> %lf\n",bestval,val);
-			bestval = val;
-			bestpoint->x = hyperpoints[i].x;
-			bestpoint->y = hyperpoints[i].y;
-		}
-	}
-	free(hyperpoints);
-	hyperpoints = construct_hyperbola(&stations[0],&stations[1],del01, &num);
-	for (int i=0; i<num; i++)
-	{
-		double val = fitnessfunc(&hyperpoints[i],del01,del12,del20,stations);
-		if (val < bestval)
-		{
-			dp(10,"Got a better one on hyperbola: %lf -> %lf\n",bestval,val);
-			bestval = val;
-			bestpoint->x = hyperpoints[i].x;
-			bestpoint->y = hyperpoints[i].y;
-		}
-	}
-	free(hyperpoints);
-
-
-	dp(10,"Best found by search is at (%lf,%lf) with badness of %lf\n",bestpoint->x,bestpoint->y,fitnessfunc(bestpoint,del01,del12,del20,stations));
-	*badness = fitnessfunc(bestpoint,del01,del12,del20,stations);
-
-	if (graphing >= 5)
-	{
-		char line[1024];
-		sprintf(line,"python pyplot.py %lf %lf %lf %lf %lf %lf %lf %lf %lf > /dev/null\n",stations[0].x,stations[0].y,stations[1].x,stations[1].y,stations[2].x,stations[2].y,TDOA_01,TDOA_12,TDOA_20);
-		if (system(line) != 0)
-		{
-			printf("Running pyplot.py failed\n");
-		}
-		else
-		{
-			dp(10,"Ran pyplot.py\n");
-		}
-	}
-
-}
-#endif
-
-#if 0
-void pinpoint_via_tdoa(double TDOA_01,double TDOA_12,double TDOA_20,point2d_t stations[],point2d_t *bestpoint)
-{
-	double del01, del12, del20;
-	del01 = TDOA_01 * SPEED_OF_SOUND;
-	del12 = TDOA_12 * SPEED_OF_SOUND;
-	del20 = TDOA_20 * SPEED_OF_SOUND;
-
-	double station0_nsqr, station1_nsqr, station2_nsqr;
-	double A,B,C;
-	double M;
-
-	station0_nsqr = normsquared2(stations[0]);
-	station1_nsqr = normsquared2(stations[1]);
-	station2_nsqr = normsquared2(stations[2]);
-
-	A     = stations[0].x * del12 +
-		stations[1].x * del20 +
-		stations[2].x * del01;
-
-	B     = stations[0].y * del12 +
-		stations[1].y * del20 +
-		stations[2].y * del01;
-
-	C     = (del01*del12*del20   +
-		 station0_nsqr*del12 +
-		 station1_nsqr*del20 +
-		 station2_nsqr*del01  )/2.0;
-
-	/* The line is Ax + By = C */
-	dp(10,"The line is %lf x + %lf y = %lf\n",A,B,C);
-
-	if (A == 0 || B==0)
-	{
-		printf("geometry.c: The line of goodness is horizontal or vertical, not sure what to do, bailing.\n");
-		exit(1);
-	}
-
-	// M is the slope
-	M = -A/B;
-	point2d_t xintercept;
-	xintercept.x = C/A;
-	xintercept.y = 0;
-
-	point2d_t p0 = stations[0];
-	point2d_t p1 = stations[1];
-	point2d_t p2 = stations[2];
-
-	rotate2(&p0,-M,&xintercept);
-	rotate2(&p1,-M,&xintercept);
-	rotate2(&p2,-M,&xintercept);
-
-	double U, V, W;
-
-	U = ((p2.x - p1.x)*square_d(p0.y) +
-             (p0.x - p2.x)*square_d(p1.y) +
-	     (p1.x - p0.x)*square_d(p2.y))   /
-		     (  p2.x*square_d(p1.x)
-		      - p1.x*square_d(p2.x)
-		      + p1.x*square_d(p0.x)
-		      - p0.x*square_d(p1.x)
-		      + p0.x*square_d(p2.x)
-		      - p2.x*square_d(p0.x)
-		     );
-
-	V = (square_d(p2.y) - square_d(p1.y) + U*(square_d(p2.x) - square_d(p1.x))) / (p1.x - p2.x);
-
-	W = -square_d(p0.y) - V*p0.x - U*square_d(p0.x);
-
-	dp(10,"U=%lf, V=%lf, W=%lf\n",U,V,W);
-
-
-	double asqr, bsqr;
-
-	point2d_t rotated_centre;
-	rotated_centre.x = -V/(2*U);
-	rotated_centre.y = 0;
-
-	asqr = square_d(rotated_centre.x) - W/U;
-	bsqr = U*asqr;
-
-	dp(10,"asqr = %lf, bsqr = %lf\n",asqr,bsqr);
-
-	double dist_to_focus;
-	int majorx = 1;
-	int hyper = 1;
-	if (bsqr < 0)
-	{
-		// we have a hyperbola
-		dist_to_focus = sqrt(asqr-bsqr);
-		dp(10,"Equation of hyperbola is (x- %.2f)^2/%.2f - y^2/%.2f = 1\n",rotated_centre.x,asqr,bsqr);
-
-	}
-	else
-	{
-		hyper = 0;
-		// we have an ellipse
-		dp(10,"Equation of ellipse is (x- %.2f)^2/%.2f + y^2/%.2f = 1\n", rotated_centre.x,asqr,bsqr);
-		if (asqr >= bsqr)
-		{
-			dp(10,"Major x is true");
-			dist_to_focus = sqrt(asqr-bsqr);
-		}
-		else
-		{
-			dp(10,"Major x is false");
-			dist_to_focus = sqrt(bsqr-asqr);
-			majorx=0;
-		}
-		
-
-	}
-	dp(10,"Dist to focus = %.10lf\n",dist_to_focus);
-
-
-	point2d_t focus1;
-	point2d_t focus2;
-
-
-/*	if (!majorx)
-	{
-		focus1.x = rotated_centre.x;
-		focus1.y = dist_to_focus;
-		rotate2(&focus1,M,&xintercept);
-
-		focus2.x = rotated_centre.x;
-		focus2.y = -dist_to_focus;
-		rotate2(&focus2,M,&xintercept);	
-	}
-	else*/
-	{
-		focus1.x = rotated_centre.x+dist_to_focus;
-		focus1.y = 0;
-		rotate2(&focus1,M,&xintercept);
-
-		focus2.x = rotated_centre.x-dist_to_focus;
-		focus2.y = 0;
-		rotate2(&focus2,M,&xintercept);
-	}
-
-	dp(10,"Focus 1 at (%.10lf,%.10lf)\n",focus1.x,focus1.y);
-	dp(10,"Focus 2 at (%.10lf,%.10lf)\n",focus2.x,focus2.y);
-
-	dp(10,"Focus 1 has fitness %lf\n",fitnessfunc(&focus1,del01,del12,del20,stations));
-	dp(10,"Focus 2 has fitness %lf\n",fitnessfunc(&focus2,del01,del12,del20,stations));
-
-	if (hyper)
-	{
-	dp(10,"Hyper\n");
-	}
-	else if (majorx)
-	{
-		dp(10,"Ellip, Major\n");
-	}
-	else
-	{
-		dp(10,"Ellip, Minor\n");
-	}
-	dp(10,"A/C=%lf, B/C=%lf, U=%lf, V=%lf, W=%lf\n",A/C,B/C,U,V,W);
-
-	searchforit(&focus1,&focus2,500,bestpoint,del01,del12,del20,stations);
-	double bestval = fitnessfunc(bestpoint,del01,del12,del20,stations);
-
-	/* now let's search the hyperbolas */
-	point2d_t *hyperpoints; int num;
-	hyperpoints = construct_hyperbola(&stations[1],&stations[2],del12, &num);
-	for (int i=0; i<num; i++)
-	{
-		double val = fitnessfunc(&hyperpoints[i],del01,del12,del20,stations);
-		//	printf(" %lf (%lf,%lf)\n",val,hyperpoints[i].x,hyperpoints[i].y);
-		if (val < bestval)
-		{
-			dp(10,"Got a better one on hyperbola: %lf -> %lf\n",bestval,val);
-			bestval = val;
-			bestpoint->x = hyperpoints[i].x;
-			bestpoint->y = hyperpoints[i].y;
-		}
-	}
-
-	free(hyperpoints);
-	hyperpoints = construct_hyperbola(&stations[2],&stations[0],del20, &num);
-	for (int i=0; i<num; i++)
-	{
-		double val = fitnessfunc(&hyperpoints[i],del01,del12,del20,stations);
-		if (val < bestval)
-		{
-			dp(10,"Got a better one on hyperbola: %lf -> %lf\n",bestval,val);
-			bestval = val;
-			bestpoint->x = hyperpoints[i].x;
-			bestpoint->y = hyperpoints[i].y;
-		}
-	}
-	free(hyperpoints);
-	hyperpoints = construct_hyperbola(&stations[0],&stations[1],del01, &num);
-	for (int i=0; i<num; i++)
-	{
-		double val = fitnessfunc(&hyperpoints[i],del01,del12,del20,stations);
-		if (val < bestval)
-		{
-			dp(10,"Got a better one on hyperbola: %lf -> %lf\n",bestval,val);
-			bestval = val;
-			bestpoint->x = hyperpoints[i].x;
-			bestpoint->y = hyperpoints[i].y;
-		}
-	}
-	free(hyperpoints);
-
-
-	dp(10,"Best found by search is at (%lf,%lf) with badness of %lf\n",bestpoint->x,bestpoint->y,fitnessfunc(bestpoint,del01,del12,del20,stations));
-
-	if (graphing >= 5)
-	{
-		char line[1024];
-		sprintf(line,"python pyplot.py %lf %lf %lf %lf %lf %lf %lf %lf %lf > /dev/null\n",stations[0].x,stations[0].y,stations[1].x,stations[1].y,stations[2].x,stations[2].y,TDOA_01,TDOA_12,TDOA_20);
-		if (system(line) != 0)
-		{
-			printf("Running pyplot.py failed\n");
-		}
-		else
-		{
-			dp(10,"Ran pyplot.py\n");
-		}
-	}
-
-}
-void rotate90(point2d_t *p)
-{
-	double newx = -p->y;
-	double newy = p->x;
-
-	p->x = newx;
-	p->y = newy;
-}
-
-void rotate270(point2d_t *p)
-{
-	double newx = p->y;
-	double newy = -p->x;
-
-	p->x = newx;
-	p->y = newy;
-}
-
-void rotate2_(point2d_t *p,double slope)
-{
-	double d = sqrt(1+slope*slope);
-	double newx = (p->x - slope*(p->y))/d;
-	double newy = (slope*(p->x) + p->y)/d;
-	p->x = newx;
-	p->y = newy;
-}
-
-
-
-void searchforit(point2d_t *startpoint, point2d_t *endpoint, double granularity, point2d_t *bestpoint, double del01, double del12, double del20, point2d_t *stations)
-{
-
-	double stepsizex = (endpoint->x - startpoint->x)/granularity;
-	double stepsizey = (endpoint->y - startpoint->y)/granularity;
-	bestpoint->x = startpoint->x;
-	bestpoint->y = startpoint->y;
-	double bestval = fitnessfunc(bestpoint,del01,del12,del20,stations);
-	dp(10,"Starting with %lf at (%lf,%lf)\n",bestval,bestpoint->x,bestpoint->y);
-	point2d_t current;
-	current.x = startpoint->x;
-	current.y = startpoint->y;
-	for (int i = 0; i<= granularity; i++)
-	{
-		current.x = current.x + stepsizex;
-		current.y = current.y + stepsizey;
-
-		double fitness = fitnessfunc(&current,del01,del12,del20,stations);
-		if (fitness < bestval)
-		{
-			bestpoint->x = current.x;
-			bestpoint->y = current.y;
-			bestval = fitness;
-			dp(15,"New best of %lf at (%lf,%lf)\n",bestval,bestpoint->x,bestpoint->y);
-		}
-	}
-
-}
-
-void rotate(point2d_t *point, double theta)
-{
-	double costheta = cos(theta);
-	double sintheta = sin(theta);
-
-	double x = costheta*(point->x) - sintheta*(point->y);
-	double y = sintheta*(point->x) + costheta*(point->y);
-
-	point->x = x;
-	point->y = y;
-}
-
-void pivot_rotate2(point2d_t *point, double theta, point2d_t *pivot)
-{
-// point -> R(point - pivot) + pivot = Rpoint - Rpivot + pivot
-
-	double costheta = cos(theta);
-	double sintheta = sin(theta);
-
-	double x = pivot->x + costheta*(point->x-pivot->x) - sintheta*(point->y-pivot->y);
-	double y = pivot->y + sintheta*(point->x-pivot->x) + costheta*(point->y-pivot->y);
-
-	point->x = x;
-	point->y = y;
-}
-point2d_t *construct_hyperbola(point2d_t *focus1, point2d_t *focus2, double constant_difference, int *num_)
-{
-	double a = constant_difference / 2.0;
-	double c = dist2(focus1,focus2) / 2.0;
-	double asqr = a*a;
-	double bsqr = c*c - asqr;
-
-	if (bsqr < 0)
-	{
-		printf("bsqr = %lf is negative!\n",bsqr);
-		*num_ = 0;
-		return NULL;
-	}
-
-	double granularity = 300.0;
-	double startx, stopx;
-	if (constant_difference >= 0)
-	{
-		startx = fabs(a);
-		stopx = 2*fabs(a);
-	}
-	else
-	{
-		startx = -2*fabs(a);
-		stopx = -fabs(a);
-	}
-	double xdelta = (stopx - startx) / granularity;
-
-	int num = floor(granularity);
-	point2d_t *points = salloc(2*num*sizeof(point2d_t));
-	double x = startx;
-	for (int i=0; i<num; i++)
-	{
-		double val = sqrt(bsqr*( square_d(x/a) - 1));
-		points[i].x = x;
-		points[i].y = val;
-		points[i+num].x =x;
-		points[i+num].y = -val;
-
-		x += xdelta;
-		//printf("(%lf,%lf) and (%lf,%lf)     , ",x,val,x,-val);
-	}
-
-
-	double M = (focus2->y - focus1->y) / (focus2->x-focus1->x);
-	num = 2*num; //BEREN
-	/*
-	double theta;
-
-	if (focus2->x >= focus1->x)
-	{
-		if (focus2->y >= focus1->y)
-		{
-			theta = atan(-M);
-		}
-		else
-		{
-			theta = -atan(-M);
-		}
-	}	
-	else
-	{
-		if (focus2->y >= focus1->y)
-		{
-			theta = PI - atan(-M);
-		}
-		else
-		{
-			theta = -(PI - atan(-M));
-		}
-	}*/
-//	printf("Focuii: (%lf,%lf), (%lf,%lf)\n",focus1->x,focus1->y,focus2->x,focus2->y);
-	if  (focus2->x < focus1->x)
-	{
-		if (focus2->y >= focus1->y)
-		{
-			M = -(focus2->x - focus1->x)/(focus2->y - focus1->y);
-			for (int i=0; i<num; i++)
-			{
-				rotate2_(&points[i],M);
-				rotate90(&points[i]);
-			}
-		}
-		else
-		{
-			M = (focus2->x - focus1->x)/(focus2->y - focus1->y);
-			for (int i=0; i<num; i++)
-			{
-				rotate2_(&points[i],-M);
-				rotate270(&points[i]);
-			}
-		}
-	}
-	else
+	/* only the stations in the pairs are given to the solver, numbered in the
+	 * order they are first seen */
+	int solver_station[NUM_STATIONS];
+	for (int i=0; i<NUM_STATIONS; i++)
+		solver_station[i] = -1;
+	point2d_t station_planepos[NUM_STATIONS];
+	range_difference_t measurements[npairs];
+	int nstations = 0;
+	for (int p=0; p<npairs; p++)
 	{
-		for (int i=0; i<num; i++)
+		int s[2] = {pairs[p].station1,pairs[p].station2};
+		for (int k=0; k<2; k++)
 		{
-			rotate2_(&points[i],M);
+			if (solver_station[s[k]] >= 0)
+				continue;
+			solver_station[s[k]] = nstations;
+			station_planepos[nstations++] = planepos[s[k]];
 		}
+		measurements[p].station1 = solver_station[s[0]];
+		measurements[p].station2 = solver_station[s[1]];
+		measurements[p].range_difference = tdoas_in_seconds[p]*SPEED_OF_SOUND;
 	}
 
-	double midx = 0.5*(focus1->x + focus2->x);
-	double midy = 0.5*(focus1->y + focus2->y);
-	for (int i=0; i<num; i++)
-	{
-//		rotate(&points[i],theta);
-		
-		points[i].x = points[i].x + midx;
-		points[i].y = points[i].y + midy;
-	}	
+	fix_t fix;
+	if (!multilaterate(station_planepos,nstations,measurements,npairs,&fix))
+		die("Can't locate a point from %d TDOAs between %d stations",npairs,nstations);
 
+	relative_2d_to_earth_position(location,&fix.location,&station_earthpos[0]);
+	dp(5,"Best point in plane at (%lf,%lf) coordinates (%.10lf, %.10lf)\n",fix.location.x,fix.location.y,deg2full(location->lng_deg,location->lng_min),deg2full(location->lat_deg,location->lat_min));
 
-	*num_ = num;
-	return points;
+	heuristics[LOCATION_CONSISTENCY_HEUR] = fix.residual;
+	heuristics[LOCATION_UNCERTAINTY_HEUR] = fix.uncertainty;
+	heuristics[LOCATION_LATDEG_HEUR] = location->lat_deg;
+	heuristics[LOCATION_LATMIN_HEUR] = location->lat_min;
+	heuristics[LOCATION_LNGDEG_HEUR] = location->lng_deg;
+	heuristics[LOCATION_LNGMIN_HEUR] = location->lng_min;
 }
-
-#endif
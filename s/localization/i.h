@@ -1,17 +1,23 @@
 #include "bowerbird.h"
 #include <sys/types.h>
 #include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <errno.h>
 #include <complex.h>
 #include <fftw3.h>
 
 #include <wavpack/wavpack.h>
-#define NUM_STATIONS		3
-#define NUM_STATION_PAIRS	3
-#define NUM_CHANNELS		4
-#define SAMPLING_RATE		16000
+/* the number of stations comes from the config file, and the number of channels
+ * and the sampling rate from the recordings, see NUM_STATIONS, NUM_CHANNELS and
+ * SAMPLING_RATE in localize.c and dataman.c */
+#define MAX_STATIONS		64
 #define PI			3.14159265358979323846264338327
 #define SPEED_OF_SOUND		340.29
 
+/* this is the name of the group for localization parameters in the config file */
+#define LOCALIZATION_PARAM_GROUP	"localization"
+
 typedef struct
 {
 	double lat_deg;
@@ -27,6 +33,57 @@ typedef struct point2d_t
 	double y;
 } point2d_t;
 
+/* multilateration.c */
+
+#define MULTILATERATION_MAX_STATIONS	MAX_STATIONS
+#define MULTILATERATION_MAX_ITERATIONS	50
+#define MULTILATERATION_TOLERANCE	1e-4	/* metres, a smaller step ends the refinement */
+#define MULTILATERATION_MIN_CONDITION	1e-6	/* geometry with a smaller inverse condition number is ill-conditioned */
+#define MULTILATERATION_RANGE_SIGMA	(SPEED_OF_SOUND/SAMPLING_RATE)	/* metres, the least error assumed in a range difference */
+#define MULTILATERATION_GRID_SIZE	64	/* points along each side of the fallback grid */
+#define MULTILATERATION_GRID_EXTENT	4.0	/* the grid reaches this many times the stations' radius from their centre */
+typedef struct
+{
+	int station1, station2;
+	double range_difference;	/* metres, distance to station1 less distance to station2 */
+} range_difference_t;
+typedef struct
+{
+	point2d_t location;
+	double covariance[2][2];	/* of location, square metres */
+	double uncertainty;		/* metres, root of the trace of the covariance */
+	double residual;		/* metres, rms of the range difference residuals */
+	int iterations;
+	int searched_grid;		/* the closed form wasn't trusted */
+} fix_t;
+
+/* sigproc.c */
+
+typedef struct
+{
+	int n;				/* transform length, 0 if unused */
+	int users;
+	unsigned long last_used;
+	fftw_plan forward;		/* real to complex */
+	fftw_plan inverse;		/* complex to real, destroys its input */
+} fft_plans_t;
+
+#define MAX_BIQUADS	8
+typedef struct
+{
+	double b0, b1, b2, a1, a2;	/* normalised so a0 is 1 */
+} biquad_t;
+typedef struct
+{
+	biquad_t stage[MAX_BIQUADS];
+	int nstages;
+	index_t settle;			/* samples for the cascade's transient to die away */
+} biquad_cascade_t;
+
+#define FIR_TAPS		511
+#define FIR_KAISER_BETA		8.0
+#define FIR_DIRECT_LIMIT	1e6	/* samples*taps below which fir filters skip the fft */
+
 /* tdoa.c */
 
 #define GCC_PLAIN 0
@@ -36,6 +93,63 @@ typedef struct point2d_t
 #define GCC_SCOT  4
 #define GCC_ML    5
 
+/* correlate directly rather than by fft when there are fewer lags than this times log2(nsamples) */
+#define TDOA_DIRECT_LAGS_PER_LOG2	4
+
+typedef struct
+{
+	index_t nsamples;
+	index_t nbins;
+	int nchannels;
+	fft_plans_t *plans;
+	double **waveform;		/* [nchannels], not owned */
+	fftw_complex **spectrum;	/* [nchannels][nbins] fourier transform of each channel */
+	double **autopower;		/* [nchannels][nbins] squared magnitude of spectrum */
+} gcc_engine_t;
+
+typedef struct
+{
+	int channel1, channel2;
+	index_t max_lag;		/* samples either way to search, 0 for all */
+	double tdoa;
+	double *heuristics;		/* receives NUM_TDOA_HEUR values */
+} gcc_pair_t;
+
+/* catalogue.c */
+
+#define MAX_PATH_LEN	1024
+#define MAX_FILENAME_LEN 64
+#define CATALOGUE_WAV	0x01
+#define CATALOGUE_WV	0x02
+typedef struct catalogue_entry
+{
+	const char *station_dir;	/* interned, as is date_dir */
+	const char *date_dir;
+	char    base_filename[MAX_FILENAME_LEN];
+	int     formats;		/* CATALOGUE_WAV and/or CATALOGUE_WV */
+	double  time_at_eof;
+	int     suffix;
+	index_t nsamples;		/* 0 until the recording has been read */
+	int     priority;		/* from its .details file, -1 if there is none */
+} catalogue_entry_t;
+
+typedef struct
+{
+	const char *station_dir;
+	const char *date_dir;
+	int64_t mtime;			/* in nanoseconds when last read, -1 if never */
+	GPtrArray *entries;
+} catalogue_dir_t;
+
+typedef struct
+{
+	char *root;
+	GHashTable *entries;		/* "station/date/base filename" -> catalogue_entry_t */
+	GHashTable *dirs;		/* "station/date" -> catalogue_dir_t */
+	GHashTable *stations;		/* station dir -> GPtrArray of its entries by time, made as needed */
+	int changed;			/* since it was read in */
+} catalogue_t;
+
 /* plotting.c */
 
 #define BLOCKING	0x01
@@ -44,8 +158,6 @@ typedef struct point2d_t
 
 /* dataman.c */
 
-#define MAX_PATH_LEN	1024
-#define MAX_FILENAME_LEN 64
 typedef struct
 {
 	int have_uncompressed;
@@ -56,16 +168,57 @@ typedef struct
 	double time_at_eof;
 	int    suffix;
 	int    station;
+	const char *date_dir;
+	struct catalogue_entry *entry;
 
-	double *clicktrack;
+	index_t *clicks;	/* sample positions of the pps clicks, NULL until read */
+	int     nclicks;
 	index_t nsamples;
+	pthread_mutex_t clicks_lock;	/* held while the clicks are read or found */
 } datafile_t;
+
+#define CLICK_DECIMATION	16
+#define CLICK_LOWPASS_FREQ	125
+#define CLICK_LOWPASS_ORDER	4
+#define CLICK_REFINE_SAMPLES	1024	/* either side of a click, filtered to place it exactly */
+#define CLICK_HISTORY		4096	/* samples kept for that */
+#define CLICK_BLOCK_SAMPLES	65536	/* read at a time when finding the clicks in a file */
+typedef struct
+{
+	double history[CLICK_HISTORY];
+	index_t nsamples;		/* seen so far */
+	index_t pending;		/* rough position of a click waiting to be placed */
+	int has_pending;
+	biquad_cascade_t lowpass;	/* run at the decimated rate */
+	double state[MAX_BIQUADS][2];
+	double sum;			/* of the samples in the current block */
+	int nsummed;
+	index_t ndecimated;
+	double previous;		/* last filtered value */
+	int found_peak;
+	double delay;			/* of the filters, in samples at the full rate */
+	double threshold;
+	GArray *clicks;			/* index_t */
+} click_detector_t;
+
+#define CLICK_INDEX_MAGIC	"bbclick1"
+typedef struct
+{
+	char magic[8];
+	uint32_t nsamples;
+	uint32_t nclicks;
+	double threshold;		/* the index is remade if click_threshold changes */
+} click_index_header_t;		/* followed by nclicks index_t's */
 #define WAVPACK         1
 #define UNCOMPRESSED    0
 
+/* a read of at least this fraction of a file decodes the whole file into the waveform cache */
+#define WAVEFORM_CACHE_WHOLE_FRACTION	0.25
+
 /* other */
 #define CHANNEL_NOISE_HEUR	0
-#define NUM_CHANNEL_HEUR	1
+#define CHANNEL_SNR_HEUR	1
+#define NUM_CHANNEL_HEUR	2
 
 #define TDOA_TDOA_HEUR		0
 #define TDOA_BADNESS_HEUR	1
@@ -76,7 +229,8 @@ typedef struct
 #define LOCATION_LATMIN_HEUR 2
 #define LOCATION_LNGDEG_HEUR 3
 #define LOCATION_LNGMIN_HEUR 4
-#define NUM_LOCATION_HEUR	5
+#define LOCATION_UNCERTAINTY_HEUR 5
+#define NUM_LOCATION_HEUR	6
 typedef struct channel_s
 {
 	double heuristics[NUM_CHANNEL_HEUR];
@@ -92,25 +246,29 @@ typedef struct tdoa_result_s
 	channel_t *channel2;
 } tdoa_result_t;
 
+/* a pair of stations whose TDOAs are computed */
+typedef struct
+{
+	int station1, station2;
+	double baseline;		/* metres between them */
+	index_t max_lag;		/* samples either way to search, 0 for all */
+} station_pair_t;
+
+/* blocks of this many seconds are compared to estimate a channel's SNR */
+#define SNR_BLOCK_SECONDS	0.016
+
 typedef struct estimate_s
 {
 	double heuristics[NUM_LOCATION_HEUR];
 	earthpos_t location;
 	double uncertainty;
-	tdoa_result_t *tdoa_01;
-	tdoa_result_t *tdoa_12;
-	tdoa_result_t *tdoa_20;
+	tdoa_result_t **tdoas;		/* one for each station pair used, NULL in a final estimate */
+	int ntdoas;
 	double start_time;
 	double length;
 } estimate_t;
 
 
-
-void locate_point(double TDOA_01_in_seconds,double TDOA_12_in_seconds,double TDOA_20_in_seconds,earthpos_t station_earthpos[],earthpos_t *location,double heuristics[]);
-
-
-void write_waveform(char *file, double *waveform, index_t nsamples, int compression);
-
 /* select.c */
 #define VALUE_ABOVE		0
 #define VALUE_BELOW		1
@@ -121,5 +279,4 @@ void write_waveform(char *file, double *waveform, index_t nsamples, int compress
 #define PERCENT_FROM_MIDDLE	6
 #define PERCENT_FROM_BOTTOM	7
 
-#define	MAX_FILES	4096
 #include "localization-prototypes.h"
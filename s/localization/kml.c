@@ -53,7 +53,8 @@ void write_kml_coordinates(FILE *fp,int level,earthpos_t *point)
 {
 	fprintf_tagline(fp,level,"coordinates","%.10lf, %.10lf",deg2full(point->lng_deg,point->lng_min),deg2full(point->lat_deg,point->lat_min));
 }
-char *stationdescriptions[NUM_STATIONS] = {
+/* the stations at the original site, others go without */
+static char *stationdescriptions[] = {
 	"The base station.",
 	"The station near the road.",
 	"The station in the creek."};
@@ -79,8 +80,8 @@ void write_kml_stations(FILE *fp,int level,earthpos_t *stations)
 	fprintf_tagline(fp,level,"description","Our weathered and beaten tracking stations");
 	for (int i=0; i<NUM_STATIONS; i++)
 	{
-		char name[16]; sprintf(name,"Station %d\n",i);
-		write_kml_point(fp,level,&stations[i],name,"#station_style",stationdescriptions[i]);
+		char name[32]; sprintf(name,"Station %d\n",i);
+		write_kml_point(fp,level,&stations[i],name,"#station_style",i < sizeof(stationdescriptions)/sizeof(char *) ? stationdescriptions[i] : NULL);
 	}
 	fputs_tag(--level,"</Folder>",fp);
 }
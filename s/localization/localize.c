@@ -9,14 +9,12 @@
  *   o glib2 for some generic datastructures;
  *   o libsndfile for reading and writing .WAV files;
  *   o libfftw3 for Fourier transforms;
+ * Filtering and resampling are done in sigproc.c.
  * And requires:
- *   o sox for some signal processing; 
  *   o gnuplot and python (with pylab) for some plotting functions;
- *   o wavpack for compression (including libwavpack)
+ *   o libwavpack for compression
  *
  * Things that could be done to improve the software:
- *   o use a library for the signal filtering rather than calling
- *     the external sox executable
  *   o figure out a nicer way to utilize the plotting features of
  *     pylab, or write a more general interface to them (like
  *     the gnuplotf function)
@@ -31,24 +29,40 @@
  * General comments:
  *
  * The localization system requires a config file which specifies
- * (among other things) the location of three directories, one
- * for each station.  These directories contain numerous one-minute
- * long wave files.  Each wave file contains 4 channels (one for
- * each microphone at the station).  The filenames are of the form
+ * (among other things) the location of a directory for each
+ * station, station0_dir, station1_dir and so on; there must be at
+ * least three.  These directories contain numerous one-minute
+ * long wave files.  Each wave file contains a channel for each
+ * microphone at the station, and the number of channels and the
+ * sampling rate are read from them (they must be the same at every
+ * station).  The filenames are of the form
  *                 1205910013.409933@40.wav
  * where 1205910013.409933 is the time at the end of the file (in
  * seconds since epoch) and the @40 signifies the likelihood of this
  * minute of sound data containing ground parrot calls.
  *
+ * The wave files are kept in a directory for each day, and the
+ * days from date_dir to last_date_dir (if given) are used, so a
+ * region may span midnight.  What was found in each day's directory
+ * is kept in a catalogue, `.catalogue' in base_dir, and a day's
+ * directory is only read again if it has changed since.
+ *
  * Each data directory should also contain a subdirectory 
- * `clicktracks'. As the system is used on this data it will extract
- * the PPS signal from the wave files it considers and store these
- * so-called clicktracks in this directory.  Once a given clicktrack
- * has been generated, it will be reused in later runs.
+ * `clicktracks'. As the system is used on this data it will find
+ * the clicks of the PPS signal in the wave files it considers and
+ * store their positions in an index file for each wave file in this
+ * directory.  Once a given index has been made, it will be reused in
+ * later runs.
+ *
+ * The config file specifies the location of the data directories,
+ * the GPS coordinates of the stations, and a couple of other minor
+ * filenames and variables.
  *
- * The config file specifies the location of the three data
- * directories, the GPS coordinates of the three stations, and a
- * couple of other minor filenames and variables.
+ * TDOAs are computed between pairs of stations.  Every pair is used
+ * unless max_baseline or pair_neighbours prune them, and for each
+ * region stations whose best channel is quieter than min_snr are left
+ * out (the three loudest are always used).  pair_channels limits the
+ * channels of a station correlated to its loudest few.
  *
  * The input of the localization algorithm is a region of time 
  * covered by the data. Regions of time are specified just by
@@ -102,11 +116,15 @@ const char *usage = "<start time> <length in seconds> OR <filename>";
 
 #include "i.h"
 
-/* this is the name of the group for localization parameters in the config file */
-#define LOCALIZATION_PARAM_GROUP	"localization"
-
 /* some parameters from the config file */
 double BREATHING_SPACE;
+double TDOA_LAG_MARGIN;
+int REGION_THREADS;
+int NUM_STATIONS;
+double MAX_BASELINE;
+int PAIR_NEIGHBOURS;
+double MIN_SNR;
+int PAIR_CHANNELS;
 
 /* verbosity for the various graphs that can be displayed */
 int graphing;
@@ -119,15 +137,15 @@ earthpos_t *current = NULL;
 
 void load_station_positions(earthpos_t stations[])
 {
-	char *station_position[NUM_STATIONS];
-	station_position[0] = param_get_string(LOCALIZATION_PARAM_GROUP,"station0_position");
-	station_position[1] = param_get_string(LOCALIZATION_PARAM_GROUP,"station1_position");
-	station_position[2] = param_get_string(LOCALIZATION_PARAM_GROUP,"station2_position");
 	for (int i=0; i<NUM_STATIONS; i++)
 	{
+		char *key = g_strdup_printf("station%d_position",i);
+		char *station_position = param_get_string(LOCALIZATION_PARAM_GROUP,key);
 		char lat_char, lng_char;
 		double lat_deg, lat_min, lng_deg, lng_min;
-		sscanf(station_position[i],"%c%lf %lf %c%lf %lf",&lat_char,&lat_deg,&lat_min,&lng_char,&lng_deg,&lng_min);
+		if (sscanf(station_position,"%c%lf %lf %c%lf %lf",&lat_char,&lat_deg,&lat_min,&lng_char,&lng_deg,&lng_min) != 6)
+			die("Can't parse %s '%s'",key,station_position);
+		g_free(key);
 		lat_deg = geochar_sgn(lat_char)*lat_deg;
 		lng_deg = geochar_sgn(lng_char)*lng_deg;
 
@@ -135,15 +153,64 @@ void load_station_positions(earthpos_t stations[])
 
 		dp(10,"Station %d at (Lat %f %f,Lng %f %f)\n",i,stations[i].lat_deg,stations[i].lat_min,stations[i].lng_deg,stations[i].lng_min);
 	}
+}
 
-	dp(10,"Distance between station 0 and station 1 is %g metres\n",earth_distance(&stations[0],&stations[1]));
-	dp(10,"Distance between station 1 and station 2 is %g metres\n",earth_distance(&stations[1],&stations[2]));
-	dp(10,"Distance between station 2 and station 0 is %g metres\n",earth_distance(&stations[2],&stations[0]));
+/* the number of stations nearer to station s than station t */
+static int nearer_stations(earthpos_t stations[], int s, int t)
+{
+	double distance = earth_distance(&stations[s],&stations[t]);
+	int nearer = 0;
+	for (int i=0; i<NUM_STATIONS; i++)
+	{
+		if (i != s && i != t && earth_distance(&stations[s],&stations[i]) < distance)
+			nearer++;
+	}
+	return nearer;
 }
 
+/* makes the pairs of stations between which TDOAs are computed.  all pairs are
+ * used, except those longer than max_baseline and, if pair_neighbours is set,
+ * those in which neither station is one of the other's nearest pair_neighbours.
+ * SAMPLING_RATE must be known, so it is called after dataman_scan(). */
+station_pair_t *make_station_pairs(earthpos_t stations[], int *npairs)
+{
+	station_pair_t *pairs = salloc(sizeof(station_pair_t)*NUM_STATIONS*(NUM_STATIONS-1)/2);
+	*npairs = 0;
+	for (int s1=0; s1<NUM_STATIONS; s1++)
+	for (int s2=s1+1; s2<NUM_STATIONS; s2++)
+	{
+		double baseline = earth_distance(&stations[s1],&stations[s2]);
+		dp(10,"Distance between station %d and station %d is %g metres\n",s1,s2,baseline);
+		if (MAX_BASELINE > 0 && baseline > MAX_BASELINE)
+			continue;
+		if (PAIR_NEIGHBOURS > 0 && nearer_stations(stations,s1,s2) >= PAIR_NEIGHBOURS && nearer_stations(stations,s2,s1) >= PAIR_NEIGHBOURS)
+			continue;
+
+		/* sound can't take longer than the distance between stations to travel between them */
+		station_pair_t *pair = &pairs[(*npairs)++];
+		pair->station1 = s1;
+		pair->station2 = s2;
+		pair->baseline = baseline;
+		pair->max_lag = TDOA_LAG_MARGIN < 0 ? 0 : ceil((baseline/SPEED_OF_SOUND + TDOA_LAG_MARGIN)*SAMPLING_RATE);
+	}
+	dp(5,"Using %d pairs of %d stations\n",*npairs,NUM_STATIONS);
+	if (*npairs < 2)
+		die("Only %d pairs of stations are left by max_baseline and pair_neighbours, at least 2 are needed",*npairs);
+	return pairs;
+}
 
-/* analyzes the specified region and returns an estimated location */
-estimate_t *analyze_region(double start_in_seconds, double length_in_seconds)
+void free_estimate(estimate_t *estimate)
+{
+	free(estimate->tdoas);
+	free(estimate);
+}
+
+
+/* analyzes the specified region and returns an estimated location.
+ * the tdoas are computed on nthreads threads, one per processor if it is 0.
+ * nothing is changed but the data files' clicks, which are locked, so
+ * regions can be analyzed in parallel. */
+estimate_t *analyze_region(double start_in_seconds, double length_in_seconds, earthpos_t station_earthpos[], station_pair_t station_pairs[], int nstation_pairs, int nthreads)
 {
 	dp(1,
 "=========================================================\n\
@@ -190,18 +257,13 @@ estimate_t *analyze_region(double start_in_seconds, double length_in_seconds)
 	for (int j=0; j<NUM_CHANNELS; j++)
 	{
 		channel_t *chan = g_ptr_array_index(channels[i],j);
-		chan->waveform = filter(chan->waveform,chan->nsamples,3000,5000);
+		filter_in_place(chan->waveform,chan->nsamples,3000,5000);
 		filtered[i][j] = chan->waveform;
+		chan->heuristics[CHANNEL_SNR_HEUR] = estimate_snr(chan->waveform,chan->nsamples);
+		dp(10,"Station %d channel %d has SNR %.1lf dB\n",i,j,chan->heuristics[CHANNEL_SNR_HEUR]);
 	}
 	dp(5,"Filtered the waveforms.\n");
 
-	/* we are now done with the original waveforms */
-	for (int i=0; i<NUM_STATIONS; i++)
-	for (int j=0; j<NUM_CHANNELS; j++)
-	{
-		free(waveforms[i][j]);
-	}
-
 	/*====================================================
 	 * then we analyze the filtered waveforms
 	 * (for shape, noise, whatever)
@@ -225,23 +287,75 @@ estimate_t *analyze_region(double start_in_seconds, double length_in_seconds)
 	 * discard or select channels based just on the filtered waveforms
 	 *=============================================================*/
 
-			 /* not implemented */
+	/* a station is used if its best channel is loud enough, and the three
+	 * loudest stations are always used */
+	double station_snr[NUM_STATIONS];
+	for (int i=0; i<NUM_STATIONS; i++)
+		station_snr[i] = value(channels[i],CHANNEL_SNR_HEUR,POSITION_FROM_TOP,0);
+	int active_station[NUM_STATIONS];
+	for (int i=0; i<NUM_STATIONS; i++)
+	{
+		int louder = 0;
+		for (int j=0; j<NUM_STATIONS; j++)
+			louder += station_snr[j] > station_snr[i] || (station_snr[j] == station_snr[i] && j < i);
+		active_station[i] = station_snr[i] >= MIN_SNR || louder < 3;
+		if (!active_station[i])
+			dp(5,"Not using station %d, its SNR is %.1lf dB\n",i,station_snr[i]);
+	}
+
+	/* and only the pairs between stations used */
+	station_pair_t active_pairs[nstation_pairs];
+	int nactive = 0;
+	for (int p=0; p<nstation_pairs; p++)
+	{
+		if (active_station[station_pairs[p].station1] && active_station[station_pairs[p].station2])
+			active_pairs[nactive++] = station_pairs[p];
+	}
+	if (nactive < 2)
+	{
+		dp(5,"Only %d pairs of stations are loud enough, using them all\n",nactive);
+		for (int i=0; i<NUM_STATIONS; i++)
+			active_station[i] = 1;
+		memcpy(active_pairs,station_pairs,sizeof(station_pair_t)*nstation_pairs);
+		nactive = nstation_pairs;
+	}
 
-	/* e.g.
-	 	    select_main(channels,CHANNEL_NOISE_HEUR,VALUE_BELOW,1000);
-	   or to just select the least noisy channel
-		    select_main(channels,CHANNEL_NOISE_HEUR,POSITION_FROM_TOP,0);
+	/* only the loudest pair_channels channels of each station are correlated */
+	if (PAIR_CHANNELS > 0)
+		select_main(channels,NUM_STATIONS,CHANNEL_SNR_HEUR,POSITION_FROM_TOP,PAIR_CHANNELS-1);
+	/* or e.g. to drop the noisy ones
+	 	    select_main(channels,NUM_STATIONS,CHANNEL_NOISE_HEUR,VALUE_BELOW,1000);
 	   */
 
 	/*================================================================
 	 * then we compute TDOAs for all combinations of remaining channels
+	 * of each pair of stations
 	 *===============================================================*/
 	int method = GCC_PLAIN;
-	GPtrArray *tdoa_results[NUM_STATIONS];
-	for (int s1=0; s1<NUM_STATIONS; s1++)
+
+	/* each channel used is transformed once, and the pairs are correlated in parallel */
+	double *engine_waveforms[NUM_STATIONS*NUM_CHANNELS];
+	int first_channel[NUM_STATIONS];
+	int nchannels = 0;
+	for (int i=0; i<NUM_STATIONS; i++)
+	{
+		first_channel[i] = nchannels;
+		if (!active_station[i])
+			continue;
+		for (int j=0; j<channels[i]->len; j++)
+			engine_waveforms[nchannels++] = ((channel_t *)g_ptr_array_index(channels[i],j))->waveform;
+	}
+	gcc_engine_t *engine = gcc_engine_new(engine_waveforms,nchannels,nsamples);
+	gcc_pair_t pairs[nactive*NUM_CHANNELS*NUM_CHANNELS];
+	tdoa_result_t *pair_results[nactive*NUM_CHANNELS*NUM_CHANNELS];
+	int npairs = 0;
+
+	GPtrArray *tdoa_results[nactive];
+	for (int p=0; p<nactive; p++)
 	{
-		int s2=(s1+1)%NUM_STATIONS;
-		tdoa_results[s1] = g_ptr_array_new();
+		int s1 = active_pairs[p].station1;
+		int s2 = active_pairs[p].station2;
+		tdoa_results[p] = g_ptr_array_new();
 
 		for (int c1=0; c1<channels[s1]->len; c1++)
 		for (int c2=0; c2<channels[s2]->len; c2++)
@@ -252,10 +366,18 @@ estimate_t *analyze_region(double start_in_seconds, double length_in_seconds)
 			tdoa_result_t *result = salloc(sizeof(tdoa_result_t));
 			result->channel1 = chan1; 
 			result->channel2 = chan2;
-			result->tdoa = time_difference_of_arrival(chan1->waveform,chan2->waveform,nsamples,method,result->heuristics);
-			g_ptr_array_add(tdoa_results[s1],result);
+			pairs[npairs].channel1 = first_channel[s1] + c1;
+			pairs[npairs].channel2 = first_channel[s2] + c2;
+			pairs[npairs].max_lag = active_pairs[p].max_lag;
+			pairs[npairs].heuristics = result->heuristics;
+			pair_results[npairs++] = result;
+			g_ptr_array_add(tdoa_results[p],result);
 		}
 	}
+	gcc_tdoa_pairs(engine,pairs,npairs,method,nthreads);
+	for (int p=0; p<npairs; p++)
+		pair_results[p]->tdoa = pairs[p].tdoa;
+	gcc_engine_free(engine);
 
 	/* we're then done with the filtered waveforms  */
 	for (int i=0; i<NUM_STATIONS; i++)
@@ -267,33 +389,40 @@ estimate_t *analyze_region(double start_in_seconds, double length_in_seconds)
 	/*===========================================================
 	 * discard or select TDOA results based on TDOA heuristics
 	 *==========================================================*/
-	//e.g. drop(tdoa_results,TDOA_BADNESS_HEUR,VALUE_BELOW,1000);
+	//e.g. drop(tdoa_results,nactive,TDOA_BADNESS_HEUR,VALUE_BELOW,1000);
 	//the following work:
-	select_main(tdoa_results,TDOA_TDOA_HEUR,POSITION_FROM_MIDDLE,0);  /* to grab the medians */
-	//select_main(tdoa_results,TDOA_TDOA_HEUR,PERCENT_FROM_MIDDLE,0.5);   /* to drop the outer two quartiles */
+	select_main(tdoa_results,nactive,TDOA_TDOA_HEUR,POSITION_FROM_MIDDLE,0);  /* to grab the medians */
+	//select_main(tdoa_results,nactive,TDOA_TDOA_HEUR,PERCENT_FROM_MIDDLE,0.5);   /* to drop the outer two quartiles */
 	
 
 	/*===========================================================
 	 * then we do the geometric algorithm for all combinations of
 	 * remaining TDOAs
 	 *==========================================================*/
-	earthpos_t station_earthpos[NUM_STATIONS];
-	load_station_positions(station_earthpos);
 	GPtrArray *estimates = g_ptr_array_new();
 
-	for (int i0=0; i0<tdoa_results[0]->len; i0++)
-	for (int i1=0; i1<tdoa_results[1]->len; i1++)
-	for (int i2=0; i2<tdoa_results[2]->len; i2++)
+	/* which result of each pair is in the current combination */
+	int combination[nactive];
+	memset(combination,0,sizeof(combination));
+	while (1)
 	{
 		estimate_t *estimate = salloc(sizeof *estimate);
-		estimate->tdoa_01 = g_ptr_array_index(tdoa_results[0],i0);
-		estimate->tdoa_12 = g_ptr_array_index(tdoa_results[1],i1);
-		estimate->tdoa_20 = g_ptr_array_index(tdoa_results[2],i2);
-		double tdoa_01 = estimate->tdoa_01->tdoa;
-		double tdoa_12 = estimate->tdoa_12->tdoa;
-		double tdoa_20 = estimate->tdoa_20->tdoa;
-		locate_point(tdoa_01,tdoa_12,tdoa_20,station_earthpos,&estimate->location,estimate->heuristics);
+		estimate->tdoas = salloc(sizeof(tdoa_result_t *)*nactive);
+		estimate->ntdoas = nactive;
+		double tdoas[nactive];
+		for (int p=0; p<nactive; p++)
+		{
+			estimate->tdoas[p] = g_ptr_array_index(tdoa_results[p],combination[p]);
+			tdoas[p] = estimate->tdoas[p]->tdoa;
+		}
+		locate_point(active_pairs,tdoas,nactive,station_earthpos,&estimate->location,estimate->heuristics);
 		g_ptr_array_add(estimates,estimate);
+
+		int p = 0;
+		while (p<nactive && ++combination[p] == tdoa_results[p]->len)
+			combination[p++] = 0;
+		if (p == nactive)
+			break;
 	}
 
 
@@ -313,6 +442,7 @@ estimate_t *analyze_region(double start_in_seconds, double length_in_seconds)
 	/*===========================================================
 	 * give an uncertainty to the point(s) we are returning
 	 *==========================================================*/
+	best_estimate->uncertainty = value(estimates,LOCATION_UNCERTAINTY_HEUR,POSITION_FROM_MIDDLE,0);
 
 	/*==========================================================
 	 * final cleanup
@@ -322,10 +452,13 @@ estimate_t *analyze_region(double start_in_seconds, double length_in_seconds)
 	{
 		g_ptr_array_foreach(channels[i],(GFunc)free,NULL);
 		g_ptr_array_free(channels[i],TRUE); 
-		g_ptr_array_foreach(tdoa_results[i],(GFunc)free,NULL);
-		g_ptr_array_free(tdoa_results[i],TRUE);
 	}
-	g_ptr_array_foreach(estimates,(GFunc)free,NULL);
+	for (int p=0; p<nactive; p++)
+	{
+		g_ptr_array_foreach(tdoa_results[p],(GFunc)free,NULL);
+		g_ptr_array_free(tdoa_results[p],TRUE);
+	}
+	g_ptr_array_foreach(estimates,(GFunc)free_estimate,NULL);
 	g_ptr_array_free(estimates,TRUE);
 
 
@@ -366,18 +499,52 @@ estimate_t *analyze_region(double start_in_seconds, double length_in_seconds)
 
 
 
+/* whether a key such as station%d_dir is in the config for the station */
+static int station_key_given(const char *format, int station)
+{
+	char *key = g_strdup_printf(format,station);
+	char *value = param_get_string_n(LOCALIZATION_PARAM_GROUP,key);
+	g_free(key);
+	int given = value != NULL;
+	g_free(value);
+	return given;
+}
+
 void load_config(void)
 {
 	base_dir = param_get_string(LOCALIZATION_PARAM_GROUP,"base_dir");
 	date_dir = param_get_string(LOCALIZATION_PARAM_GROUP,"date_dir");
-	station_dir[0] = param_get_string(LOCALIZATION_PARAM_GROUP,"station0_dir");
-	station_dir[1] = param_get_string(LOCALIZATION_PARAM_GROUP,"station1_dir");
-	station_dir[2] = param_get_string(LOCALIZATION_PARAM_GROUP,"station2_dir");
+	last_date_dir = param_get_string(LOCALIZATION_PARAM_GROUP,"last_date_dir");
+	station_dir = salloc(sizeof(char *)*MAX_STATIONS);
+	for (NUM_STATIONS=0; NUM_STATIONS<MAX_STATIONS; NUM_STATIONS++)
+	{
+		char *key = g_strdup_printf("station%d_dir",NUM_STATIONS);
+		station_dir[NUM_STATIONS] = param_get_string_n(LOCALIZATION_PARAM_GROUP,key);
+		g_free(key);
+		if (!station_dir[NUM_STATIONS])
+			break;
+	}
+	if (NUM_STATIONS < 3)
+		die("Only %d stations are given (station0_dir, station1_dir, ...), at least 3 are needed",NUM_STATIONS);
+	/* stations after a gap in the numbering would otherwise be silently left out */
+	for (int i=NUM_STATIONS; i<=MAX_STATIONS; i++)
+	{
+		if (i == MAX_STATIONS && station_key_given("station%d_dir",i))
+			die("More than %d stations are given",MAX_STATIONS);
+		if (station_key_given("station%d_dir",i) || station_key_given("station%d_position",i))
+			die("Station %d is given but station%d_dir isn't, stations must be numbered from 0 without gaps",i,NUM_STATIONS);
+	}
 	BREATHING_SPACE = param_get_double(LOCALIZATION_PARAM_GROUP,"breathing_space");
+	TDOA_LAG_MARGIN = param_get_double_with_default(LOCALIZATION_PARAM_GROUP,"tdoa_lag_margin",0.005);
+	REGION_THREADS = param_get_integer_with_default(LOCALIZATION_PARAM_GROUP,"threads",0);
+	MAX_BASELINE = param_get_double_with_default(LOCALIZATION_PARAM_GROUP,"max_baseline",0);
+	PAIR_NEIGHBOURS = param_get_integer_with_default(LOCALIZATION_PARAM_GROUP,"pair_neighbours",0);
+	MIN_SNR = param_get_double_with_default(LOCALIZATION_PARAM_GROUP,"min_snr",0);
+	PAIR_CHANNELS = param_get_integer_with_default(LOCALIZATION_PARAM_GROUP,"pair_channels",0);
 	kml_file    = param_get_string(LOCALIZATION_PARAM_GROUP,"kml_file");
 	result_file = param_get_string(LOCALIZATION_PARAM_GROUP,"result_file");
 	click_threshold = param_get_double(LOCALIZATION_PARAM_GROUP,"click_threshold");
-	compress_clicktracks = param_get_integer(LOCALIZATION_PARAM_GROUP,"compress_clicktracks");
+	waveform_cache_mb = param_get_double_with_default(LOCALIZATION_PARAM_GROUP,"waveform_cache_mb",256);
 	
 	dp(5,"Loaded configuration.\n");
 }
@@ -388,7 +555,41 @@ void analyze_channel_noise(channel_t *chan)
 	chan->heuristics[CHANNEL_NOISE_HEUR] = abs(chan->channel - 1);
 }
 
-/* processes a whole bunch of regions which are specified in the given file */
+/* a region from the batch file, and what we made of it */
+typedef struct
+{
+	double start_in_seconds;
+	double length_in_seconds;
+	earthpos_t *known;	/* the actual position of the call, if known */
+	estimate_t *result;
+} region_job_t;
+
+typedef struct
+{
+	region_job_t *jobs;
+	int njobs;
+	int next;
+	int tdoa_threads;
+	earthpos_t *station_earthpos;
+	station_pair_t *station_pairs;
+	int nstation_pairs;
+} region_pool_t;
+
+static void *region_worker(void *arg)
+{
+	region_pool_t *pool = arg;
+	int i;
+	while ((i = __atomic_fetch_add(&pool->next,1,__ATOMIC_RELAXED)) < pool->njobs)
+	{
+		region_job_t *job = &pool->jobs[i];
+		job->result = analyze_region(job->start_in_seconds,job->length_in_seconds,pool->station_earthpos,pool->station_pairs,pool->nstation_pairs,pool->tdoa_threads);
+	}
+	return NULL;
+}
+
+/* processes a whole bunch of regions which are specified in the given file.
+ * the regions are independent, so they are analyzed by a pool of threads,
+ * and the results are then written out in the order of the file. */
 void process_file(char *filename)
 {
 	dp(21, "process_file(%s)\n", filename);
@@ -411,6 +612,7 @@ void process_file(char *filename)
 	GArray *data_to_plot = g_array_new(FALSE,FALSE,sizeof(point2d_t));
 
 	GPtrArray *estimates = g_ptr_array_new();
+	GArray *jobs = g_array_new(FALSE,TRUE,sizeof(region_job_t));
 
 	/* see the sample batch file for it's format */
 	char line[MAX_PATH_LEN];
@@ -444,23 +646,58 @@ void process_file(char *filename)
 		{
 			/* this line contains a region which should be processed */
 			start_in_seconds = parse_time(timestr);
-			estimate_t *result = analyze_region(start_in_seconds,length_in_seconds);
-			if (current != NULL)
-			{
-				double error = earth_distance(&result->location,current);
-				dp(1,"Error is %.1lf metres\n",error);
-				point2d_t p;
-				p.x = result->uncertainty;
-				p.y = error;
-				g_array_append_val(data_to_plot,p);
-			}
-			result->start_time = start_in_seconds;
-			result->length = length_in_seconds;
-			write_result(start_in_seconds,length_in_seconds,&result->location,result->uncertainty);
-			g_ptr_array_add(estimates,result);
-			//free(result);
+			region_job_t job = {start_in_seconds,length_in_seconds,current,NULL};
+			g_array_append_val(jobs,job);
+		}
+	}
+
+	earthpos_t station_earthpos[NUM_STATIONS];
+	load_station_positions(station_earthpos);
+	int nstation_pairs;
+	station_pair_t *station_pairs = make_station_pairs(station_earthpos,&nstation_pairs);
+
+	/* each region gets a thread, unless there are fewer regions than threads to spare.
+	 * plots must come one at a time. */
+	region_pool_t pool = {(region_job_t *)jobs->data,jobs->len,0,0,station_earthpos,station_pairs,nstation_pairs};
+	int nthreads = REGION_THREADS > 0 ? REGION_THREADS : sysconf(_SC_NPROCESSORS_ONLN);
+	if (graphing > 0)
+		nthreads = 1;
+	nthreads = MAX(1,MIN(nthreads,pool.njobs));
+	if (nthreads > 1)
+		pool.tdoa_threads = 1;
+	dp(5,"Analyzing %d regions on %d threads\n",pool.njobs,nthreads);
+	pthread_t threads[nthreads];
+	int started = 0;
+	for (; started<nthreads-1; started++)
+	{
+		if (pthread_create(&threads[started],NULL,region_worker,&pool))
+			break;
+	}
+	region_worker(&pool);
+	for (int t=0; t<started; t++)
+		pthread_join(threads[t],NULL);
+
+	for (int i=0; i<jobs->len; i++)
+	{
+		region_job_t *job = &g_array_index(jobs,region_job_t,i);
+		estimate_t *result = job->result;
+		current = job->known;
+		if (current != NULL)
+		{
+			double error = earth_distance(&result->location,current);
+			dp(1,"Error is %.1lf metres\n",error);
+			point2d_t p;
+			p.x = result->uncertainty;
+			p.y = error;
+			g_array_append_val(data_to_plot,p);
 		}
+		result->start_time = job->start_in_seconds;
+		result->length = job->length_in_seconds;
+		write_result(job->start_in_seconds,job->length_in_seconds,&result->location,result->uncertainty);
+		g_ptr_array_add(estimates,result);
+		//free(result);
 	}
+	g_array_free(jobs,TRUE);
 
 
 	/* plot the heuristic data */
@@ -472,12 +709,11 @@ void process_file(char *filename)
 	/* we reall need to write them all together, because
 	 * of the closing tags of xml file */
 	/* i.e. annoying to do them one by one. */
-	earthpos_t station_earthpos[NUM_STATIONS];
-	load_station_positions(station_earthpos);
 	write_kml_file(station_earthpos,known_positions,estimates);
 
-	g_ptr_array_foreach(estimates,(GFunc)free,NULL);
+	g_ptr_array_foreach(estimates,(GFunc)free_estimate,NULL);
 	g_ptr_array_free(estimates,TRUE);
+	free(station_pairs);
 	g_hash_table_destroy(known_positions);
 	g_array_free(data_to_plot,TRUE);
 	fclose(fp);
@@ -507,7 +743,12 @@ int main(int argc, char **argv)
 		double start_in_seconds	  = parse_time(argv[optind]);
 		double length_in_seconds  = atof(argv[optind+1]);
 
-		analyze_region(start_in_seconds,length_in_seconds);
+		earthpos_t station_earthpos[NUM_STATIONS];
+		load_station_positions(station_earthpos);
+		int nstation_pairs;
+		station_pair_t *station_pairs = make_station_pairs(station_earthpos,&nstation_pairs);
+		free_estimate(analyze_region(start_in_seconds,length_in_seconds,station_earthpos,station_pairs,nstation_pairs,0));
+		free(station_pairs);
 	}
 
 	dataman_cleanup();
@@ -0,0 +1,442 @@
+/* multilateration: finding the point in the plane which produced a set of
+ * range differences, that is TDOAs times the speed of sound, between pairs
+ * of stations.
+ *   o a closed-form solution gives a first guess
+ *   o Levenberg-Marquardt then refines it on the hyperbolic residuals
+ *         (| p - s_a | - | p - s_b |) - range difference
+ *   o the covariance of the fix comes from the Jacobian at the solution
+ *
+ * the closed form is spherical intersection: writing r_i for the distance from
+ * the point p to station i, the range differences give r_i = r_0 + delta_i, and
+ * subtracting r_0^2 = |p - s_0|^2 from r_i^2 = |p - s_i|^2 leaves equations
+ * linear in p and r_0
+ *         2(s_i - s_0).p + 2 delta_i r_0 = |s_i|^2 - |s_0|^2 - delta_i^2
+ * solving these for p in terms of r_0 and putting that back into
+ * r_0^2 = |p - s_0|^2 gives a quadratic in r_0, with up to two roots.
+ *
+ * when the stations are nearly collinear, or the sound came from well outside
+ * them, the closed form is unreliable and the refined fix ill-conditioned, so
+ * a coarse grid over the area around the stations is searched for a starting
+ * point as well.  any number of stations from 3 up, and any set of pairs which
+ * connects them, may be used.  with inconsistent range differences, as real
+ * TDOAs always are, the fix is the least squares one. */
+
+#include "i.h"
+
+/* solve a x = b in place for the n x n matrix a (row major), leaving x in b.
+ * returns 0 if a is singular */
+static int solve_linear(int n, double *a, double *b)
+{
+	double scale = 0;
+	for (int i=0; i<n*n; i++)
+		scale = fmax(scale,fabs(a[i]));
+	if (scale == 0)
+		return 0;
+	for (int col=0; col<n; col++)
+	{
+		int pivot = col;
+		for (int row=col+1; row<n; row++)
+			if (fabs(a[row*n+col]) > fabs(a[pivot*n+col]))
+				pivot = row;
+		if (fabs(a[pivot*n+col]) < 1e-12*scale)
+			return 0;
+		if (pivot != col)
+		{
+			for (int k=0; k<n; k++)
+			{
+				double t = a[col*n+k];
+				a[col*n+k] = a[pivot*n+k];
+				a[pivot*n+k] = t;
+			}
+			double t = b[col];
+			b[col] = b[pivot];
+			b[pivot] = t;
+		}
+		for (int row=col+1; row<n; row++)
+		{
+			double f = a[row*n+col]/a[col*n+col];
+			for (int k=col; k<n; k++)
+				a[row*n+k] -= f*a[col*n+k];
+			b[row] -= f*b[col];
+		}
+	}
+	for (int row=n-1; row>=0; row--)
+	{
+		for (int k=row+1; k<n; k++)
+			b[row] -= a[row*n+k]*b[k];
+		b[row] /= a[row*n+row];
+	}
+	return 1;
+}
+
+/* the range differences relative to station 0, delta_i = r_i - r_0, which best
+ * fit the measured pairs.  with more pairs than stations this also shares out
+ * any inconsistency between them, e.g. a non-zero sum around a triangle.
+ * returns 0 if the pairs don't connect all the stations */
+static int reference_range_differences(int nstations, range_difference_t measurements[], int nmeasurements, double delta[])
+{
+	int n = nstations-1;
+	double a[n*n];
+	double b[n];
+	memset(a,0,sizeof(a));
+	memset(b,0,sizeof(b));
+	for (int k=0; k<nmeasurements; k++)
+	{
+		/* delta_a - delta_b = range difference, with delta_0 fixed at 0 */
+		int i = measurements[k].station1 - 1;
+		int j = measurements[k].station2 - 1;
+		double d = measurements[k].range_difference;
+		if (i >= 0)
+		{
+			a[i*n+i] += 1;
+			b[i] += d;
+		}
+		if (j >= 0)
+		{
+			a[j*n+j] += 1;
+			b[j] -= d;
+		}
+		if (i >= 0 && j >= 0)
+		{
+			a[i*n+j] -= 1;
+			a[j*n+i] -= 1;
+		}
+	}
+	if (!solve_linear(n,a,b))
+		return 0;
+	delta[0] = 0;
+	for (int i=1; i<nstations; i++)
+		delta[i] = b[i-1];
+	return 1;
+}
+
+/* the closed-form candidates, as described at the top of this file.
+ * returns how many were found, from 0 to 2 */
+static int closed_form(point2d_t stations[], int nstations, double delta[], point2d_t candidates[2])
+{
+	/* least squares for p = u + v r_0 from the equations linear in p and r_0 */
+	double gtg[4] = {0,0,0,0};
+	double gtk[2] = {0,0};
+	double gth[2] = {0,0};
+	double s0sqr = normsquared2(stations[0]);
+	for (int i=1; i<nstations; i++)
+	{
+		double gx = 2*(stations[i].x - stations[0].x);
+		double gy = 2*(stations[i].y - stations[0].y);
+		double k = normsquared2(stations[i]) - s0sqr - delta[i]*delta[i];
+		double h = 2*delta[i];
+		gtg[0] += gx*gx;
+		gtg[1] += gx*gy;
+		gtg[3] += gy*gy;
+		gtk[0] += gx*k;
+		gtk[1] += gy*k;
+		gth[0] += gx*h;
+		gth[1] += gy*h;
+	}
+	gtg[2] = gtg[1];
+	double det = gtg[0]*gtg[3] - gtg[1]*gtg[2];
+	double trace = gtg[0] + gtg[3];
+	if (fabs(det) < MULTILATERATION_MIN_CONDITION*trace*trace)
+		return 0;	/* stations are (nearly) collinear */
+	point2d_t u, v;
+	u.x = ( gtg[3]*gtk[0] - gtg[1]*gtk[1])/det;
+	u.y = (-gtg[2]*gtk[0] + gtg[0]*gtk[1])/det;
+	v.x = -( gtg[3]*gth[0] - gtg[1]*gth[1])/det;
+	v.y = -(-gtg[2]*gth[0] + gtg[0]*gth[1])/det;
+
+	/* and then r_0^2 = |u + v r_0 - s_0|^2 */
+	point2d_t w;
+	w.x = u.x - stations[0].x;
+	w.y = u.y - stations[0].y;
+	double qa = normsquared2(v) - 1;
+	double qb = 2*(v.x*w.x + v.y*w.y);
+	double qc = normsquared2(w);
+	double roots[2];
+	int nroots = 0;
+	if (fabs(qa) < 1e-12)
+	{
+		if (qb != 0)
+			roots[nroots++] = -qc/qb;
+	}
+	else
+	{
+		/* noisy range differences can leave the discriminant just below 0,
+		 * in which case the nearest point is the double root */
+		double disc = fmax(qb*qb - 4*qa*qc,0);
+		double q = -0.5*(qb + (qb >= 0 ? 1 : -1)*sqrt(disc));
+		roots[nroots++] = q/qa;
+		if (q != 0 && disc > 0)
+			roots[nroots++] = qc/q;
+	}
+	int ncandidates = 0;
+	for (int i=0; i<nroots; i++)
+	{
+		if (roots[i] < 0 || !isfinite(roots[i]))
+			continue;
+		candidates[ncandidates].x = u.x + v.x*roots[i];
+		candidates[ncandidates].y = u.y + v.y*roots[i];
+		ncandidates++;
+	}
+	return ncandidates;
+}
+
+/* the residuals at p and their Jacobian, returning the sum of squared residuals */
+static double residuals(point2d_t stations[], range_difference_t measurements[], int nmeasurements, point2d_t *p, double f[], double jacobian[][2])
+{
+	double sumsqr = 0;
+	for (int k=0; k<nmeasurements; k++)
+	{
+		point2d_t *sa = &stations[measurements[k].station1];
+		point2d_t *sb = &stations[measurements[k].station2];
+		double ra = dist2(p,sa);
+		double rb = dist2(p,sb);
+		f[k] = ra - rb - measurements[k].range_difference;
+		sumsqr += f[k]*f[k];
+		if (jacobian)
+		{
+			/* the gradient of |p - s| is the unit vector from s to p, taken as 0 at s */
+			jacobian[k][0] = (ra > 0 ? (p->x - sa->x)/ra : 0) - (rb > 0 ? (p->x - sb->x)/rb : 0);
+			jacobian[k][1] = (ra > 0 ? (p->y - sa->y)/ra : 0) - (rb > 0 ? (p->y - sb->y)/rb : 0);
+		}
+	}
+	return sumsqr;
+}
+
+static void normal_matrix(double jacobian[][2], double f[], int nmeasurements, double jtj[3], double jtf[2])
+{
+	jtj[0] = jtj[1] = jtj[2] = 0;
+	jtf[0] = jtf[1] = 0;
+	for (int k=0; k<nmeasurements; k++)
+	{
+		jtj[0] += jacobian[k][0]*jacobian[k][0];
+		jtj[1] += jacobian[k][0]*jacobian[k][1];
+		jtj[2] += jacobian[k][1]*jacobian[k][1];
+		jtf[0] += jacobian[k][0]*f[k];
+		jtf[1] += jacobian[k][1]*f[k];
+	}
+}
+
+/* Levenberg-Marquardt from p.  returns 1 if it converged, leaving the fix in p
+ * and its sum of squared residuals in *sumsqr */
+static int refine(point2d_t stations[], range_difference_t measurements[], int nmeasurements, point2d_t *p, double *sumsqr, int *iterations)
+{
+	double f[nmeasurements];
+	double jacobian[nmeasurements][2];
+	double trial_f[nmeasurements];
+	double lambda = 1e-3;
+	double cost = residuals(stations,measurements,nmeasurements,p,f,jacobian);
+	int converged = 0;
+	int it;
+	for (it=0; it<MULTILATERATION_MAX_ITERATIONS && !converged; it++)
+	{
+		double jtj[3], jtf[2];
+		normal_matrix(jacobian,f,nmeasurements,jtj,jtf);
+		while (1)
+		{
+			/* Marquardt's scaling, damping each coordinate by its own curvature */
+			double a00 = jtj[0]*(1+lambda) + 1e-12;
+			double a11 = jtj[2]*(1+lambda) + 1e-12;
+			double a01 = jtj[1];
+			double det = a00*a11 - a01*a01;
+			point2d_t step;
+			step.x = -( a11*jtf[0] - a01*jtf[1])/det;
+			step.y = -(-a01*jtf[0] + a00*jtf[1])/det;
+			point2d_t trial;
+			trial.x = p->x + step.x;
+			trial.y = p->y + step.y;
+			double trial_cost = residuals(stations,measurements,nmeasurements,&trial,trial_f,NULL);
+			if (trial_cost <= cost)
+			{
+				*p = trial;
+				converged = norm2(step) < MULTILATERATION_TOLERANCE || cost - trial_cost <= 1e-15*cost;
+				cost = residuals(stations,measurements,nmeasurements,p,f,jacobian);
+				lambda = fmax(lambda/10,1e-12);
+				break;
+			}
+			lambda *= 10;
+			if (lambda > 1e12)
+			{
+				/* no step downhill at all, so we are at the bottom */
+				converged = 1;
+				break;
+			}
+		}
+	}
+	*sumsqr = cost;
+	*iterations += it;
+	return converged;
+}
+
+static point2d_t centroid(point2d_t stations[], int nstations)
+{
+	point2d_t centre = {0,0};
+	for (int i=0; i<nstations; i++)
+	{
+		centre.x += stations[i].x/nstations;
+		centre.y += stations[i].y/nstations;
+	}
+	return centre;
+}
+
+/* whether p, with sum of squared residuals cost, is a better fix than best.
+ * three stations give two independent range differences, and away from the
+ * stations two points can fit them equally well (the third pair only checks
+ * the other two).  between such points we take the one nearer the stations,
+ * which is where calls are most likely to be heard from */
+static int better_fix(point2d_t *p, double cost, point2d_t *best, double best_cost, point2d_t *centre, int nmeasurements)
+{
+	double tie = nmeasurements*square_d(MULTILATERATION_TOLERANCE);
+	if (cost < best_cost - tie)
+		return 1;
+	return cost <= best_cost + tie && dist2(p,centre) < dist2(best,centre);
+}
+
+/* the point of a coarse grid around the stations with the least sum of squared
+ * residuals.  a row of the grid is done at a time, a station at a time, so the
+ * inner loops are straight-line arithmetic over arrays which the compiler can
+ * vectorize */
+static void grid_search(point2d_t stations[], int nstations, range_difference_t measurements[], int nmeasurements, point2d_t *best)
+{
+	point2d_t centre = centroid(stations,nstations);
+	double radius = 1;
+	for (int i=0; i<nstations; i++)
+		radius = fmax(radius,dist2(&stations[i],&centre));
+	double extent = MULTILATERATION_GRID_EXTENT*radius;
+	double step = 2*extent/(MULTILATERATION_GRID_SIZE-1);
+
+	double xs[MULTILATERATION_GRID_SIZE];
+	double range[nstations][MULTILATERATION_GRID_SIZE];
+	double cost[MULTILATERATION_GRID_SIZE];
+	for (int i=0; i<MULTILATERATION_GRID_SIZE; i++)
+		xs[i] = centre.x - extent + i*step;
+
+	double best_cost = INFINITY;
+	best->x = centre.x;
+	best->y = centre.y;
+	for (int row=0; row<MULTILATERATION_GRID_SIZE; row++)
+	{
+		double y = centre.y - extent + row*step;
+		for (int s=0; s<nstations; s++)
+		{
+			double sx = stations[s].x;
+			double dysqr = (y - stations[s].y)*(y - stations[s].y);
+			double *r = range[s];
+			for (int i=0; i<MULTILATERATION_GRID_SIZE; i++)
+				r[i] = sqrt((xs[i]-sx)*(xs[i]-sx) + dysqr);
+		}
+		for (int i=0; i<MULTILATERATION_GRID_SIZE; i++)
+			cost[i] = 0;
+		for (int k=0; k<nmeasurements; k++)
+		{
+			double *ra = range[measurements[k].station1];
+			double *rb = range[measurements[k].station2];
+			double d = measurements[k].range_difference;
+			for (int i=0; i<MULTILATERATION_GRID_SIZE; i++)
+			{
+				double e = ra[i] - rb[i] - d;
+				cost[i] += e*e;
+			}
+		}
+		for (int i=0; i<MULTILATERATION_GRID_SIZE; i++)
+		{
+			if (cost[i] < best_cost)
+			{
+				best_cost = cost[i];
+				best->x = xs[i];
+				best->y = y;
+			}
+		}
+	}
+	dp(10,"grid search best (%lf,%lf) with %lf\n",best->x,best->y,best_cost);
+}
+
+/* the smaller over the larger eigenvalue of the symmetric 2x2 matrix {{a,b},{b,c}} */
+static double inverse_condition(double jtj[3])
+{
+	double half_trace = (jtj[0]+jtj[2])/2;
+	double det = jtj[0]*jtj[2] - jtj[1]*jtj[1];
+	double root = sqrt(fmax(half_trace*half_trace - det,0));
+	double largest = half_trace + root;
+	if (largest <= 0)
+		return 0;
+	return fmax(half_trace - root,0)/largest;
+}
+
+/* locate the point in the plane which best produces the range differences
+ * (metres, distance to station1 less distance to station2) between pairs of
+ * the nstations stations.  returns 0 if there are too few stations or pairs. */
+int multilaterate(point2d_t stations[], int nstations, range_difference_t measurements[], int nmeasurements, fix_t *fix)
+{
+	memset(fix,0,sizeof(fix_t));
+	if (nstations < 3 || nstations > MULTILATERATION_MAX_STATIONS || nmeasurements < 2)
+		return 0;
+
+	double best_cost = INFINITY;
+	int best_converged = 0;
+	double delta[nstations];
+	point2d_t candidates[2];
+	int ncandidates = 0;
+	if (reference_range_differences(nstations,measurements,nmeasurements,delta))
+		ncandidates = closed_form(stations,nstations,delta,candidates);
+	point2d_t centre = centroid(stations,nstations);
+	for (int i=0; i<ncandidates; i++)
+	{
+		double cost;
+		point2d_t p = candidates[i];
+		dp(10,"closed form candidate %d at (%lf,%lf)\n",i,p.x,p.y);
+		int converged = refine(stations,measurements,nmeasurements,&p,&cost,&fix->iterations);
+		if (better_fix(&p,cost,&fix->location,best_cost,&centre,nmeasurements))
+		{
+			best_cost = cost;
+			best_converged = converged;
+			fix->location = p;
+		}
+	}
+
+	double f[nmeasurements];
+	double jacobian[nmeasurements][2];
+	double jtj[3] = {0,0,0}, jtf[2];
+	if (ncandidates)
+	{
+		residuals(stations,measurements,nmeasurements,&fix->location,f,jacobian);
+		normal_matrix(jacobian,f,nmeasurements,jtj,jtf);
+	}
+	if (!ncandidates || !best_converged || inverse_condition(jtj) < MULTILATERATION_MIN_CONDITION)
+	{
+		double cost;
+		point2d_t p;
+		grid_search(stations,nstations,measurements,nmeasurements,&p);
+		refine(stations,measurements,nmeasurements,&p,&cost,&fix->iterations);
+		fix->searched_grid = 1;
+		if (better_fix(&p,cost,&fix->location,best_cost,&centre,nmeasurements))
+		{
+			best_cost = cost;
+			fix->location = p;
+		}
+		residuals(stations,measurements,nmeasurements,&fix->location,f,jacobian);
+		normal_matrix(jacobian,f,nmeasurements,jtj,jtf);
+	}
+
+	/* covariance = sigma^2 (J'J)^-1, with sigma taken from the residuals
+	 * when there are more pairs than unknowns, but never below the
+	 * resolution of the TDOAs themselves */
+	double sigmasqr = square_d(MULTILATERATION_RANGE_SIGMA);
+	if (nmeasurements > 2)
+		sigmasqr = fmax(sigmasqr,best_cost/(nmeasurements-2));
+	double det = jtj[0]*jtj[2] - jtj[1]*jtj[1];
+	if (det > 0)
+	{
+		fix->covariance[0][0] = sigmasqr*jtj[2]/det;
+		fix->covariance[0][1] = fix->covariance[1][0] = -sigmasqr*jtj[1]/det;
+		fix->covariance[1][1] = sigmasqr*jtj[0]/det;
+		fix->uncertainty = sqrt(fix->covariance[0][0] + fix->covariance[1][1]);
+	}
+	else
+	{
+		fix->covariance[0][0] = fix->covariance[1][1] = INFINITY;
+		fix->uncertainty = INFINITY;
+	}
+	fix->residual = sqrt(best_cost/nmeasurements);
+	dp(5,"fix at (%lf,%lf) uncertainty %lf residual %lf after %d iterations%s\n",fix->location.x,fix->location.y,fix->uncertainty,fix->residual,fix->iterations,fix->searched_grid ? " and grid search" : "");
+	return 1;
+}
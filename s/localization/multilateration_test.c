@@ -0,0 +1,234 @@
+#include "i.h"
+
+/* globals of localize.c, which is not in the library */
+int NUM_STATIONS;
+int graphing;
+
+#define TEST_SAMPLING_RATE	16000
+
+/* the range differences a sound from source gives between every pair of stations */
+static int exact_measurements(point2d_t stations[], int nstations, point2d_t source, range_difference_t measurements[])
+{
+	int n = 0;
+	for (int a=0; a<nstations; a++)
+	for (int b=a+1; b<nstations; b++)
+	{
+		measurements[n].station1 = a;
+		measurements[n].station2 = b;
+		measurements[n].range_difference = dist2(&source,&stations[a]) - dist2(&source,&stations[b]);
+		n++;
+	}
+	return n;
+}
+
+static point2d_t centroid(point2d_t stations[], int nstations)
+{
+	point2d_t centre = {0,0};
+	for (int i=0; i<nstations; i++)
+	{
+		centre.x += stations[i].x/nstations;
+		centre.y += stations[i].y/nstations;
+	}
+	return centre;
+}
+
+static void test_exact(void)
+{
+	point2d_t stations[] = {{0,0},{300,0},{300,300},{0,300},{150,-100}};
+	point2d_t sources[] = {{100,120},{290,20},{-150,400},{150,150},{700,-300}};
+	/* away from three stations a second point fits the range differences as well */
+	int ambiguous_with_three[] = {0,0,0,0,1};
+	range_difference_t measurements[10];
+	for (int nstations=3; nstations<=5; nstations++)
+	{
+		for (int s=0; s<(int)(sizeof sources/sizeof sources[0]); s++)
+		{
+			fix_t fix;
+			int n = exact_measurements(stations,nstations,sources[s],measurements);
+			assert(multilaterate(stations,nstations,measurements,n,&fix));
+			dp(5,"%d stations, source (%g,%g) fix (%g,%g) grid %d\n",nstations,sources[s].x,sources[s].y,fix.location.x,fix.location.y,fix.searched_grid);
+			assert(fix.residual < 1e-3);
+			assert(isfinite(fix.uncertainty));
+			if (nstations == 3 && ambiguous_with_three[s])
+			{
+				/* and the one nearer the stations is taken */
+				point2d_t centre = centroid(stations,nstations);
+				assert(dist2(&fix.location,&centre) < dist2(&sources[s],&centre));
+			}
+			else
+				assert(dist2(&fix.location,&sources[s]) < 1e-3);
+		}
+	}
+	dp(0,"exact range differences OK\n");
+}
+
+/* three stations need only two of their pairs */
+static void test_two_measurements(void)
+{
+	point2d_t stations[] = {{0,0},{300,0},{0,300}};
+	point2d_t source = {80,110};
+	range_difference_t measurements[3];
+	exact_measurements(stations,3,source,measurements);
+	/* pairs 0-1 and 1-2, leaving out 0-2 */
+	measurements[1] = measurements[2];
+	fix_t fix;
+	assert(multilaterate(stations,3,measurements,2,&fix));
+	assert(dist2(&fix.location,&source) < 1e-3);
+	dp(0,"two measurements OK\n");
+}
+
+static void test_too_few(void)
+{
+	point2d_t stations[] = {{0,0},{300,0},{0,300}};
+	point2d_t source = {80,110};
+	range_difference_t measurements[3];
+	exact_measurements(stations,3,source,measurements);
+	fix_t fix;
+	assert(!multilaterate(stations,2,measurements,1,&fix));
+	assert(!multilaterate(stations,3,measurements,1,&fix));
+	assert(!multilaterate(stations,3,measurements,0,&fix));
+	dp(0,"too few stations or measurements OK\n");
+}
+
+/* with the stations in a line the closed form has nothing to go on, and the
+ * source can only be placed up to its reflection in the line */
+static void test_collinear(void)
+{
+	point2d_t stations[] = {{0,0},{200,0},{500,0},{650,0}};
+	point2d_t sources[] = {{100,150},{420,-60},{-200,90}};
+	range_difference_t measurements[6];
+	for (int nstations=3; nstations<=4; nstations++)
+	{
+		for (int s=0; s<(int)(sizeof sources/sizeof sources[0]); s++)
+		{
+			fix_t fix;
+			int n = exact_measurements(stations,nstations,sources[s],measurements);
+			assert(multilaterate(stations,nstations,measurements,n,&fix));
+			dp(5,"collinear %d stations, source (%g,%g) fix (%g,%g)\n",nstations,sources[s].x,sources[s].y,fix.location.x,fix.location.y);
+			assert(fix.searched_grid);
+			assert(fix.residual < 1e-3);
+			assert(fabs(fix.location.x - sources[s].x) < 0.01);
+			assert(fabs(fabs(fix.location.y) - fabs(sources[s].y)) < 0.01);
+		}
+	}
+	dp(0,"collinear stations OK\n");
+}
+
+/* the grid is searched when the closed form can't be used, here because the
+ * pairs don't connect all the stations */
+static void test_grid_fallback(void)
+{
+	point2d_t stations[] = {{0,0},{300,0},{300,300},{0,300}};
+	point2d_t source = {120,200};
+	range_difference_t measurements[6];
+	fix_t fix;
+
+	/* 0-1, 0-2 and 2-3 connect the stations; 0-1 and 2-3 alone don't */
+	exact_measurements(stations,4,source,measurements);
+	range_difference_t disconnected[2] = {measurements[0],measurements[5]};
+	assert(multilaterate(stations,4,disconnected,2,&fix));
+	assert(fix.searched_grid);
+	assert(fix.residual < 1e-3);
+
+	/* a wildly wrong pair still gives the least squares fix, not a failure */
+	int n = exact_measurements(stations,4,source,measurements);
+	measurements[2].range_difference += 250;
+	assert(multilaterate(stations,4,measurements,n,&fix));
+	assert(isfinite(fix.location.x) && isfinite(fix.location.y));
+	assert(fix.residual > 1);
+	dp(0,"grid search fallback OK\n");
+}
+
+static void parse_position(const char *text, earthpos_t *position)
+{
+	char lat_char, lng_char;
+	double lat_deg, lat_min, lng_deg, lng_min;
+	if (sscanf(text,"%c%lf %lf %c%lf %lf",&lat_char,&lat_deg,&lat_min,&lng_char,&lng_deg,&lng_min) != 6)
+		die("Can't parse position '%s'",text);
+	set_earthpos(position,geochar_sgn(lat_char)*lat_deg,lat_min,geochar_sgn(lng_char)*lng_deg,lng_min);
+}
+
+/* the playbacks listed in localization/test_data, placed from the exact TDOAs
+ * their positions give at the stations of its config, as localize does */
+static void test_playbacks(const char *list_file)
+{
+	earthpos_t stations[MAX_STATIONS];
+	for (NUM_STATIONS=0; NUM_STATIONS<MAX_STATIONS; NUM_STATIONS++)
+	{
+		char *key = g_strdup_printf("station%d_position",NUM_STATIONS);
+		char *position = param_get_string_n(LOCALIZATION_PARAM_GROUP,key);
+		g_free(key);
+		if (!position)
+			break;
+		parse_position(position,&stations[NUM_STATIONS]);
+		g_free(position);
+	}
+	assert(NUM_STATIONS >= 3);
+	/* station 0 is the origin of the plane, as in locate_point */
+	point2d_t planepos[NUM_STATIONS];
+	planepos[0].x = planepos[0].y = 0;
+	for (int i=1; i<NUM_STATIONS; i++)
+		earth_to_relative_2d_position(&planepos[i],&stations[i],&stations[0]);
+	int npairs = 0;
+	station_pair_t pairs[NUM_STATIONS*(NUM_STATIONS-1)/2];
+	for (int a=0; a<NUM_STATIONS; a++)
+	for (int b=a+1; b<NUM_STATIONS; b++)
+	{
+		pairs[npairs].station1 = a;
+		pairs[npairs].station2 = b;
+		npairs++;
+	}
+
+	FILE *fp = fopen(list_file,"r");
+	if (!fp)
+		die("Can't open %s",list_file);
+	char line[256];
+	int nplaybacks = 0;
+	while (fgets(line,sizeof line,fp))
+	{
+		int number;
+		double lat_deg, lat_min, lng_deg, lng_min;
+		if (sscanf(line,"#@playback%d = %lf %lf, %lf %lf",&number,&lat_deg,&lat_min,&lng_deg,&lng_min) != 5)
+			continue;
+		earthpos_t playback, location;
+		set_earthpos(&playback,lat_deg,lat_min,lng_deg,lng_min);
+		point2d_t source;
+		earth_to_relative_2d_position(&source,&playback,&stations[0]);
+		double tdoas[npairs];
+		for (int p=0; p<npairs; p++)
+			tdoas[p] = (dist2(&source,&planepos[pairs[p].station1]) - dist2(&source,&planepos[pairs[p].station2]))/SPEED_OF_SOUND;
+		double heuristics[NUM_LOCATION_HEUR];
+		locate_point(pairs,tdoas,npairs,stations,&location,heuristics);
+		double error = earth_distance(&location,&playback);
+		dp(5,"playback%02d error %g metres\n",number,error);
+		assert(heuristics[LOCATION_CONSISTENCY_HEUR] < 1e-3);
+		if (error >= 0.1)
+		{
+			/* three stations can leave two points fitting exactly, see test_exact */
+			assert(NUM_STATIONS == 3);
+			point2d_t found;
+			earth_to_relative_2d_position(&found,&location,&stations[0]);
+			point2d_t centre = centroid(planepos,NUM_STATIONS);
+			assert(dist2(&found,&centre) < dist2(&source,&centre));
+			dp(5,"playback%02d is placed at the other fit, %g metres away\n",number,error);
+		}
+		nplaybacks++;
+	}
+	fclose(fp);
+	assert(nplaybacks > 0);
+	dp(0,"%d playbacks at %d stations OK\n",nplaybacks,NUM_STATIONS);
+}
+
+int main(int argc, char **argv)
+{
+	int optind = testing_initialize(&argc,&argv,"");
+	SAMPLING_RATE = TEST_SAMPLING_RATE;
+	test_exact();
+	test_two_measurements();
+	test_too_few();
+	test_collinear();
+	test_grid_fallback();
+	for (int i=optind; i<argc; i++)
+		test_playbacks(argv[i]);
+	return 0;
+}
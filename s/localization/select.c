@@ -211,30 +211,28 @@ double value_position(GPtrArray *array, int heur_id, int query_type, double thre
 	return elem[heur_id];
 }
 
-/* the sort function needs to know which heuristic we are sorting over */
-int static_sort_by_heuristic_heur_id;
-int cmp_heuristic(const void *p1, const void *p2)
+/* the sort function is told which heuristic we are sorting over */
+int cmp_heuristic(const void *p1, const void *p2, void *heur_id)
 {
 /* without the hack, we'd have one of these for each structure, and do
    something like
   
   	channel_t *chan1 = *((channel_t **)p1);
 	channel_t *chan2 = *((channel_t **)p2);
-	double heur1 = chan1->heuristics[static_sort_channels_heur_id];
-	double heur2 = chan2->heuristics[static_sort_channels_heur_id];
+	double heur1 = chan1->heuristics[heur_id];
+	double heur2 = chan2->heuristics[heur_id];
    
   instead we just go:
 */
-	double heur1 = (*((double **)p1))[static_sort_by_heuristic_heur_id];
-	double heur2 = (*((double **)p2))[static_sort_by_heuristic_heur_id];
+	double heur1 = (*((double **)p1))[*(int *)heur_id];
+	double heur2 = (*((double **)p2))[*(int *)heur_id];
 	if (heur1 == heur2) return 0;
 	return (heur1 > heur2) ? 1:-1;
 }
 /* used to be called sort_channels, since had to have one for each type */
 void sort_by_heuristic(GPtrArray *array, int heur_id)
 {
-	static_sort_by_heuristic_heur_id = heur_id;
-	g_ptr_array_sort(array,cmp_heuristic);
+	g_ptr_array_sort_with_data(array,cmp_heuristic,&heur_id);
 }
 double value(GPtrArray *array, int heur_id, int query_type, double argument)
 {
@@ -277,9 +275,9 @@ select_single(GPtrArray *array, int  heur_id, int query_type, double argument)
 	}
 }
 
-void select_main(GPtrArray *array[NUM_STATIONS], int  heur_id, int query_type, double argument)
+void select_main(GPtrArray *array[], int narrays, int  heur_id, int query_type, double argument)
 {
-	for (int i=0; i<NUM_STATIONS; i++)
+	for (int i=0; i<narrays; i++)
 	{
 		select_single(array[i],heur_id,query_type,argument);
 	}
@@ -304,9 +302,9 @@ int drop_single(GPtrArray *array, int  heur_id, int query_type, double argument)
 	default: die("Unsupported query_type for drop");
 	}
 }
-void drop(GPtrArray *array[NUM_STATIONS], int heur_id, int query_type, double argument)
+void drop(GPtrArray *array[], int narrays, int heur_id, int query_type, double argument)
 {
-	for (int i=0; i<NUM_STATIONS; i++)
+	for (int i=0; i<narrays; i++)
 	{
 		drop_single(array[i],heur_id,query_type,argument);
 	}
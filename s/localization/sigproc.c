@@ -1,44 +1,368 @@
-/* signal processing functions.  my own filtering functions have been replaced
- * by calls to the external sox program. :(  */
+/* signal processing functions.
+ *
+ * filtering is done in process and in place, so many regions can be filtered
+ * at once by different threads.  band limits use a windowed-sinc fir filter,
+ * applied by fft overlap-save, and the other filters are butterworth biquad
+ * cascades run forwards then backwards.  both have zero phase, so time
+ * differences between channels are not disturbed. */
 
 #include "i.h"
 
+/* fftw's planner is not thread-safe but executing a plan is, so plans are
+ * made under a lock and shared.  they are made on fftw_malloc'd arrays so
+ * they can be run on any out-of-place fftw_malloc'd arrays with
+ * fftw_execute_dft_r2c and fftw_execute_dft_c2r.  region lengths vary, so
+ * the least recently used plans not in use are replaced. */
+#define MAX_CACHED_PLANS	32
+static struct
+{
+	pthread_mutex_t lock;
+	unsigned long uses;
+	fft_plans_t plans[MAX_CACHED_PLANS];
+} plan_cache = {PTHREAD_MUTEX_INITIALIZER};
+
+/* returns plans for transforms of length n, to be released when finished with */
+fft_plans_t *acquire_fft_plans(int n)
+{
+	pthread_mutex_lock(&plan_cache.lock);
+	fft_plans_t *p = NULL;
+	for (int i=0; i<MAX_CACHED_PLANS && !p; i++)
+		if (plan_cache.plans[i].n == n)
+			p = &plan_cache.plans[i];
+	if (!p)
+	{
+		for (int i=0; i<MAX_CACHED_PLANS; i++)
+		{
+			fft_plans_t *q = &plan_cache.plans[i];
+			if (!q->users && (!p || q->last_used < p->last_used))
+				p = q;
+		}
+		if (!p)
+			die("all %d cached fft plans are in use\n",MAX_CACHED_PLANS);
+		if (p->n)
+		{
+			fftw_destroy_plan(p->forward);
+			fftw_destroy_plan(p->inverse);
+		}
+		double *real = fftw_malloc(sizeof(double)*n);
+		fftw_complex *spectrum = fftw_malloc(sizeof(fftw_complex)*(n/2+1));
+		p->n = n;
+		p->forward = fftw_plan_dft_r2c_1d(n,real,spectrum,FFTW_ESTIMATE);
+		p->inverse = fftw_plan_dft_c2r_1d(n,spectrum,real,FFTW_ESTIMATE);
+		fftw_free(real);
+		fftw_free(spectrum);
+	}
+	p->users++;
+	p->last_used = ++plan_cache.uses;
+	pthread_mutex_unlock(&plan_cache.lock);
+	return p;
+}
+
+void release_fft_plans(fft_plans_t *p)
+{
+	pthread_mutex_lock(&plan_cache.lock);
+	p->users--;
+	pthread_mutex_unlock(&plan_cache.lock);
+}
+
+/*===============================================================
+ * biquad cascades
+ *==============================================================*/
+
+/* one section of a butterworth filter, designed by the bilinear transform */
+static biquad_t butterworth_section(double freq, double q, int highpass)
+{
+	double w0 = 2*PI*freq/SAMPLING_RATE;
+	double alpha = sin(w0)/(2*q);
+	double cosw0 = cos(w0);
+	double a0 = 1 + alpha;
+	biquad_t b;
+	if (highpass)
+	{
+		b.b0 = (1 + cosw0)/2/a0;
+		b.b1 = -(1 + cosw0)/a0;
+	}
+	else
+	{
+		b.b0 = (1 - cosw0)/2/a0;
+		b.b1 = (1 - cosw0)/a0;
+	}
+	b.b2 = b.b0;
+	b.a1 = -2*cosw0/a0;
+	b.a2 = (1 - alpha)/a0;
+	return b;
+}
+
+/* appends the sections of an even order butterworth low or high pass filter */
+static void add_butterworth(biquad_cascade_t *cascade, double freq, int order, int highpass)
+{
+	assert(order > 0 && order % 2 == 0);
+	assert(freq > 0 && freq < SAMPLING_RATE/2);
+	for (int k=0; k<order/2; k++)
+	{
+		assert(cascade->nstages < MAX_BIQUADS);
+		double q = 1/(2*cos((2*k+1)*PI/(2*order)));
+		cascade->stage[cascade->nstages++] = butterworth_section(freq,q,highpass);
+	}
+	/* transients have died away after a few cycles of the lowest corner frequency */
+	index_t settle = 3*SAMPLING_RATE/freq;
+	if (settle > cascade->settle)
+		cascade->settle = settle;
+}
+
+void butterworth_lowpass(biquad_cascade_t *cascade, double highfreq, int order)
+{
+	memset(cascade,0,sizeof(biquad_cascade_t));
+	add_butterworth(cascade,highfreq,order,0);
+}
+
+void butterworth_highpass(biquad_cascade_t *cascade, double lowfreq, int order)
+{
+	memset(cascade,0,sizeof(biquad_cascade_t));
+	add_butterworth(cascade,lowfreq,order,1);
+}
+
+void butterworth_bandpass(biquad_cascade_t *cascade, double lowfreq, double highfreq, int order)
+{
+	memset(cascade,0,sizeof(biquad_cascade_t));
+	add_butterworth(cascade,lowfreq,order,1);
+	add_butterworth(cascade,highfreq,order,0);
+}
+
+static void biquad_run(const biquad_t *b, double *x, index_t n, int step)
+{
+	double z1 = 0, z2 = 0;
+	for (index_t i=0; i<n; i++, x+=step)
+	{
+		double in = *x;
+		double out = b->b0*in + z1;
+		z1 = b->b1*in - b->a1*out + z2;
+		z2 = b->b2*in - b->a2*out;
+		*x = out;
+	}
+}
+
+/* runs one sample through a cascade, keeping its state in z between calls so a
+ * signal can be filtered as it streams in */
+double biquad_cascade_step(const biquad_cascade_t *cascade, double z[][2], double x)
+{
+	for (int s=0; s<cascade->nstages; s++)
+	{
+		const biquad_t *b = &cascade->stage[s];
+		double y = b->b0*x + z[s][0];
+		z[s][0] = b->b1*x - b->a1*y + z[s][1];
+		z[s][1] = b->b2*x - b->a2*y;
+		x = y;
+	}
+	return x;
+}
+
+/* the delay of a cascade at low frequencies, in samples */
+double biquad_cascade_delay(const biquad_cascade_t *cascade)
+{
+	double delay = 0;
+	for (int s=0; s<cascade->nstages; s++)
+	{
+		const biquad_t *b = &cascade->stage[s];
+		delay += (b->b1 + 2*b->b2)/(b->b0 + b->b1 + b->b2) - (b->a1 + 2*b->a2)/(1 + b->a1 + b->a2);
+	}
+	return delay;
+}
+
+/* filters in place with zero phase: the cascade is run forwards and then
+ * backwards over the waveform, extended at each end by its reflection
+ * about the end sample so the filter has settled before the real samples. */
+void biquad_filtfilt(double *x, index_t nsamples, const biquad_cascade_t *cascade)
+{
+	if (nsamples < 2)
+		return;
+	index_t pad = MIN(nsamples-1,cascade->settle);
+	double *ext = (double *)salloc(sizeof(double)*(nsamples+2*pad));
+	for (index_t i=0; i<pad; i++)
+	{
+		ext[pad-1-i] = 2*x[0] - x[i+1];
+		ext[pad+nsamples+i] = 2*x[nsamples-1] - x[nsamples-2-i];
+	}
+	memcpy(ext+pad,x,sizeof(double)*nsamples);
+	index_t n = nsamples + 2*pad;
+	for (int s=0; s<cascade->nstages; s++)
+		biquad_run(&cascade->stage[s],ext,n,1);
+	for (int s=0; s<cascade->nstages; s++)
+		biquad_run(&cascade->stage[s],ext+n-1,n,-1);
+	memcpy(x,ext+pad,sizeof(double)*nsamples);
+	free(ext);
+}
+
+/*===============================================================
+ * fir filters
+ *==============================================================*/
+
+/* zeroth order modified bessel function of the first kind, for the kaiser window */
+static double bessel_i0(double x)
+{
+	double sum = 1, term = 1;
+	for (int k=1; k<50 && term > 1e-12*sum; k++)
+	{
+		term *= (x/(2*k))*(x/(2*k));
+		sum += term;
+	}
+	return sum;
+}
+
+static double sinc(double x)
+{
+	return x == 0 ? 1 : sin(PI*x)/(PI*x);
+}
+
+/* designs a kaiser windowed-sinc band-pass filter of ntaps (odd) taps.
+ * lowfreq <= 0 gives a low-pass filter, highfreq >= SAMPLING_RATE/2 a high-pass one */
+void fir_bandpass(double *taps, int ntaps, double lowfreq, double highfreq, double kaiser_beta)
+{
+	/* the window is defined by the distance from the centre tap, so needs one each side */
+	assert(ntaps >= 3 && ntaps % 2 == 1);
+	int half = ntaps/2;
+	double low = MAX(lowfreq,0)*2/SAMPLING_RATE;
+	double high = MIN(highfreq,SAMPLING_RATE/2)*2/SAMPLING_RATE;
+	for (int k=0; k<ntaps; k++)
+	{
+		double t = k - half;
+		double r = t/half;
+		double window = bessel_i0(kaiser_beta*sqrt(1 - r*r))/bessel_i0(kaiser_beta);
+		taps[k] = window*(high*sinc(high*t) - low*sinc(low*t));
+	}
+}
+
+/* applies a symmetric fir filter of ntaps (odd) taps to x in place, delayed by
+ * half its length so the result has zero phase.  samples beyond the ends are
+ * taken as zero.  long filters are applied by fft overlap-save. */
+void fir_filter(double *x, index_t nsamples, const double *taps, int ntaps)
+{
+	assert(ntaps % 2 == 1);
+	int half = ntaps/2;
+	if ((double)nsamples*ntaps < FIR_DIRECT_LIMIT)
+	{
+		double *in = (double *)salloc(sizeof(double)*(nsamples+2*half));
+		memset(in,0,sizeof(double)*(nsamples+2*half));
+		memcpy(in+half,x,sizeof(double)*nsamples);
+		for (index_t i=0; i<nsamples; i++)
+		{
+			double sum = 0;
+			for (int k=0; k<ntaps; k++)
+				sum += taps[k]*in[i+2*half-k];
+			x[i] = sum;
+		}
+		free(in);
+		return;
+	}
+
+	/* each block of the transform gives block causal outputs, following ntaps-1 samples of history */
+	int fft_size = 1024;
+	while (fft_size < 4*ntaps)
+		fft_size *= 2;
+	int block = fft_size - ntaps + 1;
+	int nbins = fft_size/2 + 1;
+	double *in = fftw_malloc(sizeof(double)*fft_size);
+	double *out = fftw_malloc(sizeof(double)*fft_size);
+	fftw_complex *spectrum = fftw_malloc(sizeof(fftw_complex)*nbins);
+	fftw_complex *response = fftw_malloc(sizeof(fftw_complex)*nbins);
+	fft_plans_t *plans = acquire_fft_plans(fft_size);
+
+	memset(in,0,sizeof(double)*fft_size);
+	memcpy(in,taps,sizeof(double)*ntaps);
+	fftw_execute_dft_r2c(plans->forward,in,response);
+	for (int k=0; k<nbins; k++)
+		response[k] /= fft_size;
+
+	/* output y[i] is the causal output at i+half, so block j writes x[j*block-half...] in place;
+	 * the input it overwrites is already in the history at the start of in[] */
+	memset(in,0,sizeof(double)*fft_size);
+	for (index_t start=0; start < nsamples + half; start += block)
+	{
+		memmove(in,in+block,sizeof(double)*(ntaps-1));
+		index_t n = start < nsamples ? MIN(block,nsamples-start) : 0;
+		memcpy(in+ntaps-1,x+start,sizeof(double)*n);
+		memset(in+ntaps-1+n,0,sizeof(double)*(block-n));
+		fftw_execute_dft_r2c(plans->forward,in,spectrum);
+		for (int k=0; k<nbins; k++)
+			spectrum[k] *= response[k];
+		fftw_execute_dft_c2r(plans->inverse,spectrum,out);
+		for (int i=0; i<block; i++)
+		{
+			index_t j = start + i - half;
+			if (start + i >= half && j < nsamples)
+				x[j] = out[ntaps-1+i];
+		}
+	}
+
+	release_fft_plans(plans);
+	fftw_free(in);
+	fftw_free(out);
+	fftw_free(spectrum);
+	fftw_free(response);
+}
+
+/*===============================================================
+ * the filters used by localization
+ *==============================================================*/
+
+/* band-pass filters x in place, lowfreq of 0 gives a low-pass filter */
+void filter_in_place(double *x, index_t nsamples, double lowfreq, double highfreq)
+{
+	double taps[FIR_TAPS];
+	fir_bandpass(taps,FIR_TAPS,lowfreq,highfreq,FIR_KAISER_BETA);
+	fir_filter(x,nsamples,taps,FIR_TAPS);
+}
+
 double* filter(double *in, index_t nsamples, double lowfreq, double highfreq)
 {
-	write_waveform("/tmp/nyinput.wav",in,nsamples,UNCOMPRESSED);
-	char line[MAX_PATH_LEN];
-	sprintf(line,"sox /tmp/nyinput.wav /tmp/nyoutput.wav filter %.0lf-%.0lf",lowfreq,highfreq);
-	if (system(line) == -1) die("Filtering failed. Exiting...\n");
-	double *filtered;
-	index_t nsamples2 = read_whole_waveform(&filtered,"/tmp/nyoutput.wav",0,UNCOMPRESSED);
-	assert(nsamples == nsamples2);
+	double *filtered = (double *)sdup(in,sizeof(double)*nsamples);
+	filter_in_place(filtered,nsamples,lowfreq,highfreq);
 	return filtered;
 }
 
 double* bandpass_filter(double *in, index_t nsamples, double centre, double width)
 {
-	write_waveform("/tmp/nyinput.wav",in,nsamples,UNCOMPRESSED);
-	char line[MAX_PATH_LEN];
-	sprintf(line,"sox /tmp/nyinput.wav /tmp/nyoutput.wav band %lf %lfh",centre,width);
-	if (system(line) == -1) die("Filtering failed. Exiting...\n");
-	double *filtered;
-	index_t nsamples2 = read_whole_waveform(&filtered,"/tmp/nyoutput.wav",0,UNCOMPRESSED);
-	assert(nsamples == nsamples2);
+	biquad_cascade_t cascade;
+	butterworth_bandpass(&cascade,centre-width/2,centre+width/2,2);
+	double *filtered = (double *)sdup(in,sizeof(double)*nsamples);
+	biquad_filtfilt(filtered,nsamples,&cascade);
 	return filtered;
 }
 
 double* highpass_filter(double *in, index_t nsamples, double lowfreq)
 {
-	write_waveform("/tmp/nyinput.wav",in,nsamples,UNCOMPRESSED);
-	char line[MAX_PATH_LEN];
-	sprintf(line,"sox /tmp/nyinput.wav /tmp/nyoutput.wav highpass %lf",lowfreq);
-	if (system(line) == -1) die("Filtering failed. Exiting...\n");
-	double *filtered;
-	index_t nsamples2 = read_whole_waveform(&filtered,"/tmp/nyoutput.wav",0,UNCOMPRESSED);
-	assert(nsamples == nsamples2);
+	biquad_cascade_t cascade;
+	butterworth_highpass(&cascade,lowfreq,2);
+	double *filtered = (double *)sdup(in,sizeof(double)*nsamples);
+	biquad_filtfilt(filtered,nsamples,&cascade);
 	return filtered;
 }
 
+/* estimates the signal to noise ratio of a filtered waveform in dB, as the energy of
+ * its loudest block of SNR_BLOCK_SECONDS over that of its median block.  a call is
+ * short compared to a region, so most blocks hold only noise. */
+double estimate_snr(double *x, index_t nsamples)
+{
+	index_t block = MAX(1,SNR_BLOCK_SECONDS*SAMPLING_RATE);
+	int nblocks = nsamples/block;
+	if (nblocks < 2)
+		return 0;
+	double energy[nblocks];
+	for (int b=0; b<nblocks; b++)
+	{
+		double sum = 0;
+		for (index_t i=b*block; i<(b+1)*block; i++)
+			sum += x[i]*x[i];
+		energy[b] = sum;
+	}
+	qsort(energy,nblocks,sizeof(double),cmp_double);
+	double noise = median(energy,nblocks);
+	double signal = energy[nblocks-1];
+	if (signal <= 0)
+		return 0;
+	return 10*log10(signal/MAX(noise,signal*1e-12));
+}
+
 /* this was just used when testing some of the filters. inefficiently and badly coded.
  * it plots the powerspectrum of the input waveform */
 void plotpowerspectrum(double *inorig, index_t nsamples,int fft_size)
@@ -0,0 +1,151 @@
+#include "i.h"
+
+/* globals of localize.c, which is not in the library */
+int NUM_STATIONS;
+int graphing;
+
+#define TEST_SAMPLING_RATE	16000
+
+static double *noise(index_t n, unsigned seed)
+{
+	double *x = (double *)salloc(sizeof(double)*n);
+	srand(seed);
+	for (index_t i=0; i<n; i++)
+		x[i] = rand()/(double)RAND_MAX - 0.5;
+	return x;
+}
+
+/* the textbook convolution, which fir_filter must match however it applies the filter */
+static double fir_reference_error(const double *x, const double *y, index_t n, const double *taps, int ntaps)
+{
+	double error = 0;
+	for (index_t i=0; i<n; i++)
+	{
+		double sum = 0;
+		for (int k=0; k<ntaps; k++)
+		{
+			long j = (long)i + ntaps/2 - k;
+			if (j >= 0 && j < n)
+				sum += taps[k]*x[j];
+		}
+		error = MAX(error,fabs(sum - y[i]));
+	}
+	return error;
+}
+
+/* the magnitude of the fir filter's response at freq */
+static double fir_gain(const double *taps, int ntaps, double freq)
+{
+	double complex h = 0;
+	for (int k=0; k<ntaps; k++)
+		h += taps[k]*cexp(-2*PI*I*freq*k/SAMPLING_RATE);
+	return cabs(h);
+}
+
+/* the magnitude of the cascade's response at freq */
+static double cascade_gain(const biquad_cascade_t *cascade, double freq)
+{
+	double complex z = cexp(-2*PI*I*freq/SAMPLING_RATE);
+	double complex h = 1;
+	for (int s=0; s<cascade->nstages; s++)
+	{
+		const biquad_t *b = &cascade->stage[s];
+		h *= (b->b0 + b->b1*z + b->b2*z*z)/(1 + b->a1*z + b->a2*z*z);
+	}
+	return cabs(h);
+}
+
+static void test_fir_bandpass(void)
+{
+	double taps[FIR_TAPS];
+	fir_bandpass(taps,FIR_TAPS,3000,5000,FIR_KAISER_BETA);
+	for (int k=0; k<FIR_TAPS/2; k++)
+		assert(taps[k] == taps[FIR_TAPS-1-k]);
+	assert(fabs(fir_gain(taps,FIR_TAPS,4000) - 1) < 1e-3);
+	assert(fir_gain(taps,FIR_TAPS,1000) < 1e-3);
+	assert(fir_gain(taps,FIR_TAPS,7000) < 1e-3);
+	/* the shortest allowed filter still has a finite window */
+	double short_taps[3];
+	fir_bandpass(short_taps,3,0,4000,FIR_KAISER_BETA);
+	for (int k=0; k<3; k++)
+		assert(isfinite(short_taps[k]));
+	dp(0,"fir_bandpass OK\n");
+}
+
+/* short signals are filtered directly and long ones by overlap-save */
+static void test_fir_filter(void)
+{
+	double taps[FIR_TAPS];
+	fir_bandpass(taps,FIR_TAPS,3000,5000,FIR_KAISER_BETA);
+	index_t lengths[] = {1500, 40000, 40000 + FIR_TAPS/2};
+	for (int l=0; l<(int)(sizeof lengths/sizeof lengths[0]); l++)
+	{
+		index_t n = lengths[l];
+		dp(5,"n=%d direct=%d\n",(int)n,(double)n*FIR_TAPS < FIR_DIRECT_LIMIT);
+		double *x = noise(n,l + 1);
+		double *y = (double *)sdup(x,sizeof(double)*n);
+		fir_filter(y,n,taps,FIR_TAPS);
+		assert(fir_reference_error(x,y,n,taps,FIR_TAPS) < 1e-10);
+		free(x);
+		free(y);
+	}
+	dp(0,"fir_filter OK\n");
+}
+
+static void test_butterworth(void)
+{
+	biquad_cascade_t cascade;
+	for (int order=2; order<=8; order+=2)
+	{
+		butterworth_lowpass(&cascade,1000,order);
+		assert(cascade.nstages == order/2);
+		assert(fabs(cascade_gain(&cascade,0) - 1) < 1e-9);
+		assert(fabs(cascade_gain(&cascade,1000) - sqrt(0.5)) < 1e-9);
+		assert(cascade_gain(&cascade,4000) < pow(0.25,order));
+		butterworth_highpass(&cascade,1000,order);
+		assert(fabs(cascade_gain(&cascade,SAMPLING_RATE/2) - 1) < 1e-9);
+		assert(fabs(cascade_gain(&cascade,1000) - sqrt(0.5)) < 1e-9);
+		assert(cascade_gain(&cascade,250) < pow(0.25,order));
+	}
+	butterworth_bandpass(&cascade,2000,6000,4);
+	assert(cascade.nstages == 4);
+	assert(fabs(cascade_gain(&cascade,3500) - 1) < 0.01);
+	dp(0,"butterworth OK\n");
+}
+
+/* a pulse symmetric about its centre stays so after zero phase filtering,
+ * and a tone comes out in phase, scaled by the gain squared */
+static void test_biquad_filtfilt(void)
+{
+	biquad_cascade_t cascade;
+	butterworth_bandpass(&cascade,1000,3000,4);
+	index_t n = 8001;
+	long centre = n/2;
+	double *x = (double *)salloc(sizeof(double)*n);
+	for (index_t i=0; i<n; i++)
+		x[i] = exp(-square_d(((long)i - centre)/20.0))*cos(2*PI*2000*((long)i - centre)/SAMPLING_RATE);
+	biquad_filtfilt(x,n,&cascade);
+	for (long k=1; k<centre; k++)
+		assert(fabs(x[centre-k] - x[centre+k]) < 1e-9);
+	assert(fabs(x[centre]) > 0.1);
+
+	double f = 1700, gain = square_d(cascade_gain(&cascade,f));
+	for (index_t i=0; i<n; i++)
+		x[i] = sin(2*PI*f*i/SAMPLING_RATE + 0.3);
+	biquad_filtfilt(x,n,&cascade);
+	for (index_t i=cascade.settle; i<n-cascade.settle; i++)
+		assert(fabs(x[i] - gain*sin(2*PI*f*i/SAMPLING_RATE + 0.3)) < 1e-3);
+	free(x);
+	dp(0,"biquad_filtfilt OK\n");
+}
+
+int main(int argc, char **argv)
+{
+	testing_initialize(&argc,&argv,"");
+	SAMPLING_RATE = TEST_SAMPLING_RATE;
+	test_fir_bandpass();
+	test_fir_filter();
+	test_butterworth();
+	test_biquad_filtfilt();
+	return 0;
+}
@@ -2,40 +2,127 @@
 
 /* the crosspower spectrum is the fourier transform of the cross-correlation.
  * some equations: http://mathworld.wolfram.com/Cross-Correlation.html
- * so we just reverse one of the waveforms, take their fourier transforms,
- * and then multiply these fourier transforms together pointwise.  */
-fftw_complex *crosspower_spectrum(double *waveform1, double *waveform2, index_t nsamples)
+ * so we take the fourier transforms of the waveforms and multiply one by
+ * the complex conjugate of the other pointwise, conjugation in the
+ * frequency domain being time reversal in the time domain.
+ *
+ * all the pairs of channels in a region are correlated, so a gcc engine
+ * transforms each channel once and keeps its spectrum and auto-power.
+ * each pair then costs one inverse transform, whatever the weighting. */
+gcc_engine_t *gcc_engine_new(double **waveforms, int nchannels, index_t nsamples)
+{
+	gcc_engine_t *engine = salloc(sizeof(gcc_engine_t));
+	engine->nsamples = nsamples;
+	engine->nbins = nsamples/2+1;
+	engine->nchannels = nchannels;
+	engine->plans = acquire_fft_plans(nsamples);
+	engine->waveform = salloc(sizeof(double *)*nchannels);
+	engine->spectrum = salloc(sizeof(fftw_complex *)*nchannels);
+	engine->autopower = salloc(sizeof(double *)*nchannels);
+	double *in = fftw_malloc(sizeof(double)*nsamples);
+	for (int c=0; c<nchannels; c++)
+	{
+		engine->waveform[c] = waveforms[c];
+		engine->spectrum[c] = fftw_malloc(sizeof(fftw_complex)*engine->nbins);
+		engine->autopower[c] = salloc(sizeof(double)*engine->nbins);
+		memcpy(in,waveforms[c],sizeof(double)*nsamples);
+		fftw_execute_dft_r2c(engine->plans->forward,in,engine->spectrum[c]);
+		for (index_t i=0; i<engine->nbins; i++)
+			engine->autopower[c][i] = square_d(cabs(engine->spectrum[c][i]));
+	}
+	fftw_free(in);
+	return engine;
+}
+
+void gcc_engine_free(gcc_engine_t *engine)
 {
-	double *waveform2reversed = (double *)salloc(sizeof(double)*nsamples);
-	for (index_t i=0,j=nsamples-1; i<nsamples; i++,j--) {
-		waveform2reversed[i] = waveform2[j];
+	for (int c=0; c<engine->nchannels; c++)
+	{
+		fftw_free(engine->spectrum[c]);
+		free(engine->autopower[c]);
+	}
+	release_fft_plans(engine->plans);
+	free(engine->spectrum);
+	free(engine->autopower);
+	free(engine->waveform);
+	free(engine);
+}
+
+/* weights the crosspower spectrum of two channels, inverse transforms it,
+ * and leaves the magnitude of the correlation at lags lo...hi in result */
+static void spectral_correlation(gcc_engine_t *engine, int channel1, int channel2, int method, int lo, int hi, double *result)
+{
+	index_t nsamples = engine->nsamples;
+	index_t nbins = engine->nbins;
+	const fftw_complex *X1 = engine->spectrum[channel1];
+	const fftw_complex *X2 = engine->spectrum[channel2];
+	const double *G11 = engine->autopower[channel1];
+	const double *G22 = engine->autopower[channel2];
+	fftw_complex *crosspower = fftw_malloc(sizeof(fftw_complex)*nbins);
+	for (index_t i=0; i<nbins; i++) {
+		crosspower[i] = X1[i] * conj(X2[i]);
+	}
+
+	switch (method)
+	{
+		case GCC_PLAIN:
+			break;
+		case GCC_PHAT:
+			for (index_t i=0; i<nbins; i++) {
+				crosspower[i] = crosspower[i] / cabs(crosspower[i]); 
+			}
+			break;
+		case GCC_ROTH:
+			for (index_t i=0; i<nbins; i++) {
+				crosspower[i] = crosspower[i] / G11[i];
+			}
+			break;
+		case GCC_ROTH2:
+			for (index_t i=0; i<nbins; i++) {
+				crosspower[i] = crosspower[i] / G22[i];
+			}
+			break;
+		case GCC_SCOT:
+			for (index_t i=0; i<nbins; i++) {
+				crosspower[i] = crosspower[i] / sqrt(G11[i]*G22[i]);
+			}
+			break;
+		case GCC_ML:
+			for (index_t i=0; i<nbins; i++) {
+				double g12 = crosspower[i]/sqrt(G11[i]*G22[i]);
+				double g12sqr = square_d(cabs(g12));
+				crosspower[i] = (crosspower[i]*g12sqr)/((1-g12sqr)*cabs(crosspower[i]));
+			}
+			break;
 	}
-	
-	
-	fftw_complex *out1, *out2;
-	out1 = (fftw_complex *) salloc(sizeof(fftw_complex) * nsamples);
-	out2 = (fftw_complex *) salloc(sizeof(fftw_complex) * nsamples);
-
-	// take the DFT of both channels
-	fftw_plan plan1, plan2;
-	plan1 = fftw_plan_dft_r2c_1d(nsamples,waveform1,out1,FFTW_ESTIMATE);
-	plan2 = fftw_plan_dft_r2c_1d(nsamples,waveform2reversed,out2,FFTW_ESTIMATE);
-	fftw_execute(plan1);
-	fftw_execute(plan2);
-	fftw_destroy_plan(plan1);
-	fftw_destroy_plan(plan2);
-
-	// now multiply them together (result in out1)
-	for (index_t i=0; i<nsamples; i++) {
-		out1[i] = out1[i] * out2[i];
+
+	/* take inverse FFT */
+	double *correlation = fftw_malloc(sizeof(double)*nsamples);
+	fftw_execute_dft_c2r(engine->plans->inverse, crosspower, correlation);
+	fftw_free(crosspower);
+
+	// the FFT we're using is unnormalized
+	for (int lag=lo; lag<=hi; lag++) {
+		result[lag-lo] = fabs(correlation[(lag+nsamples)%nsamples]/nsamples);
 	}
+	fftw_free(correlation);
+}
 
-	free(out2);
-	free(waveform2reversed);
-	return out1;
+/* the same as spectral_correlation with no weighting, for few lags: it
+ * correlates the waveforms directly, without the wrap around at the ends */
+static void direct_correlation(double *waveform1, double *waveform2, index_t nsamples, int lo, int hi, double *result)
+{
+	for (int lag=lo; lag<=hi; lag++)
+	{
+		double sum = 0;
+		index_t start = MAX(0,lag), end = MIN(nsamples,nsamples+lag);
+		for (index_t i=start; i<end; i++)
+			sum += waveform1[i]*waveform2[i-lag];
+		result[lag-lo] = fabs(sum/nsamples);
+	}
 }
 
-/* returns the estimated TDOA (in seconds) between the two waveforms.
+/* returns the estimated TDOA (in seconds) between two channels of a gcc engine.
  * Our method uses the generalized cross-correlation (GCC) between the
  * two waveforms.  GCC is a venerable method for estimating
  * time-difference-of-arrival.  In fact, it is really a collection of
@@ -61,86 +148,39 @@ fftw_complex *crosspower_spectrum(double *waveform1, double *waveform2, index_t
  * fact that the DFT implemented by fftw3 is unnormalized, which might
  * be messing up the weighting in the frequency domain. Just a guess.
  *
+ * Only lags up to max_lag samples either way are searched, if it is
+ * given, as station spacing bounds the delays that are possible.  The
+ * peak is interpolated to a fraction of a sample.
+ *
  * For amusement purposes, notice how the second author's initials are
  * GCC, which is the commonly used acronym for referring to Generalized
  * Cross-Correlation.
  */
-double time_difference_of_arrival(double *waveform1,double *waveform2,index_t nsamples,int method,double *heuristic)
+double gcc_tdoa(gcc_engine_t *engine, int channel1, int channel2, int method, index_t max_lag, double *heuristic)
 {
+	index_t nsamples = engine->nsamples;
+	double *waveform1 = engine->waveform[channel1];
+	double *waveform2 = engine->waveform[channel2];
 	if (graphing >= 5)
 	{
 		gnuplotf("rows=2 length=%d title='Input Waveforms' %lf ; length=%d title='bb' %lf",nsamples,waveform1,nsamples,waveform2);
 	}
 
-	dp(6,"Computing cross-correlation...");
-	fftw_complex *crosspower = crosspower_spectrum(waveform1,waveform2,nsamples);
-
-	switch (method)
+	/* lags run from lo to hi, all the lags of the circular correlation if max_lag isn't given */
+	int lo = -(int)((nsamples-1)/2), hi = nsamples/2;
+	if (max_lag > 0 && max_lag < hi)
 	{
-		case GCC_PLAIN:
-			break;
-		case GCC_PHAT:
-			for (index_t i=0; i<nsamples; i++) {
-				crosspower[i] = crosspower[i] / cabs(crosspower[i]); 
-			}
-			break;
-		case GCC_ROTH:
-			{
-				fftw_complex* G11 = crosspower_spectrum(waveform1,waveform1,nsamples);
-				for (index_t i=0; i<nsamples; i++) {
-					crosspower[i] = crosspower[i] / G11[i];
-				}
-				free(G11);
-			}
-			break;
-		case GCC_ROTH2:
-			{
-				fftw_complex* G22 = crosspower_spectrum(waveform2,waveform2,nsamples);
-				for (index_t i=0; i<nsamples; i++) {
-					crosspower[i] = crosspower[i] / G22[i];
-				}
-				free(G22);
-			}
-			break;
-		case GCC_SCOT:
-			{
-				fftw_complex* G11 = crosspower_spectrum(waveform1,waveform1,nsamples);
-				fftw_complex* G22 = crosspower_spectrum(waveform2,waveform2,nsamples);
-				for (index_t i=0; i<nsamples; i++) {
-					crosspower[i] = crosspower[i] / csqrt(G11[i]*G22[i]);
-				}
-				free(G11);
-				free(G22);
-			}
-			break;
-		case GCC_ML:
-			{
-				fftw_complex* G11 = crosspower_spectrum(waveform1,waveform1,nsamples);
-				fftw_complex* G22 = crosspower_spectrum(waveform2,waveform2,nsamples);
-				for (index_t i=0; i<nsamples; i++) {
-					double g12 = crosspower[i]/csqrt(G11[i]*G22[i]);
-					double g12sqr = square_d(cabs(g12));
-					crosspower[i] = (crosspower[i]*g12sqr)/((1-g12sqr)*cabs(crosspower[i]));
-				}
-				free(G11);
-				free(G22);
-			}
-			break;
+		lo = -max_lag;
+		hi = max_lag;
 	}
+	int nlags = hi - lo + 1;
 
-	/* take inverse FFT */
-	double *result = (double *)salloc(sizeof(double)*nsamples);
-	fftw_plan plan = fftw_plan_dft_c2r_1d(nsamples, crosspower, result, FFTW_ESTIMATE);
-	fftw_execute(plan);
-	fftw_destroy_plan(plan);
-	free(crosspower);
-	
-	
-	// the FFT we're using is unnormalized
-	for (index_t i=0; i<nsamples; i++) {
-		result[i] = result[i]/nsamples;
-		result[i] = fabs(result[i]);
-	}
+	dp(6,"Computing cross-correlation...");
+	double *result = salloc(sizeof(double)*nlags);
+	if (method == GCC_PLAIN && nlags < TDOA_DIRECT_LAGS_PER_LOG2*log2(nsamples))
+		direct_correlation(waveform1,waveform2,nsamples,lo,hi,result);
+	else
+		spectral_correlation(engine,channel1,channel2,method,lo,hi,result);
 	dp(6,"done\n");
 
 	if (graphing >= 5)
@@ -148,34 +188,41 @@ double time_difference_of_arrival(double *waveform1,double *waveform2,index_t ns
 		switch(method)
 		{
 			case GCC_PLAIN:
-				gnuplotf("length=%d title='Cross-Correlation using plain method' %lf",nsamples,result);
+				gnuplotf("length=%d title='Cross-Correlation using plain method' %lf",nlags,result);
 				break;
 			case GCC_PHAT:
-				gnuplotf("length=%d title='Cross-Correlation using PHAT method' %lf",nsamples,result);
+				gnuplotf("length=%d title='Cross-Correlation using PHAT method' %lf",nlags,result);
 				break;
 			case GCC_ROTH:
-				gnuplotf("length=%d title='Cross-Correlation using ROTH method' %lf",nsamples,result);
+				gnuplotf("length=%d title='Cross-Correlation using ROTH method' %lf",nlags,result);
 				break;
 			case GCC_ROTH2:
-				gnuplotf("length=%d title='Cross-Correlation using ROTH2 method' %lf",nsamples,result);
+				gnuplotf("length=%d title='Cross-Correlation using ROTH2 method' %lf",nlags,result);
 				break;
 			case GCC_SCOT:
-				gnuplotf("length=%d title='Cross-Correlation using SCOT method' %lf",nsamples,result);
+				gnuplotf("length=%d title='Cross-Correlation using SCOT method' %lf",nlags,result);
 				break;
 			case GCC_ML:
-				gnuplotf("length=%d title='Cross-Correlation using ML method' %lf",nsamples,result);
+				gnuplotf("length=%d title='Cross-Correlation using ML method' %lf",nlags,result);
 				break;
 		}
 	}
 
-	double max;
-	int delay;
-	max = maxwithindex(result,nsamples,(unsigned int *)&delay);
-	if (delay >= nsamples/2-1) //one off?
-		delay = delay-nsamples; 
+	index_t peak;
+	double max = maxwithindex(result,nlags,&peak);
+	int delay = lo + (int)peak;
 
+	/* the peak of a parabola through the maximum and its neighbours gives a fraction of a sample */
+	double fraction = 0;
+	if (peak > 0 && peak < nlags-1)
+	{
+		double left = result[peak-1], right = result[peak+1];
+		double curvature = left - 2*max + right;
+		if (curvature < 0)
+			fraction = 0.5*(left - right)/curvature;
+	}
 
-	dp(10,"\tMaximum correlation of %lf at delay %d\n",max,delay);
+	dp(10,"\tMaximum correlation of %lf at delay %d%+.3f\n",max,delay,fraction);
 
 	if (graphing >= 5)
 	{
@@ -195,13 +242,11 @@ double time_difference_of_arrival(double *waveform1,double *waveform2,index_t ns
 	// some heuristics to get an idea for how good this is 
 	double badness = 0;
 	double threshold = 0.65*max;
-	for (index_t i=0; i<nsamples; i++)
+	for (int i=0; i<nlags; i++)
 	{
 		if (result[i] > threshold)
 		{
-			int position = i;
-			if (i >= nsamples/2-1)
-				position = i - nsamples;
+			int position = lo + i;
 			double dist = fabs(position - delay);
 			badness += square_d(dist);
 /*			if (dist >= 2000)
@@ -210,36 +255,8 @@ double time_difference_of_arrival(double *waveform1,double *waveform2,index_t ns
 	}
 	badness /= nsamples;
 	heuristic[TDOA_BADNESS_HEUR] = badness;
-/*
-	int up = 0;
-	double current = result[0];
-	index_t peaks=0;
-	count=0;
-	threshold = 0.5*max;
-	for (index_t i = 1; i<nsamples; i++)
-	{
-		if (result[i] > current)
-		{
-			up=1;
-		}
 
-		if (result[i] < current)
-		{
-			if (up)
-			{
-				peaks++;
-				up=0;
-				if (result[i-1] > threshold)
-					count++;
-			}
-		}
-	}
-	dp(5,"Peaks = %d\n",peaks);
-	dp(5,"Above threshold = %d\n",count);
-	dp(5,"Percentage above = %lf\n",(100.0*count)/nsamples);
-	*heuristic = (100.0*count)/nsamples;
-*/	
-	double tdoa = ((double)delay)/SAMPLING_RATE;
+	double tdoa = (delay + fraction)/SAMPLING_RATE;
 
 	heuristic[TDOA_TDOA_HEUR] = tdoa;
 
@@ -247,3 +264,55 @@ double time_difference_of_arrival(double *waveform1,double *waveform2,index_t ns
 	free(result);
 	return tdoa;
 }
+
+/* returns the estimated TDOA (in seconds) between two waveforms, see gcc_tdoa */
+double time_difference_of_arrival(double *waveform1,double *waveform2,index_t nsamples,int method,double *heuristic)
+{
+	double *waveforms[2] = {waveform1,waveform2};
+	gcc_engine_t *engine = gcc_engine_new(waveforms,2,nsamples);
+	double tdoa = gcc_tdoa(engine,0,1,method,0,heuristic);
+	gcc_engine_free(engine);
+	return tdoa;
+}
+
+typedef struct
+{
+	gcc_engine_t *engine;
+	gcc_pair_t *pairs;
+	int npairs;
+	int method;
+	int next;
+} gcc_job_t;
+
+static void *gcc_worker(void *arg)
+{
+	gcc_job_t *job = arg;
+	int i;
+	while ((i = __atomic_fetch_add(&job->next,1,__ATOMIC_RELAXED)) < job->npairs)
+	{
+		gcc_pair_t *pair = &job->pairs[i];
+		pair->tdoa = gcc_tdoa(job->engine,pair->channel1,pair->channel2,job->method,pair->max_lag,pair->heuristics);
+	}
+	return NULL;
+}
+
+/* computes the tdoa of each pair, spread over nthreads threads, or a thread per processor if it is 0 */
+void gcc_tdoa_pairs(gcc_engine_t *engine, gcc_pair_t *pairs, int npairs, int method, int nthreads)
+{
+	gcc_job_t job = {engine,pairs,npairs,method,0};
+	if (nthreads <= 0)
+		nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	nthreads = MAX(1,MIN(npairs,nthreads));
+	if (graphing >= 5)
+		nthreads = 1;	/* plots must come one at a time */
+	pthread_t threads[nthreads];
+	int started = 0;
+	for (; started<nthreads-1; started++)
+	{
+		if (pthread_create(&threads[started],NULL,gcc_worker,&job))
+			break;
+	}
+	gcc_worker(&job);
+	for (int t=0; t<started; t++)
+		pthread_join(threads[t],NULL);
+}
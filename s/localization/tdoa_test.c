@@ -0,0 +1,83 @@
+#include "i.h"
+
+/* globals of localize.c, which is not in the library */
+int NUM_STATIONS;
+int graphing;
+
+#define TEST_SAMPLING_RATE	16000
+#define TEST_NSAMPLES		1000
+
+/* a call-like burst of harmonics delayed by a fraction of a sample, exactly, as it is computed from t */
+static void burst(double *waveform, index_t nsamples, double delay)
+{
+	for (index_t i=0; i<nsamples; i++)
+	{
+		double t = i - delay;
+		waveform[i] = 0;
+		for (int k=1; k<40; k++)
+			waveform[i] += sin(2*PI*50.0*k*t/SAMPLING_RATE + k*k*0.7);
+		waveform[i] *= exp(-square_d((t - nsamples/2.0)/120.0));
+	}
+}
+
+/* the peak is interpolated to within a hundredth of a sample */
+static void test_fractional_delay(void)
+{
+	double *waveforms[2] = {salloc(sizeof(double)*TEST_NSAMPLES),salloc(sizeof(double)*TEST_NSAMPLES)};
+	double heuristic[NUM_TDOA_HEUR];
+	double worst = 0;
+	burst(waveforms[0],TEST_NSAMPLES,0);
+	for (double delay=-30; delay<=30; delay+=0.37)
+	{
+		burst(waveforms[1],TEST_NSAMPLES,delay);
+		gcc_engine_t *engine = gcc_engine_new(waveforms,2,TEST_NSAMPLES);
+		double tdoa = gcc_tdoa(engine,0,1,GCC_PLAIN,60,heuristic)*SAMPLING_RATE;
+		dp(5,"delay %.2f tdoa %.4f\n",delay,tdoa);
+		worst = MAX(worst,fabs(tdoa + delay));
+		gcc_engine_free(engine);
+	}
+	dp(5,"worst error %.4f samples\n",worst);
+	assert(worst < 0.01);
+	free(waveforms[0]);
+	free(waveforms[1]);
+	dp(0,"fractional delay OK\n");
+}
+
+/* the direct and fft correlations must agree either side of TDOA_DIRECT_LAGS_PER_LOG2,
+ * so which is used only changes the cost */
+static void test_correlation_paths(void)
+{
+	double *waveforms[2] = {salloc(sizeof(double)*TEST_NSAMPLES),salloc(sizeof(double)*TEST_NSAMPLES)};
+	double direct[NUM_TDOA_HEUR], spectral[NUM_TDOA_HEUR];
+	/* the widest window correlated directly, and the narrowest by fft */
+	index_t max_lag = (TDOA_DIRECT_LAGS_PER_LOG2*log2(TEST_NSAMPLES) - 1)/2;
+	assert(2*max_lag+1 < TDOA_DIRECT_LAGS_PER_LOG2*log2(TEST_NSAMPLES));
+	assert(2*max_lag+3 >= TDOA_DIRECT_LAGS_PER_LOG2*log2(TEST_NSAMPLES));
+	burst(waveforms[0],TEST_NSAMPLES,0);
+	for (double delay=-15; delay<=15; delay+=1.3)
+	{
+		burst(waveforms[1],TEST_NSAMPLES,delay);
+		gcc_engine_t *engine = gcc_engine_new(waveforms,2,TEST_NSAMPLES);
+		gcc_tdoa(engine,0,1,GCC_PLAIN,max_lag,direct);
+		gcc_tdoa(engine,0,1,GCC_PLAIN,max_lag+1,spectral);
+		dp(5,"delay %.2f direct %.6f spectral %.6f\n",delay,direct[TDOA_TDOA_HEUR]*SAMPLING_RATE,spectral[TDOA_TDOA_HEUR]*SAMPLING_RATE);
+		assert(fabs(direct[TDOA_TDOA_HEUR] - spectral[TDOA_TDOA_HEUR])*SAMPLING_RATE < 1e-9);
+		assert(fabs(direct[TDOA_BADNESS_HEUR] - spectral[TDOA_BADNESS_HEUR]) < 1e-9);
+		/* and over every lag, where the fft's correlation wraps around */
+		double all = gcc_tdoa(engine,0,1,GCC_PLAIN,0,spectral);
+		assert(fabs(direct[TDOA_TDOA_HEUR] - all)*SAMPLING_RATE < 1e-9);
+		gcc_engine_free(engine);
+	}
+	free(waveforms[0]);
+	free(waveforms[1]);
+	dp(0,"direct and fft correlation OK\n");
+}
+
+int main(int argc, char **argv)
+{
+	testing_initialize(&argc,&argv,"");
+	SAMPLING_RATE = TEST_SAMPLING_RATE;
+	test_fractional_delay();
+	test_correlation_paths();
+	return 0;
+}
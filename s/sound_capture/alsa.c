@@ -10,6 +10,8 @@ static int n_periods;
 static unsigned long period_size;
 static int n_channels;
 static unsigned long desired_buffer_size;
+static metric_t *overruns_metric;
+static int use_mmap;
 
 
 void
@@ -17,19 +19,59 @@ alsa_close(void) {
 	snd_pcm_close(pcm_handle);
 }
 
+/*
+ * Read n_frames by copying them straight out of the device's mmapped buffer,
+ * waiting with snd_pcm_wait (poll) until they are available.
+ * Returns frames read or a negative error code, as snd_pcm_readi does.
+ */
+static int
+alsa_mmap_read(int16_t *data, int n_frames) {
+	int err;
+	if (snd_pcm_state(pcm_handle) == SND_PCM_STATE_PREPARED && (err = snd_pcm_start(pcm_handle)) < 0)
+		return err;
+	snd_pcm_sframes_t avail;
+	while ((avail = snd_pcm_avail_update(pcm_handle)) < n_frames) {
+		if (avail < 0)
+			return avail;
+		if ((err = snd_pcm_wait(pcm_handle, 1000)) < 0)
+			return err;
+		if (err == 0)
+			return -EIO;
+	}
+	int done = 0;
+	while (done < n_frames) {
+		const snd_pcm_channel_area_t *areas;
+		snd_pcm_uframes_t offset;
+		snd_pcm_uframes_t frames = n_frames - done;
+		if ((err = snd_pcm_mmap_begin(pcm_handle, &areas, &offset, &frames)) < 0)
+			return err;
+		// interleaved access, so one area holds all the channels
+		const char *start = (const char *)areas[0].addr + (areas[0].first + offset*areas[0].step)/8;
+		memcpy(data + done*n_channels, start, frames*n_channels*sizeof *data);
+		snd_pcm_sframes_t committed = snd_pcm_mmap_commit(pcm_handle, offset, frames);
+		if (committed < 0)
+			return committed;
+		if (committed != frames)
+			return -EPIPE;
+		done += frames;
+	}
+	return done;
+}
+
 int 
 alsa_readi(int16_t *data, int n_frames) {
     dp(30, "n_frames=%d\n", n_frames);
     for(int j = 0;;++j) {
 		dp(30, "loop %d\n", j);
 	    for (int i = 0; i < 10; i++) {
-			int rc = snd_pcm_readi(pcm_handle, data, n_frames);
+			int rc = use_mmap ? alsa_mmap_read(data, n_frames) : snd_pcm_readi(pcm_handle, data, n_frames);
 			if (rc > 0) {
 				dp(30, "pcm read %d frames\n", rc);
 				return rc;
 			} else if (rc == -EPIPE) {
 				/* EPIPE means overrun */
 	    		dp(0, "overrun occurred\n");
+				metric_add(overruns_metric, 1);
 				snd_pcm_prepare(pcm_handle);
 			} else if (rc < 0) {
 	    		dp(0, "error from read: %s\n", snd_strerror(rc));
@@ -52,12 +94,13 @@ alsa_readi(int16_t *data, int n_frames) {
  * (Currently ignored in favour of desired_buffer_size)
  * \param n_channels Number of channels
  * \param desired_buffer_size Can't remember.
+ * \param use_mmap Read from the device's mmapped buffer, rather than with snd_pcm_readi
  *
  * This saves the parameters to static variables,
  * the calls alsa_init and prints a message if it fails.
  */
 void    
-do_alsa_init(char *p_pcm_name, int p_rate, int p_n_periods, unsigned long p_period_size, int p_n_channels, unsigned long p_desired_buffer_size)
+do_alsa_init(char *p_pcm_name, int p_rate, int p_n_periods, unsigned long p_period_size, int p_n_channels, unsigned long p_desired_buffer_size, int p_use_mmap)
 {
     dp(30, "pcm_name = %s\n", p_pcm_name);
 	pcm_name = p_pcm_name;
@@ -66,6 +109,8 @@ do_alsa_init(char *p_pcm_name, int p_rate, int p_n_periods, unsigned long p_peri
 	period_size = p_period_size;
 	n_channels = p_n_channels;
 	desired_buffer_size = p_desired_buffer_size;
+	use_mmap = p_use_mmap;
+	overruns_metric = metric_counter("alsa_overruns");
 	
 	for (int i = 0; i < 1; i++) {
 		if (alsa_init() == 0)
@@ -122,7 +167,7 @@ alsa_init(void)
     /* There are also access types for MMAPed */
     /* access, but this is beyond the scope   */
     /* of this introduction.                  */
-    if ((err = snd_pcm_hw_params_set_access(pcm_handle, hwparams, SND_PCM_ACCESS_RW_INTERLEAVED)) < 0) {
+    if ((err = snd_pcm_hw_params_set_access(pcm_handle, hwparams, use_mmap ? SND_PCM_ACCESS_MMAP_INTERLEAVED : SND_PCM_ACCESS_RW_INTERLEAVED)) < 0) {
       fprintf(stderr, "Error setting access. (%s)\n", snd_strerror(err));
       return(-1);
     }
@@ -0,0 +1,260 @@
+#include <sys/mman.h>
+#include <sched.h>
+#include "i.h"
+
+/*
+ * The capture thread does nothing but read periods from ALSA into a ring buffer,
+ * so a slow write (SD card garbage collection, compression on a busy CPU) delays
+ * the writer rather than overrunning the sound card.  There is one producer and
+ * one consumer, so the ring needs no locks: the capture thread only advances
+ * written and the writer only advances read.
+ */
+
+static metric_t *periods_metric;
+static metric_t *waiting_metric;
+static metric_t *overruns_metric;
+static metric_t *cpu_metric;
+
+static void *
+capture_thread(void *arg) {
+	capture_ring_t *r = arg;
+	const int n_channels = r->n_channels;
+	uint64_t cpu = metrics_thread_cpu_microseconds();
+	while (!r->finished) {
+		const uint64_t now = metrics_thread_cpu_microseconds();
+		metric_add(cpu_metric, now - cpu);
+		cpu = now;
+		const uint64_t written = r->written;
+		const uint64_t used = written - __atomic_load_n(&r->read, __ATOMIC_ACQUIRE);
+		const index_t offset = written % r->n_frames;
+		index_t n_frames = r->n_frames - offset;
+		if (n_frames > r->period_frames)
+			n_frames = r->period_frames;
+		if (r->n_frames - used < n_frames) {
+			if (r->simulator && !r->simulator->speed) {
+				// unpaced input can wait for the writer, the sound card (or paced simulation) can't
+				usleep(1000);
+				continue;
+			}
+			// keep draining the device, losing this period rather than overrunning ALSA
+			int length = r->simulator ? simulate_read(r->simulator, r->scratch, r->period_frames) : alsa_readi(r->scratch, r->period_frames);
+			if (length > 0) {
+				__atomic_store_n(&r->overruns, r->overruns + 1, __ATOMIC_RELAXED);
+				__atomic_store_n(&r->overrun_frames, r->overrun_frames + length, __ATOMIC_RELAXED);
+				metric_add(overruns_metric, 1);
+				dp(1, "capture ring full, %d frames lost\n", length);
+			}
+			continue;
+		}
+		int16_t *data = r->data + offset*n_channels;
+		int length;
+		if (r->simulator)
+			length = simulate_read(r->simulator, data, n_frames);
+		else
+			length = alsa_readi(data, n_frames);
+		struct timeval tv;
+		// frames dropped on overrun were still captured, so they count towards the simulated clock
+		if (r->simulator)
+			simulate_time(r->simulator, written + __atomic_load_n(&r->overrun_frames, __ATOMIC_RELAXED) + length, &tv);
+		else
+			gettimeofday(&tv, NULL);
+		if (length > 0) {
+			const unsigned sequence = r->stamp_sequence;
+			__atomic_store_n(&r->stamp_sequence, sequence + 1, __ATOMIC_RELAXED);
+			__atomic_thread_fence(__ATOMIC_RELEASE);
+			__atomic_store_n(&r->stamp_frame, written + length, __ATOMIC_RELAXED);
+			__atomic_store_n(&r->stamp_microseconds, tv.tv_sec*(int64_t)1000000 + tv.tv_usec, __ATOMIC_RELAXED);
+			__atomic_store_n(&r->stamp_sequence, sequence + 2, __ATOMIC_RELEASE);
+			if (used + length > r->high_watermark)
+				__atomic_store_n(&r->high_watermark, used + length, __ATOMIC_RELAXED);
+			__atomic_store_n(&r->written, written + length, __ATOMIC_RELEASE);
+			metric_add(periods_metric, 1);
+			metric_set(waiting_metric, used + length);
+		}
+		if (r->simulator && length < n_frames)
+			__atomic_store_n(&r->finished, 1, __ATOMIC_RELEASE);
+		sem_post(&r->available);
+	}
+	sem_post(&r->available);
+	return NULL;
+}
+
+/**
+ * Start a thread capturing sound into a ring buffer
+ * @param[in] simulator simulated input to read instead of ALSA, or NULL
+ * @param[in] n_channels channels per frame
+ * @param[in] sampling_rate used to timestamp frames
+ * @param[in] ring_frames capacity of the ring
+ * @param[in] period_frames frames read at a time
+ * @param[in] priority SCHED_FIFO priority for the capture thread, 0 for normal scheduling
+ * @returns the ring, to be passed to capture_wait and capture_read
+ *
+ * ALSA must already be initialised. The ring is locked into memory if possible.
+ */
+capture_ring_t *
+capture_start(simulator_t *simulator, int n_channels, int sampling_rate, index_t ring_frames, index_t period_frames, int priority) {
+	capture_ring_t *r = salloc(sizeof *r);
+	memset(r, 0, sizeof *r);
+	if (period_frames > ring_frames)
+		period_frames = ring_frames;
+	// a whole number of periods, so each read lands in one piece and views of the ring are period aligned
+	ring_frames = (ring_frames + period_frames - 1)/period_frames*period_frames;
+	r->n_frames = ring_frames;
+	r->n_channels = n_channels;
+	r->sampling_rate = sampling_rate;
+	r->period_frames = period_frames;
+	r->simulator = simulator;
+	r->data = salloc((size_t)ring_frames*n_channels*sizeof *r->data);
+	r->scratch = salloc((size_t)period_frames*n_channels*sizeof *r->scratch);
+	// touch every page now so the capture thread never takes a page fault
+	memset(r->data, 0, (size_t)ring_frames*n_channels*sizeof *r->data);
+	memset(r->scratch, 0, (size_t)period_frames*n_channels*sizeof *r->scratch);
+	if (mlock(r->data, (size_t)ring_frames*n_channels*sizeof *r->data) || mlock(r->scratch, (size_t)period_frames*n_channels*sizeof *r->scratch))
+		dp(1, "could not lock capture ring into memory: %s\n", strerror(errno));
+	if (sem_init(&r->available, 0, 0))
+		die("sem_init failed: %s", strerror(errno));
+	periods_metric = metric_counter("capture_periods");
+	waiting_metric = metric_gauge("capture_ring_frames_waiting");
+	overruns_metric = metric_counter("capture_ring_overruns");
+	cpu_metric = metric_counter("capture_thread_cpu_us");
+
+	pthread_t thread;
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	int error = EPERM;
+	if (priority > 0) {
+		struct sched_param param = {0};
+		param.sched_priority = priority;
+		pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+		pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+		pthread_attr_setschedparam(&attr, &param);
+		error = pthread_create(&thread, &attr, capture_thread, r);
+		if (error)
+			dp(1, "could not start capture thread with SCHED_FIFO priority %d (%s), using normal scheduling\n", priority, strerror(error));
+		pthread_attr_setinheritsched(&attr, PTHREAD_INHERIT_SCHED);
+	}
+	if (error)
+		error = pthread_create(&thread, &attr, capture_thread, r);
+	pthread_attr_destroy(&attr);
+	if (error)
+		die("pthread_create failed: %s", strerror(error));
+	dp(20, "capture thread started, ring %d frames, period %d frames\n", ring_frames, period_frames);
+	return r;
+}
+
+/**
+ * Wait until frames are available in the ring
+ * @param[in] r ring
+ * @param[in] n_frames frames wanted
+ * @returns frames available, fewer than n_frames only if capture has finished
+ */
+index_t
+capture_wait(capture_ring_t *r, index_t n_frames) {
+	while (1) {
+		const int finished = __atomic_load_n(&r->finished, __ATOMIC_ACQUIRE);
+		const uint64_t available = __atomic_load_n(&r->written, __ATOMIC_ACQUIRE) - r->read;
+		if (available >= n_frames || finished)
+			return available;
+		while (sem_wait(&r->available) && errno == EINTR)
+			;
+	}
+}
+
+/* time at which frame was captured, from the most recent capture timestamp */
+static void
+capture_time(capture_ring_t *r, uint64_t frame, struct timeval *tv) {
+	unsigned sequence;
+	uint64_t stamp_frame;
+	int64_t microseconds;
+	do {
+		sequence = __atomic_load_n(&r->stamp_sequence, __ATOMIC_ACQUIRE);
+		stamp_frame = __atomic_load_n(&r->stamp_frame, __ATOMIC_RELAXED);
+		microseconds = __atomic_load_n(&r->stamp_microseconds, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while ((sequence & 1) || sequence != __atomic_load_n(&r->stamp_sequence, __ATOMIC_RELAXED));
+	microseconds -= (int64_t)((stamp_frame - frame)*1000000/r->sampling_rate);
+	tv->tv_sec = microseconds/1000000;
+	tv->tv_usec = microseconds%1000000;
+}
+
+/**
+ * Look at frames in the ring without copying them
+ * @param[in] r ring
+ * @param[in] n_frames frames wanted, must already be available (see capture_wait)
+ * @param[out] data set to the first frame
+ * @param[out] tv time the last of the returned frames was captured
+ * @returns number of frames at data, fewer than n_frames if they wrap around the ring
+ *
+ * The frames stay valid until they are passed to capture_release.
+ */
+index_t
+capture_peek(capture_ring_t *r, index_t n_frames, int16_t **data, struct timeval *tv) {
+	const index_t offset = r->read % r->n_frames;
+	index_t n = r->n_frames - offset;
+	if (n > n_frames)
+		n = n_frames;
+	*data = r->data + (size_t)offset*r->n_channels;
+	capture_time(r, r->read + n, tv);
+	return n;
+}
+
+/**
+ * Return frames to the capture thread
+ * @param[in] r ring
+ * @param[in] n_frames number of frames from the start of those available
+ */
+void
+capture_release(capture_ring_t *r, index_t n_frames) {
+	__atomic_store_n(&r->read, r->read + n_frames, __ATOMIC_RELEASE);
+}
+
+/**
+ * Take frames from the ring
+ * @param[in] r ring
+ * @param[out] buffer receives n_frames interleaved frames
+ * @param[in] n_frames frames to take, must already be available (see capture_wait)
+ * @param[out] tv time the last of these frames was captured
+ */
+void
+capture_read(capture_ring_t *r, int16_t *buffer, index_t n_frames, struct timeval *tv) {
+	for (index_t n, done = 0; done < n_frames; done += n) {
+		int16_t *data;
+		n = capture_peek(r, n_frames - done, &data, tv);
+		memcpy(buffer + (size_t)done*r->n_channels, data, (size_t)n*r->n_channels*sizeof *buffer);
+		capture_release(r, n);
+	}
+}
+
+/**
+ * Write the capture counters to a file, replacing it atomically
+ * @param[in] r ring
+ * @param[in] pathname file to write, nothing is written if empty
+ * @param[in] force write even if the file was written this second, for the final counts on exit
+ *
+ * The file is otherwise rewritten at most once a second.
+ */
+void
+capture_write_stats(capture_ring_t *r, const char *pathname, int force) {
+	static time_t last_written;
+	if (!pathname || !*pathname || (!force && time(NULL) == last_written))
+		return;
+	last_written = time(NULL);
+	char tmp_pathname[PATH_MAX];
+	snprintf(tmp_pathname, sizeof tmp_pathname, "%s.tmp", pathname);
+	FILE *fp = fopen(tmp_pathname, "w");
+	if (!fp) {
+		dp(1, "can not write %s: %s\n", tmp_pathname, strerror(errno));
+		return;
+	}
+	const uint64_t written = __atomic_load_n(&r->written, __ATOMIC_RELAXED);
+	fprintf(fp, "frames_captured=%llu\n", (unsigned long long)written);
+	fprintf(fp, "frames_waiting=%llu\n", (unsigned long long)(written - r->read));
+	fprintf(fp, "ring_frames=%lu\n", (unsigned long)r->n_frames);
+	fprintf(fp, "ring_high_watermark_frames=%llu\n", (unsigned long long)__atomic_load_n(&r->high_watermark, __ATOMIC_RELAXED));
+	fprintf(fp, "ring_overrun_frames=%llu\n", (unsigned long long)__atomic_load_n(&r->overrun_frames, __ATOMIC_RELAXED));
+	metrics_print(fp, NULL);
+	fclose(fp);
+	if (rename(tmp_pathname, pathname))
+		dp(1, "can not rename %s to %s: %s\n", tmp_pathname, pathname, strerror(errno));
+}
@@ -0,0 +1,294 @@
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include "i.h"
+
+/*
+ * Call detection: a low priority worker runs the spectral_analysis sinusoid
+ * tracker over captured audio and scores each file by the tracks found in it,
+ * so files containing calls can be picked out without decoding them again.
+ * The capture path only copies frames into a queue.  If the worker falls too
+ * far behind, frames are dropped and the file gets its scheduled priority instead.
+ */
+
+typedef struct detect_job {
+	int16_t *frames;                    // NULL marks the end of a file
+	index_t n_frames;
+	char *details_pathname;             // NULL as well tells the worker to stop
+	time_t seconds;
+	uint32_t microseconds;
+	int incomplete;                     // frames of this file were dropped
+	struct detect_job *next;
+} detect_job_t;
+
+static struct {
+	int active;
+	pthread_mutex_t lock;
+	pthread_cond_t ready;
+	pthread_t thread;
+	detect_job_t *head;
+	detect_job_t *tail;
+	index_t queued_frames;
+	index_t max_queued_frames;
+	int dropped;                        // frames of the current file have been dropped
+	int n_channels;
+	int sampling_rate;
+	uint64_t ignore_channel_bitmap;
+	double half_score;
+	int nice;
+	metric_t *queued_metric;
+	metric_t *skipped_metric;
+	metric_t *cpu_metric;
+} detect = {0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER};
+
+// tracker state for the file being analysed
+typedef struct {
+	fft_t fft;
+	sample_t *window;                   // fft.window_size interleaved frames
+	index_t n_buffered;                 // frames in window
+	index_t step;
+	power_t *power;                     // [2][n_channels][n_bins], alternate steps
+	GArray **active_tracks;
+	int n_tracks;
+	double sum_score;
+	double max_score;
+} detector_t;
+
+static void
+detector_init(detector_t *d) {
+	const spectral_analysis_parameters_t *p = spectral_analysis_parameters();
+	memset(d, 0, sizeof *d);
+	d->fft.window_size = p->fft_window;
+	d->fft.fft_size = p->fft_points;
+	d->fft.step_size = MAX(1, (1 - p->fft_overlap) * d->fft.window_size);
+	d->fft.sampling_rate = detect.sampling_rate;
+	d->fft.window_type = fw_hann;
+	d->fft.n_bins = (d->fft.fft_size+1)/2;
+	d->fft.n_steps = 1;
+	d->window = salloc((size_t)d->fft.window_size*detect.n_channels*sizeof d->window[0]);
+	d->power = salloc((size_t)2*detect.n_channels*d->fft.n_bins*sizeof d->power[0]);
+	d->active_tracks = salloc(detect.n_channels*sizeof d->active_tracks[0]);
+	for (int channel = 0; channel < detect.n_channels; channel++)
+		d->active_tracks[channel] = g_array_new(0, 1, sizeof (track_t));
+}
+
+static void
+detector_score_tracks(detector_t *d, GArray *tracks) {
+	for (int j = 0; j < tracks->len; j++) {
+		track_t *t = &g_array_index(tracks, track_t, j);
+		if (t->points->len > 1) {
+			double score = score_track(t);
+			d->max_score = MAX(d->max_score, score);
+			d->sum_score += score;
+			d->n_tracks++;
+		}
+		g_array_free(t->points, 1);
+	}
+}
+
+static void
+detector_step(detector_t *d) {
+	const int n_channels = detect.n_channels;
+	const int n_bins = d->fft.n_bins;
+	for (int channel = 0; channel < n_channels; channel++) {
+		if (detect.ignore_channel_bitmap & (1 << channel))
+			continue;
+		sample_t mono[d->fft.window_size];
+		for (int i = 0; i < d->fft.window_size; i++)
+			mono[i] = d->window[i*n_channels + channel];
+		power_t *power = d->power + ((d->step % 2)*n_channels + channel)*n_bins;
+		power_t *previous_power = d->power + (((d->step + 1) % 2)*n_channels + channel)*n_bins;
+		short_time_power_phase(mono, &d->fft, (void *)power, NULL);
+		GArray *completed_tracks = new_update_sinusoid_tracks(d->fft, power, d->step ? previous_power : NULL, NULL, d->active_tracks[channel], d->step);
+		detector_score_tracks(d, completed_tracks);
+		g_array_free(completed_tracks, 1);
+	}
+	d->step++;
+}
+
+static void
+detector_add(detector_t *d, const int16_t *frames, index_t n_frames) {
+	const int n_channels = detect.n_channels;
+	while (n_frames) {
+		index_t n = MIN(n_frames, d->fft.window_size - d->n_buffered);
+		memcpy(d->window + (size_t)d->n_buffered*n_channels, frames, (size_t)n*n_channels*sizeof *frames);
+		d->n_buffered += n;
+		frames += (size_t)n*n_channels;
+		n_frames -= n;
+		if (d->n_buffered == d->fft.window_size) {
+			detector_step(d);
+			d->n_buffered -= d->fft.step_size;
+			memmove(d->window, d->window + (size_t)d->fft.step_size*n_channels, (size_t)d->n_buffered*n_channels*sizeof d->window[0]);
+		}
+	}
+}
+
+static void
+detector_free(detector_t *d) {
+	for (int channel = 0; channel < detect.n_channels; channel++) {
+		detector_score_tracks(d, d->active_tracks[channel]);
+		g_array_free(d->active_tracks[channel], 1);
+	}
+	free(d->active_tracks);
+	free(d->power);
+	free(d->window);
+	free_fft(&d->fft);
+}
+
+/* score the file, write its details and start afresh for the next */
+static void
+detector_finish(detector_t *d, detect_job_t *job) {
+	detector_free(d);
+	int level;
+	char extra[256];
+	if (job->incomplete) {
+		level = 10*calculate_monitoring_priority(job->seconds);
+		snprintf(extra, sizeof extra, "call_detection skipped");
+	} else {
+		level = MIN(99, (int)(100*d->max_score/(d->max_score + detect.half_score)));
+		snprintf(extra, sizeof extra, "call_detection tracks=%d max_score=%g sum_score=%g", d->n_tracks, d->max_score, d->sum_score);
+	}
+	dp(20, "%s: level %d %s\n", job->details_pathname, level, extra);
+	write_details_file(job->details_pathname, job->seconds, job->microseconds, level, extra);
+	detector_init(d);
+}
+
+static void *
+detect_thread(void *arg) {
+	// analysis must never compete with capture or the writer
+	if (setpriority(PRIO_PROCESS, syscall(SYS_gettid), detect.nice))
+		dp(1, "could not lower call detection priority: %s\n", strerror(errno));
+	detector_t d;
+	detector_init(&d);
+	pthread_mutex_lock(&detect.lock);
+	while (1) {
+		while (!detect.head)
+			pthread_cond_wait(&detect.ready, &detect.lock);
+		detect_job_t *job = detect.head;
+		detect.head = job->next;
+		if (!detect.head)
+			detect.tail = NULL;
+		pthread_mutex_unlock(&detect.lock);
+		if (!job->frames && !job->details_pathname) {
+			free(job);
+			break;
+		}
+		uint64_t cpu = metrics_thread_cpu_microseconds();
+		if (job->frames) {
+			detector_add(&d, job->frames, job->n_frames);
+			free(job->frames);
+		} else {
+			detector_finish(&d, job);
+			free(job->details_pathname);
+		}
+		metric_add(detect.cpu_metric, metrics_thread_cpu_microseconds() - cpu);
+		pthread_mutex_lock(&detect.lock);
+		detect.queued_frames -= job->n_frames;
+		metric_set(detect.queued_metric, detect.queued_frames);
+		free(job);
+	}
+	detector_free(&d);
+	return NULL;
+}
+
+/**
+ * Start the call detection worker if sound_capture:call_detection is set
+ * @param[in] n_channels channels in captured frames
+ * @param[in] sampling_rate of captured frames
+ */
+void
+detect_start(int n_channels, int sampling_rate) {
+	if (!param_get_boolean_with_default(SOUND_CAPTURE_GROUP, "call_detection", 0))
+		return;
+	detect.n_channels = n_channels;
+	detect.sampling_rate = sampling_rate;
+	detect.ignore_channel_bitmap = param_get_integer_with_default(SOUND_CAPTURE_GROUP, "call_detection_ignore_channel_bitmap", 0);
+	detect.half_score = param_get_double_with_default(SOUND_CAPTURE_GROUP, "call_detection_half_score", 1000);
+	detect.nice = param_get_integer_with_default(SOUND_CAPTURE_GROUP, "call_detection_nice", 10);
+	detect.max_queued_frames = sampling_rate*param_get_double_with_default(SOUND_CAPTURE_GROUP, "call_detection_max_queued_seconds", 120);
+	// the tracker converts between hertz and bins with spectral_analysis:sampling_rate
+	param_set_double("spectral_analysis", "sampling_rate", sampling_rate);
+	spectral_analysis_parameters();
+	detect.queued_metric = metric_gauge("detect_queued_frames");
+	detect.skipped_metric = metric_counter("detect_skipped_files");
+	detect.cpu_metric = metric_counter("detect_thread_cpu_us");
+	int error = pthread_create(&detect.thread, NULL, detect_thread, NULL);
+	if (error)
+		die("pthread_create failed: %s", strerror(error));
+	detect.active = 1;
+	dp(20, "call detection started\n");
+}
+
+static void
+detect_queue(detect_job_t *job) {
+	pthread_mutex_lock(&detect.lock);
+	if (detect.tail)
+		detect.tail->next = job;
+	else
+		detect.head = job;
+	detect.tail = job;
+	detect.queued_frames += job->n_frames;
+	metric_set(detect.queued_metric, detect.queued_frames);
+	pthread_cond_signal(&detect.ready);
+	pthread_mutex_unlock(&detect.lock);
+}
+
+/**
+ * Queue captured frames for call detection, they are copied
+ * @param[in] frames interleaved frames of the current file
+ * @param[in] n_frames number of frames
+ */
+void
+detect_submit(const int16_t *frames, index_t n_frames) {
+	if (!detect.active || detect.dropped)
+		return;
+	pthread_mutex_lock(&detect.lock);
+	int full = detect.queued_frames + n_frames > detect.max_queued_frames;
+	pthread_mutex_unlock(&detect.lock);
+	if (full) {
+		dp(1, "call detection has fallen behind, current file will not be scored\n");
+		detect.dropped = 1;
+		metric_add(detect.skipped_metric, 1);
+		return;
+	}
+	detect_job_t *job = salloc(sizeof *job);
+	memset(job, 0, sizeof *job);
+	job->frames = sdup((void *)frames, (size_t)n_frames*detect.n_channels*sizeof *frames);
+	job->n_frames = n_frames;
+	detect_queue(job);
+}
+
+/**
+ * Mark the end of the current file
+ * @param[in] details_pathname details file for the worker to write when the file is scored
+ * @param[in] seconds,microseconds timestamp written to the details file
+ * @returns 1 if the details file will be written by the worker, 0 if detection is off
+ */
+int
+detect_finish(const char *details_pathname, time_t seconds, uint32_t microseconds) {
+	if (!detect.active)
+		return 0;
+	detect_job_t *job = salloc(sizeof *job);
+	memset(job, 0, sizeof *job);
+	job->details_pathname = sstrdup((char *)details_pathname);
+	job->seconds = seconds;
+	job->microseconds = microseconds;
+	job->incomplete = detect.dropped;
+	detect.dropped = 0;
+	detect_queue(job);
+	return 1;
+}
+
+/**
+ * Stop the call detection worker once it has scored the files already finished
+ *
+ * Call before exiting so the details files of those files are written.
+ */
+void
+detect_stop(void) {
+	if (!detect.active)
+		return;
+	detect_queue(salloc(sizeof (detect_job_t)));
+	pthread_join(detect.thread, NULL);
+	detect.active = 0;
+	dp(20, "call detection stopped\n");
+}
@@ -10,6 +10,8 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <semaphore.h>
 
 #ifndef PATH_MAX
 #define PATH_MAX 4096
@@ -29,6 +31,95 @@ typedef enum action {
 
 
 #include "bowerbird.h"
+
+#define SOUND_CAPTURE_GROUP "sound_capture"
+
+// sound files played in place of the sound card - see simulate.c
+typedef struct simulator {
+	char **pathnames;                   // input files, played in order
+	int n_pathnames;
+	int next_pathname;
+	int loop;                           // start again after the last file
+	soundfile_t *file;
+	int n_channels;
+	int sampling_rate;
+	double speed;                       // multiple of real time, 0 for as fast as possible
+	sinusoid_t *sinusoids;              // mixed into every channel
+	int n_sinusoids;
+	double burst_seconds;               // sinusoids are on for this long
+	double burst_period_seconds;        // out of every this long, 0 for always
+	sample_t *mono;
+	index_t mono_frames;
+	double stall_seconds;               // writer sleeps this long
+	int stall_every_buffers;            // after every this many buffers, 0 for never
+	int64_t start_time;                 // wall clock microseconds at start
+	int64_t start_microseconds;         // monotonic clock at start
+	uint64_t frames;                    // frames read, only used by the capture thread
+	// the rest is only used by the writer
+	int64_t buffer_start;
+	int n_buffers;
+	int n_stalls;
+	double max_buffer_seconds;
+	double writer_clock;                // when the writer would have finished at real time
+	double realtime_high_watermark;     // most frames that would have waited in the ring at real time
+} simulator_t;
+
+// single-producer single-consumer ring of interleaved frames - see capture.c
+// fields shared between the threads are only accessed with __atomic builtins
+typedef struct capture_ring {
+	int16_t *data;
+	index_t n_frames;                   // capacity
+	int n_channels;
+	int sampling_rate;
+	index_t period_frames;              // frames captured per read
+	int16_t *scratch;                   // period_frames, read into when the ring is full
+	simulator_t *simulator;             // NULL when capturing from ALSA
+	uint64_t written;                   // frames ever written, only changed by capture thread
+	uint64_t read;                      // frames ever read, only changed by writer
+	int finished;
+	sem_t available;                    // posted by the capture thread after each read
+	unsigned stamp_sequence;            // odd while the stamp is being changed
+	uint64_t stamp_frame;               // frames written when stamp was taken
+	int64_t stamp_microseconds;
+	uint64_t overruns;                  // periods dropped because the ring was full
+	uint64_t overrun_frames;
+	uint64_t high_watermark;            // most frames ever waiting in the ring
+} capture_ring_t;
+
+// where files are written - see get_output_settings
+typedef struct {
+	const char *data_dir;
+	const char *file_dir_format;
+	const char *file_name_format;
+	const char *file_ext;
+	const char *details_ext;
+	int n_channels;
+	int sampling_rate;
+	int rotation_seconds;               // 0 for a file per buffer, otherwise files are streamed
+} output_settings_t;
+
+// file being written through the storage layer - see storage.c
+typedef struct {
+	int fd;
+	int direct;                         // opened with O_DIRECT
+	char *buffer;                       // aligned staging buffer, O_DIRECT only
+	size_t size;                        // of buffer, a multiple of the alignment
+	size_t used;                        // bytes staged in buffer
+	off_t written;                      // bytes written to fd
+	char *pathname;
+} storage_file_t;
+
+// recording on the card, a sound file and its details file - see reclaim_storage.c
+typedef struct {
+	char *directory;                    // day directory, relative to the data directory
+	char *stem;                         // file name without extension
+	char *sound_ext;                    // extension of the sound file, NULL if there isn't one
+	int has_details;
+	uint64_t bytes;                     // disk space used by sound and details files
+	time_t time;                        // when recording started
+	int priority;                       // -1 if not yet known
+} recording_t;
+
 #include "sound_capture-prototypes.h"
 
 #endif
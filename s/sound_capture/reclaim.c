@@ -0,0 +1,45 @@
+#include "i.h"
+
+/*
+ * The order in which reclaim_storage deletes recordings: lowest priority first,
+ * oldest first within a priority.
+ */
+
+static int
+compare_value(const void *a, const void *b) {
+	const recording_t *r1 = *(recording_t **)a;
+	const recording_t *r2 = *(recording_t **)b;
+	if (r1->priority != r2->priority)
+		return r1->priority < r2->priority ? -1 : 1;
+	return r1->time < r2->time ? -1 : r1->time > r2->time;
+}
+
+/**
+ * Recordings which may be deleted, least valuable first
+ * @param[in] recordings recording_t values
+ * @param[in] newest recordings started after this are left alone
+ * @param[out] n_candidates number of recordings returned
+ * @returns array of recordings, which the caller must free
+ *
+ * Recordings whose priority is not yet known are given their scheduled monitoring priority.
+ * Details files without a sound file are not candidates.
+ */
+recording_t **
+reclaim_candidates(GHashTable *recordings, time_t newest, int *n_candidates) {
+	int n = 0;
+	recording_t **candidates = salloc(g_hash_table_size(recordings)*sizeof candidates[0] + 1);
+	GHashTableIter iter;
+	gpointer key, value;
+	g_hash_table_iter_init(&iter, recordings);
+	while (g_hash_table_iter_next(&iter, &key, &value)) {
+		recording_t *r = value;
+		if (r->sound_ext && r->time <= newest) {
+			if (r->priority < 0)
+				r->priority = 10*calculate_monitoring_priority(r->time);
+			candidates[n++] = r;
+		}
+	}
+	qsort(candidates, n, sizeof candidates[0], compare_value);
+	*n_candidates = n;
+	return candidates;
+}
@@ -0,0 +1,481 @@
+#include <dirent.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/statvfs.h>
+#include "i.h"
+
+/*
+ * Frees space on the recording card by deleting the least valuable recordings.
+ * A recording is a sound file and its details file.  Its value is the @NN
+ * priority in the details file: the scheduled monitoring priority, or the
+ * call detection score.  When free space falls below reclaim_min_free_percent,
+ * recordings are deleted lowest priority first, oldest first within a priority,
+ * until reclaim_target_free_percent is free.  Every deletion is logged.
+ *
+ * Recordings are kept in an index saved in the data directory. A day directory
+ * whose mtime has not changed since the index was saved is taken from the index,
+ * not re-read.  While running as a daemon, inotify keeps the index current.
+ */
+
+#define RECLAIM_STORAGE_GROUP "reclaim_storage"
+#define VERSION "0.1.0"
+#define INDEX_FILE ".reclaim_index"
+
+typedef struct {
+	char *name;
+	time_t mtime;                       // when the directory was last scanned
+} directory_t;
+
+static const char *data_dir;
+static const char *details_ext;
+static char **sound_exts;
+static GHashTable *recordings;          // "directory/stem" -> recording_t
+static GHashTable *directories;         // name -> directory_t
+static GHashTable *watches;             // inotify watch descriptor -> directory_t
+static FILE *audit_log;
+static int index_changed;
+
+static void
+audit(const char *format, ...) {
+	if (!audit_log)
+		return;
+	time_t now = time(NULL);
+	char when[64];
+	strftime(when, sizeof when, "%Y-%m-%d %H:%M:%S", localtime(&now));
+	fprintf(audit_log, "%s ", when);
+	va_list ap;
+	va_start(ap, format);
+	vfprintf(audit_log, format, ap);
+	va_end(ap);
+	fflush(audit_log);
+}
+
+static char *
+recording_key(const char *directory, const char *stem) {
+	return g_strdup_printf("%s/%s", directory, stem);
+}
+
+static void
+free_recording(void *p) {
+	recording_t *r = p;
+	g_free(r->directory);
+	g_free(r->stem);
+	g_free(r->sound_ext);
+	free(r);
+}
+
+static void
+free_directory(void *p) {
+	directory_t *d = p;
+	g_free(d->name);
+	free(d);
+}
+
+static recording_t *
+get_recording(const char *directory, const char *stem) {
+	char *key = recording_key(directory, stem);
+	recording_t *r = g_hash_table_lookup(recordings, key);
+	if (r) {
+		g_free(key);
+		return r;
+	}
+	r = salloc(sizeof *r);
+	memset(r, 0, sizeof *r);
+	r->directory = g_strdup(directory);
+	r->stem = g_strdup(stem);
+	r->priority = -1;
+	g_hash_table_insert(recordings, key, r);
+	return r;
+}
+
+static int
+is_sound_ext(const char *ext) {
+	for (char **e = sound_exts; *e; e++)
+		if (!strcmp(ext, *e))
+			return 1;
+	return 0;
+}
+
+// split name into stem and extension, returns 0 if it is not a recording's file
+static int
+split_name(const char *name, char *stem, const char **ext) {
+	const char *dot = strrchr(name, '.');
+	if (name[0] == '.' || !dot || dot - name >= PATH_MAX)
+		return 0;
+	*ext = dot + 1;
+	if (strcmp(*ext, details_ext) && !is_sound_ext(*ext))
+		return 0;
+	memcpy(stem, name, dot - name);
+	stem[dot - name] = '\0';
+	return 1;
+}
+
+// priority and start time from the first line of a details file
+static void
+read_details(recording_t *r) {
+	char pathname[PATH_MAX];
+	snprintf(pathname, sizeof pathname, "%s/%s/%s.%s", data_dir, r->directory, r->stem, details_ext);
+	FILE *fp = fopen(pathname, "r");
+	if (!fp)
+		return;
+	double seconds;
+	int priority;
+	if (fscanf(fp, "%lf@%d", &seconds, &priority) == 2) {
+		r->time = seconds;
+		r->priority = priority;
+	}
+	fclose(fp);
+}
+
+static void
+update_bytes(recording_t *r) {
+	char pathname[PATH_MAX];
+	struct stat st;
+	r->bytes = 0;
+	if (r->sound_ext) {
+		snprintf(pathname, sizeof pathname, "%s/%s/%s.%s", data_dir, r->directory, r->stem, r->sound_ext);
+		if (stat(pathname, &st) == 0) {
+			r->bytes += st.st_blocks*(uint64_t)512;
+			if (!r->time)
+				r->time = st.st_mtime;
+		} else {
+			g_free(r->sound_ext);
+			r->sound_ext = NULL;
+		}
+	}
+	if (r->has_details) {
+		snprintf(pathname, sizeof pathname, "%s/%s/%s.%s", data_dir, r->directory, r->stem, details_ext);
+		if (stat(pathname, &st) == 0)
+			r->bytes += st.st_blocks*(uint64_t)512;
+		else
+			r->has_details = 0;
+	}
+}
+
+static void
+remove_recording(recording_t *r) {
+	char *key = recording_key(r->directory, r->stem);
+	g_hash_table_remove(recordings, key);
+	g_free(key);
+	index_changed = 1;
+}
+
+/* a file of a recording has been written or has appeared */
+static void
+file_added(const char *directory, const char *name) {
+	char stem[PATH_MAX];
+	const char *ext;
+	if (!split_name(name, stem, &ext))
+		return;
+	recording_t *r = get_recording(directory, stem);
+	if (!strcmp(ext, details_ext)) {
+		r->has_details = 1;
+		read_details(r);
+	} else if (!r->sound_ext || strcmp(r->sound_ext, ext)) {
+		g_free(r->sound_ext);
+		r->sound_ext = g_strdup(ext);
+	}
+	update_bytes(r);
+	index_changed = 1;
+}
+
+static void
+file_removed(const char *directory, const char *name) {
+	char stem[PATH_MAX];
+	const char *ext;
+	if (!split_name(name, stem, &ext))
+		return;
+	char *key = recording_key(directory, stem);
+	recording_t *r = g_hash_table_lookup(recordings, key);
+	g_free(key);
+	if (!r)
+		return;
+	if (!strcmp(ext, details_ext))
+		r->has_details = 0;
+	else if (r->sound_ext && !strcmp(r->sound_ext, ext)) {
+		g_free(r->sound_ext);
+		r->sound_ext = NULL;
+	}
+	if (!r->sound_ext && !r->has_details)
+		remove_recording(r);
+	else
+		update_bytes(r);
+	index_changed = 1;
+}
+
+static gboolean
+in_directory(gpointer key, gpointer value, gpointer directory) {
+	return !strcmp(((recording_t *)value)->directory, directory);
+}
+
+static void
+watch_directory(int inotify_fd, directory_t *d) {
+	if (inotify_fd < 0)
+		return;
+	char pathname[PATH_MAX];
+	snprintf(pathname, sizeof pathname, "%s/%s", data_dir, d->name);
+	int wd = inotify_add_watch(inotify_fd, pathname, IN_CLOSE_WRITE|IN_MOVED_TO|IN_MOVED_FROM|IN_DELETE|IN_DELETE_SELF);
+	if (wd < 0)
+		dp(1, "can not watch %s: %s\n", pathname, strerror(errno));
+	else
+		g_hash_table_replace(watches, GINT_TO_POINTER(wd), d);
+}
+
+static directory_t *
+scan_directory(int inotify_fd, const char *name) {
+	char pathname[PATH_MAX];
+	snprintf(pathname, sizeof pathname, "%s/%s", data_dir, name);
+	struct stat st;
+	if (stat(pathname, &st) || !S_ISDIR(st.st_mode))
+		return NULL;
+	directory_t *d = g_hash_table_lookup(directories, name);
+	if (!d) {
+		d = salloc(sizeof *d);
+		d->name = g_strdup(name);
+		d->mtime = 0;
+		g_hash_table_insert(directories, d->name, d);
+	}
+	// watch before reading, so no file can slip between the two
+	watch_directory(inotify_fd, d);
+	if (d->mtime == st.st_mtime)
+		return d;
+	// read before the scan, so a change made during it is seen next time
+	d->mtime = st.st_mtime;
+	dp(20, "scanning %s\n", pathname);
+	g_hash_table_foreach_remove(recordings, in_directory, (gpointer)name);
+	DIR *dirp = opendir(pathname);
+	if (!dirp) {
+		dp(1, "can not open %s: %s\n", pathname, strerror(errno));
+		return d;
+	}
+	struct dirent *ep;
+	while ((ep = readdir(dirp)))
+		file_added(name, ep->d_name);
+	closedir(dirp);
+	index_changed = 1;
+	return d;
+}
+
+static void
+load_index(void) {
+	char pathname[PATH_MAX];
+	snprintf(pathname, sizeof pathname, "%s/%s", data_dir, INDEX_FILE);
+	FILE *fp = fopen(pathname, "r");
+	if (!fp)
+		return;
+	char line[3*PATH_MAX], name[PATH_MAX], stem[PATH_MAX], ext[PATH_MAX];
+	long mtime, t;
+	unsigned long long bytes;
+	int priority, has_details;
+	while (fgets(line, sizeof line, fp)) {
+		if (sscanf(line, "d %ld %4095s", &mtime, name) == 2) {
+			directory_t *d = salloc(sizeof *d);
+			d->name = g_strdup(name);
+			d->mtime = mtime;
+			g_hash_table_replace(directories, d->name, d);
+		} else if (sscanf(line, "r %llu %ld %d %d %4095s %4095s %4095s", &bytes, &t, &priority, &has_details, name, stem, ext) == 7) {
+			recording_t *r = get_recording(name, stem);
+			r->bytes = bytes;
+			r->time = t;
+			r->priority = priority;
+			r->has_details = has_details;
+			r->sound_ext = strcmp(ext, "-") ? g_strdup(ext) : NULL;
+		}
+	}
+	fclose(fp);
+	dp(20, "%s: %d directories, %d recordings\n", pathname, g_hash_table_size(directories), g_hash_table_size(recordings));
+}
+
+static void
+save_index(void) {
+	if (!index_changed)
+		return;
+	char pathname[PATH_MAX], tmp_pathname[PATH_MAX];
+	snprintf(pathname, sizeof pathname, "%s/%s", data_dir, INDEX_FILE);
+	snprintf(tmp_pathname, sizeof tmp_pathname, "%s.tmp", pathname);
+	FILE *fp = fopen(tmp_pathname, "w");
+	if (!fp) {
+		dp(1, "can not write %s: %s\n", tmp_pathname, strerror(errno));
+		return;
+	}
+	GHashTableIter iter;
+	gpointer key, value;
+	g_hash_table_iter_init(&iter, directories);
+	while (g_hash_table_iter_next(&iter, &key, &value)) {
+		directory_t *d = value;
+		fprintf(fp, "d %ld %s\n", (long)d->mtime, d->name);
+	}
+	g_hash_table_iter_init(&iter, recordings);
+	while (g_hash_table_iter_next(&iter, &key, &value)) {
+		recording_t *r = value;
+		fprintf(fp, "r %llu %ld %d %d %s %s %s\n", (unsigned long long)r->bytes, (long)r->time, r->priority, r->has_details, r->directory, r->stem, r->sound_ext ? r->sound_ext : "-");
+	}
+	if (fclose(fp) || rename(tmp_pathname, pathname))
+		dp(1, "can not write %s: %s\n", pathname, strerror(errno));
+	else
+		index_changed = 0;
+}
+
+/* bring the index up to date with the data directory, watching each day directory */
+static void
+scan(int inotify_fd) {
+	DIR *dirp = opendir(data_dir);
+	if (!dirp)
+		die("can not open %s: %s", data_dir, strerror(errno));
+	GHashTable *seen = g_hash_table_new(g_str_hash, g_str_equal);
+	struct dirent *ep;
+	while ((ep = readdir(dirp))) {
+		if (ep->d_name[0] == '.')
+			continue;
+		directory_t *d = scan_directory(inotify_fd, ep->d_name);
+		if (d)
+			g_hash_table_insert(seen, d->name, d);
+	}
+	closedir(dirp);
+	// directories removed while we weren't looking
+	GHashTableIter iter;
+	gpointer key, value;
+	g_hash_table_iter_init(&iter, directories);
+	while (g_hash_table_iter_next(&iter, &key, &value))
+		if (!g_hash_table_lookup(seen, key)) {
+			g_hash_table_foreach_remove(recordings, in_directory, key);
+			g_hash_table_iter_remove(&iter);
+			index_changed = 1;
+		}
+	g_hash_table_destroy(seen);
+}
+
+static void
+handle_events(int inotify_fd, int data_wd) {
+	char buffer[16*(sizeof (struct inotify_event) + NAME_MAX + 1)] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	ssize_t length = read(inotify_fd, buffer, sizeof buffer);
+	for (char *p = buffer; length > 0 && p < buffer + length; ) {
+		struct inotify_event *event = (struct inotify_event *)p;
+		p += sizeof *event + event->len;
+		if (event->mask & IN_Q_OVERFLOW) {
+			dp(1, "inotify queue overflowed, rescanning\n");
+			g_hash_table_remove_all(watches);
+			g_hash_table_remove_all(directories);
+			scan(inotify_fd);
+			continue;
+		}
+		if (event->wd == data_wd) {
+			if (event->len && (event->mask & (IN_CREATE|IN_MOVED_TO)))
+				scan_directory(inotify_fd, event->name);
+			continue;
+		}
+		directory_t *d = g_hash_table_lookup(watches, GINT_TO_POINTER(event->wd));
+		if (!d)
+			continue;
+		if (event->mask & IN_DELETE_SELF) {
+			g_hash_table_foreach_remove(recordings, in_directory, d->name);
+			g_hash_table_remove(watches, GINT_TO_POINTER(event->wd));
+			g_hash_table_remove(directories, d->name);
+			index_changed = 1;
+		} else if (event->len && (event->mask & (IN_CLOSE_WRITE|IN_MOVED_TO)))
+			file_added(d->name, event->name);
+		else if (event->len && (event->mask & (IN_DELETE|IN_MOVED_FROM)))
+			file_removed(d->name, event->name);
+	}
+}
+
+static double
+free_percent(uint64_t *free_bytes, uint64_t *total_bytes) {
+	struct statvfs s;
+	if (statvfs(data_dir, &s))
+		die("statvfs %s failed: %s", data_dir, strerror(errno));
+	*free_bytes = s.f_bavail*(uint64_t)s.f_frsize;
+	*total_bytes = s.f_blocks*(uint64_t)s.f_frsize;
+	return *total_bytes ? 100.0**free_bytes / *total_bytes : 100;
+}
+
+/**
+ * Delete recordings, least valuable first, until target_percent of the filesystem is free
+ * @returns number of recordings deleted, -1 if space is needed and nothing can be deleted
+ */
+static int
+reclaim(double min_percent, double target_percent, int min_age) {
+	uint64_t free_bytes, total_bytes;
+	double percent = free_percent(&free_bytes, &total_bytes);
+	dp(20, "%.1f%% free\n", percent);
+	if (percent >= min_percent)
+		return 0;
+	audit("start free=%llu total=%llu free_percent=%.2f target_percent=%.2f\n", (unsigned long long)free_bytes, (unsigned long long)total_bytes, percent, target_percent);
+	const uint64_t target_bytes = total_bytes*target_percent/100;
+	// recordings still being written or scored are left alone
+	int n;
+	recording_t **candidates = reclaim_candidates(recordings, time(NULL) - min_age, &n);
+	int n_deleted = 0;
+	for (int i = 0; i < n && free_bytes < target_bytes; i++) {
+		recording_t *r = candidates[i];
+		char pathname[PATH_MAX];
+		snprintf(pathname, sizeof pathname, "%s/%s/%s.%s", data_dir, r->directory, r->stem, r->sound_ext);
+		if (unlink(pathname) && errno != ENOENT) {
+			audit("failed %s: %s\n", pathname, strerror(errno));
+			continue;
+		}
+		audit("delete %s priority=%d time=%ld bytes=%llu\n", pathname, r->priority, (long)r->time, (unsigned long long)r->bytes);
+		if (r->has_details) {
+			snprintf(pathname, sizeof pathname, "%s/%s/%s.%s", data_dir, r->directory, r->stem, details_ext);
+			unlink(pathname);
+		}
+		free_bytes += r->bytes;
+		remove_recording(r);
+		n_deleted++;
+	}
+	free(candidates);
+	percent = free_percent(&free_bytes, &total_bytes);
+	audit("done deleted=%d free=%llu free_percent=%.2f\n", n_deleted, (unsigned long long)free_bytes, percent);
+	dp(2, "deleted %d recordings, %.1f%% free\n", n_deleted, percent);
+	return n_deleted || percent >= min_percent ? n_deleted : -1;
+}
+
+int
+main(int argc, char *argv[]) {
+	debug_stream = stderr;
+	int optind = initialize(argc, argv, RECLAIM_STORAGE_GROUP, VERSION, "[data directory]");
+	data_dir = optind < argc ? argv[optind] : param_get_string("sound_capture", "data_dir");
+	details_ext = param_get_string("sound_capture", "sound_details_ext");
+	if (details_ext[0] == '.')
+		details_ext++;
+	sound_exts = g_strsplit(param_get_string_with_default(RECLAIM_STORAGE_GROUP, "sound_extensions", "wv,wav"), ",", 0);
+	const double min_percent = param_get_double_with_default(RECLAIM_STORAGE_GROUP, "min_free_percent", 1);
+	const double target_percent = param_get_double_with_default(RECLAIM_STORAGE_GROUP, "target_free_percent", 3);
+	const int min_age = param_get_integer_with_default(RECLAIM_STORAGE_GROUP, "min_age_seconds", 600);
+	const int run_as_daemon = param_get_boolean_with_default(RECLAIM_STORAGE_GROUP, "daemon", 0);
+	const int check_seconds = param_get_integer_with_default(RECLAIM_STORAGE_GROUP, "check_seconds", 60);
+	const char *log_file = param_get_string_with_default(RECLAIM_STORAGE_GROUP, "log_file", "");
+	if (*log_file && !(audit_log = fopen(log_file, "a")))
+		dp(1, "can not open %s: %s\n", log_file, strerror(errno));
+
+	recordings = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, free_recording);
+	directories = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, free_directory);
+	watches = g_hash_table_new(g_direct_hash, g_direct_equal);
+	load_index();
+	if (!run_as_daemon) {
+		scan(-1);
+		int result = reclaim(min_percent, target_percent, min_age);
+		save_index();
+		// die exits with 1, so check_disk_space can tell an error from a full card
+		return result < 0 ? 2 : 0;
+	}
+
+	int inotify_fd = inotify_init();
+	if (inotify_fd < 0)
+		die("inotify_init failed: %s", strerror(errno));
+	int data_wd = inotify_add_watch(inotify_fd, data_dir, IN_CREATE|IN_MOVED_TO|IN_ONLYDIR);
+	if (data_wd < 0)
+		die("can not watch %s: %s", data_dir, strerror(errno));
+	scan(inotify_fd);
+	time_t last_check = 0;
+	while (1) {
+		struct pollfd pfd = {inotify_fd, POLLIN, 0};
+		if (poll(&pfd, 1, check_seconds*1000) > 0)
+			handle_events(inotify_fd, data_wd);
+		if (time(NULL) - last_check >= check_seconds) {
+			last_check = time(NULL);
+			reclaim(min_percent, target_percent, min_age);
+			save_index();
+		}
+	}
+}
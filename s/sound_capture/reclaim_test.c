@@ -0,0 +1,45 @@
+#include "i.h"
+
+static recording_t *
+add_recording(GHashTable *recordings, const char *stem, const char *sound_ext, time_t time, int priority) {
+	recording_t *r = salloc(sizeof *r);
+	memset(r, 0, sizeof *r);
+	r->directory = "2010_01_01";
+	r->stem = (char *)stem;
+	r->sound_ext = (char *)sound_ext;
+	r->time = time;
+	r->priority = priority;
+	g_hash_table_insert(recordings, (char *)stem, r);
+	return r;
+}
+
+int
+main(int argc, char*argv[]) {
+	verbosity = 0;
+	const time_t now = 1262304000;
+	GHashTable *recordings = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, free);
+	add_recording(recordings, "new_low", "wv", now - 10, 0);
+	add_recording(recordings, "old_high", "wv", now - 3000, 90);
+	add_recording(recordings, "details_only", NULL, now - 5000, 0);
+	add_recording(recordings, "mid_low", "wv", now - 2000, 10);
+	add_recording(recordings, "old_low", "wav", now - 4000, 10);
+	add_recording(recordings, "young_high", "wv", now - 1000, 90);
+	recording_t *unscored = add_recording(recordings, "unscored", "wv", now - 1500, -1);
+	int n;
+	recording_t **candidates = reclaim_candidates(recordings, now - 600, &n);
+	// too recent and details-only recordings are kept, then priority decides before age
+	const char *expected[] = {"old_low", "mid_low", "old_high", "young_high"};
+	assert(unscored->priority == 10*calculate_monitoring_priority(unscored->time));
+	assert(n == sizeof expected/sizeof expected[0] + 1);
+	for (int i = 0, j = 0; i < n; i++) {
+		if (candidates[i] == unscored)
+			continue;
+		assert(!strcmp(candidates[i]->stem, expected[j++]));
+	}
+	for (int i = 1; i < n; i++)
+		assert(candidates[i - 1]->priority <= candidates[i]->priority);
+	free(candidates);
+	g_hash_table_destroy(recordings);
+	dp(0, "reclaim order OK\n");
+	return 0;
+}
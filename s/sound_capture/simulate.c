@@ -0,0 +1,267 @@
+#include <dirent.h>
+#include "i.h"
+
+/*
+ * Capture simulator: sound files take the place of the sound card so buffer
+ * settings and hardware can be sized without field trials.
+ * Input is paced at real time, a multiple of it, or as fast as the writer
+ * will take it.  It can loop over a directory of files, with sinusoids
+ * mixed in.  Stalls can be injected into the writer.
+ * When paced, a full ring loses a period just as it would with ALSA.
+ * Whatever the pacing, the writer's time per buffer is replayed against real-time
+ * arrival, to say whether the ring would have overrun at the real sampling rate.
+ */
+
+static int64_t
+simulate_microseconds(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*(int64_t)1000000 + ts.tv_nsec/1000;
+}
+
+static int
+compare_pathnames(const void *a, const void *b) {
+	return strcmp(*(char **)a, *(char **)b);
+}
+
+// pathname is a sound file or a directory of them, played in name order
+static void
+simulate_add_input(simulator_t *s, const char *pathname) {
+	struct stat st;
+	if (stat(pathname, &st))
+		die("can not stat %s: %s", pathname, strerror(errno));
+	if (!S_ISDIR(st.st_mode)) {
+		s->pathnames = srealloc(s->pathnames, (s->n_pathnames+1)*sizeof s->pathnames[0]);
+		s->pathnames[s->n_pathnames++] = g_strdup(pathname);
+		return;
+	}
+	DIR *dp = opendir(pathname);
+	if (!dp)
+		die("can not open directory %s: %s", pathname, strerror(errno));
+	struct dirent *ep;
+	while ((ep = readdir(dp))) {
+		if (ep->d_name[0] == '.')
+			continue;
+		s->pathnames = srealloc(s->pathnames, (s->n_pathnames+1)*sizeof s->pathnames[0]);
+		s->pathnames[s->n_pathnames++] = g_strdup_printf("%s/%s", pathname, ep->d_name);
+	}
+	closedir(dp);
+	qsort(s->pathnames, s->n_pathnames, sizeof s->pathnames[0], compare_pathnames);
+}
+
+// parse "frequency:amplitude,..." with frequencies in Hz and amplitudes relative to full scale
+static void
+simulate_parse_sinusoids(simulator_t *s, const char *spec) {
+	while (spec && *spec) {
+		char *end;
+		double frequency = strtod(spec, &end);
+		if (*end != ':')
+			die("simulate_sinusoids: expected frequency:amplitude at '%s'", spec);
+		double amplitude = strtod(end + 1, &end);
+		if (frequency < 0 || frequency > s->sampling_rate/2.0 || amplitude < 0 || amplitude > 1)
+			die("simulate_sinusoids: %g Hz at amplitude %g is out of range", frequency, amplitude);
+		s->sinusoids = srealloc(s->sinusoids, (s->n_sinusoids+1)*sizeof s->sinusoids[0]);
+		s->sinusoids[s->n_sinusoids++] = (sinusoid_t){amplitude, 0, frequency/s->sampling_rate};
+		spec = *end == ',' ? end + 1 : end;
+		if (*end && *end != ',')
+			die("simulate_sinusoids: unexpected '%s'", end);
+	}
+}
+
+/**
+ * Set up simulated capture from sound_capture:simulate_input_from_file
+ * @param[in] n_channels channels of simulated frames, input files must match
+ * @param[in] sampling_rate rate simulated frames are paced at
+ * @returns simulator to pass to capture_start, NULL if input is to come from ALSA
+ */
+simulator_t *
+simulate_start(int n_channels, int sampling_rate) {
+	const char *input = param_get_string_with_default(SOUND_CAPTURE_GROUP, "simulate_input_from_file", "");
+	if (!input || !*input)
+		return NULL;
+	simulator_t *s = salloc(sizeof *s);
+	memset(s, 0, sizeof *s);
+	s->n_channels = n_channels;
+	s->sampling_rate = sampling_rate;
+	simulate_add_input(s, input);
+	if (!s->n_pathnames)
+		die("no sound files in %s", input);
+	s->loop = param_get_boolean_with_default(SOUND_CAPTURE_GROUP, "simulate_loop", 0);
+	s->speed = param_get_double_with_default(SOUND_CAPTURE_GROUP, "simulate_speed", 0);
+	simulate_parse_sinusoids(s, param_get_string_with_default(SOUND_CAPTURE_GROUP, "simulate_sinusoids", ""));
+	s->burst_seconds = param_get_double_with_default(SOUND_CAPTURE_GROUP, "simulate_sinusoid_seconds", 0);
+	s->burst_period_seconds = param_get_double_with_default(SOUND_CAPTURE_GROUP, "simulate_sinusoid_period_seconds", 0);
+	s->stall_seconds = param_get_double_with_default(SOUND_CAPTURE_GROUP, "simulate_stall_seconds", 0);
+	s->stall_every_buffers = param_get_integer_with_default(SOUND_CAPTURE_GROUP, "simulate_stall_every_buffers", 0);
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	s->start_time = tv.tv_sec*(int64_t)1000000 + tv.tv_usec;
+	s->start_microseconds = simulate_microseconds();
+	dp(2, "simulating capture from %d files, speed %g%s\n", s->n_pathnames, s->speed, s->speed ? "x real time" : " (as fast as possible)");
+	return s;
+}
+
+// mix the sinusoids into frames, which start at frame number first
+static void
+simulate_add_sinusoids(simulator_t *s, int16_t *frames, index_t n_frames, uint64_t first) {
+	if (n_frames > s->mono_frames) {
+		s->mono = srealloc(s->mono, n_frames*sizeof s->mono[0]);
+		s->mono_frames = n_frames;
+	}
+	for (index_t i = 0, n; i < n_frames; i += n) {
+		// split at the start and end of bursts
+		n = n_frames - i;
+		if (s->burst_period_seconds > 0) {
+			index_t period = s->burst_period_seconds*s->sampling_rate;
+			index_t on = s->burst_seconds*s->sampling_rate;
+			index_t position = (first + i) % period;
+			if (position >= on) {
+				n = MIN(n, period - position);
+				continue;
+			}
+			n = MIN(n, on - position);
+		}
+		for (int j = 0; j < s->n_sinusoids; j++) {
+			sinusoid_t sinusoid = s->sinusoids[j];
+			sinusoid.phase = fmod(2*M_PI*sinusoid.frequency*(double)(first + i), 2*M_PI);
+			set_sinusoid(s->mono, n, sinusoid);
+			for (index_t k = 0; k < n; k++)
+				for (int channel = 0; channel < s->n_channels; channel++) {
+					int16_t *f = &frames[(i + k)*s->n_channels + channel];
+					*f = MAX(INT16_MIN, MIN(INT16_MAX, *f + s->mono[k]));
+				}
+		}
+	}
+}
+
+static int
+simulate_next_file(simulator_t *s) {
+	if (s->file) {
+		soundfile_close(s->file);
+		free(s->file);
+		s->file = NULL;
+	}
+	if (s->next_pathname == s->n_pathnames) {
+		if (!s->loop)
+			return 0;
+		s->next_pathname = 0;
+	}
+	const char *pathname = s->pathnames[s->next_pathname++];
+	s->file = soundfile_open_read(pathname);
+	if (s->file->channels != s->n_channels)
+		die("%s has %d channels, %d are being simulated", pathname, s->file->channels, s->n_channels);
+	if (s->file->samplerate != s->sampling_rate)
+		dp(1, "%s sampled at %d Hz is being played at %d Hz\n", pathname, s->file->samplerate, s->sampling_rate);
+	dp(20, "simulating input from %s\n", pathname);
+	return 1;
+}
+
+/**
+ * Read simulated frames, in place of alsa_readi
+ * @param[in] s simulator
+ * @param[out] frames receives n_frames interleaved frames
+ * @param[in] n_frames frames wanted
+ * @returns frames read, fewer than n_frames only when the input is exhausted
+ *
+ * Returns once the frames would have been captured at the simulated speed.
+ */
+index_t
+simulate_read(simulator_t *s, int16_t *frames, index_t n_frames) {
+	index_t done = 0;
+	while (done < n_frames) {
+		if (!s->file && !simulate_next_file(s))
+			break;
+		index_t n = soundfile_read(s->file, frames + (size_t)done*s->n_channels, n_frames - done);
+		if (n <= 0) {
+			if (!simulate_next_file(s))
+				break;
+			continue;
+		}
+		done += n;
+	}
+	if (s->n_sinusoids)
+		simulate_add_sinusoids(s, frames, done, s->frames);
+	s->frames += done;
+	if (s->speed > 0) {
+		int64_t due = s->start_microseconds + (int64_t)(s->frames*1e6/(s->sampling_rate*s->speed));
+		int64_t wait = due - simulate_microseconds();
+		if (wait > 0)
+			usleep(wait);
+	}
+	return done;
+}
+
+/**
+ * Time at which simulated frames would have been captured
+ * @param[in] s simulator
+ * @param[in] frame number of frames captured
+ * @param[out] tv wall clock time when the simulation started plus frame/sampling_rate,
+ * so file names and rotation follow simulated rather than real time
+ */
+void
+simulate_time(simulator_t *s, uint64_t frame, struct timeval *tv) {
+	int64_t microseconds = s->start_time + (int64_t)(frame*1000000/s->sampling_rate);
+	tv->tv_sec = microseconds/1000000;
+	tv->tv_usec = microseconds%1000000;
+}
+
+/* call when the writer starts on a buffer */
+void
+simulate_buffer_start(simulator_t *s) {
+	if (s)
+		s->buffer_start = simulate_microseconds();
+}
+
+/**
+ * Call when the writer has finished a buffer: inject any stall, then work out
+ * how full the ring would have been had the writer taken as long at real time
+ * @param[in] s simulator, may be NULL
+ * @param[in] r ring the buffer was taken from
+ * @param[in] n_frames frames in the buffer
+ */
+void
+simulate_buffer_end(simulator_t *s, capture_ring_t *r, index_t n_frames) {
+	if (!s)
+		return;
+	s->n_buffers++;
+	if (s->stall_every_buffers && s->n_buffers % s->stall_every_buffers == 0) {
+		dp(20, "simulating a %gs writer stall\n", s->stall_seconds);
+		usleep(s->stall_seconds*1e6);
+		s->n_stalls++;
+	}
+	double seconds = (simulate_microseconds() - s->buffer_start)/1e6;
+	s->max_buffer_seconds = MAX(s->max_buffer_seconds, seconds);
+	// at real time the buffer's last frame arrives at consumed/sampling_rate
+	const uint64_t consumed = r->read;
+	double start = MAX(s->writer_clock, consumed/(double)s->sampling_rate);
+	s->writer_clock = start + seconds;
+	// frames arrived by the time this buffer is released, less those already released
+	double waiting = s->writer_clock*s->sampling_rate - (consumed - n_frames);
+	s->realtime_high_watermark = MAX(s->realtime_high_watermark, waiting);
+}
+
+/**
+ * Print a summary of the simulation to stdout
+ * @param[in] s simulator, may be NULL
+ * @param[in] r ring
+ */
+void
+simulate_report(simulator_t *s, capture_ring_t *r) {
+	if (!s)
+		return;
+	double seconds = (simulate_microseconds() - s->start_microseconds)/1e6;
+	double sound_seconds = r->read/(double)s->sampling_rate;
+	printf("simulated_seconds=%.3f\n", sound_seconds);
+	printf("elapsed_seconds=%.3f\n", seconds);
+	printf("throughput_frames_per_second=%.0f\n", seconds > 0 ? r->read/seconds : 0);
+	printf("throughput_times_real_time=%.2f\n", seconds > 0 ? sound_seconds/seconds : 0);
+	printf("buffers=%d\n", s->n_buffers);
+	printf("writer_stalls=%d\n", s->n_stalls);
+	printf("writer_max_buffer_seconds=%.3f\n", s->max_buffer_seconds);
+	printf("ring_frames=%lu\n", (unsigned long)r->n_frames);
+	printf("ring_high_watermark_frames=%llu\n", (unsigned long long)__atomic_load_n(&r->high_watermark, __ATOMIC_RELAXED));
+	printf("ring_overruns=%llu\n", (unsigned long long)__atomic_load_n(&r->overruns, __ATOMIC_RELAXED));
+	printf("realtime_high_watermark_frames=%.0f\n", s->realtime_high_watermark);
+	printf("realtime_overrun=%s\n", s->realtime_high_watermark > r->n_frames ? "yes" : "no");
+	fflush(stdout);
+}
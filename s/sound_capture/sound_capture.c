@@ -1,6 +1,5 @@
 #include "i.h"
 
-#define SOUND_CAPTURE_GROUP "sound_capture"
 #define VERSION "0.1.1"
 #define FILE_DIR_FORMAT "%d_%02d_%02d" // args are year, month, day
 #define FILE_NAME_FORMAT "%s/%s/%02d_%02d_%02d_%06d.%s" // args are data_dir, file_dir(date), hours, minutes, seconds, microseconds, file extension
@@ -21,29 +20,51 @@ int main(int argc, char *argv[])
 }
 
 
+static void
+settings_changed(const char *group, void *data)
+{
+	*(int *)data = 1;
+}
+
+
+static metric_t *buffer_metric;
+static metric_t *writer_cpu_metric;
+
+/* record the time taken to write a buffer, start and cpu taken before it was begun */
+static void
+buffer_written(uint64_t start, uint64_t cpu)
+{
+	metric_observe(buffer_metric, metrics_microseconds() - start);
+	metric_add(writer_cpu_metric, metrics_thread_cpu_microseconds() - cpu);
+}
+
+
 void run(void) 
 {
 	struct timeval  tv ;
-	const int duration = param_get_integer_with_default(SOUND_CAPTURE_GROUP, "recording_duration", 0);
+	const time_t start_time = time(NULL);
+	int duration = param_get_integer_with_default(SOUND_CAPTURE_GROUP, "recording_duration", 0);
 	const int n_channels = param_get_integer(SOUND_CAPTURE_GROUP, "alsa_n_channels");
-	const int buffer_frames = param_get_integer(SOUND_CAPTURE_GROUP, "sound_buffer_frames");
+	int buffer_frames = param_get_integer(SOUND_CAPTURE_GROUP, "sound_buffer_frames");
 	const int sampling_rate = param_get_integer(SOUND_CAPTURE_GROUP, "alsa_sampling_rate");
-	const char *data_dir = param_get_string(SOUND_CAPTURE_GROUP, "data_dir");
-	const char *file_dir_format = param_get_string_with_default(SOUND_CAPTURE_GROUP, "file_dir_format", FILE_DIR_FORMAT);
-	const char *file_name_format = param_get_string_with_default(SOUND_CAPTURE_GROUP, "file_name_format", FILE_NAME_FORMAT);
-	const char *file_ext = param_get_string(SOUND_CAPTURE_GROUP, "sound_file_ext");
-	const char *details_ext = param_get_string(SOUND_CAPTURE_GROUP, "sound_details_ext");
-	char *simulate_input_from_file = param_get_string(SOUND_CAPTURE_GROUP, "simulate_input_from_file");
-	soundfile_t	*simulated_input = NULL;
+	output_settings_t output = {0};
+	get_output_settings(&output);
+	int reload = 0;
 	
-	if (simulate_input_from_file && strlen(simulate_input_from_file))
-		simulated_input = soundfile_open_read(simulate_input_from_file);
+	// compression type is read for each file, so needs no action on reload
+	if (param_get_boolean_with_default(SOUND_CAPTURE_GROUP, "reload_config", 1) && param_watch_config_files() == 0)
+		param_add_reload_callback(SOUND_CAPTURE_GROUP, settings_changed, &reload);
+	simulator_t *simulator = simulate_start(n_channels, sampling_rate);
+	// shared with beagle_watchdog and the web interface, and printed in the stats file
+	metrics_open(param_get_string_with_default(SOUND_CAPTURE_GROUP, "metrics_file", ""));
+	buffer_metric = metric_histogram("writer_buffer_us");
+	writer_cpu_metric = metric_counter("writer_cpu_us");
 	
 	// if a duration is given, then set time_limit to (current time + duration), 
 	// otherwise set time_limit to max value of time_t (signed long) so it'll never be reached
-	time_t time_limit = duration ? time(NULL) + duration : LONG_MAX;
+	time_t time_limit = duration ? start_time + duration : LONG_MAX;
 
-	if (ensure_directory_exists(data_dir, ".", 20))
+	if (ensure_directory_exists(output.data_dir, ".", 20))
 			exit(1);
 
 	int16_t *buffer = salloc(n_channels*buffer_frames*sizeof *buffer); 
@@ -51,35 +72,83 @@ void run(void)
 	reapchildren.sa_flags = SA_NOCLDWAIT;
 	sigaction(SIGCHLD, &reapchildren, 0);
 
-	if (!simulated_input) {
+	if (!simulator) {
 		do_alsa_init(param_get_string(SOUND_CAPTURE_GROUP, "alsa_pcm_name"),
 				param_get_integer(SOUND_CAPTURE_GROUP, "alsa_sampling_rate"),
 				param_get_integer(SOUND_CAPTURE_GROUP, "alsa_n_periods"),
 				param_get_integer(SOUND_CAPTURE_GROUP, "alsa_periods_size"),
 				param_get_integer(SOUND_CAPTURE_GROUP, "alsa_n_channels"),
-				param_get_integer(SOUND_CAPTURE_GROUP, "alsa_buffer_size"));
+				param_get_integer(SOUND_CAPTURE_GROUP, "alsa_buffer_size"),
+				param_get_boolean_with_default(SOUND_CAPTURE_GROUP, "alsa_mmap", 0));
 	} 
+
+	// the capture thread fills the ring while this thread writes files from it
+	const char *stats_file = param_get_string(SOUND_CAPTURE_GROUP, "capture_stats_file");
+	capture_ring_t *ring = capture_start(simulator, n_channels, sampling_rate,
+			param_get_integer_with_default(SOUND_CAPTURE_GROUP, "capture_ring_frames", 2*buffer_frames),
+			param_get_integer_with_default(SOUND_CAPTURE_GROUP, "capture_period_frames", 4096),
+			param_get_integer_with_default(SOUND_CAPTURE_GROUP, "capture_priority", 0));
+	detect_start(n_channels, sampling_rate);
+	storage_init();
 	
 //	int beep_enabled = param_get_boolean(SOUND_CAPTURE_GROUP, "beep");
 	dp(30, "starting loop\n");
 	for (int i = 0; time(NULL) < time_limit; ++i) {
 		dp(30, "loop %d\n", i);
-		int length;
-		if (simulated_input) {
-			length = soundfile_read(simulated_input, buffer, buffer_frames);
-			dp(20, "%d frames read from %s (%d requested)\n", length, simulate_input_from_file, buffer_frames);
-			if (length <buffer_frames) {
-				dp(2, "existing because insufficient simulated input left to fill buffer\n");
-				exit(0);
+		// the previous file is complete, so this is a safe point to take up config changes
+		if (param_apply_changes() > 0 && reload) {
+			reload = 0;
+			duration = param_get_integer_with_default(SOUND_CAPTURE_GROUP, "recording_duration", 0);
+			time_limit = duration ? start_time + duration : LONG_MAX;
+			int new_buffer_frames = param_get_integer(SOUND_CAPTURE_GROUP, "sound_buffer_frames");
+			if (new_buffer_frames > ring->n_frames) {
+				dp(0, "sound_buffer_frames %d is larger than the capture ring (%d frames), not changed\n", new_buffer_frames, ring->n_frames);
+			} else if (new_buffer_frames != buffer_frames) {
+				buffer_frames = new_buffer_frames;
+				buffer = srealloc(buffer, n_channels*buffer_frames*sizeof *buffer);
 			}
-		} else {
-			length = alsa_readi(buffer, buffer_frames);
+			// the file being streamed keeps its name, the next one uses the new settings,
+			// except that a new rotation period (or none) ends it now
+			int rotation_seconds = output.rotation_seconds;
+			get_output_settings(&output);
+			if (output.rotation_seconds != rotation_seconds)
+				stream_close();
+			stats_file = param_get_string(SOUND_CAPTURE_GROUP, "capture_stats_file");
+			if (param_get_integer(SOUND_CAPTURE_GROUP, "alsa_n_channels") != n_channels
+					|| param_get_integer(SOUND_CAPTURE_GROUP, "alsa_sampling_rate") != sampling_rate)
+				dp(0, "alsa settings changed - restart sound_capture for them to take effect\n");
+			if (ensure_directory_exists(output.data_dir, ".", 20))
+				exit(1);
+			dp(2, "reloaded settings, buffer %d frames\n", buffer_frames);
+		}
+		index_t available = capture_wait(ring, buffer_frames);
+		dp(30, "%d frames available (%d requested)\n", available, buffer_frames);
+		if (available < buffer_frames) {
+			dp(2, "existing because insufficient simulated input left to fill buffer\n");
+			stream_close();
+			detect_stop();
+			storage_sync(1);
+			capture_write_stats(ring, stats_file, 1);
+			simulate_report(simulator, ring);
+			exit(0);
 		}
-		gettimeofday(&tv, NULL);
-		time_t t = time(NULL);
-		struct tm *local = localtime(&t);
-		if (length <= 0)
+		simulate_buffer_start(simulator);
+		const uint64_t buffer_start = metrics_microseconds();
+		const uint64_t buffer_cpu = metrics_thread_cpu_microseconds();
+		if (output.rotation_seconds) {
+			// hand views of the ring straight to the encoder, no copy is needed
+			for (index_t n, done = 0; done < buffer_frames; done += n) {
+				int16_t *data;
+				n = capture_peek(ring, buffer_frames - done, &data, &tv);
+				stream_write(&output, data, n, &tv);
+				capture_release(ring, n);
+			}
+			buffer_written(buffer_start, buffer_cpu);
+			simulate_buffer_end(simulator, ring, buffer_frames);
+			capture_write_stats(ring, stats_file, 0);
 			continue;
+		}
+		capture_read(ring, buffer, buffer_frames, &tv);
 //		if (beep_enabled) {
 //			beep_enabled = FALSE;
 //			int active_high = param_get_boolean(SOUND_CAPTURE_GROUP, "active_high");
@@ -89,23 +158,116 @@ void run(void)
 //			msleep(300);
 //			beep(1, 3000, 1, active_high);
 //		}
-		char file_dir[PATH_MAX];
-		snprintf(file_dir, sizeof(file_dir), file_dir_format, 1900 + local->tm_year, local->tm_mon+1, local->tm_mday);
-		if (ensure_directory_exists(data_dir, file_dir, 20))
-			exit(1);
-
 		char details_pathname[PATH_MAX];
 		char pathname[PATH_MAX];
-		snprintf(details_pathname, sizeof(details_pathname), file_name_format, data_dir, file_dir, local->tm_hour, local->tm_min, local->tm_sec, (uint32_t)tv.tv_usec, details_ext);
-		snprintf(pathname, sizeof(pathname), file_name_format, data_dir, file_dir, local->tm_hour, local->tm_min, local->tm_sec, (uint32_t)tv.tv_usec, file_ext);
-		write_data(buffer, n_channels, length, sampling_rate, pathname, details_pathname, tv.tv_sec, (uint32_t)tv.tv_usec);
-        if (length < buffer_frames)
-			die("too few frames returned(%d) - %d requested", length, buffer_frames);
-            
+		make_pathnames(&output, &tv, pathname, details_pathname);
+		write_data(buffer, n_channels, buffer_frames, sampling_rate, pathname, details_pathname, tv.tv_sec, (uint32_t)tv.tv_usec);
+		buffer_written(buffer_start, buffer_cpu);
+		simulate_buffer_end(simulator, ring, buffer_frames);
+		capture_write_stats(ring, stats_file, 0);
 	}
+	stream_close();
+	detect_stop();
+	storage_sync(1);
+	capture_write_stats(ring, stats_file, 1);
+	simulate_report(simulator, ring);
+}
+
+
+void
+get_output_settings(output_settings_t *o)
+{
+	o->data_dir = param_get_string(SOUND_CAPTURE_GROUP, "data_dir");
+	o->file_dir_format = param_get_string_with_default(SOUND_CAPTURE_GROUP, "file_dir_format", FILE_DIR_FORMAT);
+	o->file_name_format = param_get_string_with_default(SOUND_CAPTURE_GROUP, "file_name_format", FILE_NAME_FORMAT);
+	o->file_ext = param_get_string(SOUND_CAPTURE_GROUP, "sound_file_ext");
+	o->details_ext = param_get_string(SOUND_CAPTURE_GROUP, "sound_details_ext");
+	o->n_channels = param_get_integer(SOUND_CAPTURE_GROUP, "alsa_n_channels");
+	o->sampling_rate = param_get_integer(SOUND_CAPTURE_GROUP, "alsa_sampling_rate");
+	o->rotation_seconds = param_get_integer_with_default(SOUND_CAPTURE_GROUP, "file_rotation_seconds", 0);
+}
+
+
+/* build the sound and details pathnames for a file timestamped tv, creating its directory */
+void
+make_pathnames(const output_settings_t *o, const struct timeval *tv, char *pathname, char *details_pathname)
+{
+	time_t t = tv->tv_sec;
+	struct tm *local = localtime(&t);
+	char file_dir[PATH_MAX];
+	snprintf(file_dir, sizeof(file_dir), o->file_dir_format, 1900 + local->tm_year, local->tm_mon+1, local->tm_mday);
+	if (storage_ensure_directory(o->data_dir, file_dir))
+		exit(1);
+	snprintf(details_pathname, PATH_MAX, o->file_name_format, o->data_dir, file_dir, local->tm_hour, local->tm_min, local->tm_sec, (uint32_t)tv->tv_usec, o->details_ext);
+	snprintf(pathname, PATH_MAX, o->file_name_format, o->data_dir, file_dir, local->tm_hour, local->tm_min, local->tm_sec, (uint32_t)tv->tv_usec, o->file_ext);
 }
 
 
+/*
+ * Streaming output: one file is kept open and buffers are appended to it,
+ * starting a new file at each multiple of rotation_seconds of wall-clock time.
+ * Buffers can then be short while files stay long, and no process is forked.
+ */
+static soundfile_t *stream_file;
+static char stream_pathname[PATH_MAX];
+static char stream_details_pathname[PATH_MAX];
+static struct timeval stream_start;	// capture time of first frame of stream_file
+static int64_t stream_end;			// microseconds since the epoch at which the next file starts
+
+static void
+stream_open(const output_settings_t *o, int64_t microseconds)
+{
+	stream_start.tv_sec = microseconds/1000000;
+	stream_start.tv_usec = microseconds%1000000;
+	int64_t rotation = o->rotation_seconds*(int64_t)1000000;
+	stream_end = (microseconds/rotation + 1)*rotation;
+	make_pathnames(o, &stream_start, stream_pathname, stream_details_pathname);
+	dp(20, "starting %s\n", stream_pathname);
+	unlink(stream_details_pathname);
+	unlink(stream_pathname);
+	stream_file = soundfile_open_write(stream_pathname, o->n_channels, o->sampling_rate);
+}
+
+/* finish the file being streamed, if any, and write its details file */
+void
+stream_close(void)
+{
+	if (!stream_file)
+		return;
+	dp(20, "finishing %s\n", stream_pathname);
+	soundfile_close(stream_file);
+	free(stream_file);
+	stream_file = NULL;
+	write_details(stream_details_pathname, stream_start.tv_sec, stream_start.tv_usec);
+}
+
+/*
+ * append n_frames to the streamed files, tv is the capture time of the end of the buffer
+ * files are named by the capture time of their first frame
+ */
+void
+stream_write(const output_settings_t *o, int16_t *buffer, index_t n_frames, const struct timeval *tv)
+{
+	const int64_t end = tv->tv_sec*(int64_t)1000000 + tv->tv_usec;
+	const int64_t start = end - n_frames*(int64_t)1000000/o->sampling_rate;
+	index_t done = 0;
+	while (done < n_frames) {
+		int64_t frame_time = start + done*(int64_t)1000000/o->sampling_rate;
+		if (!stream_file)
+			stream_open(o, frame_time);
+		// first frame captured at or after the rotation boundary
+		int64_t boundary = (stream_end - start)*o->sampling_rate;
+		index_t n_before = boundary <= 0 ? 0 : MIN(n_frames, (boundary + 999999)/1000000);
+		if (n_before > done) {
+			soundfile_write(stream_file, buffer + (size_t)done*o->n_channels, n_before - done);
+			detect_submit(buffer + (size_t)done*o->n_channels, n_before - done);
+			done = n_before;
+		}
+		if (done < n_frames)
+			stream_close();
+	}
+}
+
 
 /* ensure the directory exists and is writable. 
  * return 0 on success
@@ -207,24 +369,41 @@ write_data(int16_t *buffer, int n_channels, int n_frames, int sampling_rate, cha
 		default:
 			die("unknown compression type '%d' requested", param_get_integer(SOUND_CAPTURE_GROUP, "sound_compression_type"));
 	}
-	FILE *fp = fopen(details_pathname, "w");
-	assert(fp);
-	fprintf(fp, "%lu.%06lu@%02d\n", (unsigned long)seconds, (unsigned long)microseconds, 10*calculate_monitoring_priority(seconds));
-	fclose(fp);
+	detect_submit(buffer, n_frames);
+	write_details(details_pathname, seconds, microseconds);
+}
+
+
+/* with call detection on, the details file is written once the file has been scored */
+void
+write_details(char *details_pathname, time_t seconds, uint32_t microseconds)
+{
+	if (!detect_finish(details_pathname, seconds, microseconds))
+		write_details_file(details_pathname, seconds, microseconds, 10*calculate_monitoring_priority(seconds), NULL);
+}
+
+/* level is the @NN priority dataman uses, extra is an optional second line */
+void
+write_details_file(const char *details_pathname, time_t seconds, uint32_t microseconds, int level, const char *extra)
+{
+	char details[512];
+	int length = snprintf(details, sizeof details, "%lu.%06lu@%02d\n%s%s", (unsigned long)seconds, (unsigned long)microseconds, level, extra ? extra : "", extra ? "\n" : "");
+	storage_file_t *f = storage_open(details_pathname, 0, 0);
+	assert(f);
+	storage_write(f, details, MIN(length, sizeof details - 1));
+	storage_close(f);
 }
 
 
 void
 write_wav_data(char *wav_header, int16_t *buffer, int n_channels, int n_frames, int sampling_rate, char *pathname)
 {
-	int fd = open(pathname, O_WRONLY|O_CREAT, 0666);
-	assert(fd >= 0);
-	if (write(fd, wav_header, WAV_HEADER_SIZE) != WAV_HEADER_SIZE)
-		die("write header failed");
 	size_t write_size = n_channels*n_frames*sizeof *buffer;
-	if (write(fd, buffer, write_size) != write_size)
-		die("write data failed");
-	close(fd);
+	storage_file_t *f = storage_open(pathname, WAV_HEADER_SIZE + write_size, 1);
+	assert(f);
+	storage_write(f, wav_header, WAV_HEADER_SIZE);
+	storage_write(f, buffer, write_size);
+	storage_close(f);
 }
 
 
@@ -290,7 +469,8 @@ fork_write_cmd(char *wav_header, int16_t *buffer, int n_channels, int n_frames,
 	write_cmd(wav_header, buffer, n_channels, n_frames, sampling_rate, pathname);
 
 	dp(20,"child complete\n");
-	exit(0);
+	// _exit as the detector thread and stdio buffers belong to the parent
+	_exit(0);
 }
 
 
@@ -0,0 +1,241 @@
+#define _GNU_SOURCE                     // O_DIRECT, fallocate
+#include "i.h"
+
+/*
+ * Storage for capture output, tuned for SD/CF cards.
+ * Each file's full size is reserved when it is opened.
+ * With O_DIRECT, data is staged and written in large aligned chunks; otherwise
+ * it is written straight from the caller's buffer and the page cache batches it.
+ * fdatasync is batched: closed files are kept open and synced together every
+ * storage_sync_seconds rather than one by one.
+ * The day directory is checked once, not on every buffer.
+ * Latency of each kind of operation is recorded in a storage_*_us histogram metric.
+ */
+
+#define STORAGE_ALIGNMENT 4096
+#define STORAGE_MAX_PENDING 64
+
+typedef enum {
+	so_open,                            // open and fallocate
+	so_write,
+	so_sync,
+	so_n_operations
+} storage_operation_t;
+
+static const char *storage_metric_names[so_n_operations] = {"storage_open_us", "storage_write_us", "storage_sync_us"};
+
+static struct {
+	int initialized;
+	int o_direct;
+	int preallocate;
+	size_t chunk_bytes;
+	int sync_seconds;
+	pthread_mutex_t lock;               // protects everything below
+	char directory[PATH_MAX];           // last directory known to exist
+	int pending[STORAGE_MAX_PENDING];   // descriptors written but not yet synced
+	int n_pending;
+	time_t last_sync;
+	metric_t *latency[so_n_operations];
+	metric_t *bytes_written;
+} storage = {0, 0, 0, 0, 0, PTHREAD_MUTEX_INITIALIZER};
+
+static void
+storage_record(storage_operation_t op, uint64_t start) {
+	metric_observe(storage.latency[op], metrics_microseconds() - start);
+}
+
+/* read storage settings, called once before capture starts */
+void
+storage_init(void) {
+	storage.o_direct = param_get_boolean_with_default(SOUND_CAPTURE_GROUP, "storage_o_direct", 0);
+	storage.preallocate = param_get_boolean_with_default(SOUND_CAPTURE_GROUP, "storage_preallocate", 1);
+	index_t chunk_bytes = param_get_integer_with_default(SOUND_CAPTURE_GROUP, "storage_chunk_bytes", 1<<20);
+	storage.chunk_bytes = MAX(STORAGE_ALIGNMENT, chunk_bytes - chunk_bytes % STORAGE_ALIGNMENT);
+	storage.sync_seconds = param_get_integer_with_default(SOUND_CAPTURE_GROUP, "storage_sync_seconds", 10);
+	storage.last_sync = time(NULL);
+	for (int op = 0; op < so_n_operations; op++)
+		storage.latency[op] = metric_histogram(storage_metric_names[op]);
+	storage.bytes_written = metric_counter("storage_bytes_written");
+	storage.initialized = 1;
+	dp(20, "storage o_direct=%d preallocate=%d chunk_bytes=%lu sync_seconds=%d\n", storage.o_direct, storage.preallocate, (unsigned long)storage.chunk_bytes, storage.sync_seconds);
+}
+
+/**
+ * ensure_directory_exists, remembering the last directory found so
+ * files written to the same day's directory cost no extra stat or mkdir
+ * @param[in] parent,dir_name as for ensure_directory_exists
+ * @returns as for ensure_directory_exists
+ */
+int
+storage_ensure_directory(const char *parent, const char *dir_name) {
+	char dir[PATH_MAX];
+	snprintf(dir, sizeof dir, "%s/%s", parent, dir_name);
+	pthread_mutex_lock(&storage.lock);
+	int known = !strcmp(dir, storage.directory);
+	pthread_mutex_unlock(&storage.lock);
+	if (known)
+		return 0;
+	int result = ensure_directory_exists(parent, dir_name, 20);
+	if (result)
+		return result;
+	// the new directory entry is synced with the next batch of files
+	int fd = open(parent, O_RDONLY|O_DIRECTORY);
+	pthread_mutex_lock(&storage.lock);
+	strcpy(storage.directory, dir);
+	if (fd >= 0 && storage.n_pending < STORAGE_MAX_PENDING)
+		storage.pending[storage.n_pending++] = fd;
+	else if (fd >= 0)
+		close(fd);
+	pthread_mutex_unlock(&storage.lock);
+	return 0;
+}
+
+/**
+ * fdatasync and close files written since the last sync
+ * @param[in] force sync even if storage_sync_seconds have not passed
+ */
+void
+storage_sync(int force) {
+	int fds[STORAGE_MAX_PENDING];
+	pthread_mutex_lock(&storage.lock);
+	time_t now = time(NULL);
+	int n = 0;
+	if (force || storage.n_pending == STORAGE_MAX_PENDING || now - storage.last_sync >= storage.sync_seconds) {
+		n = storage.n_pending;
+		memcpy(fds, storage.pending, n*sizeof fds[0]);
+		storage.n_pending = 0;
+		storage.last_sync = now;
+	}
+	pthread_mutex_unlock(&storage.lock);
+	for (int i = 0; i < n; i++) {
+		uint64_t start = metrics_microseconds();
+		if (fdatasync(fds[i]))
+			dp(1, "fdatasync failed: %s\n", strerror(errno));
+		storage_record(so_sync, start);
+		close(fds[i]);
+	}
+	if (n)
+		dp(30, "synced %d files\n", n);
+}
+
+/**
+ * Open a file for writing
+ * @param[in] pathname file to create or truncate
+ * @param[in] expected_bytes size to reserve, 0 if unknown
+ * @param[in] direct use O_DIRECT if storage_o_direct is set, only worth it for large files
+ * @returns file, or NULL if pathname can not be opened
+ */
+storage_file_t *
+storage_open(const char *pathname, size_t expected_bytes, int direct) {
+	if (!storage.initialized)
+		storage_init();
+	uint64_t start = metrics_microseconds();
+	direct = direct && storage.o_direct;
+	int fd = open(pathname, O_WRONLY|O_CREAT|O_TRUNC|(direct ? O_DIRECT : 0), 0666);
+	if (fd < 0 && direct && errno == EINVAL) {
+		dp(1, "O_DIRECT not supported for %s\n", pathname);
+		direct = 0;
+		fd = open(pathname, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+	}
+	if (fd < 0) {
+		dp(1, "can not open %s: %s\n", pathname, strerror(errno));
+		if (errno == ENOENT) {
+			// the directory has been removed, check it again next time
+			pthread_mutex_lock(&storage.lock);
+			storage.directory[0] = '\0';
+			pthread_mutex_unlock(&storage.lock);
+		}
+		return NULL;
+	}
+	// without filesystem support fallocate fails rather than writing zeroes, which is what we want
+	if (storage.preallocate && expected_bytes && fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, expected_bytes) && errno != EOPNOTSUPP)
+		dp(20, "fallocate %s failed: %s\n", pathname, strerror(errno));
+	storage_record(so_open, start);
+	storage_file_t *f = salloc(sizeof *f);
+	f->fd = fd;
+	f->direct = direct;
+	if (direct) {
+		f->size = expected_bytes ? MIN(expected_bytes + STORAGE_ALIGNMENT - 1, storage.chunk_bytes) : storage.chunk_bytes;
+		f->size -= f->size % STORAGE_ALIGNMENT;
+		f->size = MAX(f->size, STORAGE_ALIGNMENT);
+		if (posix_memalign((void **)&f->buffer, STORAGE_ALIGNMENT, f->size))
+			die("posix_memalign %lu bytes failed", (unsigned long)f->size);
+	}
+	f->used = 0;
+	f->written = 0;
+	f->pathname = g_strdup(pathname);
+	return f;
+}
+
+// write n_bytes from data, for O_DIRECT a multiple of STORAGE_ALIGNMENT from the aligned buffer
+static void
+storage_flush(storage_file_t *f, const char *data, size_t n_bytes) {
+	uint64_t start = metrics_microseconds();
+	for (size_t done = 0; done < n_bytes;) {
+		ssize_t n = write(f->fd, data + done, n_bytes - done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			die("write to %s failed: %s", f->pathname, n ? strerror(errno) : "no space");
+		done += n;
+	}
+	storage_record(so_write, start);
+	metric_add(storage.bytes_written, n_bytes);
+	f->written += n_bytes;
+}
+
+/**
+ * Append to a file, with O_DIRECT data is staged and written in full chunks
+ * @param[in] f file from storage_open
+ * @param[in] data bytes to append
+ * @param[in] n_bytes number of bytes
+ */
+void
+storage_write(storage_file_t *f, const void *data, size_t n_bytes) {
+	if (!f->direct) {
+		storage_flush(f, data, n_bytes);
+		return;
+	}
+	const char *p = data;
+	while (n_bytes) {
+		size_t n = MIN(n_bytes, f->size - f->used);
+		memcpy(f->buffer + f->used, p, n);
+		f->used += n;
+		p += n;
+		n_bytes -= n;
+		if (f->used == f->size) {
+			storage_flush(f, f->buffer, f->size);
+			f->used = 0;
+		}
+	}
+}
+
+/**
+ * Write out any staged data and close a file
+ * The descriptor is kept until the next batched sync.
+ * @param[in] f file from storage_open, freed
+ */
+void
+storage_close(storage_file_t *f) {
+	if (f->used) {
+		// O_DIRECT writes whole blocks, so pad the tail and trim it off afterwards
+		size_t padded = f->used + (STORAGE_ALIGNMENT - f->used % STORAGE_ALIGNMENT) % STORAGE_ALIGNMENT;
+		memset(f->buffer + f->used, 0, padded - f->used);
+		off_t length = f->written + f->used;
+		storage_flush(f, f->buffer, padded);
+		if (ftruncate(f->fd, length))
+			dp(1, "ftruncate %s failed: %s\n", f->pathname, strerror(errno));
+	}
+	pthread_mutex_lock(&storage.lock);
+	while (storage.n_pending == STORAGE_MAX_PENDING) {
+		pthread_mutex_unlock(&storage.lock);
+		storage_sync(1);
+		pthread_mutex_lock(&storage.lock);
+	}
+	storage.pending[storage.n_pending++] = f->fd;
+	pthread_mutex_unlock(&storage.lock);
+	free(f->buffer);
+	g_free(f->pathname);
+	free(f);
+	storage_sync(0);
+}
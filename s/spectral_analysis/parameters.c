@@ -0,0 +1,45 @@
+#include "i.h"
+
+#define SA_PARAM(key, type, default_value, min, max, description) \
+	{SPECTRAL_ANALYSIS_GROUP, #key, type, offsetof(spectral_analysis_parameters_t, key), default_value, min, max, description}
+
+static const param_spec_t spectral_analysis_specs[] = {
+	SA_PARAM(use_fftw, pt_integer, "1", 0, 1, "use FFTW (1) or fixed-point KISS FFT (0)"),
+	SA_PARAM(sampling_rate, pt_double, "16000", 1, 1e6, "hertz, changed appropriately when files read"),
+	SA_PARAM(fft_points, pt_double, "1024", 2, 1 << 20, NULL),
+	SA_PARAM(fft_window, pt_integer, "128", 1, 1 << 20, NULL),
+	SA_PARAM(fft_overlap, pt_double, "0.5", 0, 0.999, "fraction of fft_window shared by successive windows"),
+	SA_PARAM(peak_min_height, pt_double, "0.0001", 0, 1e9, NULL),
+	SA_PARAM(peak_radius, pt_double, "265", 0, 1e6, "hertz"),
+	SA_PARAM(relative_relief_inside_radius, pt_double, "150", 0, 1e6, "hertz"),
+	SA_PARAM(relative_relief_outside_radius, pt_double, "265", 0, 1e6, "hertz"),
+	SA_PARAM(min_relative_relief, pt_double, "5", 0, 1e9, "minimum ratio of peak to bins between inside and outside radius"),
+	SA_PARAM(max_frequency_delta, pt_double, "8000", 0, 1e9, "hertz per second"),
+	SA_PARAM(min_power_between_track_bins, pt_double, "0.2", 0, 1e9, "minimum relative power of non-peaks incorporated into tracks"),
+	SA_PARAM(min_track_length, pt_double, "0.05", 0, 1e6, "seconds"),
+	SA_PARAM(max_gap_size, pt_double, "0.005", 0, 1e6, "seconds"),
+};
+
+static param_table_t spectral_analysis_table = {
+	spectral_analysis_specs,
+	sizeof spectral_analysis_specs/sizeof spectral_analysis_specs[0],
+	sizeof (spectral_analysis_parameters_t),
+};
+
+static void register_spectral_analysis_parameters(void) __attribute__ ((constructor));
+
+static void
+register_spectral_analysis_parameters(void) {
+	param_register(&spectral_analysis_table);
+}
+
+/**
+ * @returns the spectral_analysis parameters
+ *
+ * Fields are only re-read from the config when a parameter has been set,
+ * so this is cheap enough to call for every frame.
+ */
+const spectral_analysis_parameters_t *
+spectral_analysis_parameters(void) {
+	return param_snapshot(&spectral_analysis_table);
+}
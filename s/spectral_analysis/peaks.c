@@ -2,17 +2,18 @@
 
 int
 bins_to_peaks(int length, power_t data[length], int peaks[length]) {
-	power_t min_height = double_to_power_t(param_get_double("spectral_analysis", "peak_min_height")); // FIXME convert db to power_t
-    double hertz_per_bin = param_get_double("spectral_analysis","sampling_rate")/param_get_double("spectral_analysis","fft_points");
-	dp(27, "hertz_per_bin=%g (%g/%g)\n", hertz_per_bin, param_get_double("spectral_analysis","sampling_rate"), param_get_double("spectral_analysis","fft_points"));
+	const spectral_analysis_parameters_t *p = spectral_analysis_parameters();
+	power_t min_height = double_to_power_t(p->peak_min_height); // FIXME convert db to power_t
+    double hertz_per_bin = p->sampling_rate/p->fft_points;
+	dp(27, "hertz_per_bin=%g (%g/%g)\n", hertz_per_bin, p->sampling_rate, p->fft_points);
 
-	int inside_radius = MAX(1,param_get_double("spectral_analysis", "relative_relief_inside_radius")/hertz_per_bin);
-	int outside_radius = MAX(1, param_get_double("spectral_analysis", "relative_relief_outside_radius")/hertz_per_bin);
+	int inside_radius = MAX(1, p->relative_relief_inside_radius/hertz_per_bin);
+	int outside_radius = MAX(1, p->relative_relief_outside_radius/hertz_per_bin);
 	outside_radius = MIN(outside_radius, (length-1)/2);
 	inside_radius = MIN(inside_radius, outside_radius);
-	int radius = MAX(outside_radius, param_get_double("spectral_analysis", "peak_radius")/hertz_per_bin);
+	int radius = MAX(outside_radius, p->peak_radius/hertz_per_bin);
 	radius = MIN(radius, (length-1)/2);
-	double min_relative_relief = param_get_double("spectral_analysis", "min_relative_relief");
+	double min_relative_relief = p->min_relative_relief;
 	assert(length >= radius*2 + 1);
 	int n_peaks = find_peaks_radius(length, data, peaks, radius, min_height);
 	dp(27, "n_peaks before filtering =%d\n", n_peaks);
@@ -46,7 +46,7 @@ extract_power_phase(sample_t samples[], index_t length, index_t fft_length, int
 	f.fft_size = fft_length;
 	f.n_bins = (f.fft_size+1)/2;
 	if (!do_windowing) {
-		if (param_get_integer("spectral_analysis", "use_fftw")) {
+		if (spectral_analysis_parameters()->use_fftw) {
 			f.window = salloc(f.window_size*sizeof (double));
 			create_square_window(f.window, f.window_size);
 		} else {
@@ -61,7 +61,7 @@ extract_power_phase(sample_t samples[], index_t length, index_t fft_length, int
 
 void
 short_time_power_phase(sample_t samples[], fft_t *f, power_t power[f->n_steps][f->n_bins], phase_t phase[f->n_steps][f->n_bins]) {
-	int use_fftw = param_get_integer("spectral_analysis", "use_fftw");
+	int use_fftw = spectral_analysis_parameters()->use_fftw;
 	assert(f->n_steps > 0);
 	assert(f->window_size > 0 && f->window_size <= f->fft_size);
 	assert(f->step_size > 0 && f->step_size <= f->window_size);
@@ -80,7 +80,7 @@ short_time_power_phase(sample_t samples[], fft_t *f, power_t power[f->n_steps][f
 void
 free_fft(fft_t *f) {
 	if (f->window) g_free(f->window);
-	if (param_get_integer("spectral_analysis", "use_fftw")) {
+	if (spectral_analysis_parameters()->use_fftw) {
 #ifdef USE_FFTW
 		if (f->in) {
 			fftw_destroy_plan(f->state);
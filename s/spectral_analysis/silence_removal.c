@@ -16,6 +16,7 @@ void
 silence_removal_file(char *infilename, char *outfilename) {
 	soundfile_t	*infile = soundfile_open_read(infilename);
 	if (!infile) sdie(NULL, "can not open input file %s: ", infilename) ;
+	soundfile_read_ahead(infile, 0, 0);
 	soundfile_t	*outfile = soundfile_open_write(outfilename, infile->channels, infile->samplerate);
 	if (!outfile) sdie(NULL, "can not open output file %s: ", outfilename) ;
 	int n_channels = infile->channels;
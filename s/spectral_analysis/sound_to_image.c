@@ -6,6 +6,7 @@ void
 sound_to_image(char *sound_file, char *image_file) {
 	soundfile_t	*infile = soundfile_open_read(sound_file);
 	if (!infile) sdie(NULL, "can not open input file %s: ", sound_file) ;
+	soundfile_read_ahead(infile, 0, 0);
 	int n_channels = infile->channels;
 	fft_t fft = {0};
 	fft.window_size = param_get_integer("spectral_analysis", "fft_window");
@@ -8,6 +8,7 @@ extract_calls_file(char *filename, FILE *index_file, int *call_count) {
 	int calculate_phase = param_get_integer("call", "calculate_phase");
 	soundfile_t	*infile = soundfile_open_read(filename);
 	if (!infile) sdie(NULL, "can not open input file %s: ", filename) ;
+	soundfile_read_ahead(infile, 0, 0);
 	int n_channels = infile->channels;
 	uint64_t ignore_channel_bitmap = param_get_integer("call", "ignore_channel_bitmap");
 	fft_t fft = {0};
@@ -219,6 +220,7 @@ score_calls_file(char *filename) {
 	int calculate_phase = 0;
 	soundfile_t	*infile = soundfile_open_read(filename);
 	if (!infile) sdie(NULL, "can not open input file %s: ", filename) ;
+	soundfile_read_ahead(infile, 0, 0);
 	int n_channels = infile->channels;
 	uint64_t ignore_channel_bitmap = param_get_integer("call", "ignore_channel_bitmap");
 	fft_t fft = {0};
@@ -625,6 +627,7 @@ score_channels_file(char *filename) {
 	int calculate_phase = 0;
 	soundfile_t	*infile = soundfile_open_read(filename);
 	if (!infile) sdie(NULL, "can not open input file %s: ", filename) ;
+	soundfile_read_ahead(infile, 0, 0);
 	int n_channels = infile->channels;
 	uint64_t ignore_channel_bitmap = param_get_integer("call", "ignore_channel_bitmap");
 	fft_t fft = {0};
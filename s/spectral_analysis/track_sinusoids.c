@@ -12,10 +12,11 @@ new_update_sinusoid_tracks(fft_t fft, power_t *power, power_t *previous_power, p
 	for (int i = 0; i < n_peaks; i++)
 		is_peak[peaks[i]] = 1;
 	double seconds_per_step = fft.step_size/fft.sampling_rate;
-	int max_frequency_delta = MAX(1,0.5+param_get_double("spectral_analysis", "max_frequency_delta") * seconds_per_step);
-	double min_power_between_track_bins = param_get_double("spectral_analysis", "min_power_between_track_bins");
-	int min_track_length = 0.5+param_get_double("spectral_analysis", "min_track_length")/seconds_per_step;
-	int max_gap_size = 0.5+param_get_double("spectral_analysis", "max_gap_size")/seconds_per_step;;
+	const spectral_analysis_parameters_t *parameters = spectral_analysis_parameters();
+	int max_frequency_delta = MAX(1,0.5+parameters->max_frequency_delta * seconds_per_step);
+	double min_power_between_track_bins = parameters->min_power_between_track_bins;
+	int min_track_length = 0.5+parameters->min_track_length/seconds_per_step;
+	int max_gap_size = 0.5+parameters->max_gap_size/seconds_per_step;
 	dp(22, "max_frequency_delta=%g max_gap_size=%d min_track_length=%d active_tracks=%d\n", (double)max_frequency_delta, (int)max_gap_size, (int)min_track_length, (int)active_tracks->len); 
 	
 	for (int i = 0; i < active_tracks->len; i++) {
@@ -149,9 +150,10 @@ update_sinusoid_tracks(fft_t fft, power_t power_spectrum[restrict fft.n_bins], p
 	uint32_t sinusoid_used_in_track[n_current_sinusoids];
 	memset(sinusoid_used_in_track,0, sizeof sinusoid_used_in_track);
 	double seconds_per_step = fft.step_size/fft.sampling_rate;
-	double max_frequency_delta = param_get_double("spectral_analysis", "max_frequency_delta") * seconds_per_step;
-	int min_track_length = 0.5+param_get_double("spectral_analysis", "min_track_length")/seconds_per_step;
-	int max_gap_size = 0.5+param_get_double("spectral_analysis", "max_gap_size")/seconds_per_step;;
+	const spectral_analysis_parameters_t *parameters = spectral_analysis_parameters();
+	double max_frequency_delta = parameters->max_frequency_delta * seconds_per_step;
+	int min_track_length = 0.5+parameters->min_track_length/seconds_per_step;
+	int max_gap_size = 0.5+parameters->max_gap_size/seconds_per_step;
 	dp(22, "max_frequency_delta=%g max_gap_size=%d min_track_length=%d active_tracks=%d\n", (double)max_frequency_delta, (int)max_gap_size, (int)min_track_length, (int)active_tracks->len); 
 	
 	for (int i = 0; i < active_tracks->len; i++) {
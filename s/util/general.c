@@ -97,6 +97,7 @@ static struct option long_options[] = {
 	{"config-file", 1, 0, 'C'},
 	{"verbosity", 1, 0, 'v'},
 	{"version", 1, 0, 'V'},
+	{"dump-config", 0, 0, 'D'},
 	{0, 0, 0, 0}
 };
 
@@ -105,6 +106,7 @@ simple_option_parsing(int argc, char *argv[], const char *config_group, const ch
 	set_myname(argv);
 	param_initialize();
 	errno = 0;  // handy place to clear any previous errno
+	int dump_config = 0;
 	while (1) {
 		int option_index;
 		int c = getopt_long(argc, argv, short_options, long_options, &option_index);
@@ -124,11 +126,19 @@ simple_option_parsing(int argc, char *argv[], const char *config_group, const ch
 		case 'V':
 			printf("%s v%s\n",myname, version);
   			exit(0);
+		case 'D':
+			dump_config = 1;
+			break;
 		case '?':
-			fprintf(stderr, "Usage: %s [-v<verbosity>] [-o<parameter>=<value>] [-C <config-file>] %s\n", myname, usage);
+			fprintf(stderr, "Usage: %s [-v<verbosity>] [-o<parameter>=<value>] [-C <config-file>] [--dump-config] %s\n", myname, usage);
 			exit(1);
  		}
  	}
+	param_validate();
+	if (dump_config) {
+		param_dump_config(stdout);
+		exit(0);
+	}
  	return optind;
 }
 
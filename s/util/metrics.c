@@ -0,0 +1,252 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "i.h"
+
+/*
+ * Counters, gauges and histograms cheap enough for per-period code.
+ * Updates are relaxed atomic adds, with no locks.
+ * After metrics_open the metrics live in a shared mapping of a file.
+ * Other processes (beagle_watchdog, the web interface) can then read
+ * them with metrics_map, at any time and without IPC.
+ * Metrics are registered by name; registering the same name again returns the same metric.
+ */
+
+static metrics_file_t in_memory_metrics;
+static metrics_file_t *metrics_file = &in_memory_metrics;
+static pthread_mutex_t metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Keep metrics in a file so other processes can read them
+ * @param[in] pathname file to create, replacing any left by a previous run
+ *
+ * Must be called before any metric is registered.
+ */
+void
+metrics_open(const char *pathname) {
+	if (!pathname || !*pathname)
+		return;
+	if (in_memory_metrics.n_metrics)
+		die("metrics_open(%s) called after metrics were registered", pathname);
+	// build the new file beside the old one, so readers never see it half written
+	char tmp_pathname[PATH_MAX];
+	snprintf(tmp_pathname, sizeof tmp_pathname, "%s.tmp", pathname);
+	int fd = open(tmp_pathname, O_RDWR|O_CREAT|O_TRUNC, 0644);
+	if (fd < 0) {
+		dp(1, "can not create %s: %s\n", tmp_pathname, strerror(errno));
+		return;
+	}
+	if (ftruncate(fd, sizeof (metrics_file_t)))
+		die("ftruncate %s failed: %s", tmp_pathname, strerror(errno));
+	metrics_file_t *m = mmap(NULL, sizeof *m, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (m == MAP_FAILED)
+		die("mmap %s failed: %s", tmp_pathname, strerror(errno));
+	m->max_metrics = METRICS_MAX;
+	m->pid = getpid();
+	m->start_time = time(NULL);
+	memcpy(m->magic, METRICS_MAGIC, sizeof m->magic);
+	if (rename(tmp_pathname, pathname))
+		die("rename %s to %s failed: %s", tmp_pathname, pathname, strerror(errno));
+	metrics_file = m;
+	dp(20, "metrics in %s\n", pathname);
+}
+
+/**
+ * Map a metrics file written by another process
+ * @param[in] pathname file created by metrics_open
+ * @returns read-only view of the metrics, NULL if pathname is not a metrics file
+ */
+const metrics_file_t *
+metrics_map(const char *pathname) {
+	int fd = open(pathname, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+	struct stat st;
+	const metrics_file_t *m = MAP_FAILED;
+	if (fstat(fd, &st) == 0 && st.st_size >= sizeof *m)
+		m = mmap(NULL, sizeof *m, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (m == MAP_FAILED)
+		return NULL;
+	if (memcmp(m->magic, METRICS_MAGIC, sizeof m->magic)) {
+		munmap((void *)m, sizeof *m);
+		return NULL;
+	}
+	return m;
+}
+
+/* release a mapping from metrics_map */
+void
+metrics_unmap(const metrics_file_t *m) {
+	if (m)
+		munmap((void *)m, sizeof *m);
+}
+
+/**
+ * Find a metric by name
+ * @param[in] m metrics, from metrics_map, or NULL for this process's metrics
+ * @param[in] name of metric
+ * @returns the metric, NULL if there is no metric of that name
+ */
+const metric_t *
+metrics_find(const metrics_file_t *m, const char *name) {
+	if (!m)
+		m = metrics_file;
+	uint32_t n = __atomic_load_n(&m->n_metrics, __ATOMIC_ACQUIRE);
+	for (uint32_t i = 0; i < n && i < METRICS_MAX; i++)
+		if (!strncmp(m->metrics[i].name, name, METRICS_NAME_LENGTH))
+			return &m->metrics[i];
+	return NULL;
+}
+
+/**
+ * Check a counter in another process's metrics file for change
+ * @param[in,out] w watch, value and last_changed are updated
+ * @param[in] now current time
+ * @returns seconds since the counter last changed
+ *
+ * Time when the file or the counter does not exist, e.g. before the process
+ * has started, is not counted, so only a running process whose counter has
+ * stopped grows old.
+ */
+uint32_t
+metrics_watch_age(metric_watch_t *w, time_t now) {
+	const metrics_file_t *m = metrics_map(w->pathname);
+	const metric_t *metric = m ? metrics_find(m, w->name) : NULL;
+	if (!metric)
+		w->last_changed = now;
+	else {
+		uint64_t value = __atomic_load_n(&metric->value, __ATOMIC_RELAXED);
+		if (value != w->value) {
+			w->value = value;
+			w->last_changed = now;
+		}
+	}
+	metrics_unmap(m);
+	return now - w->last_changed;
+}
+
+static metric_t *
+metric_register(const char *name, metric_type_t type) {
+	pthread_mutex_lock(&metrics_lock);
+	metric_t *metric = (metric_t *)metrics_find(NULL, name);
+	if (!metric) {
+		uint32_t n = metrics_file->n_metrics;
+		if (n == METRICS_MAX)
+			die("more than %d metrics registered", METRICS_MAX);
+		metric = &metrics_file->metrics[n];
+		strncpy(metric->name, name, METRICS_NAME_LENGTH - 1);
+		metric->type = type;
+		__atomic_store_n(&metrics_file->n_metrics, n + 1, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&metrics_lock);
+	if (metric->type != type)
+		die("metric %s registered with two types", name);
+	return metric;
+}
+
+/* register a counter, a total that only increases */
+metric_t *
+metric_counter(const char *name) {
+	return metric_register(name, mt_counter);
+}
+
+/* register a gauge, a current value such as a queue depth, which also records its maximum */
+metric_t *
+metric_gauge(const char *name) {
+	return metric_register(name, mt_gauge);
+}
+
+/* register a histogram of values, with log2 buckets */
+metric_t *
+metric_histogram(const char *name) {
+	return metric_register(name, mt_histogram);
+}
+
+static void
+metric_update_max(metric_t *m, uint64_t value) {
+	uint64_t max = __atomic_load_n(&m->max, __ATOMIC_RELAXED);
+	while (value > max && !__atomic_compare_exchange_n(&m->max, &max, value, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+/* add n to a counter */
+void
+metric_add(metric_t *m, uint64_t n) {
+	__atomic_fetch_add(&m->value, n, __ATOMIC_RELAXED);
+}
+
+/* set a gauge */
+void
+metric_set(metric_t *m, uint64_t value) {
+	__atomic_store_n(&m->value, value, __ATOMIC_RELAXED);
+	metric_update_max(m, value);
+}
+
+/* add a value to a histogram */
+void
+metric_observe(metric_t *m, uint64_t value) {
+	int bucket = 0;
+	while (bucket < METRICS_HISTOGRAM_BUCKETS - 1 && value >= (1ULL << bucket))
+		bucket++;
+	__atomic_fetch_add(&m->buckets[bucket], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&m->sum, value, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&m->value, 1, __ATOMIC_RELAXED);
+	metric_update_max(m, value);
+}
+
+/* monotonic clock in microseconds, for timing operations to observe */
+uint64_t
+metrics_microseconds(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*(uint64_t)1000000 + ts.tv_nsec/1000;
+}
+
+/* CPU time used by the calling thread in microseconds, for CPU time per stage */
+uint64_t
+metrics_thread_cpu_microseconds(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return ts.tv_sec*(uint64_t)1000000 + ts.tv_nsec/1000;
+}
+
+/**
+ * Print metrics as key=value lines
+ * @param[in] fp stream to print to
+ * @param[in] m metrics from metrics_map, or NULL for this process's metrics
+ *
+ * Histograms print name_count, name_sum, name_max and name_log2_buckets,
+ * in which bucket i counts values below 2^i.
+ */
+void
+metrics_print(FILE *fp, const metrics_file_t *m) {
+	if (!m)
+		m = metrics_file;
+	uint32_t n = __atomic_load_n(&m->n_metrics, __ATOMIC_ACQUIRE);
+	for (uint32_t i = 0; i < n && i < METRICS_MAX; i++) {
+		const metric_t *metric = &m->metrics[i];
+		const char *name = metric->name;
+		switch (metric->type) {
+		case mt_counter:
+			fprintf(fp, "%s=%llu\n", name, (unsigned long long)__atomic_load_n(&metric->value, __ATOMIC_RELAXED));
+			break;
+		case mt_gauge:
+			fprintf(fp, "%s=%llu\n", name, (unsigned long long)__atomic_load_n(&metric->value, __ATOMIC_RELAXED));
+			fprintf(fp, "%s_max=%llu\n", name, (unsigned long long)__atomic_load_n(&metric->max, __ATOMIC_RELAXED));
+			break;
+		case mt_histogram:
+			fprintf(fp, "%s_count=%llu\n", name, (unsigned long long)__atomic_load_n(&metric->value, __ATOMIC_RELAXED));
+			fprintf(fp, "%s_sum=%llu\n", name, (unsigned long long)__atomic_load_n(&metric->sum, __ATOMIC_RELAXED));
+			fprintf(fp, "%s_max=%llu\n", name, (unsigned long long)__atomic_load_n(&metric->max, __ATOMIC_RELAXED));
+			fprintf(fp, "%s_log2_buckets=", name);
+			for (int j = 0; j < METRICS_HISTOGRAM_BUCKETS; j++)
+				fprintf(fp, "%s%llu", j ? " " : "", (unsigned long long)__atomic_load_n(&metric->buckets[j], __ATOMIC_RELAXED));
+			fprintf(fp, "\n");
+			break;
+		}
+	}
+}
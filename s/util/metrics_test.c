@@ -0,0 +1,70 @@
+#include "i.h"
+#include <stdlib.h>
+
+static void
+test_print(const metrics_file_t *m) {
+	char *text;
+	size_t size;
+	FILE *fp = open_memstream(&text, &size);
+	assert(fp);
+	metrics_print(fp, m);
+	fclose(fp);
+	assert(strstr(text, "test_counter=5\n"));
+	assert(strstr(text, "test_gauge=3\ntest_gauge_max=9\n"));
+	assert(strstr(text, "test_histogram_count=3\ntest_histogram_sum=1003\ntest_histogram_max=1000\n"));
+	assert(strstr(text, "test_histogram_log2_buckets=1 0 1 0 0 0 0 0 0 0 1 0"));
+	free(text);
+}
+
+/* as beagle_watchdog sees counter, time only counts while its file exists */
+static void
+test_watch(const char *pathname, metric_t *counter) {
+	metric_watch_t missing = {"/nonexistent/metrics", "test_counter", 60, 0, 0};
+	assert(metrics_watch_age(&missing, 1000) == 0 && missing.last_changed == 1000);
+	metric_watch_t w = {(char *)pathname, "test_counter", 60, 0, 0};
+	assert(metrics_watch_age(&w, 1000) == 0 && w.value == 6);
+	assert(metrics_watch_age(&w, 1050) == 50);
+	metric_add(counter, 1);
+	assert(metrics_watch_age(&w, 1100) == 0 && w.value == 7);
+	metric_watch_t absent_metric = {(char *)pathname, "missing", 60, 0, 0};
+	assert(metrics_watch_age(&absent_metric, 1200) == 0);
+	unlink(pathname);
+	assert(metrics_watch_age(&w, 5000) == 0);
+}
+
+int
+main(int argc, char*argv[]) {
+	verbosity = 0;
+	char pathname[] = "/tmp/metrics_test_XXXXXX";
+	int fd = mkstemp(pathname);
+	assert(fd >= 0);
+	close(fd);
+	metrics_open(pathname);
+	metric_t *counter = metric_counter("test_counter");
+	assert(metric_counter("test_counter") == counter);
+	metric_t *gauge = metric_gauge("test_gauge");
+	metric_t *histogram = metric_histogram("test_histogram");
+	metric_add(counter, 2);
+	metric_add(counter, 3);
+	metric_set(gauge, 9);
+	metric_set(gauge, 3);
+	metric_observe(histogram, 0);
+	metric_observe(histogram, 3);
+	metric_observe(histogram, 1000);
+	assert(metrics_find(NULL, "test_gauge") == gauge);
+	assert(!metrics_find(NULL, "missing"));
+	test_print(NULL);
+
+	// another process would see the same values
+	const metrics_file_t *m = metrics_map(pathname);
+	assert(m && m->n_metrics == 3 && m->pid == getpid());
+	assert(metrics_find(m, "test_counter")->value == 5);
+	test_print(m);
+	metric_add(counter, 1);
+	assert(metrics_find(m, "test_counter")->value == 6);
+	metrics_unmap(m);
+	test_watch(pathname, counter);
+	unlink(pathname);
+	assert(!metrics_map(pathname));
+	return 0;
+}
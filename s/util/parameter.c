@@ -1,27 +1,64 @@
 #include "i.h"
+#include <errno.h>
+#include <pthread.h>
+#include <sys/inotify.h>
 
 /** all loaded keyfiles are stored here */
 static GArray *keyfiles;
-/** used when parameters are set that aren't in an existing keyfile */
-static GKeyFile *default_keyfile;
+/** pathname each keyfile was loaded from, same order as keyfiles */
+static GPtrArray *keyfile_pathnames;
+/** values set by param_set_* (e.g. from the command line), take precedence over config files and are never reloaded */
+static GKeyFile *override_keyfile;
+/** incremented whenever a parameter may have changed */
+static volatile int generation = 1;
+/** tables passed to param_register */
+static GPtrArray *registered_tables;
+/** callbacks passed to param_add_reload_callback */
+static GArray *reload_callbacks;
+/** held for reading while the keyfiles are looked at, for writing while they, snapshots or pending reloads change */
+static pthread_rwlock_t param_lock = PTHREAD_RWLOCK_INITIALIZER;
+/** keyfiles re-parsed by the watcher thread, indexed like keyfiles, waiting for param_apply_changes */
+static GKeyFile **pending_keyfiles;
+static volatile int reload_pending;
 
+typedef struct {
+	const char *group;
+	void (*callback)(const char *group, void *data);
+	void *data;
+} reload_callback_t;
 
-GKeyFile *
+
+/* keyfile which param_set_* write to, so the values survive param_apply_changes */
+static GKeyFile *
+param_override_keyfile(void) {
+	if (!override_keyfile)
+		override_keyfile = g_key_file_new();
+	return override_keyfile;
+}
+
+/* take param_lock for reading, loading the config files first if need be */
+static void
+param_read_lock(void) {
+	if (!keyfiles)
+		param_initialize();
+	pthread_rwlock_rdlock(&param_lock);
+}
+
+/* the keyfile a parameter comes from, param_lock must be held */
+static GKeyFile *
 param_get_keyfile(const char *group, const char *key) {
 	dp(31, "get_keyfile(group=%s, key=%s)\n", group, key);
-	if(!keyfiles)
-		param_initialize();
-	assert(keyfiles);
+	assert(keyfiles && override_keyfile);
 	dp(31, "keyfiles=%p\n", keyfiles);
+	if (g_key_file_has_key(override_keyfile, group, key, NULL))
+		return override_keyfile;
 	for (int i = 0; i < keyfiles->len; i++) {
 		GKeyFile *keyfile = g_array_index(keyfiles, GKeyFile *, i);
 		if (g_key_file_has_key(keyfile, group, key, NULL))
 			return keyfile;
 	}
 	dp(31, "No keyfile has parameter %s::%s\n", group, key);
-	if (!default_keyfile)
-		default_keyfile = g_key_file_new();
-	return default_keyfile;
+	return override_keyfile;
 }
 
 
@@ -43,7 +80,10 @@ void
 param_initialize(void) {
 	if(keyfiles)
 		return;
+	pthread_rwlock_wrlock(&param_lock);
+	param_override_keyfile();
 	keyfiles = g_array_new(0, 0, sizeof (GKeyFile *));
+	pthread_rwlock_unlock(&param_lock);
 	dp(31, "keyfiles->len=%d\n", keyfiles->len);
 	const char *directories[] = {NULL, "$BOWERBIRD_HOME", g_get_user_data_dir(), g_get_user_config_dir(), "$HOME", "$home",  "../..","..","."};
 	char *names[] = {"bowerbird_config", ".bowerbird_config"};
@@ -88,7 +128,15 @@ param_add_config_file(const char *pathname, int ignore_missing) {
   	GError *error = NULL;
 	if (!g_key_file_load_from_file(keyfile, pathname, flags, &error))
 		die("config file '%s' load failed: %s", pathname, error->message);
+	if (!keyfiles)
+		param_initialize();
+	pthread_rwlock_wrlock(&param_lock);
 	g_array_append_val(keyfiles, keyfile);
+	if (!keyfile_pathnames)
+		keyfile_pathnames = g_ptr_array_new();
+	g_ptr_array_add(keyfile_pathnames, g_strdup(pathname));
+	__sync_fetch_and_add(&generation, 1);
+	pthread_rwlock_unlock(&param_lock);
 }
 
 void
@@ -116,7 +164,9 @@ param_get_boolean(const char *group, const char *key) {
 int
 param_get_boolean_with_default(const char *group, const char *key, int default_value) {
 	GError *g_error = NULL;
+	param_read_lock();
 	int value = g_key_file_get_boolean(param_get_keyfile(group, key), group, key, &g_error);
+	pthread_rwlock_unlock(&param_lock);
 	if (g_error) {
 		if (g_error->code == G_KEY_FILE_ERROR_INVALID_VALUE) {
 			dp(0, "Config file has invalid value for %s:%s\n", group, key);
@@ -136,7 +186,10 @@ param_get_boolean_with_default(const char *group, const char *key, int default_v
 void
 param_set_boolean(const char *group, const char *key, int value) {
 	dp(30, "%s:%s <- %s\n", group, key, value ? "TRUE" : "FALSE");
-	g_key_file_set_boolean(param_get_keyfile(group, key), group, key, value);
+	pthread_rwlock_wrlock(&param_lock);
+	g_key_file_set_boolean(param_override_keyfile(), group, key, value);
+	__sync_fetch_and_add(&generation, 1);
+	pthread_rwlock_unlock(&param_lock);
 }
 
 int
@@ -147,7 +200,9 @@ param_get_integer(const char *group, const char *key) {
 int
 param_get_integer_with_default(const char *group, const char *key, int default_value) {
 	GError *g_error = NULL;
+	param_read_lock();
 	int value = g_key_file_get_integer(param_get_keyfile(group, key), group, key, &g_error);
+	pthread_rwlock_unlock(&param_lock);
 	if (g_error) {
 		if (g_error->code == G_KEY_FILE_ERROR_INVALID_VALUE) {
 			dp(0, "Config file has invalid value for %s:%s\n", group, key);
@@ -167,7 +222,10 @@ param_get_integer_with_default(const char *group, const char *key, int default_v
 void
 param_set_integer(const char *group, const char *key, int value) {
 	dp(30, "%s:%s <- %d\n", group, key, value);
-	g_key_file_set_integer(param_get_keyfile(group, key), group, key, value);
+	pthread_rwlock_wrlock(&param_lock);
+	g_key_file_set_integer(param_override_keyfile(), group, key, value);
+	__sync_fetch_and_add(&generation, 1);
+	pthread_rwlock_unlock(&param_lock);
 }
 
 double
@@ -178,7 +236,9 @@ param_get_double(const char *group, const char *key) {
 double
 param_get_double_with_default(const char *group, const char *key, double default_value) {
 	GError *g_error = NULL;
+	param_read_lock();
 	double value = g_key_file_get_double(param_get_keyfile(group, key), group, key, &g_error);
+	pthread_rwlock_unlock(&param_lock);
 	if (g_error) {
 		if (g_error->code == G_KEY_FILE_ERROR_INVALID_VALUE) {
 			dp(0, "Config file has invalid value for %s:%s\n", group, key);
@@ -198,9 +258,18 @@ param_get_double_with_default(const char *group, const char *key, double default
 void
 param_set_double(const char *group, const char *key, double value) {
 	dp(30, "%s:%s <- %g\n", group, key, value);
-	g_key_file_set_double(param_get_keyfile(group, key), group, key, value);
+	pthread_rwlock_wrlock(&param_lock);
+	g_key_file_set_double(param_override_keyfile(), group, key, value);
+	__sync_fetch_and_add(&generation, 1);
+	pthread_rwlock_unlock(&param_lock);
 }
 
+/**
+ * @returns a copy of the value which the caller should g_free, or default_value if it is not set
+ *
+ * The copy is not affected by param_apply_changes, so a caller holding it
+ * across a reload keeps the old value until it asks again.
+ */
 char *
 param_get_string(const char *group, const char *key) {
 	return param_get_string_with_default(group, key, "");
@@ -209,7 +278,9 @@ param_get_string(const char *group, const char *key) {
 char *
 param_get_string_with_default(const char *group, const char *key, char *default_value) {
 	GError *g_error = NULL;
+	param_read_lock();
 	char *value = g_key_file_get_string(param_get_keyfile(group, key), group, key, &g_error);
+	pthread_rwlock_unlock(&param_lock);
 	if (value == NULL) {
 		dp(30, "%s:%s -> '%s' (default)\n", group, key, default_value);
 		return default_value;
@@ -221,8 +292,9 @@ param_get_string_with_default(const char *group, const char *key, char *default_
 
 char *
 param_get_string_n(const char *group, const char *key) {
-	GKeyFile *kf = param_get_keyfile(group, key);
-	char *value = g_key_file_get_string(kf, group, key, NULL);
+	param_read_lock();
+	char *value = g_key_file_get_string(param_get_keyfile(group, key), group, key, NULL);
+	pthread_rwlock_unlock(&param_lock);
 	if (!value) {
 		dp(30, "%s:%s -> NULL\n", group, key);
 		return NULL;
@@ -237,7 +309,10 @@ param_get_string_n(const char *group, const char *key) {
 void
 param_set_string(const char *group, const char *key, const char *value) {
 	dp(30, "%s:%s <- '%s'\n", group, key, value);
-	g_key_file_set_string(param_get_keyfile(group, key), group, key, value);
+	pthread_rwlock_wrlock(&param_lock);
+	g_key_file_set_string(param_override_keyfile(), group, key, value);
+	__sync_fetch_and_add(&generation, 1);
+	pthread_rwlock_unlock(&param_lock);
 }
 
 char *
@@ -252,3 +327,420 @@ param_sprintf(char *group, char *param, ...) {
 		g_free(format);		
 	return s;
 }
+
+/**
+ * @returns a number which changes whenever any parameter may have changed
+ */
+int
+param_generation(void) {
+	return generation;
+}
+
+/* returns NULL on success or an error message which the caller must g_free, param_lock must be held */
+static char *
+param_resolve_spec(const param_spec_t *spec, void *snapshot) {
+	GKeyFile *keyfile = param_get_keyfile(spec->group, spec->key);
+	int from_default = !g_key_file_has_key(keyfile, spec->group, spec->key, NULL);
+	const char *source = from_default ? "default" : "config";
+	if (from_default) {
+		if (!spec->default_value)
+			return g_strdup_printf("parameter %s:%s must be set", spec->group, spec->key);
+		keyfile = g_key_file_new();
+		g_key_file_set_value(keyfile, spec->group, spec->key, spec->default_value);
+	}
+	GError *g_error = NULL;
+	char *error = NULL;
+	void *field = (char *)snapshot + spec->offset;
+	double value = 0;
+	switch (spec->type) {
+	case pt_boolean:
+		*(int *)field = g_key_file_get_boolean(keyfile, spec->group, spec->key, &g_error);
+		break;
+	case pt_integer:
+		value = *(int *)field = g_key_file_get_integer(keyfile, spec->group, spec->key, &g_error);
+		break;
+	case pt_double:
+		value = *(double *)field = g_key_file_get_double(keyfile, spec->group, spec->key, &g_error);
+		break;
+	case pt_string:
+		*(char **)field = g_key_file_get_string(keyfile, spec->group, spec->key, &g_error);
+		break;
+	}
+	if (g_error) {
+		error = g_strdup_printf("%s value for %s:%s is invalid: %s", source, spec->group, spec->key, g_error->message);
+		g_error_free(g_error);
+	} else if ((spec->type == pt_integer || spec->type == pt_double) && spec->min <= spec->max && (value < spec->min || value > spec->max))
+		error = g_strdup_printf("%s value %g for %s:%s is outside range %g..%g", source, value, spec->group, spec->key, spec->min, spec->max);
+	if (from_default)
+		g_key_file_free(keyfile);
+	dp(30, "%s:%s resolved from %s\n", spec->group, spec->key, source);
+	return error;
+}
+
+static void
+param_free_snapshot(const param_table_t *table, void *snapshot) {
+	if (!snapshot)
+		return;
+	for (int i = 0; i < table->n_specs; i++)
+		if (table->specs[i].type == pt_string)
+			g_free(*(char **)((char *)snapshot + table->specs[i].offset));
+	free(snapshot);
+}
+
+/* resolve a fresh snapshot for table, returns NULL and sets *error if a value is bad */
+static void *
+param_new_snapshot(const param_table_t *table, char **error) {
+	void *snapshot = salloc(table->snapshot_size);
+	memset(snapshot, 0, table->snapshot_size);
+	for (int i = 0; i < table->n_specs; i++) {
+		if ((*error = param_resolve_spec(&table->specs[i], snapshot))) {
+			param_free_snapshot(table, snapshot);
+			return NULL;
+		}
+	}
+	return snapshot;
+}
+
+/* make snapshot current for readers; the one it replaces is freed at the following publication */
+static void
+param_publish_snapshot(param_table_t *table, void *snapshot, int snapshot_generation) {
+	param_free_snapshot(table, table->retired);
+	table->retired = table->snapshot;
+	__sync_synchronize();
+	table->snapshot = snapshot;
+	__sync_synchronize();
+	table->generation = snapshot_generation;
+}
+
+/**
+ * Resolve parameters into a struct, checking their types and ranges
+ * @param[in] specs declarations of the parameters, each naming a field of snapshot
+ * @param[in] n_specs number of declarations
+ * @param[out] snapshot struct whose fields are set
+ *
+ * @note calls die() if a value is invalid or out of range
+ */
+void
+param_resolve(const param_spec_t *specs, int n_specs, void *snapshot) {
+	param_read_lock();
+	for (int i = 0; i < n_specs; i++) {
+		char *error = param_resolve_spec(&specs[i], snapshot);
+		if (error)
+			die("%s", error);
+	}
+	pthread_rwlock_unlock(&param_lock);
+}
+
+/**
+ * Get a module's parameters as a struct, resolving them only if they have changed
+ * @param[in] table the module's parameter table
+ * @returns pointer to struct of table->snapshot_size bytes
+ *
+ * Cheap enough for per-frame code, and may be called from any thread.
+ * When parameters change a new struct is published in place of the old one,
+ * which stays valid until the next change after that, so callers should
+ * not keep the pointer beyond their current use (e.g. one file or one frame).
+ */
+const void *
+param_snapshot(param_table_t *table) {
+	const void *snapshot = table->snapshot;
+	__sync_synchronize();
+	if (snapshot && table->generation == generation)
+		return snapshot;
+	if (!keyfiles)
+		param_initialize();
+	pthread_rwlock_wrlock(&param_lock);
+	int snapshot_generation = generation;
+	if (!table->snapshot || table->generation != snapshot_generation) {
+		char *error = NULL;
+		void *new_snapshot = param_new_snapshot(table, &error);
+		if (!new_snapshot)
+			die("%s", error);
+		param_publish_snapshot(table, new_snapshot, snapshot_generation);
+	}
+	snapshot = table->snapshot;
+	pthread_rwlock_unlock(&param_lock);
+	return snapshot;
+}
+
+/**
+ * Make a module's parameters known to param_validate and param_dump_config
+ * @param[in] table the module's parameter table, must remain valid
+ */
+void
+param_register(param_table_t *table) {
+	if (!registered_tables)
+		registered_tables = g_ptr_array_new();
+	for (int i = 0; i < registered_tables->len; i++)
+		if (g_ptr_array_index(registered_tables, i) == table)
+			return;
+	g_ptr_array_add(registered_tables, table);
+}
+
+/**
+ * Resolve all registered parameters
+ *
+ * @note calls die() if a value is invalid or out of range
+ */
+void
+param_validate(void) {
+	for (int i = 0; registered_tables && i < registered_tables->len; i++)
+		param_snapshot(g_ptr_array_index(registered_tables, i));
+}
+
+/**
+ * Print all registered parameters with their resolved values in config file format
+ * @param[in] fp stream to print to
+ */
+void
+param_dump_config(FILE *fp) {
+	for (int i = 0; registered_tables && i < registered_tables->len; i++) {
+		param_table_t *table = g_ptr_array_index(registered_tables, i);
+		const char *snapshot = param_snapshot(table);
+		const char *group = NULL;
+		for (int j = 0; j < table->n_specs; j++) {
+			const param_spec_t *spec = &table->specs[j];
+			if (!group || strcmp(group, spec->group))
+				fprintf(fp, "%s[%s]\n", group ? "\n" : "", spec->group);
+			group = spec->group;
+			if (spec->description)
+				fprintf(fp, "# %s\n", spec->description);
+			const void *field = snapshot + spec->offset;
+			switch (spec->type) {
+			case pt_boolean:
+				fprintf(fp, "%s = %s\n", spec->key, *(int *)field ? "true" : "false");
+				break;
+			case pt_integer:
+				fprintf(fp, "%s = %d\n", spec->key, *(int *)field);
+				break;
+			case pt_double:
+				fprintf(fp, "%s = %.17g\n", spec->key, *(double *)field);
+				break;
+			case pt_string:
+				fprintf(fp, "%s = %s\n", spec->key, *(char **)field);
+				break;
+			}
+		}
+		fprintf(fp, "\n");
+	}
+}
+
+/* returns true if group's keys or values differ between the keyfiles */
+static int
+param_group_differs(GKeyFile *a, GKeyFile *b, const char *group) {
+	gsize n_a = 0, n_b = 0;
+	char **keys_a = g_key_file_get_keys(a, group, &n_a, NULL);
+	char **keys_b = g_key_file_get_keys(b, group, &n_b, NULL);
+	int differs = n_a != n_b;
+	for (gsize i = 0; !differs && i < n_a; i++) {
+		char *value_a = g_key_file_get_value(a, group, keys_a[i], NULL);
+		char *value_b = g_key_file_get_value(b, group, keys_a[i], NULL);
+		differs = !value_a || !value_b || strcmp(value_a, value_b);
+		g_free(value_a);
+		g_free(value_b);
+	}
+	g_strfreev(keys_a);
+	g_strfreev(keys_b);
+	return differs;
+}
+
+/* add the names of groups which differ between the keyfiles to changed */
+static void
+param_changed_groups(GKeyFile *a, GKeyFile *b, GHashTable *changed) {
+	GKeyFile *keyfile[] = {a, b};
+	for (int k = 0; k < 2; k++) {
+		char **groups = g_key_file_get_groups(keyfile[k], NULL);
+		for (int i = 0; groups[i]; i++)
+			if (!g_hash_table_lookup(changed, groups[i]) && param_group_differs(a, b, groups[i]))
+				g_hash_table_insert(changed, g_strdup(groups[i]), GINT_TO_POINTER(1));
+		g_strfreev(groups);
+	}
+}
+
+/* state of the watcher thread, fixed when it is started */
+static int n_watched;
+static char **watched_pathnames;
+static int *watch_descriptors;
+
+static void *
+param_watch_thread(void *arg) {
+	int fd = GPOINTER_TO_INT(arg);
+	char buffer[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	while (1) {
+		ssize_t length = read(fd, buffer, sizeof buffer);
+		if (length < 0 && errno == EINTR)
+			continue;
+		if (length <= 0) {
+			dp(0, "config file watch failed: %s\n", strerror(errno));
+			return NULL;
+		}
+		int changed[n_watched];
+		memset(changed, 0, sizeof changed);
+		for (char *p = buffer; p < buffer + length; p += sizeof (struct inotify_event) + ((struct inotify_event *)p)->len) {
+			const struct inotify_event *event = (struct inotify_event *)p;
+			if (!event->len)
+				continue;
+			for (int i = 0; i < n_watched; i++) {
+				char *name = g_path_get_basename(watched_pathnames[i]);
+				if (watch_descriptors[i] == event->wd && !strcmp(name, event->name))
+					changed[i] = 1;
+				g_free(name);
+			}
+		}
+		for (int i = 0; i < n_watched; i++) {
+			if (!changed[i])
+				continue;
+			// parse outside the lock - readers only ever see a completely loaded keyfile
+			GKeyFile *keyfile = g_key_file_new();
+			GError *error = NULL;
+			if (!g_key_file_load_from_file(keyfile, watched_pathnames[i], G_KEY_FILE_KEEP_COMMENTS|G_KEY_FILE_KEEP_TRANSLATIONS, &error)) {
+				dp(0, "config file '%s' changed but can not be loaded: %s\n", watched_pathnames[i], error->message);
+				g_error_free(error);
+				g_key_file_free(keyfile);
+				continue;
+			}
+			dp(2, "config file %s changed\n", watched_pathnames[i]);
+			pthread_rwlock_wrlock(&param_lock);
+			if (pending_keyfiles[i])
+				g_key_file_free(pending_keyfiles[i]);
+			pending_keyfiles[i] = keyfile;
+			reload_pending = 1;
+			pthread_rwlock_unlock(&param_lock);
+		}
+	}
+}
+
+/**
+ * Start a thread which re-reads loaded config files when they change
+ * @returns 0 on success, -1 if the files can not be watched
+ *
+ * Changes only take effect when the program next calls param_apply_changes.
+ * Config files must all be loaded before this is called.
+ */
+int
+param_watch_config_files(void) {
+	if (!keyfiles)
+		param_initialize();
+	if (watched_pathnames)
+		return 0;
+	if (!keyfile_pathnames || !keyfile_pathnames->len)
+		return -1;
+	int fd = inotify_init();
+	if (fd < 0) {
+		dp(1, "inotify_init failed: %s\n", strerror(errno));
+		return -1;
+	}
+	int n = keyfile_pathnames->len;
+	watch_descriptors = salloc(n*sizeof *watch_descriptors);
+	watched_pathnames = salloc(n*sizeof *watched_pathnames);
+	pending_keyfiles = salloc(n*sizeof *pending_keyfiles);
+	for (int i = 0; i < n; i++) {
+		watched_pathnames[i] = g_ptr_array_index(keyfile_pathnames, i);
+		pending_keyfiles[i] = NULL;
+		// watch the directory so files replaced by rename are still seen
+		char *directory = g_path_get_dirname(watched_pathnames[i]);
+		watch_descriptors[i] = inotify_add_watch(fd, directory, IN_CLOSE_WRITE|IN_MOVED_TO);
+		if (watch_descriptors[i] < 0)
+			dp(1, "can not watch %s: %s\n", directory, strerror(errno));
+		g_free(directory);
+	}
+	n_watched = n;
+	pthread_t thread;
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	int error = pthread_create(&thread, &attr, param_watch_thread, GINT_TO_POINTER(fd));
+	pthread_attr_destroy(&attr);
+	if (error)
+		die("pthread_create failed: %s", strerror(error));
+	dp(21, "watching %d config files\n", n);
+	return 0;
+}
+
+/**
+ * Arrange for a function to be called when param_apply_changes changes a config group
+ * @param[in] group name of config group, NULL for all groups
+ * @param[in] callback called with the name of the changed group and data
+ * @param[in] data passed to callback
+ */
+void
+param_add_reload_callback(const char *group, void callback(const char *group, void *data), void *data) {
+	if (!reload_callbacks)
+		reload_callbacks = g_array_new(0, 0, sizeof (reload_callback_t));
+	reload_callback_t c = {group, callback, data};
+	g_array_append_val(reload_callbacks, c);
+}
+
+/**
+ * Bring in config file changes seen by the watcher thread
+ * @returns number of config files changed, 0 if none, -1 if the changes were rejected
+ *
+ * Call from the main thread at a point where parameters may safely change,
+ * e.g. between output files.  Registered tables are resolved from the new
+ * files before anything is replaced, so an invalid edit leaves the old values
+ * in force.  The new snapshots are then published and the reload callbacks
+ * called for each group whose contents changed.
+ */
+int
+param_apply_changes(void) {
+	if (!reload_pending)
+		return 0;
+	pthread_rwlock_wrlock(&param_lock);
+	reload_pending = 0;
+	GKeyFile *previous[n_watched];
+	GHashTable *changed_groups = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	int n_changed = 0;
+	for (int i = 0; i < n_watched; i++) {
+		previous[i] = NULL;
+		if (!pending_keyfiles[i])
+			continue;
+		previous[i] = g_array_index(keyfiles, GKeyFile *, i);
+		param_changed_groups(previous[i], pending_keyfiles[i], changed_groups);
+		g_array_index(keyfiles, GKeyFile *, i) = pending_keyfiles[i];
+		pending_keyfiles[i] = NULL;
+		n_changed++;
+	}
+
+	int n_tables = registered_tables ? registered_tables->len : 0;
+	void *snapshots[n_tables + 1];
+	char *error = NULL;
+	for (int t = 0; t < n_tables && !error; t++)
+		snapshots[t] = param_new_snapshot(g_ptr_array_index(registered_tables, t), &error);
+	if (error) {
+		dp(0, "config change rejected: %s\n", error);
+		g_free(error);
+		for (int t = 0; t < n_tables && snapshots[t]; t++)
+			param_free_snapshot(g_ptr_array_index(registered_tables, t), snapshots[t]);
+		for (int i = 0; i < n_watched; i++) {
+			if (!previous[i])
+				continue;
+			g_key_file_free(g_array_index(keyfiles, GKeyFile *, i));
+			g_array_index(keyfiles, GKeyFile *, i) = previous[i];
+		}
+		n_changed = -1;
+	} else {
+		int new_generation = __sync_add_and_fetch(&generation, 1);
+		for (int t = 0; t < n_tables; t++)
+			param_publish_snapshot(g_ptr_array_index(registered_tables, t), snapshots[t], new_generation);
+		for (int i = 0; i < n_watched; i++)
+			if (previous[i])
+				g_key_file_free(previous[i]);
+	}
+	pthread_rwlock_unlock(&param_lock);
+
+	if (n_changed > 0 && reload_callbacks) {
+		GHashTableIter iter;
+		gpointer group;
+		g_hash_table_iter_init(&iter, changed_groups);
+		while (g_hash_table_iter_next(&iter, &group, NULL)) {
+			dp(2, "config group %s changed\n", (char *)group);
+			for (int i = 0; i < reload_callbacks->len; i++) {
+				reload_callback_t *c = &g_array_index(reload_callbacks, reload_callback_t, i);
+				if (!c->group || !strcmp(c->group, group))
+					c->callback(group, c->data);
+			}
+		}
+	}
+	g_hash_table_destroy(changed_groups);
+	return n_changed;
+}
@@ -1,6 +1,90 @@
 #include "i.h"
 #include <stdlib.h>
 
+typedef struct {
+	int forty_two;
+	double nought_point_five;
+	int missing;
+} test_parameters_t;
+
+static const param_spec_t test_specs[] = {
+	{"parameter_test", "forty_two", pt_integer, offsetof(test_parameters_t, forty_two), "0", 0, 100, NULL},
+	{"parameter_test", "nought_point_five", pt_double, offsetof(test_parameters_t, nought_point_five), "0", 0, 1, NULL},
+	{"parameter_test", "missing", pt_integer, offsetof(test_parameters_t, missing), "7", 1, 0, NULL},
+};
+
+static param_table_t test_table = {test_specs, sizeof test_specs/sizeof test_specs[0], sizeof (test_parameters_t)};
+
+static void
+write_config(const char *pathname, int value) {
+	FILE *fp = fopen(pathname, "w");
+	assert(fp);
+	fprintf(fp, "[parameter_reload_test]\nvalue = %d\noverridden = %d\n", value, value);
+	fclose(fp);
+}
+
+static void
+reloaded(const char *group, void *data) {
+	assert(!strcmp(group, "parameter_reload_test"));
+	++*(int *)data;
+}
+
+static int stop_reading;
+
+/* getters on another thread must see the old or new value, never a freed keyfile */
+static void *
+read_while_reloading(void *arg) {
+	while (!__sync_fetch_and_add(&stop_reading, 0)) {
+		int value = param_get_integer("parameter_reload_test", "value");
+		assert(value == 2 || value == 3);
+		char *s = param_get_string("parameter_reload_test", "value");
+		assert(!strcmp(s, "2") || !strcmp(s, "3"));
+		g_free(s);
+	}
+	return NULL;
+}
+
+static int
+wait_for_changes(void) {
+	int n_changed = 0;
+	for (int i = 0; i < 200 && !n_changed; i++) {
+		usleep(10000);
+		n_changed = param_apply_changes();
+	}
+	return n_changed;
+}
+
+static void
+test_reload(void) {
+	char pathname[] = "/tmp/parameter_test_XXXXXX";
+	int fd = mkstemp(pathname);
+	assert(fd >= 0);
+	close(fd);
+	write_config(pathname, 1);
+	param_add_config_file(pathname, 0);
+	assert(param_get_integer("parameter_reload_test", "value") == 1);
+	param_set_integer("parameter_reload_test", "overridden", 5);
+	assert(param_get_integer("parameter_reload_test", "overridden") == 5);
+	int n_callbacks = 0;
+	param_add_reload_callback("parameter_reload_test", reloaded, &n_callbacks);
+	param_add_reload_callback("parameter_test", reloaded, &n_callbacks);
+	assert(param_watch_config_files() == 0);
+	assert(param_apply_changes() == 0);
+	write_config(pathname, 2);
+	assert(wait_for_changes() == 1 && n_callbacks == 1);
+	assert(param_get_integer("parameter_reload_test", "value") == 2);
+	// values set by the program outlive the reload
+	assert(param_get_integer("parameter_reload_test", "overridden") == 5);
+	pthread_t reader;
+	assert(!pthread_create(&reader, NULL, read_while_reloading, NULL));
+	write_config(pathname, 3);
+	assert(wait_for_changes() == 1 && n_callbacks == 2);
+	__sync_fetch_and_add(&stop_reading, 1);
+	pthread_join(reader, NULL);
+	assert(param_get_integer("parameter_reload_test", "value") == 3);
+	unlink(pathname);
+}
+
 int
 main(int argc, char*argv[]) {
 	verbosity = 0;
@@ -10,6 +94,15 @@ main(int argc, char*argv[]) {
 	assert(param_get_double("parameter_test", "nought_point_five") == 0.49);
 	param_assignment("parameter_test:nought_point_five=0.51", NULL);
 	assert(param_get_double("parameter_test", "nought_point_five") == 0.51);
+	const test_parameters_t *t = param_snapshot(&test_table);
+	assert(t->forty_two == 42 && t->nought_point_five == 0.51 && t->missing == 7);
+	assert(param_snapshot(&test_table) == t);
+	param_set_integer("parameter_test", "missing", 8);
+	t = param_snapshot(&test_table);
+	assert(t->missing == 8);
+	test_reload();
+	t = param_snapshot(&test_table);
+	assert(t->missing == 8);
 //	param_set_double("parameter_test", "not_existing", 12.34);
 //	assert(param_get_double("parameter_test", "not_existing") == 12.34);
 	return 0;
@@ -1,5 +1,22 @@
 #include "i.h"
 #include <wavpack/wavpack.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define SAMPLE_CONVERSION_AVX2	// compiled for avx2 and used if the cpu has it
+#endif
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
+
+// default for sound_io:wavpack_segment_frames, 10 seconds at 16kHz
+#define WAVPACK_SEGMENT_FRAMES 160000
+
+// the fixed part of a wavpack block, before its metadata sub-blocks
+#define WAVPACK_HEADER_SIZE 32
 
 void
 sdie(SNDFILE *sf, char *format,  ...) {
@@ -29,12 +46,99 @@ soundfile_die(soundfile_t *sf, char *format,  ...) {
 	exit(1);
 }
 
+static uint32_t
+little_endian_uint32(const unsigned char *p) {
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint16_t
+little_endian_uint16(const unsigned char *p) {
+	return p[0] | (p[1] << 8);
+}
+
+static void
+set_little_endian_uint32(unsigned char *p, uint32_t value) {
+	for (int i = 0; i < 4; i++)
+		p[i] = value >> (8*i);
+}
+
+/**
+ * Memory-map an uncompressed 16-bit PCM wav file
+ * @param[in] path file to map
+ * @param[out] s fields describing the file are set if the map succeeds
+ * @returns TRUE if path was mapped, FALSE if it is not a wav file we can map
+ *  in which case the caller should fall back to libsndfile
+ */
+static int
+soundfile_mmap_open(const char *path, soundfile_t *s) {
+	if (sizeof (sample_t) != 2 || G_BYTE_ORDER != G_LITTLE_ENDIAN)
+		return FALSE;
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return FALSE;
+	struct stat statbuf;
+	if (fstat(fd, &statbuf) != 0 || !S_ISREG(statbuf.st_mode) || statbuf.st_size < 44) {
+		close(fd);
+		return FALSE;
+	}
+	size_t length = statbuf.st_size;
+	unsigned char *map = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return FALSE;
+	if (memcmp(map, "RIFF", 4) || memcmp(map + 8, "WAVE", 4)) {
+		munmap(map, length);
+		return FALSE;
+	}
+	uint32_t channels = 0, samplerate = 0, bits_per_sample = 0, format = 0;
+	size_t data_offset = 0, data_length = 0;
+	for (size_t offset = 12; offset + 8 <= length;) {
+		const unsigned char *chunk = map + offset;
+		size_t chunk_length = little_endian_uint32(chunk + 4);
+		if (!memcmp(chunk, "fmt ", 4) && chunk_length >= 16 && offset + 8 + 16 <= length) {
+			format = little_endian_uint16(chunk + 8);
+			channels = little_endian_uint16(chunk + 10);
+			samplerate = little_endian_uint32(chunk + 12);
+			bits_per_sample = little_endian_uint16(chunk + 22);
+			// WAVE_FORMAT_EXTENSIBLE - sub-format GUID starts with the real format tag
+			if (format == 0xFFFE && chunk_length >= 26 && offset + 8 + 26 <= length)
+				format = little_endian_uint16(chunk + 32);
+		} else if (!memcmp(chunk, "data", 4)) {
+			data_offset = offset + 8;
+			data_length = chunk_length;
+			// streamed files may have a zero or bogus data length - trust the file size
+			if (data_length == 0 || data_offset + data_length > length)
+				data_length = length - data_offset;
+			break;
+		}
+		offset += 8 + chunk_length + (chunk_length & 1);
+	}
+	if (format != 1 || bits_per_sample != 16 || channels == 0 || !data_offset || data_offset % sizeof (sample_t)) {
+		dp(30, "%s not mappable format=%d bits_per_sample=%d channels=%d data_offset=%lu\n", path, format, bits_per_sample, channels, (unsigned long)data_offset);
+		munmap(map, length);
+		return FALSE;
+	}
+	madvise(map, length, MADV_SEQUENTIAL);
+	s->t = sft_mmap;
+	s->map = map;
+	s->map_length = length;
+	s->samples = (const sample_t *)(map + data_offset);
+	s->position = 0;
+	s->channels = channels;
+	s->samplerate = samplerate;
+	s->bits_per_sample = bits_per_sample;
+	s->frames = data_length/(channels*sizeof (sample_t));
+	return TRUE;
+}
+
 soundfile_t *
 soundfile_open_read(const char *path) {
 	dp(30, "path=%s \n", path);
 	soundfile_t *s = salloc(sizeof *s);
 	s->m = sft_read;
-	if 	(g_regex_match_simple ("\\.wv$", path, 0, 0)) {
+	if (g_regex_match_simple ("\\.wav$", path, G_REGEX_CASELESS, 0) && soundfile_mmap_open(path, s)) {
+		dp(30, "mapped %s channels=%d frames=%d\n", path, s->channels, s->frames);
+	} else if 	(g_regex_match_simple ("\\.wv$", path, 0, 0)) {
 		char error[80] = {0};
 	    int flags = 0;
 	    int norm_offset = 0;
@@ -62,6 +166,33 @@ soundfile_open_read(const char *path) {
 	return s;
 }
 
+/**
+ * Get a pointer to frames of a memory-mapped sound file without copying
+ * @param[in] sf sound file opened with soundfile_open_read
+ * @param[in] first_frame index of first frame wanted
+ * @param[in,out] n_frames number of frames wanted, reduced if past end of file
+ * @returns pointer to interleaved samples of frame first_frame,
+ *  or NULL if sf is not memory-mapped (caller should use soundfile_read)
+ *
+ * @note pointer is valid until soundfile_close
+ */
+const sample_t *
+soundfile_view(soundfile_t *sf, index_t first_frame, index_t *n_frames) {
+	if (sf->t != sft_mmap)
+		return NULL;
+	if (first_frame > sf->frames)
+		first_frame = sf->frames;
+	if (*n_frames > sf->frames - first_frame)
+		*n_frames = sf->frames - first_frame;
+	const sample_t *p = sf->samples + (size_t)first_frame*sf->channels;
+	size_t page_size = sysconf(_SC_PAGESIZE);
+	uintptr_t start = (uintptr_t)p & ~(page_size - 1);
+	uintptr_t finish = (uintptr_t)(p + (size_t)*n_frames*sf->channels);
+	if (finish > start)
+		madvise((void *)start, finish - start, MADV_WILLNEED);
+	return p;
+}
+
 // Next 2 functions from tinypack.c in wavpack distribution
 //              Copyright (c) 1998 - 2007 Conifer Software.               //
 //                          All Rights Reserved.                          //
@@ -116,6 +247,380 @@ write_block (void *id, void *data, int32_t length)
     return TRUE;
 }
 
+/*
+ * Parallel wavpack encoding
+ *
+ * wavpack blocks decode independently, so a long stream can be cut into
+ * segments which are compressed by separate WavpackContexts on a pool of
+ * worker threads.  Each worker collects its blocks in memory; the writing
+ * thread then passes them to write_block in segment order, rebasing the
+ * block_index in each block header by the segment's first frame.
+ */
+
+typedef struct soundfile_segment {
+	index_t first_frame;
+	index_t n_frames;
+	int32_t *samples;
+	void *header;                 // RIFF wrapper, first segment only
+	int header_size;
+	char *output;                 // compressed blocks
+	size_t output_size;
+	size_t output_allocated;
+	int done;
+	struct soundfile_segment *next_job;
+} soundfile_segment_t;
+
+struct soundfile_encoder {
+	WavpackConfig config;
+	index_t segment_frames;
+	int n_threads;
+	pthread_t *threads;
+	pthread_mutex_t lock;
+	pthread_cond_t job_ready;
+	pthread_cond_t job_done;
+	soundfile_segment_t *jobs;    // segments waiting for a worker
+	soundfile_segment_t **pending; // ring of submitted segments, in output order
+	int max_pending;
+	int pending_head;
+	int n_pending;
+	soundfile_segment_t *current; // segment being filled by soundfile_write
+	index_t next_frame;
+	void *header;
+	int header_size;
+	int header_added;             // so libwavpack generates no RIFF header
+	int stop;
+};
+
+static int
+segment_write_block(void *id, void *data, int32_t length) {
+	soundfile_segment_t *segment = id;
+	if (segment->output_size + length > segment->output_allocated) {
+		segment->output_allocated = MAX(2*segment->output_allocated, segment->output_size + length);
+		segment->output = srealloc(segment->output, segment->output_allocated);
+	}
+	memcpy(segment->output + segment->output_size, data, length);
+	segment->output_size += length;
+	return TRUE;
+}
+
+static void
+encode_segment(struct soundfile_encoder *e, soundfile_segment_t *segment) {
+	dp(30, "first_frame=%u n_frames=%u\n", segment->first_frame, segment->n_frames);
+	WavpackContext *wpc = WavpackOpenFileOutput(segment_write_block, segment, NULL);
+	if (!wpc)
+		die("WavpackOpenFileOutput failed");
+	WavpackConfig config = e->config;
+	if (!WavpackSetConfiguration(wpc, &config, -1))
+		die("WavpackSetConfiguration failed: %s\n", WavpackGetErrorMessage(wpc));
+	if (!WavpackPackInit(wpc))
+		die("WavpackPackInit failed: %s\n", WavpackGetErrorMessage(wpc));
+	// libwavpack invents a RIFF header for any context without a wrapper, so
+	// later segments get an empty one to keep the header in the first block only
+	if (segment->header) {
+		if (!WavpackAddWrapper(wpc, segment->header, segment->header_size))
+			die("error adding header to wavpack: %s\n", WavpackGetErrorMessage(wpc));
+	} else if (segment->first_frame) {
+		if (!WavpackAddWrapper(wpc, "", 0))
+			die("error adding header to wavpack: %s\n", WavpackGetErrorMessage(wpc));
+	}
+	if (segment->n_frames && !WavpackPackSamples(wpc, segment->samples, segment->n_frames))
+		die("WavpackPackSamples failed: %s\n", WavpackGetErrorMessage(wpc));
+	if (!WavpackFlushSamples(wpc))
+		die("WavpackFlushSamples failed: %s\n", WavpackGetErrorMessage(wpc));
+	WavpackCloseFile(wpc);
+}
+
+static void *
+encoder_thread(void *arg) {
+	struct soundfile_encoder *e = arg;
+	pthread_mutex_lock(&e->lock);
+	while (1) {
+		while (!e->jobs && !e->stop)
+			pthread_cond_wait(&e->job_ready, &e->lock);
+		if (!e->jobs)
+			break;
+		soundfile_segment_t *segment = e->jobs;
+		e->jobs = segment->next_job;
+		pthread_mutex_unlock(&e->lock);
+		encode_segment(e, segment);
+		pthread_mutex_lock(&e->lock);
+		segment->done = 1;
+		pthread_cond_broadcast(&e->job_done);
+	}
+	pthread_mutex_unlock(&e->lock);
+	return NULL;
+}
+
+/*
+ * find a metadata sub-block in a wavpack block
+ * returns a pointer to its data, setting size, or NULL if the block has none
+ */
+static unsigned char *
+wavpack_find_metadata(unsigned char *block, int id, uint32_t *size) {
+	unsigned char *p = block + WAVPACK_HEADER_SIZE;
+	unsigned char *end = block + little_endian_uint32(block + 4) + 8;
+	while (p + 2 <= end) {
+		int meta_id = p[0];
+		uint32_t meta_size = p[1] << 1;
+		p += 2;
+		if (meta_id & ID_LARGE) {
+			if (p + 2 > end)
+				return NULL;
+			meta_size += (p[0] << 9) + (p[1] << 17);
+			p += 2;
+		}
+		if (meta_size > end - p)
+			return NULL;
+		if ((meta_id & ID_UNIQUE) == id) {
+			*size = meta_size - !!(meta_id & ID_ODD_SIZE);
+			return p;
+		}
+		p += meta_size;
+	}
+	return NULL;
+}
+
+/*
+ * wavpack 5 ends each block with a checksum which covers its header,
+ * so it must be recomputed, as libwavpack's block_update_checksum does,
+ * after the header is changed
+ */
+static void
+wavpack_update_checksum(unsigned char *block) {
+	uint32_t size;
+	unsigned char *checksum = wavpack_find_metadata(block, ID_BLOCK_CHECKSUM, &size);
+	if (!checksum)
+		return;
+	if (size != 2 && size != 4)
+		die("wavpack block checksum has unknown size %u", size);
+	// everything before the checksum's own sub-block header, as 16 bit words
+	uint32_t sum = (uint32_t)-1;
+	for (unsigned char *p = block; p < checksum - 2; p += 2)
+		sum = sum*3 + little_endian_uint16(p);
+	if (size == 2)
+		sum ^= sum >> 16;
+	for (int i = 0; i < size; i++)
+		checksum[i] = sum >> (8*i);
+}
+
+/*
+ * write the blocks of an encoded segment, fixing their position in the stream
+ */
+static void
+write_segment(soundfile_t *sf, soundfile_segment_t *segment) {
+	for (size_t offset = 0; offset + WAVPACK_HEADER_SIZE <= segment->output_size;) {
+		unsigned char *block = (unsigned char *)segment->output + offset;
+		if (memcmp(block, "wvpk", 4))
+			die("corrupt wavpack block from encoder");
+		uint32_t length = little_endian_uint32(block + 4) + 8;
+		// block_index is 40 bits: upper 8 bits at byte 10, lower 32 at byte 16
+		uint64_t block_index = ((uint64_t)block[10] << 32) + little_endian_uint32(block + 16) + segment->first_frame;
+		block[10] = block_index >> 32;
+		set_little_endian_uint32(block + 16, block_index);
+		wavpack_update_checksum(block);
+		if (!write_block(sf, block, length))
+			die("write of wavpack block failed");
+		offset += length;
+	}
+	free(segment->output);
+	free(segment->samples);
+	free(segment->header);
+	free(segment);
+}
+
+/*
+ * write any finished segments at the head of the queue,
+ * waiting for the workers until fewer than n_pending_wanted remain queued
+ */
+static void
+encoder_drain(soundfile_t *sf, int n_pending_wanted) {
+	struct soundfile_encoder *e = sf->encoder;
+	pthread_mutex_lock(&e->lock);
+	while (e->n_pending) {
+		soundfile_segment_t *segment = e->pending[e->pending_head];
+		if (!segment->done) {
+			if (e->n_pending < n_pending_wanted)
+				break;
+			pthread_cond_wait(&e->job_done, &e->lock);
+			continue;
+		}
+		e->pending_head = (e->pending_head + 1) % e->max_pending;
+		e->n_pending--;
+		pthread_mutex_unlock(&e->lock);
+		write_segment(sf, segment);
+		pthread_mutex_lock(&e->lock);
+	}
+	pthread_mutex_unlock(&e->lock);
+}
+
+static void
+encoder_submit(soundfile_t *sf) {
+	struct soundfile_encoder *e = sf->encoder;
+	soundfile_segment_t *segment = e->current;
+	e->current = NULL;
+	if (segment->first_frame == 0 && e->header) {
+		segment->header = e->header;
+		segment->header_size = e->header_size;
+		e->header = NULL;
+	}
+	encoder_drain(sf, e->max_pending);
+	pthread_mutex_lock(&e->lock);
+	e->pending[(e->pending_head + e->n_pending) % e->max_pending] = segment;
+	e->n_pending++;
+	soundfile_segment_t **tail = &e->jobs;
+	while (*tail)
+		tail = &(*tail)->next_job;
+	*tail = segment;
+	pthread_cond_signal(&e->job_ready);
+	pthread_mutex_unlock(&e->lock);
+	encoder_drain(sf, INT_MAX);
+}
+
+static void
+encoder_pack(soundfile_t *sf, const int32_t *samples, index_t n_frames) {
+	struct soundfile_encoder *e = sf->encoder;
+	while (n_frames) {
+		if (!e->current) {
+			e->current = salloc(sizeof *e->current);
+			e->current->first_frame = e->next_frame;
+			e->current->samples = salloc((size_t)e->segment_frames*sf->channels*sizeof e->current->samples[0]);
+		}
+		soundfile_segment_t *segment = e->current;
+		index_t n = MIN(n_frames, e->segment_frames - segment->n_frames);
+		memcpy(segment->samples + (size_t)segment->n_frames*sf->channels, samples, (size_t)n*sf->channels*sizeof *samples);
+		segment->n_frames += n;
+		e->next_frame += n;
+		samples += (size_t)n*sf->channels;
+		n_frames -= n;
+		if (segment->n_frames == e->segment_frames)
+			encoder_submit(sf);
+	}
+}
+
+static void
+encoder_start(soundfile_t *sf, WavpackConfig *config, int n_threads, index_t segment_frames) {
+	dp(20, "n_threads=%d segment_frames=%u\n", n_threads, segment_frames);
+	struct soundfile_encoder *e = salloc(sizeof *e);
+	e->config = *config;
+	e->n_threads = n_threads;
+	e->segment_frames = segment_frames;
+	e->max_pending = 2*n_threads;
+	e->pending = salloc(e->max_pending*sizeof e->pending[0]);
+	pthread_mutex_init(&e->lock, NULL);
+	pthread_cond_init(&e->job_ready, NULL);
+	pthread_cond_init(&e->job_done, NULL);
+	sf->encoder = e;
+	e->threads = salloc(n_threads*sizeof e->threads[0]);
+	for (int i = 0; i < n_threads; i++)
+		if (pthread_create(&e->threads[i], NULL, encoder_thread, e))
+			die("pthread_create failed");
+}
+
+static void
+encoder_finish(soundfile_t *sf) {
+	struct soundfile_encoder *e = sf->encoder;
+	// an empty stream still needs a segment to carry the header
+	if (e->current || e->next_frame == 0) {
+		if (!e->current)
+			e->current = salloc(sizeof *e->current);
+		encoder_submit(sf);
+	}
+	encoder_drain(sf, 1);
+	pthread_mutex_lock(&e->lock);
+	e->stop = 1;
+	pthread_cond_broadcast(&e->job_ready);
+	pthread_mutex_unlock(&e->lock);
+	for (int i = 0; i < e->n_threads; i++)
+		pthread_join(e->threads[i], NULL);
+	pthread_mutex_destroy(&e->lock);
+	pthread_cond_destroy(&e->job_ready);
+	pthread_cond_destroy(&e->job_done);
+	free(e->threads);
+	free(e->pending);
+	free(e->header);
+	free(e);
+	sf->encoder = NULL;
+}
+
+/*
+ * set the sizes in a RIFF header libwavpack generated for a stream of
+ * unknown length, as WavpackUpdateNumSamples does
+ */
+static void
+wavpack_update_riff_header(soundfile_t *sf, unsigned char *block, uint64_t total_samples) {
+	uint32_t size;
+	unsigned char *riff = wavpack_find_metadata(block, ID_RIFF_HEADER, &size);
+	if (!riff || size < 12 || memcmp(riff, "RIFF", 4) || memcmp(riff + 8, "WAVE", 4))
+		return;
+	uint64_t data_size = total_samples*sf->channels*(sf->bits_per_sample/8);
+	for (uint32_t offset = 12; offset + 8 <= size;) {
+		uint32_t chunk_size = little_endian_uint32(riff + offset + 4);
+		if (!memcmp(riff + offset, "data", 4)) {
+			if (offset + data_size + (data_size & 1) > UINT32_MAX) {
+				dp(1, "too many samples for the RIFF header, its sizes are not set\n");
+				return;
+			}
+			set_little_endian_uint32(riff + offset + 4, data_size);
+			set_little_endian_uint32(riff + 4, offset + data_size + (data_size & 1));
+			return;
+		}
+		offset += 8 + chunk_size + (chunk_size & 1);
+	}
+}
+
+/*
+ * Output is started without knowing its length (so it can be streamed),
+ * so the length is filled into the first block when the file is closed.
+ * The block is updated by wavpack if wpc is given, which also fixes the RIFF
+ * header it generates.  Otherwise (the threaded encoder) total_samples is set
+ * here, along with the RIFF header if libwavpack generated it, and the
+ * block's checksum recomputed.  total_samples and riff_header_created are
+ * only used in that case.
+ */
+static void
+wavpack_update_num_samples(soundfile_t *sf, WavpackContext *wpc, uint64_t total_samples, int riff_header_created) {
+	if (!sf->file || !sf->first_block_size)
+		return;
+	unsigned char *block = salloc(sf->first_block_size);
+	if (fflush(sf->file) || fseek(sf->file, 0, SEEK_SET) || fread(block, 1, sf->first_block_size, sf->file) != sf->first_block_size || memcmp(block, "wvpk", 4)) {
+		dp(1, "can not re-read first wavpack block to set its length\n");
+		free(block);
+		return;
+	}
+	if (wpc) {
+		WavpackUpdateNumSamples(wpc, block);
+	} else {
+		// total_samples is 40 bits, upper 8 bits at byte 11 and lower 32 at byte 12,
+		// but as 0xffffffff in the lower bits means unknown the upper bits count 0xffffffffs
+		block[11] = total_samples/0xffffffff;
+		set_little_endian_uint32(block + 12, total_samples + block[11]);
+		if (riff_header_created)
+			wavpack_update_riff_header(sf, block, total_samples);
+		wavpack_update_checksum(block);
+	}
+	if (fseek(sf->file, 0, SEEK_SET) || fwrite(block, 1, sf->first_block_size, sf->file) != sf->first_block_size)
+		dp(1, "can not rewrite first wavpack block\n");
+	free(block);
+}
+
+/*
+ * set wavpack compression flags from sound_io:wavpack_compression
+ */
+static void
+set_wavpack_compression(WavpackConfig *config) {
+	char *mode = param_get_string_with_default("sound_io", "wavpack_compression", "normal");
+	if (!strcmp(mode, "fast"))
+		config->flags |= CONFIG_FAST_FLAG;
+	else if (!strcmp(mode, "high"))
+		config->flags |= CONFIG_HIGH_FLAG;
+	else if (!strcmp(mode, "very_high"))
+		config->flags |= CONFIG_HIGH_FLAG|CONFIG_VERY_HIGH_FLAG;
+	else if (!strcmp(mode, "extra"))
+		config->flags |= CONFIG_HIGH_FLAG|CONFIG_EXTRA_MODE;
+	else if (strcmp(mode, "normal"))
+		die("unknown sound_io:wavpack_compression '%s' (fast, normal, high, very_high or extra)", mode);
+}
+
 soundfile_t *
 soundfile_open_write(const char *path, int n_channels, double sampling_rate) {
 	dp(30, "path=%s n_channels=%d sampling_rate=%g\n", path, n_channels, sampling_rate);
@@ -137,6 +642,13 @@ soundfile_open_write(const char *path, int n_channels, double sampling_rate) {
 		config.channel_mask = n_channels == 1 ? 4 : 3; // Microsoft standard: 4 == mono, 3 == stereo
 		config.num_channels = n_channels;
 		config.sample_rate = sampling_rate;
+		set_wavpack_compression(&config);
+		int n_threads = param_get_integer_with_default("sound_io", "wavpack_threads", 1);
+		if (n_threads > 1) {
+			index_t segment_frames = param_get_integer_with_default("sound_io", "wavpack_segment_frames", WAVPACK_SEGMENT_FRAMES);
+			encoder_start(s, &config, n_threads, MAX(segment_frames, 1));
+			return s;
+		}
 		if (!WavpackSetConfiguration(wpc, &config, -1))
         	die("WavpackSetConfiguration failed: %s\n", WavpackGetErrorMessage(wpc));
 		if (!WavpackPackInit(wpc))
@@ -163,40 +675,343 @@ soundfile_open_write(const char *path, int n_channels, double sampling_rate) {
 	return s;
 }
 
-index_t
-soundfile_read(soundfile_t *sf, sample_t *buffer, index_t n_frames) {
+// the sample conversions use vector instructions where they can, tests clear this to compare
+int sample_conversion_simd = 1;
+
+#ifdef SAMPLE_CONVERSION_AVX2
+/*
+ * convert 16 samples at a time, returns how many were converted
+ * rounding adds bit shift-1 after the shift, so nothing can overflow
+ */
+__attribute__((target("avx2"))) static size_t
+int32_to_sample_t_avx2(const int32_t *in, sample_t *out, size_t n, int shift) {
+	__m128i count = _mm_cvtsi32_si128(shift);
+	__m128i round_count = _mm_cvtsi32_si128(shift - 1);
+	__m256i one = _mm256_set1_epi32(shift ? 1 : 0);
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16) {
+		__m256i a = _mm256_loadu_si256((const __m256i *)(in + i));
+		__m256i b = _mm256_loadu_si256((const __m256i *)(in + i + 8));
+		a = _mm256_add_epi32(_mm256_sra_epi32(a, count), _mm256_and_si256(_mm256_sra_epi32(a, round_count), one));
+		b = _mm256_add_epi32(_mm256_sra_epi32(b, count), _mm256_and_si256(_mm256_sra_epi32(b, round_count), one));
+		// packs works within 128-bit lanes so put the quadwords back in order
+		__m256i packed = _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b), 0xD8);
+		_mm256_storeu_si256((__m256i *)(out + i), packed);
+	}
+	return i;
+}
+
+__attribute__((target("avx2"))) static size_t
+sample_t_to_int32_avx2(const sample_t *in, int32_t *out, size_t n, int shift) {
+	__m128i count = _mm_cvtsi32_si128(shift);
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m256i a = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *)(in + i)));
+		_mm256_storeu_si256((__m256i *)(out + i), _mm256_sll_epi32(a, count));
+	}
+	return i;
+}
+#endif
+
+/**
+ * Convert integer samples of bits_per_sample bits to sample_t
+ * @param[in] in samples as unpacked by wavpack
+ * @param[out] out converted samples, rounded and saturated
+ * @param[in] n number of samples
+ * @param[in] bits_per_sample significant bits in each of in
+ *
+ * @note for 16 bit data this is just a saturating narrow
+ */
+void
+int32_to_sample_t_array(const int32_t *in, sample_t *out, size_t n, int bits_per_sample) {
+	int shift = bits_per_sample - (SAMPLE_T_BIT_SHIFT + 1);
+	size_t i = 0;
+	if (shift < 0) {
+		for (; i < n; i++)
+			out[i] = in[i]*(1 << -shift);
+		return;
+	}
+	int32_t bias = shift ? 1 << (shift - 1) : 0;
+#ifdef SAMPLE_CONVERSION_AVX2
+	if (sample_conversion_simd && __builtin_cpu_supports("avx2"))
+		i = int32_to_sample_t_avx2(in, out, n, shift);
+#elif defined(__ARM_NEON)
+	int32x4_t count = vdupq_n_s32(-shift);
+	for (; sample_conversion_simd && i + 8 <= n; i += 8) {
+		int32x4_t a = vrshlq_s32(vld1q_s32(in + i), count);
+		int32x4_t b = vrshlq_s32(vld1q_s32(in + i + 4), count);
+		vst1q_s16(out + i, vcombine_s16(vqmovn_s32(a), vqmovn_s32(b)));
+	}
+#endif
+	for (; i < n; i++) {
+		int32_t v = (int32_t)(((int64_t)in[i] + bias) >> shift);
+		out[i] = v > SHRT_MAX ? SHRT_MAX : v < SHRT_MIN ? SHRT_MIN : v;
+	}
+}
+
+/**
+ * Convert sample_t samples to integers of bits_per_sample bits
+ * @param[in] in samples
+ * @param[out] out samples widened for wavpack
+ * @param[in] n number of samples
+ * @param[in] bits_per_sample significant bits wanted in each of out
+ */
+void
+sample_t_to_int32_array(const sample_t *in, int32_t *out, size_t n, int bits_per_sample) {
+	int shift = bits_per_sample - (SAMPLE_T_BIT_SHIFT + 1);
+	size_t i = 0;
+	if (shift < 0) {
+		for (; i < n; i++)
+			out[i] = in[i] >> -shift;
+		return;
+	}
+#ifdef SAMPLE_CONVERSION_AVX2
+	if (sample_conversion_simd && __builtin_cpu_supports("avx2"))
+		i = sample_t_to_int32_avx2(in, out, n, shift);
+#elif defined(__ARM_NEON)
+	int32x4_t count = vdupq_n_s32(shift);
+	for (; sample_conversion_simd && i + 8 <= n; i += 8) {
+		int16x8_t a = vld1q_s16(in + i);
+		vst1q_s32(out + i, vshlq_s32(vmovl_s16(vget_low_s16(a)), count));
+		vst1q_s32(out + i + 4, vshlq_s32(vmovl_s16(vget_high_s16(a)), count));
+	}
+#endif
+	for (; i < n; i++)
+		out[i] = (int32_t)in[i]*(1 << shift);
+}
+
+/*
+ * return a conversion buffer for at least n_frames frames of sf
+ */
+static int32_t *
+soundfile_scratch(soundfile_t *sf, index_t n_frames) {
+	if (n_frames > sf->scratch_frames) {
+		sf->scratch = srealloc(sf->scratch, (size_t)n_frames*sf->channels*sizeof sf->scratch[0]);
+		sf->scratch_frames = n_frames;
+	}
+	return sf->scratch;
+}
+
+static index_t
+soundfile_decode(soundfile_t *sf, sample_t *buffer, index_t n_frames) {
 	if (sf->t == sft_libsndfile) {
 		return SF_READF_SAMPLE_T(sf->p, buffer, n_frames);
+	} else if (sf->t == sft_mmap) {
+		const sample_t *p = soundfile_view(sf, sf->position, &n_frames);
+		memcpy(buffer, p, (size_t)n_frames*sf->channels*sizeof *buffer);
+		sf->position += n_frames;
+		return n_frames;
 	} else {
 		int buffer_size = 65536;
-		int32_t b[buffer_size*sf->channels];
+		int32_t *b = soundfile_scratch(sf, MIN(buffer_size, n_frames));
 		index_t frames_read = 0;
-		double divisor = 1L << (sf->bits_per_sample - 1);
 		while (1) {
 			int to_read = MIN(buffer_size, n_frames - frames_read);
 			if (to_read <= 0)
 				return frames_read;
 			int n = WavpackUnpackSamples(sf->p, b, to_read);
-			if (n < 0 || (n == 0 && frames_read == 0))
+			if (n < 0 || (n == 0 && frames_read == 0 && WavpackGetSampleIndex(sf->p) < sf->frames))
 				die("WavpackUnpackSamples returned %d", n);
 			if (n == 0)
 				return frames_read;
-			for (index_t f = 0; f < n; f++) {
-				for (int c = 0; c < sf->channels; c++)
-					buffer[frames_read*sf->channels+c] = double_to_sample_t(b[f*sf->channels+c]/divisor);
-				frames_read++;
-			}
+			int32_to_sample_t_array(b, buffer + (size_t)frames_read*sf->channels, (size_t)n*sf->channels, sf->bits_per_sample);
+			frames_read += n;
+		}
+	}
+}
+
+struct soundfile_read_ahead {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+	sample_t **blocks;           // ring of n_blocks decoded blocks
+	index_t *block_length;       // frames decoded into each block
+	index_t block_frames;
+	int n_blocks;
+	int head;                    // block being consumed
+	int count;                   // decoded blocks waiting to be consumed
+	index_t head_offset;         // frames of head block already consumed
+	int finished;                // decoder has reached end of file
+	int stop;
+	uint64_t consumer_stalls;    // reads that had to wait for the decoder
+	uint64_t producer_stalls;    // times the decoder found the queue full
+};
+
+static void *
+soundfile_read_ahead_thread(void *arg) {
+	soundfile_t *sf = arg;
+	struct soundfile_read_ahead *r = sf->read_ahead;
+	while (1) {
+		pthread_mutex_lock(&r->lock);
+		while (r->count == r->n_blocks && !r->stop) {
+			r->producer_stalls++;
+			pthread_cond_wait(&r->not_full, &r->lock);
+		}
+		if (r->stop) {
+			pthread_mutex_unlock(&r->lock);
+			return NULL;
+		}
+		int slot = (r->head + r->count) % r->n_blocks;
+		pthread_mutex_unlock(&r->lock);
+		// slot is not visible to the consumer until count is incremented
+		index_t n = soundfile_decode(sf, r->blocks[slot], r->block_frames);
+		pthread_mutex_lock(&r->lock);
+		r->block_length[slot] = n;
+		r->count++;
+		if (n < r->block_frames)
+			r->finished = 1;
+		pthread_cond_signal(&r->not_empty);
+		pthread_mutex_unlock(&r->lock);
+		if (n < r->block_frames)
+			return NULL;
+	}
+}
+
+static void
+soundfile_read_ahead_start(soundfile_t *sf, index_t block_frames, int n_blocks) {
+	struct soundfile_read_ahead *r = salloc(sizeof *r);
+	r->block_frames = block_frames;
+	r->n_blocks = n_blocks;
+	r->blocks = salloc(n_blocks*sizeof r->blocks[0]);
+	r->block_length = salloc(n_blocks*sizeof r->block_length[0]);
+	for (int i = 0; i < n_blocks; i++)
+		r->blocks[i] = salloc((size_t)block_frames*sf->channels*sizeof r->blocks[i][0]);
+	pthread_mutex_init(&r->lock, NULL);
+	pthread_cond_init(&r->not_empty, NULL);
+	pthread_cond_init(&r->not_full, NULL);
+	sf->read_ahead = r;
+	if (pthread_create(&r->thread, NULL, soundfile_read_ahead_thread, sf))
+		die("pthread_create failed");
+}
+
+/*
+ * stop the decoder thread and discard anything it has queued
+ */
+static void
+soundfile_read_ahead_stop(soundfile_t *sf) {
+	struct soundfile_read_ahead *r = sf->read_ahead;
+	pthread_mutex_lock(&r->lock);
+	r->stop = 1;
+	pthread_cond_signal(&r->not_full);
+	pthread_mutex_unlock(&r->lock);
+	pthread_join(r->thread, NULL);
+	dp(5, "read-ahead stalls: consumer=%llu producer=%llu\n", (unsigned long long)r->consumer_stalls, (unsigned long long)r->producer_stalls);
+	for (int i = 0; i < r->n_blocks; i++)
+		free(r->blocks[i]);
+	free(r->blocks);
+	free(r->block_length);
+	pthread_mutex_destroy(&r->lock);
+	pthread_cond_destroy(&r->not_empty);
+	pthread_cond_destroy(&r->not_full);
+	free(r);
+	sf->read_ahead = NULL;
+}
+
+/*
+ * copy up to n_frames decoded frames to buffer or double_buffer
+ */
+static index_t
+soundfile_read_ahead_consume(soundfile_t *sf, sample_t *buffer, double *double_buffer, index_t n_frames) {
+	struct soundfile_read_ahead *r = sf->read_ahead;
+	index_t frames_read = 0;
+	pthread_mutex_lock(&r->lock);
+	while (frames_read < n_frames) {
+		if (!r->count) {
+			if (r->finished)
+				break;
+			r->consumer_stalls++;
+			while (!r->count)
+				pthread_cond_wait(&r->not_empty, &r->lock);
+		}
+		index_t available = r->block_length[r->head] - r->head_offset;
+		index_t n = MIN(available, n_frames - frames_read);
+		// the head block is owned by the consumer while count > 0
+		pthread_mutex_unlock(&r->lock);
+		const sample_t *from = r->blocks[r->head] + (size_t)r->head_offset*sf->channels;
+		size_t n_samples = (size_t)n*sf->channels;
+		if (buffer)
+			memcpy(buffer + (size_t)frames_read*sf->channels, from, n_samples*sizeof *buffer);
+		else
+			for (size_t i = 0; i < n_samples; i++)
+				double_buffer[(size_t)frames_read*sf->channels + i] = sample_t_to_double(from[i]);
+		frames_read += n;
+		pthread_mutex_lock(&r->lock);
+		r->head_offset += n;
+		if (r->head_offset == r->block_length[r->head]) {
+			int short_block = r->block_length[r->head] < r->block_frames;
+			r->head = (r->head + 1) % r->n_blocks;
+			r->head_offset = 0;
+			r->count--;
+			pthread_cond_signal(&r->not_full);
+			if (short_block)
+				break;
 		}
 	}
+	pthread_mutex_unlock(&r->lock);
+	return frames_read;
+}
+
+/**
+ * Decode a sound file in a separate thread ahead of soundfile_read
+ * @param[in] sf sound file opened with soundfile_open_read
+ * @param[in] block_frames frames decoded per block, if 0 sound_io:read_ahead_frames is used
+ * @param[in] n_blocks maximum blocks decoded ahead, if 0 sound_io:read_ahead_blocks is used
+ *
+ * Does nothing if n_blocks ends up 0 (the default) or sf is memory-mapped.
+ * soundfile_read_double on a read-ahead file returns samples at sample_t precision.
+ */
+void
+soundfile_read_ahead(soundfile_t *sf, index_t block_frames, int n_blocks) {
+	if (!block_frames)
+		block_frames = param_get_integer_with_default("sound_io", "read_ahead_frames", 65536);
+	if (!n_blocks)
+		n_blocks = param_get_integer_with_default("sound_io", "read_ahead_blocks", 0);
+	dp(30, "sf=%p block_frames=%u n_blocks=%d\n", sf, block_frames, n_blocks);
+	if (n_blocks <= 0 || block_frames == 0 || sf->m != sft_read || sf->t == sft_mmap || sf->read_ahead)
+		return;
+	soundfile_read_ahead_start(sf, block_frames, n_blocks);
+}
+
+/**
+ * Get counts of waits by soundfile_read on the decoder thread (consumer_stalls)
+ * and by the decoder thread on a full queue (producer_stalls).
+ * Both are 0 if read-ahead isn't active.
+ */
+void
+soundfile_read_ahead_stalls(soundfile_t *sf, uint64_t *consumer_stalls, uint64_t *producer_stalls) {
+	struct soundfile_read_ahead *r = sf->read_ahead;
+	*consumer_stalls = *producer_stalls = 0;
+	if (!r)
+		return;
+	pthread_mutex_lock(&r->lock);
+	*consumer_stalls = r->consumer_stalls;
+	*producer_stalls = r->producer_stalls;
+	pthread_mutex_unlock(&r->lock);
+}
+
+index_t
+soundfile_read(soundfile_t *sf, sample_t *buffer, index_t n_frames) {
+	if (sf->read_ahead)
+		return soundfile_read_ahead_consume(sf, buffer, NULL, n_frames);
+	return soundfile_decode(sf, buffer, n_frames);
 }
 
 index_t
 soundfile_read_double(soundfile_t *sf, double *buffer, index_t n_frames) {
+	if (sf->read_ahead)
+		return soundfile_read_ahead_consume(sf, NULL, buffer, n_frames);
 	if (sf->t == sft_libsndfile) {
-		return sf_read_double(sf->p, buffer, n_frames);
+		return sf_readf_double(sf->p, buffer, n_frames);
+	} else if (sf->t == sft_mmap) {
+		const sample_t *p = soundfile_view(sf, sf->position, &n_frames);
+		for (size_t i = 0; i < (size_t)n_frames*sf->channels; i++)
+			buffer[i] = sample_t_to_double(p[i]);
+		sf->position += n_frames;
+		return n_frames;
 	} else {
 		int buffer_size = 65536;
-		int32_t b[buffer_size*sf->channels];
+		int32_t *b = soundfile_scratch(sf, MIN(buffer_size, n_frames));
 		index_t frames_read = 0;
 		double divisor = 1L << (sf->bits_per_sample - 1);
 		while (1) {
@@ -204,7 +1019,7 @@ soundfile_read_double(soundfile_t *sf, double *buffer, index_t n_frames) {
 			if (to_read <= 0)
 				return frames_read;
 			int n = WavpackUnpackSamples(sf->p, b, to_read);
-			if (n < 0 || (n == 0 && frames_read == 0))
+			if (n < 0 || (n == 0 && frames_read == 0 && WavpackGetSampleIndex(sf->p) < sf->frames))
 				die("WavpackUnpackSamples returned %d", n);
 			if (n == 0)
 				return frames_read;
@@ -218,10 +1033,180 @@ soundfile_read_double(soundfile_t *sf, double *buffer, index_t n_frames) {
 }
 
 
+/**
+ * Position a sound file opened for reading so the next read starts at frame
+ * @param[in] sf sound file opened with soundfile_open_read
+ * @param[in] frame frame index (0 == start of file)
+ *
+ * @note calls die() if the seek fails
+ */
+void
+soundfile_seek(soundfile_t *sf, index_t frame) {
+	dp(30, "sf=%p frame=%u\n", sf, frame);
+	if (sf->m != sft_read)
+		die("soundfile_seek only supported for reading");
+	struct soundfile_read_ahead *r = sf->read_ahead;
+	if (r) {
+		// restart the decoder from the new position
+		index_t block_frames = r->block_frames;
+		int n_blocks = r->n_blocks;
+		soundfile_read_ahead_stop(sf);
+		soundfile_seek(sf, frame);
+		soundfile_read_ahead_start(sf, block_frames, n_blocks);
+		return;
+	}
+	if (sf->t == sft_mmap) {
+		sf->position = MIN(frame, sf->frames);
+	} else if (sf->t == sft_libsndfile) {
+		if (sf_seek(sf->p, frame, SEEK_SET) < 0)
+			soundfile_die(sf, "sf_seek to frame %u failed: ", frame);
+	} else {
+		if (!WavpackSeekSample(sf->p, frame))
+			die("WavpackSeekSample to frame %u failed: %s\n", frame, WavpackGetErrorMessage(sf->p));
+	}
+}
+
+/**
+ * Read frames from an arbitrary position of a sound file
+ * @param[in] sf sound file opened with soundfile_open_read
+ * @param[in] first_frame index of first frame to read
+ * @param[out] buffer space for n_frames*channels samples
+ * @param[in] n_frames number of frames wanted
+ * @returns number of frames read, less than n_frames at end of file
+ */
+index_t
+soundfile_read_range(soundfile_t *sf, index_t first_frame, sample_t *buffer, index_t n_frames) {
+	if (first_frame >= sf->frames)
+		return 0;
+	soundfile_seek(sf, first_frame);
+	return soundfile_read(sf, buffer, MIN(n_frames, sf->frames - first_frame));
+}
+
+/**
+ * As soundfile_read_range but returning doubles
+ */
+index_t
+soundfile_read_range_double(soundfile_t *sf, index_t first_frame, double *buffer, index_t n_frames) {
+	if (first_frame >= sf->frames)
+		return 0;
+	soundfile_seek(sf, first_frame);
+	return soundfile_read_double(sf, buffer, MIN(n_frames, sf->frames - first_frame));
+}
+
+#define SOUNDFILE_CACHE_SIZE 8
+
+static struct {
+	char *path;
+	soundfile_t *sf;
+	time_t mtime;
+	off_t size;
+	ino_t inode;
+	uint64_t last_used;
+	pthread_mutex_t lock;               // held while the handle is read, see soundfile_cache_lock
+} soundfile_cache[SOUNDFILE_CACHE_SIZE] = {[0 ... SOUNDFILE_CACHE_SIZE-1] = {.lock = PTHREAD_MUTEX_INITIALIZER}};
+static uint64_t soundfile_cache_clock;
+
+static void
+soundfile_cache_evict(int i) {
+	dp(30, "evicting %s\n", soundfile_cache[i].path);
+	// wait for any reader to finish with the handle
+	pthread_mutex_lock(&soundfile_cache[i].lock);
+	soundfile_close(soundfile_cache[i].sf);
+	pthread_mutex_unlock(&soundfile_cache[i].lock);
+	free(soundfile_cache[i].sf);
+	free(soundfile_cache[i].path);
+	soundfile_cache[i].path = NULL;
+	soundfile_cache[i].sf = NULL;
+}
+
+/**
+ * Open a sound file for reading, reusing a handle from a small LRU cache
+ * @param[in] path file to open
+ * @returns a soundfile_t owned by the cache - do not soundfile_close it.
+ *  The handle stays valid until SOUNDFILE_CACHE_SIZE other files have been opened
+ *  via the cache or soundfile_cache_flush is called.
+ *
+ * @note a cached handle is reopened if the file's inode, size or modification time changes.
+ *  Not thread-safe; position is unspecified so use soundfile_read_range.
+ *  To read a handle outside the lock serialising calls, see soundfile_cache_lock.
+ */
+soundfile_t *
+soundfile_cache_open(const char *path) {
+	struct stat statbuf;
+	if (stat(path, &statbuf) != 0)
+		die("can not open input file '%s'", path);
+	int lru = 0;
+	for (int i = 0; i < SOUNDFILE_CACHE_SIZE; i++) {
+		if (soundfile_cache[i].path && !strcmp(soundfile_cache[i].path, path)) {
+			if (soundfile_cache[i].mtime == statbuf.st_mtime && soundfile_cache[i].size == statbuf.st_size && soundfile_cache[i].inode == statbuf.st_ino) {
+				soundfile_cache[i].last_used = ++soundfile_cache_clock;
+				return soundfile_cache[i].sf;
+			}
+			soundfile_cache_evict(i);
+		}
+		if (!soundfile_cache[i].path)
+			lru = i;
+		else if (soundfile_cache[lru].path && soundfile_cache[i].last_used < soundfile_cache[lru].last_used)
+			lru = i;
+	}
+	if (soundfile_cache[lru].path)
+		soundfile_cache_evict(lru);
+	soundfile_cache[lru].sf = soundfile_open_read(path);
+	soundfile_cache[lru].sf->cache_lock = &soundfile_cache[lru].lock;
+	soundfile_cache[lru].path = sstrdup((char *)path);
+	soundfile_cache[lru].mtime = statbuf.st_mtime;
+	soundfile_cache[lru].size = statbuf.st_size;
+	soundfile_cache[lru].inode = statbuf.st_ino;
+	soundfile_cache[lru].last_used = ++soundfile_cache_clock;
+	return soundfile_cache[lru].sf;
+}
+
+/**
+ * Lock a handle from soundfile_cache_open for reading
+ * @param[in] sf handle returned by soundfile_cache_open
+ *
+ * Call while still holding the lock serialising soundfile_cache_open, then release that lock.
+ * Other threads can then use the cache while this one reads, and the handle is not
+ * closed by eviction until soundfile_cache_unlock.
+ */
+void
+soundfile_cache_lock(soundfile_t *sf) {
+	assert(sf->cache_lock);
+	pthread_mutex_lock(sf->cache_lock);
+}
+
+/**
+ * Unlock a handle locked by soundfile_cache_lock
+ * @param[in] sf handle returned by soundfile_cache_open
+ *
+ * The handle, and any pointer from soundfile_view, may be closed as soon as it is unlocked.
+ */
+void
+soundfile_cache_unlock(soundfile_t *sf) {
+	pthread_mutex_unlock(sf->cache_lock);
+}
+
+/**
+ * Close all sound files held by soundfile_cache_open
+ */
+void
+soundfile_cache_flush(void) {
+	for (int i = 0; i < SOUNDFILE_CACHE_SIZE; i++)
+		if (soundfile_cache[i].path)
+			soundfile_cache_evict(i);
+}
+
 void
 soundfile_write_header(soundfile_t *sf, void *header, int h_size) {
 	dp(30, "sf=%p header=%p h_size=%d\n", sf, header, h_size);
-	if (sf->t == sft_wavpack) {
+	if (sf->t == sft_wavpack && sf->encoder) {
+		if (sf->encoder->next_frame)
+			die("soundfile_write_header must be called before soundfile_write");
+		free(sf->encoder->header);
+		sf->encoder->header = sdup(header, h_size);
+		sf->encoder->header_size = h_size;
+		sf->encoder->header_added = 1;
+	} else if (sf->t == sft_wavpack) {
 		WavpackContext *wpc = sf->p;
 		if (!WavpackAddWrapper(wpc, header, h_size)) {
 			sdie(sf->p, "error adding header to wavpack: %s\n", WavpackGetErrorMessage(wpc));
@@ -243,14 +1228,13 @@ soundfile_write(soundfile_t *sf, sample_t *buffer, index_t n_frames) {
 			sdie(sf->p, "sf_writef_double returned %d (expected %d): ", count, n_frames);
 	} else {
 		WavpackContext *wpc = sf->p;
-		int32_t sample_buffer[n_frames*sf->channels];
+		int32_t *sample_buffer = soundfile_scratch(sf, n_frames);
 		for (int i = 0; i < 10; i++)
 			dp(30, "buffer[%d]=%d\n", i, buffer[i]);
-		
-		double multiplier = 1L << (sf->bits_per_sample - 1);
-		for (int i = 0; i < n_frames*sf->channels; i++)
-  	  		sample_buffer[i] = multiplier*sample_t_to_double(buffer[i]); // FIXME may overflow buffer[1] == 1
-		if (!WavpackPackSamples(sf->p, sample_buffer, n_frames))
+		sample_t_to_int32_array(buffer, sample_buffer, (size_t)n_frames*sf->channels, sf->bits_per_sample);
+		if (sf->encoder)
+			encoder_pack(sf, sample_buffer, n_frames);
+		else if (!WavpackPackSamples(sf->p, sample_buffer, n_frames))
             die("WavpackPackSamples failed: %s\n", WavpackGetErrorMessage(wpc));
 	}
 }
@@ -263,14 +1247,17 @@ soundfile_write_double(soundfile_t *sf, double *buffer, index_t n_frames) {
 			sdie(sf->p, "sf_writef_double returned %d (expected %d): ", count, n_frames);
 	} else {
 		WavpackContext *wpc = sf->p;
-		int32_t sample_buffer[n_frames*sf->channels];
+		int32_t *sample_buffer = soundfile_scratch(sf, n_frames);
 		for (int i = 0; i < 10; i++)
 			dp(30, "buffer[%d]=%g\n", i, (double)buffer[i]);
 		
+		// saturate, full scale +1.0 would otherwise wrap around to the most negative sample
 		double multiplier = 1L << (sf->bits_per_sample - 1);
 		for (int i = 0; i < n_frames*sf->channels; i++)
-  	  		sample_buffer[i] = multiplier*buffer[i]; // FIXME may overflow buffer[1] == 1
-		if (!WavpackPackSamples(sf->p, sample_buffer, n_frames))
+			sample_buffer[i] = clamp(multiplier*buffer[i], -multiplier, multiplier - 1);
+		if (sf->encoder)
+			encoder_pack(sf, sample_buffer, n_frames);
+		else if (!WavpackPackSamples(sf->p, sample_buffer, n_frames))
             die("WavpackPackSamples failed: %s\n", WavpackGetErrorMessage(wpc));
 	}
 }
@@ -278,15 +1265,33 @@ soundfile_write_double(soundfile_t *sf, double *buffer, index_t n_frames) {
 void
 soundfile_close(soundfile_t *sf) {
 	dp(30, "sf=%p \n", sf);
+	if (sf->read_ahead)
+		soundfile_read_ahead_stop(sf);
 	if (sf->t == sft_libsndfile) {
 		sf_close(sf->p);
+	} else if (sf->t == sft_mmap) {
+		munmap(sf->map, sf->map_length);
+		sf->map = NULL;
+		sf->samples = NULL;
 	} else {
-		if (sf->m == sft_write) {
+		if (sf->m == sft_write && sf->encoder) {
+			uint64_t total_samples = sf->encoder->next_frame;
+			int riff_header_created = !sf->encoder->header_added;
+			encoder_finish(sf);
+			wavpack_update_num_samples(sf, NULL, total_samples, riff_header_created);
+			WavpackCloseFile(sf->p);
+			fclose(sf->file);
+		} else if (sf->m == sft_write) {
 		    if (!WavpackFlushSamples(sf->p))
            		die("WavpackFlushSamples failed: %s\n", WavpackGetErrorMessage(sf->p));
+			wavpack_update_num_samples(sf, sf->p, 0, 0);
 			WavpackCloseFile(sf->p);
 			fclose(sf->file);
-		}
+		} else
+			WavpackCloseFile(sf->p);
+		free(sf->scratch);
+		sf->scratch = NULL;
+		sf->scratch_frames = 0;
 	}
 }
 
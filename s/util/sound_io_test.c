@@ -1,4 +1,5 @@
 #include "i.h"
+#include <wavpack/wavpack.h>
 
 static void
 check_sound_files_identical(char *file1, char *file2, double tolerance) {
@@ -10,8 +11,8 @@ check_sound_files_identical(char *file1, char *file2, double tolerance) {
 	assert(s1->frames == s2->frames);
 	index_t channels = s1->channels;
 	index_t frames = s1->frames;
-	sample_t b1[frames*channels];
-	sample_t b2[frames*channels];
+	sample_t *b1 = salloc(frames*channels*sizeof b1[0]);
+	sample_t *b2 = salloc(frames*channels*sizeof b2[0]);
 	int n1 = soundfile_read(s1, b1, frames);
 	assert(n1 == frames);
 	int n2 = soundfile_read(s2, b2, frames);
@@ -21,10 +22,36 @@ check_sound_files_identical(char *file1, char *file2, double tolerance) {
 		if (denom > 0 && ABS((b1[i] - b2[i])/denom) > tolerance)
 			die("b1[%d] = %g b2[%d] = %g\n", i, (double)b1[i], i, (double)b2[i]);
 	}
+	free(b1);
+	free(b2);
 	soundfile_close(s1);
 	soundfile_close(s2);
 }
 
+static void
+check_view(char *file) {
+	dp(30, "file=%s\n", file);
+	soundfile_t *s1 =soundfile_open_read(file);
+	index_t frames = s1->frames;
+	const sample_t *v = soundfile_view(s1, 0, &frames);
+	if (!v) {
+		// the test's wav files are all 16-bit pcm, which are always mapped
+		assert(!g_str_has_suffix(file, ".wav"));
+		soundfile_close(s1);
+		return;
+	}
+	assert(frames == s1->frames);
+	index_t channels = s1->channels;
+	sample_t *b1 = salloc(frames*channels*sizeof b1[0]);
+	int n1 = soundfile_read(s1, b1, frames);
+	assert(n1 == frames);
+	assert(!memcmp(v, b1, frames*channels*sizeof b1[0]));
+	index_t n = frames;
+	assert(soundfile_view(s1, frames/2, &n) == v + (frames/2)*channels && n == frames - frames/2);
+	free(b1);
+	soundfile_close(s1);
+}
+
 static void
 copy_file(char *file1, char *file2) {
 	dp(30, "file1=%s file2=%s\n", file1, file2);
@@ -34,19 +61,174 @@ copy_file(char *file1, char *file2) {
 	assert(s1->samplerate == s2->samplerate);
 	index_t channels = s1->channels;
 	index_t frames = s1->frames;
-	sample_t b1[frames*channels];
+	sample_t *b1 = salloc(frames*channels*sizeof b1[0]);
 	int n1 = soundfile_read(s1, b1, frames);
 	assert(n1 == frames);
 	soundfile_write(s2, b1, frames);
+	free(b1);
+	soundfile_close(s1);
+	soundfile_close(s2);
+}
+
+/*
+ * the vector loops must give exactly what the scalar ones do, for lengths
+ * with and without a tail and at the rounding and saturation boundaries
+ */
+static void
+check_sample_conversion(void) {
+	int32_t in[40];
+	sample_t vector_out[40], scalar_out[40];
+	int bits[] = {16, 20, 24, 32};
+	for (int b = 0; b < sizeof bits/sizeof bits[0]; b++) {
+		int shift = bits[b] - 16;
+		int64_t half = shift ? (int64_t)1 << (shift - 1) : 0;
+		int64_t unit = (int64_t)1 << shift;
+		int64_t boundaries[] = {0, half - 1, half, half + 1, -half, -half - 1, unit, -unit,
+			32767*unit + half - 1, 32767*unit + half, -32768*unit - half, -32768*unit - half - 1,
+			INT32_MAX, INT32_MIN};
+		int n_boundaries = sizeof boundaries/sizeof boundaries[0];
+		for (int i = 0; i < 40; i++) {
+			int64_t v = boundaries[i % n_boundaries] + (i >= n_boundaries ? i - n_boundaries : 0);
+			v = v >= (int64_t)1 << (bits[b] - 1) ? ((int64_t)1 << (bits[b] - 1)) - 1 : v;
+			v = v < -((int64_t)1 << (bits[b] - 1)) ? -((int64_t)1 << (bits[b] - 1)) : v;
+			in[i] = v;
+		}
+		int lengths[] = {5, 16, 23, 40};
+		for (int l = 0; l < sizeof lengths/sizeof lengths[0]; l++) {
+			int n = lengths[l];
+			sample_conversion_simd = 1;
+			int32_to_sample_t_array(in, vector_out, n, bits[b]);
+			sample_conversion_simd = 0;
+			int32_to_sample_t_array(in, scalar_out, n, bits[b]);
+			for (int i = 0; i < n; i++)
+				if (vector_out[i] != scalar_out[i])
+					die("%d bits: in[%d] = %d gives %d vector, %d scalar\n", bits[b], i, in[i], vector_out[i], scalar_out[i]);
+		}
+		if (shift && bits[b] < 32) {
+			// halves round up, and samples beyond the 16 bit range saturate
+			int32_t edges[] = {half, -half, -half - 1, 32767*unit + half, -32768*unit - half - 1};
+			sample_t expected[] = {1, 0, -1, 32767, -32768};
+			for (int i = 0; i < 5; i++) {
+				sample_conversion_simd = 1;
+				int32_t e[16];
+				for (int j = 0; j < 16; j++)
+					e[j] = edges[i];
+				sample_t out[16];
+				int32_to_sample_t_array(e, out, 16, bits[b]);
+				assert(out[0] == expected[i] && out[15] == expected[i]);
+			}
+		}
+
+		sample_t samples[40];
+		int32_t vector_wide[40], scalar_wide[40];
+		for (int i = 0; i < 40; i++)
+			samples[i] = i % 3 == 0 ? SHRT_MIN : i % 3 == 1 ? SHRT_MAX : i*997 - 20000;
+		for (int l = 0; l < sizeof lengths/sizeof lengths[0]; l++) {
+			int n = lengths[l];
+			sample_conversion_simd = 1;
+			sample_t_to_int32_array(samples, vector_wide, n, bits[b]);
+			sample_conversion_simd = 0;
+			sample_t_to_int32_array(samples, scalar_wide, n, bits[b]);
+			assert(!memcmp(vector_wide, scalar_wide, n*sizeof vector_wide[0]));
+		}
+	}
+	sample_conversion_simd = 1;
+}
+
+static uint32_t
+riff_uint32(const unsigned char *p) {
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/*
+ * decode a wavpack file with libwavpack directly, which counts any block
+ * failing its checksum as an error, and check every frame is there and
+ * its RIFF header gives the size a .wav restored from it needs
+ */
+static void
+check_wavpack_blocks(char *file, index_t frames) {
+	dp(30, "file=%s frames=%d\n", file, frames);
+	char error[80] = {0};
+	WavpackContext *wpc = WavpackOpenFileInput(file, error, OPEN_WRAPPER, 0);
+	if (!wpc)
+		die("can not open '%s': %s", file, error);
+	assert(WavpackGetNumSamples(wpc) == frames);
+	uint32_t data_size = frames*WavpackGetNumChannels(wpc)*2;
+	unsigned char *riff = WavpackGetWrapperData(wpc);
+	uint32_t riff_size = WavpackGetWrapperBytes(wpc);
+	assert(riff_size >= 44 && !memcmp(riff, "RIFF", 4) && !memcmp(riff + riff_size - 8, "data", 4));
+	if (riff_uint32(riff + riff_size - 4) != data_size || riff_uint32(riff + 4) != riff_size - 8 + data_size)
+		die("RIFF header of '%s' has sizes %u and %u for %u bytes of data", file, riff_uint32(riff + 4), riff_uint32(riff + riff_size - 4), data_size);
+	int32_t *buffer = salloc(4096*WavpackGetNumChannels(wpc)*sizeof buffer[0]);
+	index_t n_decoded = 0;
+	for (uint32_t n; (n = WavpackUnpackSamples(wpc, buffer, 4096)); )
+		n_decoded += n;
+	assert(n_decoded == frames);
+	if (WavpackGetNumErrors(wpc))
+		die("%d corrupt blocks in '%s'", WavpackGetNumErrors(wpc), file);
+	free(buffer);
+	WavpackCloseFile(wpc);
+}
+
+/*
+ * write a wavpack file in several segments compressed on worker threads and
+ * check it decodes to the original and carries exactly one RIFF header,
+ * either given or generated by libwavpack
+ */
+static void
+check_segmented_write(char *file1, char *file2, int add_header) {
+	dp(30, "file1=%s file2=%s add_header=%d\n", file1, file2, add_header);
+	soundfile_t *s1 = soundfile_open_read(file1);
+	index_t channels = s1->channels;
+	index_t frames = s1->frames;
+	sample_t *b1 = salloc(frames*channels*sizeof b1[0]);
+	assert(soundfile_read(s1, b1, frames) == frames);
+	param_set_integer("sound_io", "wavpack_threads", 3);
+	param_set_integer("sound_io", "wavpack_segment_frames", frames/7 + 1);
+	soundfile_t *s2 = soundfile_open_write(file2, channels, s1->samplerate);
+	assert(s2->encoder);
+	if (add_header) {
+		unsigned char header[44];
+		uint32_t fields[] = {36 + frames*channels*2, 16, 1 | channels << 16, s1->samplerate, s1->samplerate*channels*2, channels*2 | 16 << 16, frames*channels*2};
+		int offsets[] = {4, 16, 20, 24, 28, 32, 40};
+		memcpy(header, "RIFF    WAVEfmt         ", 24);
+		memcpy(header + 36, "data", 4);
+		for (int i = 0; i < sizeof offsets/sizeof offsets[0]; i++)
+			for (int j = 0; j < 4; j++)
+				header[offsets[i] + j] = fields[i] >> (8*j);
+		soundfile_write_header(s2, header, sizeof header);
+	}
+	// uneven writes so segments are filled across calls
+	for (index_t f = 0, n; f < frames; f += n) {
+		n = MIN(frames - f, 1000 + f % 3001);
+		soundfile_write(s2, b1 + f*channels, n);
+	}
 	soundfile_close(s1);
 	soundfile_close(s2);
+	param_set_integer("sound_io", "wavpack_threads", 1);
+	check_wavpack_blocks(file2, frames);
+	check_sound_files_identical(file1, file2, 0);
+	gchar *contents;
+	gsize length;
+	if (!g_file_get_contents(file2, &contents, &length, NULL))
+		die("can not read '%s'", file2);
+	int n_headers = 0;
+	for (gsize i = 0; i + 4 <= length; i++)
+		n_headers += !memcmp(contents + i, "RIFF", 4);
+	assert(n_headers == 1);
+	g_free(contents);
+	free(b1);
 }
 
 int
 main(int argc, char*argv[]) {
 	int optind = testing_initialize(&argc, &argv, "");
+	check_sample_conversion();
+	dp(0, "sample conversion OK\n");
 	check_sound_files_identical(argv[optind], argv[optind+1], 1e-10);
 	dp(0, "read OK\n");
+	check_view(argv[optind]);
+	dp(0, "view OK\n");
 	if (argc - optind > 2) {
 		copy_file(argv[optind], argv[optind+2]);
 		check_sound_files_identical(argv[optind], argv[optind+2], 0.001);
@@ -55,7 +237,13 @@ main(int argc, char*argv[]) {
 	if (argc - optind > 3) {
 		copy_file(argv[optind], argv[optind+3]);
 		check_sound_files_identical(argv[optind], argv[optind+3], 0.001);
+		soundfile_t *s = soundfile_open_read(argv[optind]);
+		check_wavpack_blocks(argv[optind+3], s->frames);
+		soundfile_close(s);
 		dp(0, "write2 OK\n");
+		check_segmented_write(argv[optind], argv[optind+3], 1);
+		check_segmented_write(argv[optind], argv[optind+3], 0);
+		dp(0, "segmented write OK\n");
 	}	
 	if (argc - optind > 4) {
 		copy_file("-", argv[optind+4]);